@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Run nbdkit-bench over a range of settings.
+#
+# Usage:
+#   bench/bench.sh [PLUGIN [PARAMS...]] > results.json
+#
+# The plugin defaults to "memory 1G".  Filters can be added using
+# --filter=... before the plugin name.  Each run prints one line
+# containing a JSON object on stdout.
+#
+# The settings to sweep are taken from these environment variables,
+# each of which is a space-separated list:
+#
+#   WORKLOADS    (default: "read write randread randwrite randrw")
+#   BLOCK_SIZES  (default: "4k 64k 1M")
+#   QUEUE_DEPTHS (default: "1 16 64")
+#   CONNECTIONS  (default: "1 4")
+#   THREADS      nbdkit -t values (default: "16")
+#
+# Other environment variables:
+#
+#   TIME         seconds per run (default: 10)
+#   TRANSPORT    "unix" (default) or "tcp"
+#   PORT         TCP port to use (default: 10809)
+#   NBDKIT       nbdkit binary (default: the wrapper in the build tree)
+#   BENCH        nbdkit-bench binary (default: the one in this directory)
+
+set -e
+
+srcdir="$(cd "$(dirname "$0")" && pwd)"
+top_builddir="$(cd "$srcdir/.." && pwd)"
+
+: ${WORKLOADS:="read write randread randwrite randrw"}
+: ${BLOCK_SIZES:="4k 64k 1M"}
+: ${QUEUE_DEPTHS:="1 16 64"}
+: ${CONNECTIONS:="1 4"}
+: ${THREADS:="16"}
+: ${TIME:=10}
+: ${TRANSPORT:=unix}
+: ${PORT:=10809}
+: ${NBDKIT:="$top_builddir/nbdkit"}
+: ${BENCH:="$srcdir/nbdkit-bench"}
+
+if [ ! -x "$BENCH" ]; then
+    echo "$0: $BENCH not found (nbdkit-bench requires libnbd)" >&2
+    exit 1
+fi
+
+if [ $# -eq 0 ]; then
+    set -- memory 1G
+fi
+
+case "$TRANSPORT" in
+    unix) listen=(-U -) ;;
+    tcp)  listen=(-i localhost -p "$PORT") ;;
+    *)
+        echo "$0: TRANSPORT must be unix or tcp" >&2
+        exit 1
+esac
+
+for t in $THREADS; do
+    for w in $WORKLOADS; do
+        for b in $BLOCK_SIZES; do
+            for q in $QUEUE_DEPTHS; do
+                for c in $CONNECTIONS; do
+                    echo "$0: threads=$t $w bs=$b qd=$q conns=$c: $*" >&2
+                    "$NBDKIT" -f "${listen[@]}" -t "$t" "$@" --run "
+                        '$BENCH' --json -T '$TIME' -w '$w' -b '$b' \
+                            -q '$q' -c '$c' \
+                            -l 'threads=$t transport=$TRANSPORT $*' \"\$uri\"
+                    "
+                done
+            done
+        done
+    done
+done
@@ -0,0 +1,594 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Simple load generator for benchmarking NBD servers.
+ *
+ * This connects to an NBD server using libnbd, runs a single workload
+ * for a fixed time with a fixed request size, queue depth and number
+ * of connections, and prints the results.  bench.sh in this directory
+ * runs it over a range of settings and nbdkit thread counts.
+ *
+ * Each connection is driven by its own thread which keeps up to
+ * queue_depth asynchronous commands in flight.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "random.h"
+#include "tvdiff.h"
+
+enum workload {
+  READ, WRITE, RANDREAD, RANDWRITE, RANDRW, EXTENTS,
+};
+
+static const char *workload_names[] = {
+  [READ] = "read",
+  [WRITE] = "write",
+  [RANDREAD] = "randread",
+  [RANDWRITE] = "randwrite",
+  [RANDRW] = "randrw",
+  [EXTENTS] = "extents",
+};
+
+/* Settings from the command line. */
+static enum workload workload = READ;
+static uint64_t block_size = 65536;
+static unsigned queue_depth = 16;
+static unsigned nr_connections = 1;
+static unsigned run_time = 10;
+static unsigned rwmix = 50;
+static bool json = false;
+static const char *label = NULL;
+static const char *uri;
+
+static int64_t size;            /* Size of the export. */
+static bool stop;               /* Set by main thread when time is up. */
+
+struct connection;
+
+/* A single command slot.  Each connection has queue_depth of these. */
+struct command {
+  struct connection *conn;
+  char *buf;
+  struct timeval start;
+  bool busy;
+};
+
+struct connection {
+  struct nbd_handle *nbd;
+  pthread_t thread;
+  struct random_state random_state;
+
+  /* Region of the disk used by sequential workloads. */
+  uint64_t start, end, next;
+
+  struct command *commands;
+  unsigned in_flight;
+
+  /* Statistics, only updated by this connection's thread. */
+  uint64_t ops, bytes, extents;
+  int64_t latency_total, latency_max; /* µs */
+};
+
+static struct connection *connections;
+
+static void
+usage (void)
+{
+  printf ("nbdkit-bench: load generator for benchmarking NBD servers\n"
+          "\n"
+          "nbdkit-bench [OPTIONS] URI\n"
+          "\n"
+          "Options:\n"
+          "  -w, --workload=WORKLOAD     read, write, randread, randwrite,\n"
+          "                              randrw or extents (default: read)\n"
+          "  -b, --block-size=SIZE       request size (default: 64k)\n"
+          "  -q, --queue-depth=N         requests in flight per connection\n"
+          "                              (default: 16)\n"
+          "  -c, --connections=N         number of connections (default: 1)\n"
+          "  -T, --time=SECS             run time in seconds (default: 10)\n"
+          "  -M, --rwmix=PERCENT         percentage of reads for randrw\n"
+          "                              (default: 50)\n"
+          "  -j, --json                  print results as a JSON object\n"
+          "  -l, --label=STRING          label added to the JSON output\n"
+          "\n"
+          "When run from nbdkit --run, use $uri as the URI, eg:\n"
+          "\n"
+          "  nbdkit -U - memory 1G --run 'nbdkit-bench -w randwrite $uri'\n");
+}
+
+static void __attribute__((noreturn))
+nbd_failed (const char *what)
+{
+  fprintf (stderr, "nbdkit-bench: %s: %s\n", what, nbd_get_error ());
+  exit (EXIT_FAILURE);
+}
+
+/* Parse a size with an optional k, M or G suffix. */
+static uint64_t
+parse_size (const char *option, const char *str)
+{
+  unsigned long long r;
+  char *end;
+
+  errno = 0;
+  r = strtoull (str, &end, 0);
+  if (errno != 0 || end == str)
+    goto bad;
+  switch (*end) {
+  case 'G': case 'g': r *= 1024;
+    /* fallthrough */
+  case 'M': case 'm': r *= 1024;
+    /* fallthrough */
+  case 'K': case 'k': r *= 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0' || r == 0)
+    goto bad;
+  return r;
+
+ bad:
+  fprintf (stderr, "nbdkit-bench: %s: could not parse '%s'\n", option, str);
+  exit (EXIT_FAILURE);
+}
+
+static unsigned
+parse_unsigned (const char *option, const char *str)
+{
+  unsigned long r;
+  char *end;
+
+  errno = 0;
+  r = strtoul (str, &end, 0);
+  if (errno != 0 || end == str || *end != '\0' || r == 0 || r > 100000) {
+    fprintf (stderr, "nbdkit-bench: %s: could not parse '%s'\n",
+             option, str);
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+static bool
+is_read (struct connection *conn)
+{
+  switch (workload) {
+  case READ: case RANDREAD: return true;
+  case WRITE: case RANDWRITE: case EXTENTS: return false;
+  case RANDRW: return xrandom (&conn->random_state) % 100 < rwmix;
+  }
+  abort ();
+}
+
+static uint64_t
+next_offset (struct connection *conn)
+{
+  uint64_t offset;
+
+  switch (workload) {
+  case READ: case WRITE: case EXTENTS:
+    if (conn->next + block_size > conn->end)
+      conn->next = conn->start;
+    offset = conn->next;
+    conn->next += block_size;
+    return offset;
+  case RANDREAD: case RANDWRITE: case RANDRW:
+    return xrandom (&conn->random_state) % (size / block_size) * block_size;
+  }
+  abort ();
+}
+
+static int
+command_done (void *opaque, int *error)
+{
+  struct command *cmd = opaque;
+  struct connection *conn = cmd->conn;
+  struct timeval now;
+  int64_t latency;
+
+  if (*error) {
+    fprintf (stderr, "nbdkit-bench: command failed: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+
+  gettimeofday (&now, NULL);
+  latency = tvdiff_usec (&cmd->start, &now);
+  conn->ops++;
+  conn->bytes += block_size;
+  conn->latency_total += latency;
+  if (latency > conn->latency_max)
+    conn->latency_max = latency;
+
+  cmd->busy = false;
+  conn->in_flight--;
+  return 1;
+}
+
+static int
+extent_callback (void *opaque, const char *metacontext, uint64_t offset,
+                 uint32_t *entries, size_t nr_entries, int *error)
+{
+  struct command *cmd = opaque;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) == 0)
+    cmd->conn->extents += nr_entries / 2;
+  return 0;
+}
+
+static void
+start_command (struct connection *conn, struct command *cmd)
+{
+  nbd_completion_callback cb = { .callback = command_done, .user_data = cmd };
+  uint64_t offset = next_offset (conn);
+  int64_t r;
+
+  gettimeofday (&cmd->start, NULL);
+  if (workload == EXTENTS) {
+    nbd_extent_callback extcb = { .callback = extent_callback,
+                                  .user_data = cmd };
+    r = nbd_aio_block_status (conn->nbd, block_size, offset, extcb, cb, 0);
+  }
+  else if (is_read (conn))
+    r = nbd_aio_pread (conn->nbd, cmd->buf, block_size, offset, cb, 0);
+  else
+    r = nbd_aio_pwrite (conn->nbd, cmd->buf, block_size, offset, cb, 0);
+  if (r == -1)
+    nbd_failed ("command");
+
+  cmd->busy = true;
+  conn->in_flight++;
+}
+
+static void *
+run_connection (void *opaque)
+{
+  struct connection *conn = opaque;
+  unsigned i;
+
+  while (!__atomic_load_n (&stop, __ATOMIC_RELAXED) || conn->in_flight > 0) {
+    if (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+      for (i = 0; i < queue_depth; ++i)
+        if (!conn->commands[i].busy)
+          start_command (conn, &conn->commands[i]);
+    }
+    if (nbd_poll (conn->nbd, -1) == -1)
+      nbd_failed ("nbd_poll");
+  }
+
+  return NULL;
+}
+
+static void
+open_connection (struct connection *conn, unsigned n)
+{
+  uint64_t region;
+  unsigned i;
+
+  conn->nbd = nbd_create ();
+  if (conn->nbd == NULL)
+    nbd_failed ("nbd_create");
+  if (workload == EXTENTS &&
+      nbd_add_meta_context (conn->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+    nbd_failed ("nbd_add_meta_context");
+  if (nbd_connect_uri (conn->nbd, uri) == -1)
+    nbd_failed (uri);
+
+  if (n == 0) {
+    size = nbd_get_size (conn->nbd);
+    if (size == -1)
+      nbd_failed ("nbd_get_size");
+    if (size < block_size) {
+      fprintf (stderr, "nbdkit-bench: export is smaller than the "
+               "block size\n");
+      exit (EXIT_FAILURE);
+    }
+    if (workload == EXTENTS &&
+        nbd_can_meta_context (conn->nbd,
+                              LIBNBD_CONTEXT_BASE_ALLOCATION) != 1) {
+      fprintf (stderr, "nbdkit-bench: server does not support "
+               "block status\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Sequential workloads split the disk between the connections.
+   * If the disk is too small they all use the whole disk.
+   */
+  region = size / nr_connections / block_size * block_size;
+  if (region >= block_size) {
+    conn->start = n * region;
+    conn->end = conn->start + region;
+  }
+  else {
+    conn->start = 0;
+    conn->end = size;
+  }
+  conn->next = conn->start;
+
+  xsrandom (n + 1, &conn->random_state);
+
+  conn->commands = calloc (queue_depth, sizeof (struct command));
+  if (conn->commands == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < queue_depth; ++i) {
+    struct command *cmd = &conn->commands[i];
+
+    cmd->conn = conn;
+    if (workload != EXTENTS) {
+      cmd->buf = malloc (block_size);
+      if (cmd->buf == NULL) {
+        perror ("malloc");
+        exit (EXIT_FAILURE);
+      }
+      /* Incompressible data for writes. */
+      xrandom_fill (n * queue_depth + i, cmd->buf, block_size, 0);
+    }
+  }
+}
+
+static void
+close_connection (struct connection *conn)
+{
+  unsigned i;
+
+  if (nbd_shutdown (conn->nbd, 0) == -1)
+    nbd_failed ("nbd_shutdown");
+  nbd_close (conn->nbd);
+  for (i = 0; i < queue_depth; ++i)
+    free (conn->commands[i].buf);
+  free (conn->commands);
+}
+
+static void
+print_json_string (const char *str)
+{
+  putchar ('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      printf ("\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      printf ("\\u%04x", *str);
+    else
+      putchar (*str);
+  }
+  putchar ('"');
+}
+
+static void
+print_results (double elapsed)
+{
+  uint64_t ops = 0, bytes = 0, extents = 0;
+  int64_t latency_total = 0, latency_max = 0;
+  double iops, mbps, latency_avg;
+  unsigned i;
+
+  for (i = 0; i < nr_connections; ++i) {
+    ops += connections[i].ops;
+    bytes += connections[i].bytes;
+    extents += connections[i].extents;
+    latency_total += connections[i].latency_total;
+    if (connections[i].latency_max > latency_max)
+      latency_max = connections[i].latency_max;
+  }
+  iops = ops / elapsed;
+  mbps = bytes / elapsed / (1024 * 1024);
+  latency_avg = ops > 0 ? (double) latency_total / ops : 0;
+
+  if (json) {
+    printf ("{");
+    if (label) {
+      printf ("\"label\": ");
+      print_json_string (label);
+      printf (", ");
+    }
+    printf ("\"workload\": \"%s\", \"block_size\": %" PRIu64 ", "
+            "\"queue_depth\": %u, \"connections\": %u, ",
+            workload_names[workload], block_size,
+            queue_depth, nr_connections);
+    if (workload == RANDRW)
+      printf ("\"rwmix\": %u, ", rwmix);
+    printf ("\"size\": %" PRIi64 ", \"time\": %.3f, "
+            "\"ops\": %" PRIu64 ", \"bytes\": %" PRIu64 ", ",
+            size, elapsed, ops, bytes);
+    if (workload == EXTENTS)
+      printf ("\"extents\": %" PRIu64 ", ", extents);
+    printf ("\"iops\": %.1f, \"mib_per_sec\": %.1f, "
+            "\"latency_avg_us\": %.1f, \"latency_max_us\": %" PRIi64 "}\n",
+            iops, mbps, latency_avg, latency_max);
+  }
+  else {
+    printf ("%s: block size %" PRIu64 ", queue depth %u, "
+            "%u connection(s), %.3f seconds\n",
+            workload_names[workload], block_size, queue_depth,
+            nr_connections, elapsed);
+    printf ("  %" PRIu64 " ops, %.1f ops/s, %.1f MiB/s\n", ops, iops, mbps);
+    printf ("  latency: avg %.1f µs, max %" PRIi64 " µs\n",
+            latency_avg, latency_max);
+    if (workload == EXTENTS)
+      printf ("  %" PRIu64 " extents\n", extents);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char short_options[] = "b:c:jl:M:q:T:w:";
+  static const struct option long_options[] = {
+    { "block-size",  required_argument, NULL, 'b' },
+    { "connections", required_argument, NULL, 'c' },
+    { "help",        no_argument,       NULL, 'h' },
+    { "json",        no_argument,       NULL, 'j' },
+    { "label",       required_argument, NULL, 'l' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "rwmix",       required_argument, NULL, 'M' },
+    { "time",        required_argument, NULL, 'T' },
+    { "workload",    required_argument, NULL, 'w' },
+    { NULL }
+  };
+  struct timeval start, end;
+  struct timespec ts;
+  size_t i;
+  int c, err;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'b':
+      block_size = parse_size ("block-size", optarg);
+      if (block_size > 32 * 1024 * 1024) {
+        fprintf (stderr, "nbdkit-bench: block-size is too large\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case 'c':
+      nr_connections = parse_unsigned ("connections", optarg);
+      break;
+
+    case 'h':
+      usage ();
+      exit (EXIT_SUCCESS);
+
+    case 'j':
+      json = true;
+      break;
+
+    case 'l':
+      label = optarg;
+      break;
+
+    case 'M':
+      if (strcmp (optarg, "0") == 0)
+        rwmix = 0;
+      else
+        rwmix = parse_unsigned ("rwmix", optarg);
+      if (rwmix > 100) {
+        fprintf (stderr, "nbdkit-bench: rwmix must be 0-100\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case 'q':
+      queue_depth = parse_unsigned ("queue-depth", optarg);
+      break;
+
+    case 'T':
+      run_time = parse_unsigned ("time", optarg);
+      break;
+
+    case 'w':
+      for (i = 0; i < sizeof workload_names / sizeof workload_names[0]; ++i)
+        if (strcmp (optarg, workload_names[i]) == 0)
+          break;
+      if (i == sizeof workload_names / sizeof workload_names[0]) {
+        fprintf (stderr, "nbdkit-bench: unknown workload '%s'\n", optarg);
+        exit (EXIT_FAILURE);
+      }
+      workload = i;
+      break;
+
+    default:
+      usage ();
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc-1) {
+    fprintf (stderr, "nbdkit-bench: expecting a single URI parameter\n");
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  uri = argv[optind];
+
+  connections = calloc (nr_connections, sizeof (struct connection));
+  if (connections == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_connections; ++i)
+    open_connection (&connections[i], i);
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < nr_connections; ++i) {
+    err = pthread_create (&connections[i].thread, NULL,
+                          run_connection, &connections[i]);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  ts.tv_sec = run_time;
+  ts.tv_nsec = 0;
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+  __atomic_store_n (&stop, true, __ATOMIC_RELAXED);
+
+  for (i = 0; i < nr_connections; ++i) {
+    err = pthread_join (connections[i].thread, NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+      exit (EXIT_FAILURE);
+    }
+  }
+  gettimeofday (&end, NULL);
+
+  print_results (tvdiff_usec (&start, &end) / 1000000.0);
+
+  for (i = 0; i < nr_connections; ++i)
+    close_connection (&connections[i]);
+  free (connections);
+
+  exit (EXIT_SUCCESS);
+}
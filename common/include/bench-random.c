@@ -0,0 +1,115 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark for the random data generator used by the random plugin.
+ *
+ * This is not run by "make check".  To build and run it:
+ *
+ *   make -C common/include bench-random
+ *   ./common/include/bench-random [SIZE_IN_MB]
+ *
+ * It prints the throughput of xrandom_fill, and of the old method
+ * (three rounds of xoshiro256** per byte) for comparison.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "random.h"
+
+#define BUFSIZE (256 * 1024)
+
+static unsigned char buf[BUFSIZE];
+static volatile unsigned char sink;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+old_fill (uint64_t seed, unsigned char *b, uint32_t count, uint64_t offset)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; ++i) {
+    struct random_state state;
+
+    xsrandom (seed + offset + i, &state);
+    xrandom (&state);
+    xrandom (&state);
+    b[i] = xrandom (&state) & 255;
+  }
+}
+
+static void
+report (const char *name, uint64_t bytes, double t)
+{
+  printf ("%-14s %8.3f GB/s\n", name, bytes / t / 1e9);
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint64_t mb = 1024, total, offset;
+  double t;
+
+  if (argc > 1)
+    mb = strtoull (argv[1], NULL, 0);
+  total = mb * 1024 * 1024;
+
+  t = now ();
+  for (offset = 0; offset < total; offset += BUFSIZE) {
+    xrandom_fill (1, buf, BUFSIZE, offset);
+    sink = buf[0];
+  }
+  report ("xrandom_fill", total, now () - t);
+
+  /* The old method is much slower so use less data. */
+  total /= 16;
+  t = now ();
+  for (offset = 0; offset < total; offset += BUFSIZE) {
+    old_fill (1, buf, BUFSIZE, offset);
+    sink = buf[0];
+  }
+  report ("old per-byte", total, now () - t);
+
+  exit (EXIT_SUCCESS);
+}
@@ -34,6 +34,9 @@
 #define NBDKIT_RANDOM_H
 
 #include <stdint.h>
+#include <string.h>
+
+#include "byte-swapping.h"
 
 /* Generate pseudo-random numbers, quickly, with explicit state.
  *
@@ -100,4 +103,53 @@ xrandom (struct random_state *state)
   return result_starstar;
 }
 
+/* Counter-based random numbers.
+ *
+ * Returns the i'th output of the splitmix64 generator started from
+ * key, ie. the same as calling snext (&key) i+1 times, but computed
+ * directly.  This lets any part of a long random stream be generated
+ * on its own, and consecutive words do not depend on each other so
+ * loops filling buffers can be vectorized by the compiler.
+ */
+static inline uint64_t
+xrandom_at (uint64_t key, uint64_t i)
+{
+  uint64_t z = key + (i+1) * 0x9e3779b97f4a7c15;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+/* Fill buf with bytes [offset, offset+count) of the random stream
+ * started from key.  The stream is made of the little endian 64 bit
+ * words xrandom_at (key, 0), xrandom_at (key, 1), etc, so the same
+ * bytes are returned however the stream is split into calls.
+ */
+static inline void __attribute__((__nonnull__ (2)))
+xrandom_fill (uint64_t key, void *buf, uint64_t count, uint64_t offset)
+{
+  unsigned char *b = buf;
+  uint64_t w;
+
+  /* Unaligned head. */
+  if (offset & 7) {
+    w = xrandom_at (key, offset >> 3) >> ((offset & 7) * 8);
+    for (; count > 0 && (offset & 7); count--, offset++, w >>= 8)
+      *b++ = w & 255;
+  }
+
+  /* Whole words. */
+  for (; count >= 8; count -= 8, offset += 8, b += 8) {
+    w = htole64 (xrandom_at (key, offset >> 3));
+    memcpy (b, &w, 8);
+  }
+
+  /* Tail. */
+  if (count > 0) {
+    w = xrandom_at (key, offset >> 3);
+    for (; count > 0; count--, w >>= 8)
+      *b++ = w & 255;
+  }
+}
+
 #endif /* NBDKIT_RANDOM_H */
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include "random.h"
 
@@ -189,6 +190,39 @@ main (void)
     exit (EXIT_FAILURE);
   }
 
+  /* xrandom_at must return the splitmix64 sequence. */
+  for (i = 0; i < nr_tests; ++i) {
+    uint64_t seed = tests[i].seed;
+
+    for (j = 0; j < LEN; ++j) {
+      r = snext (&seed);
+      if (xrandom_at (tests[i].seed, j) != r) {
+        fprintf (stderr, "xrandom_at (%" PRIu64 ", %zu) does not match "
+                 "splitmix64\n", tests[i].seed, j);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* xrandom_fill must return the same bytes however the stream is
+   * split up.
+   */
+  {
+    unsigned char whole[256], part[256];
+
+    xrandom_fill (1, whole, sizeof whole, 0);
+    for (i = 0; i < sizeof whole; ++i) {
+      for (j = i; j <= sizeof whole; ++j) {
+        memset (part, 0, sizeof part);
+        xrandom_fill (1, part, j-i, i);
+        if (memcmp (part, &whole[i], j-i) != 0) {
+          fprintf (stderr, "xrandom_fill: bytes [%zu, %zu) differ\n", i, j);
+          exit (EXIT_FAILURE);
+        }
+      }
+    }
+  }
+
   printf ("test successful\n");
   exit (EXIT_SUCCESS);
 }
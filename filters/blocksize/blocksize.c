@@ -41,28 +41,71 @@
 #include <limits.h>
 #include <errno.h>
 
+#include <pthread.h>
+
 #include <nbdkit-filter.h>
 
+#include "cleanup.h"
 #include "minmax.h"
 #include "rounding.h"
 
 #define BLOCKSIZE_MIN_LIMIT (64U * 1024)
 
-/* As long as we don't have parallel requests, we can reuse a common
- * buffer for alignment purposes; size it to the maximum we allow for
- * minblock. */
-static char bounce[BLOCKSIZE_MIN_LIMIT];
 static unsigned int minblock;
 static unsigned int maxdata;
 static unsigned int maxlen;
 
-/* We are using a common bounce buffer (see above) so we must
- * serialize all requests.
+/* Requests can run in parallel.  Unaligned heads and tails use a
+ * bounce buffer allocated by each request.  A read-modify-write
+ * cycle on an unaligned head or tail must not overlap another
+ * read-modify-write of the same block, so it holds one of these
+ * locks, chosen by block number.  Aligned requests take no locks.
+ */
+#define NR_RMW_LOCKS 64
+static pthread_mutex_t rmw_locks[NR_RMW_LOCKS];
+
+static void
+blocksize_load (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_init (&rmw_locks[i], NULL);
+}
+
+static void
+blocksize_unload (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_destroy (&rmw_locks[i]);
+}
+
+/* Return the lock for the block containing offs. */
+static pthread_mutex_t *
+rmw_lock (uint64_t offs)
+{
+  return &rmw_locks[(offs / minblock) % NR_RMW_LOCKS];
+}
+
+/* Allocate a bounce buffer if the request has an unaligned head or
+ * tail.  Returns 0 on success, even if no buffer was needed.
  */
 static int
-blocksize_thread_model (void)
+alloc_bounce (char **bounce, uint32_t count, uint64_t offs, int *err)
 {
-  return NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS;
+  *bounce = NULL;
+  if (((offs | count) & (minblock - 1)) == 0)
+    return 0;
+
+  *bounce = malloc (minblock);
+  if (*bounce == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  return 0;
 }
 
 static int
@@ -156,14 +199,22 @@ blocksize_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
   return ROUND_DOWN (size, minblock);
 }
 
+/* The filter accepts requests of any size and alignment, but clients
+ * avoid read-modify-write cycles by using at least minblock.
+ */
 static int
-blocksize_can_multi_conn (struct nbdkit_next_ops *next_ops, void *nxdata,
-                          void *handle)
+blocksize_block_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+                      void *handle, uint32_t *minimum, uint32_t *preferred,
+                      uint32_t *maximum)
 {
-  /* Although we are serializing all requests anyway so this likely
-   * doesn't make a difference, return false because the bounce buffer
-   * is not consistent for flush.
-   */
+  if (next_ops->block_size (nxdata, minimum, preferred, maximum) == -1)
+    return -1;
+
+  if (*preferred == 0)
+    *preferred = 4096;
+  *preferred = MAX (*preferred, minblock);
+  *minimum = 1;
+  *maximum = 0xffffffff;
   return 0;
 }
 
@@ -172,10 +223,14 @@ blocksize_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
                  void *handle, void *b, uint32_t count, uint64_t offs,
                  uint32_t flags, int *err)
 {
+  CLEANUP_FREE char *bounce = NULL;
   char *buf = b;
   uint32_t keep;
   uint32_t drop;
 
+  if (alloc_bounce (&bounce, count, offs, err) == -1)
+    return -1;
+
   /* Unaligned head */
   if (offs & (minblock - 1)) {
     drop = offs & (minblock - 1);
@@ -214,6 +269,7 @@ blocksize_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                   void *handle, const void *b, uint32_t count, uint64_t offs,
                   uint32_t flags, int *err)
 {
+  CLEANUP_FREE char *bounce = NULL;
   const char *buf = b;
   uint32_t keep;
   uint32_t drop;
@@ -225,8 +281,12 @@ blocksize_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
     need_flush = true;
   }
 
+  if (alloc_bounce (&bounce, count, offs, err) == -1)
+    return -1;
+
   /* Unaligned head */
   if (offs & (minblock - 1)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
     if (next_ops->pread (nxdata, bounce, minblock, offs - drop, 0, err) == -1)
@@ -252,6 +312,7 @@ blocksize_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Unaligned tail */
   if (count) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     if (next_ops->pread (nxdata, bounce, minblock, offs, 0, err) == -1)
       return -1;
     memcpy (bounce, buf, count);
@@ -307,6 +368,7 @@ blocksize_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
                 void *handle, uint32_t count, uint64_t offs, uint32_t flags,
                 int *err)
 {
+  CLEANUP_FREE char *bounce = NULL;
   uint32_t keep;
   uint32_t drop;
   bool need_flush = false;
@@ -329,8 +391,12 @@ blocksize_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     need_flush = true;
   }
 
+  if (alloc_bounce (&bounce, count, offs, err) == -1)
+    return -1;
+
   /* Unaligned head */
   if (offs & (minblock - 1)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
     if (next_ops->pread (nxdata, bounce, minblock, offs - drop, 0, err) == -1)
@@ -354,6 +420,7 @@ blocksize_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Unaligned tail */
   if (count) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     if (next_ops->pread (nxdata, bounce, minblock, offs, 0, err) == -1)
       return -1;
     memset (bounce, 0, count);
@@ -415,12 +482,13 @@ blocksize_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 static struct nbdkit_filter filter = {
   .name              = "blocksize",
   .longname          = "nbdkit blocksize filter",
-  .thread_model      = blocksize_thread_model,
+  .load              = blocksize_load,
+  .unload            = blocksize_unload,
   .config            = blocksize_config,
   .config_complete   = blocksize_config_complete,
   .config_help       = blocksize_config_help,
   .get_size          = blocksize_get_size,
-  .can_multi_conn    = blocksize_can_multi_conn,
+  .block_size        = blocksize_block_size,
   .pread             = blocksize_pread,
   .pwrite            = blocksize_pwrite,
   .trim              = blocksize_trim,
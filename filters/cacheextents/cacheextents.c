@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2019 Red Hat Inc.
+ * Copyright (C) 2019-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -48,113 +49,268 @@
 /* This lock protects the global state. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Cached extents from the last extents () call and its start and end for the
- * sake of simplicity.
+/* The cache is a map of the known parts of the disk, shared by all
+ * connections.  It is stored as an array of extents sorted by offset.
+ * The extents do not overlap, but there may be gaps between them
+ * where the extents are not known.  Adjacent extents always have
+ * different types.
  */
-struct nbdkit_extents *cache_extents;
-static uint64_t cache_start;
-static uint64_t cache_end;
+static struct nbdkit_extent *cache;
+static size_t nr_cache, cache_allocated;
+
+/* Incremented by every write, trim and zero, so that the result of an
+ * extents call which ran at the same time is not cached.
+ */
+static uint64_t generation;
 
 static void
 cacheextents_unload (void)
 {
-  nbdkit_extents_free (cache_extents);
+  free (cache);
+}
+
+/* Return the index of the first cached extent which ends after
+ * offset, or nr_cache if there is none.
+ */
+static size_t
+find_extent (uint64_t offset)
+{
+  size_t lo = 0, hi = nr_cache;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (cache[mid].offset + cache[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
+/* Replace cache[i..j-1] with n entries (which are left uninitialized). */
 static int
-cacheextents_add (struct nbdkit_extents *extents, int *err)
+replace_entries (size_t i, size_t j, size_t n)
 {
-  size_t i = 0;
+  if (nr_cache - (j - i) + n > cache_allocated) {
+    size_t new_allocated = cache_allocated ? cache_allocated : 16;
+    struct nbdkit_extent *new_cache;
 
-  for (i = 0; i < nbdkit_extents_count (cache_extents); i++) {
-    struct nbdkit_extent ex = nbdkit_get_extent (cache_extents, i);
-    if (nbdkit_add_extent (extents, ex.offset, ex.length, ex.type) == -1) {
-      *err = errno;
+    while (nr_cache - (j - i) + n > new_allocated)
+      new_allocated *= 2;
+    new_cache = realloc (cache, new_allocated * sizeof (struct nbdkit_extent));
+    if (new_cache == NULL) {
+      nbdkit_error ("realloc: %m");
       return -1;
     }
+    cache = new_cache;
+    cache_allocated = new_allocated;
   }
 
+  memmove (&cache[i+n], &cache[j], (nr_cache - j) * sizeof cache[0]);
+  nr_cache = nr_cache - (j - i) + n;
   return 0;
 }
 
+/* Forget the extents in [offset, end).  Must be called with the lock
+ * held.
+ */
 static int
-cacheextents_fill (struct nbdkit_extents *extents, int *err)
+cache_remove (uint64_t offset, uint64_t end)
 {
-  size_t i = 0;
-  size_t count = nbdkit_extents_count (extents);
-  struct nbdkit_extent first = nbdkit_get_extent (extents, 0);
-  struct nbdkit_extent last = nbdkit_get_extent (extents, count - 1);
+  size_t i, j, n;
+  struct nbdkit_extent left, right;
+  bool has_left = false, has_right = false;
 
-  nbdkit_extents_free (cache_extents);
-  cache_start = first.offset;
-  cache_end = last.offset + last.length;
-  cache_extents = nbdkit_extents_new (cache_start, cache_end);
+  i = find_extent (offset);
+  for (j = i; j < nr_cache && cache[j].offset < end; ++j)
+    ;
+  if (i == j)
+    return 0;
+
+  /* The first and last extents may only partly overlap the range. */
+  if (cache[i].offset < offset) {
+    left = cache[i];
+    left.length = offset - left.offset;
+    has_left = true;
+  }
+  if (cache[j-1].offset + cache[j-1].length > end) {
+    right = cache[j-1];
+    right.length = right.offset + right.length - end;
+    right.offset = end;
+    has_right = true;
+  }
 
-  if (!cache_extents)
+  n = has_left + has_right;
+  if (replace_entries (i, j, n) == -1)
     return -1;
+  if (has_left)
+    cache[i++] = left;
+  if (has_right)
+    cache[i] = right;
+  return 0;
+}
 
-  for (i = 0; i < count; i++) {
-    struct nbdkit_extent ex = nbdkit_get_extent (extents, i);
-    nbdkit_debug ("cacheextents: updating cache with:"
-                  " offset=%" PRIu64
-                  " length=%" PRIu64
-                  " type=%x",
-                  ex.offset, ex.length, ex.type);
-    if (nbdkit_add_extent (cache_extents, ex.offset, ex.length, ex.type) == -1) {
-      *err = errno;
-      nbdkit_extents_free (cache_extents);
-      cache_extents = NULL;
-      return -1;
-    }
+/* Merge cache[i] with cache[i+1] if they are adjacent and have the
+ * same type.
+ */
+static void
+maybe_merge (size_t i)
+{
+  if (i+1 < nr_cache &&
+      cache[i].offset + cache[i].length == cache[i+1].offset &&
+      cache[i].type == cache[i+1].type) {
+    cache[i].length += cache[i+1].length;
+    memmove (&cache[i+1], &cache[i+2], (nr_cache - i - 2) * sizeof cache[0]);
+    nr_cache--;
   }
+}
+
+/* Store the extents returned by the plugin.  They are contiguous and
+ * in ascending order.  Must be called with the lock held.
+ */
+static int
+cache_insert (struct nbdkit_extents *extents)
+{
+  const size_t n = nbdkit_extents_count (extents);
+  struct nbdkit_extent first, last;
+  size_t i, k;
+
+  if (n == 0)
+    return 0;
+  first = nbdkit_get_extent (extents, 0);
+  last = nbdkit_get_extent (extents, n-1);
+
+  if (cache_remove (first.offset, last.offset + last.length) == -1)
+    return -1;
+  i = find_extent (first.offset);
+  if (replace_entries (i, i, n) == -1)
+    return -1;
+  for (k = 0; k < n; ++k)
+    cache[i+k] = nbdkit_get_extent (extents, k);
 
+  /* Merge with the neighbours, last first so that i stays valid. */
+  maybe_merge (i+n-1);
+  if (i > 0)
+    maybe_merge (i-1);
+
+  nbdkit_debug ("cacheextents: cached %zu extents"
+                " offset=%" PRIu64 " length=%" PRIu64
+                ", cache now has %zu entries",
+                n, first.offset, last.offset + last.length - first.offset,
+                nr_cache);
   return 0;
 }
 
+/* Add the cached extents starting at offset, stopping at the first
+ * unknown part of the disk.  Returns 0 if offset is not in the cache.
+ * Must be called with the lock held.
+ */
+static int
+cache_lookup (uint64_t offset, uint32_t count, bool req_one,
+              struct nbdkit_extents *extents, int *err)
+{
+  const uint64_t end = offset + count;
+  size_t i = find_extent (offset);
+  size_t j;
+
+  if (i == nr_cache || cache[i].offset > offset)
+    return 0;
+
+  /* Find the contiguous run of known extents covering the request. */
+  for (j = i+1;
+       j < nr_cache && !req_one && cache[j].offset < end &&
+         cache[j].offset == cache[j-1].offset + cache[j-1].length;
+       ++j)
+    ;
+
+  if (nbdkit_extents_append (extents, &cache[i], j - i) == -1) {
+    *err = errno;
+    return -1;
+  }
+  return 1;
+}
+
 static int
 cacheextents_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                       void *handle, uint32_t count, uint64_t offset, uint32_t flags,
                       struct nbdkit_extents *extents,
                       int *err)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-
-  nbdkit_debug ("cacheextents:"
-                " cache_start=%" PRIu64
-                " cache_end=%" PRIu64
-                " cache_extents=%p",
-                cache_start, cache_end, cache_extents);
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *fetched = NULL;
+  uint64_t gen;
+  int64_t size;
+  int r;
 
-  if (cache_extents &&
-      offset >= cache_start && offset < cache_end) {
-    nbdkit_debug ("cacheextents: returning from cache");
-    return cacheextents_add (extents, err);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    r = cache_lookup (offset, count, req_one, extents, err);
+    if (r != 0) {
+      if (r == 1)
+        nbdkit_debug ("cacheextents: returning from cache");
+      return r == 1 ? 0 : -1;
+    }
+    gen = generation;
   }
 
   nbdkit_debug ("cacheextents: cache miss");
-  /* Clear REQ_ONE to ask the plugin for as much information as it is
+
+  /* Fetch into our own list covering the rest of the disk, and clear
+   * REQ_ONE to ask the plugin for as much information as it is
    * willing to return (the plugin may still truncate if it is too
    * costly to provide everything).
    */
+  size = next_ops->get_size (nxdata);
+  if (size == -1) {
+    *err = errno;
+    return -1;
+  }
+  fetched = nbdkit_extents_new (offset, size);
+  if (fetched == NULL) {
+    *err = errno;
+    return -1;
+  }
   flags &= ~(NBDKIT_FLAG_REQ_ONE);
-  if (next_ops->extents (nxdata, count, offset, flags, extents, err) == -1)
+  if (next_ops->extents (nxdata, count, offset, flags, fetched, err) == -1)
     return -1;
 
-  return cacheextents_fill (extents, err);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (gen == generation) {
+    if (cache_insert (fetched) == -1) {
+      *err = errno;
+      return -1;
+    }
+    r = cache_lookup (offset, count, req_one, extents, err);
+    if (r == 1)
+      return 0;
+    if (r == -1)
+      return -1;
+  }
+
+  /* The data changed while we were asking, so don't cache the answer
+   * but return it anyway.
+   */
+  if (nbdkit_extents_copy (extents, fetched, 0) == -1) {
+    *err = errno;
+    return -1;
+  }
+  return 0;
 }
 
-/* Any changes to the data needs to clean the cache.
- *
- * Similar to the readahead filter this could be more intelligent, but
- * there would be very little benefit.
+/* Any changes to the data need to remove the affected range from the
+ * cache.  This is done both before and after the change, and the
+ * generation is bumped so that a concurrent extents call does not
+ * cache the old state.
  */
-
 static void
-kill_cacheextents (void)
+kill_cacheextents (uint32_t count, uint64_t offset)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  nbdkit_extents_free (cache_extents);
-  cache_extents = NULL;
+  generation++;
+  if (cache_remove (offset, offset + count) == -1)
+    /* Out of memory splitting an extent, so forget everything. */
+    nr_cache = 0;
 }
 
 static int
@@ -163,8 +319,12 @@ cacheextents_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                      const void *buf, uint32_t count, uint64_t offset,
                      uint32_t flags, int *err)
 {
-  kill_cacheextents ();
-  return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  int r;
+
+  kill_cacheextents (count, offset);
+  r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  kill_cacheextents (count, offset);
+  return r;
 }
 
 static int
@@ -173,8 +333,12 @@ cacheextents_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
-  return next_ops->trim (nxdata, count, offset, flags, err);
+  int r;
+
+  kill_cacheextents (count, offset);
+  r = next_ops->trim (nxdata, count, offset, flags, err);
+  kill_cacheextents (count, offset);
+  return r;
 }
 
 static int
@@ -183,8 +347,12 @@ cacheextents_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
-  return next_ops->zero (nxdata, count, offset, flags, err);
+  int r;
+
+  kill_cacheextents (count, offset);
+  r = next_ops->zero (nxdata, count, offset, flags, err);
+  kill_cacheextents (count, offset);
+  return r;
 }
 
 static struct nbdkit_filter filter = {
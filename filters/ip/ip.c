@@ -38,31 +38,101 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
 
+/* How often (in seconds) the rules file is checked for changes. */
+#define RULES_FILE_INTERVAL 1
+
+/* How often (in seconds) hostnames in the rules are resolved again. */
+#define RESOLVE_INTERVAL 60
+
 /* -D ip.rules=1 to enable debugging of rules and rule matching. */
 int ip_debug_rules;
 
 struct rule {
   struct rule *next;
-  enum { BAD = 0, ANY, ANYV4, ANYV6, IPV4, IPV6 } type;
+  enum { BAD = 0, ANY, ANYV4, ANYV6, IPV4, IPV6, NAME } type;
   union {
     struct in_addr ipv4;
     struct in6_addr ipv6;
   } u;
   unsigned prefixlen;
+  char *name;                   /* NAME: hostname or wildcard pattern. */
 };
 
+/* Rules from the command line. */
 static struct rule *allow_rules, *allow_rules_last;
 static struct rule *deny_rules, *deny_rules_last;
 
+/* The rules file, if any. */
+static char *rules_file;
+
+/* The rules are compiled into a binary trie for each address family,
+ * indexed by the bits of the address starting with the most
+ * significant.  Each node records whether an allow and/or deny rule
+ * covers the prefix leading to that node, so a single walk down the
+ * trie tells us if the address matches any rule in either list.
+ */
+#define MARK_ALLOW 1
+#define MARK_DENY  2
+
+struct node {
+  struct node *child[2];
+  unsigned marks;
+};
+
+/* A compiled set of rules.  Connections take a reference to the
+ * current ruleset while checking the client address, so the rules
+ * file thread can swap in a new ruleset at any time and the old one
+ * is freed when the last user drops its reference.
+ */
+struct ruleset {
+  unsigned refs;                /* Protected by ruleset_lock. */
+  struct node root4, root6;
+
+  /* Rules from the rules file.  The IP address rules are compiled into
+   * the tries above but we keep the lists for wildcard matching.
+   */
+  struct rule *allow_rules, *allow_rules_last;
+  struct rule *deny_rules, *deny_rules_last;
+
+  /* Are there any hostname wildcards in the allow or deny lists? */
+  bool allow_wildcards, deny_wildcards;
+};
+
+static pthread_mutex_t ruleset_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ruleset *ruleset;
+
+/* Are there any hostnames which must be resolved periodically?  Only
+ * accessed by config_complete and the rules file thread.
+ */
+static bool resolve_names;
+
+/* Background thread which reloads the rules file and resolves
+ * hostnames.
+ */
+static pthread_t rules_thread;
+static bool rules_thread_running = false;
+static bool rules_thread_stop = false;
+static pthread_mutex_t rules_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rules_thread_cond = PTHREAD_COND_INITIALIZER;
+
 static void
 print_rule (const char *name, const struct rule *rule)
 {
@@ -89,6 +159,9 @@ print_rule (const char *name, const struct rule *rule)
     inet_ntop (AF_INET6, &rule->u.ipv6, u.addr6, sizeof u.addr6);
     nbdkit_debug ("%s=ipv6:[%s]/%u", name, u.addr6, rule->prefixlen);
     break;
+  case NAME:
+    nbdkit_debug ("%s=name:%s", name, rule->name);
+    break;
 
   case BAD:
     nbdkit_debug ("%s=BAD(!)", name);
@@ -114,15 +187,86 @@ free_rules (struct rule *rules)
 
   for (rule = rules; rule != NULL; rule = next) {
     next = rule->next;
+    free (rule->name);
     free (rule);
   }
 }
 
+static void
+free_node (struct node *node)
+{
+  if (node == NULL)
+    return;
+  free_node (node->child[0]);
+  free_node (node->child[1]);
+  free (node);
+}
+
+static void
+free_ruleset (struct ruleset *r)
+{
+  free_node (r->root4.child[0]);
+  free_node (r->root4.child[1]);
+  free_node (r->root6.child[0]);
+  free_node (r->root6.child[1]);
+  free_rules (r->allow_rules);
+  free_rules (r->deny_rules);
+  free (r);
+}
+
+static struct ruleset *
+get_ruleset (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ruleset_lock);
+  ruleset->refs++;
+  return ruleset;
+}
+
+static void
+put_ruleset (struct ruleset *r)
+{
+  bool last;
+
+  pthread_mutex_lock (&ruleset_lock);
+  last = --r->refs == 0;
+  pthread_mutex_unlock (&ruleset_lock);
+  if (last)
+    free_ruleset (r);
+}
+
+/* Make r the current ruleset.  The caller's reference to r becomes
+ * the global reference.  r may be NULL when unloading.
+ */
+static void
+replace_ruleset (struct ruleset *r)
+{
+  struct ruleset *old;
+
+  pthread_mutex_lock (&ruleset_lock);
+  old = ruleset;
+  ruleset = r;
+  pthread_mutex_unlock (&ruleset_lock);
+  if (old)
+    put_ruleset (old);
+}
+
 static void
 ip_unload (void)
 {
+  pthread_mutex_lock (&rules_thread_lock);
+  if (rules_thread_running) {
+    rules_thread_stop = true;
+    pthread_cond_signal (&rules_thread_cond);
+    pthread_mutex_unlock (&rules_thread_lock);
+    pthread_join (rules_thread, NULL);
+  }
+  else
+    pthread_mutex_unlock (&rules_thread_lock);
+
+  replace_ruleset (NULL);
   free_rules (allow_rules);
   free_rules (deny_rules);
+  free (rules_file);
 }
 
 /* Try to parse the first n characters of value as an IPv4 or IPv6
@@ -177,6 +321,34 @@ parse_unsigned (const char *paramname,
   return nbdkit_parse_unsigned (paramname, buf, ret);
 }
 
+/* Return true if the first n characters of value look like a
+ * hostname, optionally containing '*' wildcards.  To avoid confusion
+ * with malformed IP addresses the name must contain a letter or
+ * wildcard.
+ */
+static bool
+is_hostname (const char *value, size_t n)
+{
+  bool alpha = false;
+  size_t i;
+
+  if (n > NI_MAXHOST - 1)
+    return false;
+
+  for (i = 0; i < n; ++i) {
+    if (value[i] == '\0' ||
+        strchr ("abcdefghijklmnopqrstuvwxyz"
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "0123456789-._*", value[i]) == NULL)
+      return false;
+    if ((value[i] < '0' || value[i] > '9') && value[i] != '-' &&
+        value[i] != '.' && value[i] != '_')
+      alpha = true;
+  }
+
+  return alpha;
+}
+
 static int
 parse_rule (const char *paramname,
             struct rule **rules, struct rule **rules_last,
@@ -266,6 +438,17 @@ parse_rule (const char *paramname,
     return 0;
   }
 
+  /* Hostname or hostname wildcard. */
+  if (is_hostname (value, n)) {
+    new_rule->name = strndup (value, n);
+    if (new_rule->name == NULL) {
+      nbdkit_error ("strndup: %m");
+      return -1;
+    }
+    new_rule->type = NAME;
+    return 0;
+  }
+
   nbdkit_error ("don't know how to parse rule: %s=%.*s",
                 paramname, (int) n, value);
   return -1;
@@ -311,125 +494,476 @@ ip_config (nbdkit_next_config *next, void *nxdata,
       return -1;
     return 0;
   }
+  else if (strcmp (key, "rules") == 0) {
+    free (rules_file);
+    rules_file = nbdkit_realpath (value);
+    if (rules_file == NULL)
+      return -1;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
 
+/* Read the rules file into the allow and deny lists of r.  Each
+ * non-blank line which is not a comment has the same form as the
+ * allow=... and deny=... parameters.
+ */
 static int
-ip_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+read_rules_file (struct ruleset *r)
+{
+  int fd;
+  FILE *fp;
+  ssize_t len;
+  size_t n = 0, lineno = 0;
+  CLEANUP_FREE char *line = NULL;
+  char *p, *value;
+  int ret = -1;
+
+  /* See the comment in the rate filter about fopen("re"). */
+  fd = open (rules_file, O_CLOEXEC | O_RDONLY);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", rules_file);
+    return -1;
+  }
+  fp = fdopen (fd, "r");
+  if (fp == NULL) {
+    nbdkit_error ("fdopen: %s: %m", rules_file);
+    close (fd);
+    return -1;
+  }
+
+  while ((len = getline (&line, &n, fp)) != -1) {
+    lineno++;
+
+    /* Strip leading and trailing whitespace. */
+    while (len > 0 && strchr (" \t\r\n", line[len-1]) != NULL)
+      line[--len] = '\0';
+    p = line + strspn (line, " \t");
+    if (*p == '\0' || *p == '#')
+      continue;
+
+    value = strchr (p, '=');
+    if (value == NULL) {
+      nbdkit_error ("%s:%zu: expecting allow=... or deny=...",
+                    rules_file, lineno);
+      goto out;
+    }
+    *value++ = '\0';
+    if (strcmp (p, "allow") == 0) {
+      if (parse_rules (p, &r->allow_rules, &r->allow_rules_last,
+                       value) == -1)
+        goto out;
+    }
+    else if (strcmp (p, "deny") == 0) {
+      if (parse_rules (p, &r->deny_rules, &r->deny_rules_last,
+                       value) == -1)
+        goto out;
+    }
+    else {
+      nbdkit_error ("%s:%zu: unknown rule list: %s",
+                    rules_file, lineno, p);
+      goto out;
+    }
+  }
+  if (ferror (fp)) {
+    nbdkit_error ("read: %s: %m", rules_file);
+    goto out;
+  }
+
+  ret = 0;
+ out:
+  fclose (fp);
+  return ret;
+}
+
+/* Mark the first prefixlen bits of addr in the trie. */
+static int
+insert_prefix (struct node *node, const uint8_t *addr, unsigned prefixlen,
+               unsigned mark)
+{
+  unsigned i, bit;
+
+  for (i = 0; i < prefixlen; ++i) {
+    /* A shorter prefix already covers this one. */
+    if (node->marks & mark)
+      return 0;
+
+    bit = (addr[i/8] >> (7 - i%8)) & 1;
+    if (node->child[bit] == NULL) {
+      node->child[bit] = calloc (1, sizeof (struct node));
+      if (node->child[bit] == NULL) {
+        nbdkit_error ("calloc: %m");
+        return -1;
+      }
+    }
+    node = node->child[bit];
+  }
+
+  node->marks |= mark;
+  return 0;
+}
+
+/* Walk the trie following the bits of addr, returning the marks of
+ * every prefix of addr which appears in a rule.  We can stop early
+ * once an allow rule matches because that overrides everything.
+ */
+static unsigned
+lookup_address (const struct node *node, const uint8_t *addr, unsigned bits)
+{
+  unsigned i, marks = 0;
+
+  for (i = 0; node != NULL; ++i) {
+    marks |= node->marks;
+    if ((marks & MARK_ALLOW) || i == bits)
+      break;
+    node = node->child[(addr[i/8] >> (7 - i%8)) & 1];
+  }
+
+  return marks;
+}
+
+/* Resolve a hostname and add all its addresses to the trie.
+ *
+ * An allow rule which cannot be resolved simply matches no clients.
+ * A deny rule which cannot be resolved would let through the clients
+ * it was meant to stop, so it is an error and the new ruleset is not
+ * used.  When only re-resolving names periodically this is expected
+ * to happen during DNS outages, so it is only reported when
+ * debugging and the old ruleset is kept.
+ */
+static int
+resolve_name (struct ruleset *r, const char *name, unsigned mark,
+              bool reresolve)
 {
+  struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                            .ai_socktype = SOCK_STREAM };
+  struct addrinfo *res, *ai;
+  const struct sockaddr_in *sin;
+  const struct sockaddr_in6 *sin6;
+  int err;
+
+  err = getaddrinfo (name, NULL, &hints, &res);
+  if (err != 0) {
+    if (mark == MARK_ALLOW) {
+      nbdkit_debug ("%s: %s, ignoring this rule", name, gai_strerror (err));
+      return 0;
+    }
+    if (reresolve)
+      nbdkit_debug ("%s: %s, keeping the old rules",
+                    name, gai_strerror (err));
+    else
+      nbdkit_error ("deny=%s: %s", name, gai_strerror (err));
+    return -1;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    switch (ai->ai_family) {
+    case AF_INET:
+      sin = (struct sockaddr_in *) ai->ai_addr;
+      err = insert_prefix (&r->root4, (uint8_t *) &sin->sin_addr, 32, mark);
+      break;
+    case AF_INET6:
+      sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+      err = insert_prefix (&r->root6, sin6->sin6_addr.s6_addr, 128, mark);
+      break;
+    default:
+      err = 0;
+    }
+    if (err == -1) {
+      freeaddrinfo (res);
+      return -1;
+    }
+  }
+
+  freeaddrinfo (res);
+  return 0;
+}
+
+static int
+compile_rules (struct ruleset *r, const struct rule *rules, unsigned mark,
+               bool reresolve)
+{
+  const struct rule *rule;
+
+  for (rule = rules; rule != NULL; rule = rule->next) {
+    switch (rule->type) {
+    case ANY:
+      r->root4.marks |= mark;
+      r->root6.marks |= mark;
+      break;
+    case ANYV4:
+      r->root4.marks |= mark;
+      break;
+    case ANYV6:
+      r->root6.marks |= mark;
+      break;
+    case IPV4:
+      if (insert_prefix (&r->root4, (uint8_t *) &rule->u.ipv4,
+                         rule->prefixlen, mark) == -1)
+        return -1;
+      break;
+    case IPV6:
+      if (insert_prefix (&r->root6, rule->u.ipv6.s6_addr,
+                         rule->prefixlen, mark) == -1)
+        return -1;
+      break;
+    case NAME:
+      if (strchr (rule->name, '*') != NULL) {
+        if (mark == MARK_ALLOW)
+          r->allow_wildcards = true;
+        else
+          r->deny_wildcards = true;
+      }
+      else {
+        resolve_names = true;
+        if (resolve_name (r, rule->name, mark, reresolve) == -1)
+          return -1;
+      }
+      break;
+
+    case BAD:
+    default:
+      abort ();
+    }
+  }
+
+  return 0;
+}
+
+/* Build a new ruleset from the command line and the rules file (if
+ * any) and make it current.  If this fails the current ruleset is
+ * left alone.  reresolve is true if nothing has changed except that
+ * it is time to resolve hostnames again.
+ */
+static int
+load_rules (bool reresolve)
+{
+  struct ruleset *r;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  r->refs = 1;
+
+  if (rules_file && read_rules_file (r) == -1)
+    goto err;
+
   if (ip_debug_rules) {
     print_rules ("allow", allow_rules);
+    print_rules ("allow", r->allow_rules);
     print_rules ("deny", deny_rules);
+    print_rules ("deny", r->deny_rules);
   }
 
+  resolve_names = false;
+  if (compile_rules (r, allow_rules, MARK_ALLOW, reresolve) == -1 ||
+      compile_rules (r, r->allow_rules, MARK_ALLOW, reresolve) == -1 ||
+      compile_rules (r, deny_rules, MARK_DENY, reresolve) == -1 ||
+      compile_rules (r, r->deny_rules, MARK_DENY, reresolve) == -1)
+    goto err;
+
+  replace_ruleset (r);
+  return 0;
+
+ err:
+  free_ruleset (r);
+  return -1;
+}
+
+static int
+ip_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (load_rules (false) == -1)
+    return -1;
+
   return next (nxdata);
 }
 
 #define ip_config_help \
   "allow=addr[,addr...]     Set allow list.\n" \
-  "deny=addr[,addr...]      Set deny list."
+  "deny=addr[,addr...]      Set deny list.\n" \
+  "rules=FILENAME           Read more rules from a file."
 
-/* Compare two IPv6 addresses as far as prefixlen bits.  Both
- * addresses are in network byte order (ie. big endian) so we can
- * compare them byte by byte from the beginning without considering
- * host endianness.
+/* Reload the rules when the rules file changes, and periodically if
+ * they contain hostnames, until ip_unload tells us to stop.
  */
-static bool
-ipv6_equal (struct in6_addr addr1, struct in6_addr addr2, unsigned prefixlen)
+static void *
+rules_thread_fn (void *arg)
 {
-  size_t n;
-
-  for (n = 0; n < 16; ++n) {
-    if (prefixlen == 0)
-      return true;
-
-    if (prefixlen < 8) {
-      const uint8_t mask = 0xff << (8 - prefixlen);
-      return (addr1.s6_addr[n] & mask) == (addr2.s6_addr[n] & mask);
+  struct timespec ts;
+  struct stat statbuf, last = { 0 };
+  time_t last_resolve;
+  bool changed, reresolve;
+
+  if (rules_file && stat (rules_file, &statbuf) == 0)
+    last = statbuf;
+  last_resolve = time (NULL);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rules_thread_lock);
+  while (!rules_thread_stop) {
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += RULES_FILE_INTERVAL;
+    pthread_cond_timedwait (&rules_thread_cond, &rules_thread_lock, &ts);
+    if (rules_thread_stop)
+      break;
+
+    pthread_mutex_unlock (&rules_thread_lock);
+
+    /* If the rules file is removed we keep the old rules. */
+    changed = false;
+    if (rules_file && stat (rules_file, &statbuf) == 0 &&
+        (statbuf.st_ino != last.st_ino || statbuf.st_dev != last.st_dev ||
+         statbuf.st_size != last.st_size ||
+         statbuf.st_mtime != last.st_mtime ||
+         statbuf.st_ctime != last.st_ctime)) {
+      last = statbuf;
+      changed = true;
+      nbdkit_debug ("%s: rules file changed, reloading", rules_file);
     }
+    reresolve = !changed && resolve_names &&
+      time (NULL) - last_resolve >= RESOLVE_INTERVAL;
 
-    if (addr1.s6_addr[n] != addr2.s6_addr[n])
-      return false;
+    if (changed || reresolve) {
+      last_resolve = time (NULL);
+      load_rules (reresolve);
+    }
 
-    prefixlen -= 8;
+    pthread_mutex_lock (&rules_thread_lock);
   }
+  return NULL;
+}
 
-  assert (prefixlen == 0);
+/* The background thread is started when the first client connects
+ * rather than in config_complete, because nbdkit may fork after
+ * that.
+ */
+static int
+start_rules_thread (void)
+{
+  int err;
 
-  return true;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rules_thread_lock);
+  if (rules_thread_running || (!rules_file && !resolve_names))
+    return 0;
+  err = pthread_create (&rules_thread, NULL, rules_thread_fn, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  rules_thread_running = true;
+  return 0;
 }
 
+/* Look up the client's hostname for matching against wildcards.  To
+ * stop clients from choosing their own reverse DNS entry the name
+ * must resolve back to the client's address.
+ */
 static bool
-matches_rule (const struct rule *rule,
-              int family, const struct sockaddr *addr)
+get_client_hostname (const struct sockaddr *addr, socklen_t addrlen,
+                     char *host, size_t hostlen)
 {
-  const struct sockaddr_in *sin;
-  uint32_t cin, rin, mask;
-  const struct sockaddr_in6 *sin6;
-
-  switch (rule->type) {
-  case ANY:
-    return true;
+  struct addrinfo hints = { .ai_family = addr->sa_family,
+                            .ai_socktype = SOCK_STREAM };
+  struct addrinfo *res, *ai;
+  bool found = false;
 
-  case ANYV4:
-    return family == AF_INET;
-
-  case ANYV6:
-    return family == AF_INET6;
-
-  case IPV4:
-    if (family != AF_INET) return false;
-    sin = (struct sockaddr_in *) addr;
-    cin = ntohl (sin->sin_addr.s_addr);
-    rin = ntohl (rule->u.ipv4.s_addr);
-    mask = 0xffffffff << (32 - rule->prefixlen);
-    return (cin & mask) == (rin & mask);
-
-  case IPV6:
-    if (family != AF_INET6) return false;
-    sin6 = (struct sockaddr_in6 *) addr;
-    return ipv6_equal (sin6->sin6_addr, rule->u.ipv6, rule->prefixlen);
+  if (getnameinfo (addr, addrlen, host, hostlen, NULL, 0,
+                   NI_NAMEREQD) != 0)
+    return false;
 
-  case BAD:
-  default:
-    abort ();
+  if (getaddrinfo (host, NULL, &hints, &res) != 0)
+    return false;
+  for (ai = res; ai != NULL && !found; ai = ai->ai_next) {
+    if (addr->sa_family == AF_INET)
+      found =
+        memcmp (&((struct sockaddr_in *) ai->ai_addr)->sin_addr,
+                &((struct sockaddr_in *) addr)->sin_addr,
+                sizeof (struct in_addr)) == 0;
+    else
+      found =
+        memcmp (&((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr,
+                &((struct sockaddr_in6 *) addr)->sin6_addr,
+                sizeof (struct in6_addr)) == 0;
   }
+  freeaddrinfo (res);
+
+  if (!found)
+    nbdkit_debug ("client hostname %s does not resolve to its address",
+                  host);
+  return found;
 }
 
 static bool
-matches_rules_list (const struct rule *rules,
-                    int family, const struct sockaddr *addr)
+matches_wildcards (const struct rule *rules, const char *host)
 {
   const struct rule *rule;
-  bool b;
 
   for (rule = rules; rule != NULL; rule = rule->next) {
-    b = matches_rule (rule, family, addr);
-    if (ip_debug_rules) {
-      print_rule ("matching", rule);
-      nbdkit_debug ("returned %s", b ? "true" : "false");
-    }
-    if (b)
+    if (rule->type == NAME && strchr (rule->name, '*') != NULL &&
+        fnmatch (rule->name, host, FNM_CASEFOLD) == 0) {
+      if (ip_debug_rules)
+        print_rule ("matched", rule);
       return true;
+    }
   }
 
   return false;
 }
 
 static bool
-check_if_allowed (const struct sockaddr *addr)
+check_if_allowed (const struct sockaddr *addr, socklen_t addrlen)
 {
   int family = ((struct sockaddr_in *)addr)->sin_family;
+  struct ruleset *r;
+  unsigned marks;
+  char host[NI_MAXHOST];
 
   /* There's an implicit allow all for non-IP sockets, see the manual. */
   if (family != AF_INET && family != AF_INET6)
     return true;
 
-  if (matches_rules_list (allow_rules, family, addr))
+  r = get_ruleset ();
+
+  if (family == AF_INET) {
+    const struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+    marks = lookup_address (&r->root4, (uint8_t *) &sin->sin_addr, 32);
+  }
+  else {
+    const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+    marks = lookup_address (&r->root6, sin6->sin6_addr.s6_addr, 128);
+  }
+
+  /* Only look up the client's hostname if the result could depend
+   * on it.
+   */
+  if (!(marks & MARK_ALLOW) &&
+      (r->allow_wildcards || (!(marks & MARK_DENY) && r->deny_wildcards)) &&
+      get_client_hostname (addr, addrlen, host, sizeof host)) {
+    if (ip_debug_rules)
+      nbdkit_debug ("client hostname: %s", host);
+    if (matches_wildcards (allow_rules, host) ||
+        matches_wildcards (r->allow_rules, host))
+      marks |= MARK_ALLOW;
+    else if (matches_wildcards (deny_rules, host) ||
+             matches_wildcards (r->deny_rules, host))
+      marks |= MARK_DENY;
+  }
+
+  put_ruleset (r);
+
+  if (ip_debug_rules)
+    nbdkit_debug ("client matched allow list: %s, deny list: %s",
+                  marks & MARK_ALLOW ? "true" : "false",
+                  marks & MARK_DENY ? "true" : "false");
+
+  if (marks & MARK_ALLOW)
     return true;
 
-  if (matches_rules_list (deny_rules, family, addr))
+  if (marks & MARK_DENY)
     return false;
 
   return true;
@@ -441,11 +975,14 @@ ip_preconnect (nbdkit_next_preconnect *next, void *nxdata, int readonly)
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof addr;
 
+  if (start_rules_thread () == -1)
+    return -1;
+
   if (nbdkit_peer_name ((struct sockaddr *) &addr, &addrlen) == -1)
     return -1;                  /* We should fail closed ... */
 
   /* Follow the rules. */
-  if (check_if_allowed ((struct sockaddr *) &addr) == false) {
+  if (check_if_allowed ((struct sockaddr *) &addr, addrlen) == false) {
     nbdkit_error ("client not permitted to connect "
                   "because of IP address restriction");
     return -1;
@@ -0,0 +1,131 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* nbdkit-log-decode: convert binary logs written by
+ * nbdkit-log-filter logformat=binary to the text format.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include "log.h"
+
+static const char *progname = "nbdkit-log-decode";
+
+static void
+usage (FILE *fp)
+{
+  fprintf (fp,
+           "usage: %s [FILE ...]\n"
+           "Convert binary nbdkit-log-filter logs to text on stdout.\n"
+           "If no FILE is given, read from stdin.\n",
+           progname);
+}
+
+static int
+print_record (const struct log_record *rec, void *opaque)
+{
+  log_format_record (stdout, rec);
+  return 0;
+}
+
+static int
+decode (FILE *fp, const char *name)
+{
+  char *what;
+  int r;
+
+  if (asprintf (&what, "%s: %s", progname, name) == -1) {
+    perror ("asprintf");
+    return -1;
+  }
+  r = log_read_file (fp, what, print_record, NULL);
+  free (what);
+  return r;
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum { HELP_OPTION = CHAR_MAX + 1 };
+  static const struct option long_options[] = {
+    { "help", no_argument, NULL, HELP_OPTION },
+    { "version", no_argument, NULL, 'V' },
+    { NULL }
+  };
+  int c, i, ret = EXIT_SUCCESS;
+  FILE *fp;
+
+  while ((c = getopt_long (argc, argv, "V", long_options, NULL)) != -1) {
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout);
+      exit (EXIT_SUCCESS);
+    case 'V':
+      printf ("%s %s\n", progname, PACKAGE_VERSION);
+      exit (EXIT_SUCCESS);
+    default:
+      usage (stderr);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc) {
+    if (decode (stdin, "stdin") == -1)
+      ret = EXIT_FAILURE;
+  }
+  for (i = optind; i < argc; ++i) {
+    fp = fopen (argv[i], "r");
+    if (fp == NULL) {
+      fprintf (stderr, "%s: %s: %s\n", progname, argv[i], strerror (errno));
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    if (decode (fp, argv[i]) == -1)
+      ret = EXIT_FAILURE;
+    fclose (fp);
+  }
+
+  if (fflush (stdout) == EOF) {
+    perror ("stdout");
+    ret = EXIT_FAILURE;
+  }
+  exit (ret);
+}
@@ -0,0 +1,203 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <nbdkit-filter.h>
+
+#include "log.h"
+
+static const char *
+type_name (uint16_t type)
+{
+  switch (type) {
+  case LOG_CONNECT:    return "Connect";
+  case LOG_DISCONNECT: return "Disconnect";
+  case LOG_READ:       return "Read";
+  case LOG_WRITE:      return "Write";
+  case LOG_FLUSH:      return "Flush";
+  case LOG_TRIM:       return "Trim";
+  case LOG_ZERO:       return "Zero";
+  case LOG_EXTENTS:    return "Extents";
+  case LOG_CACHE:      return "Cache";
+  default:             return "Unknown";
+  }
+}
+
+/* Nicer log of return value.  Only decode what
+ * connections.c:nbd_errno() recognizes.
+ */
+static const char *
+return_string (int r, int err)
+{
+  if (r != -1)
+    return "Success";
+
+  switch (err) {
+  case EROFS:
+    return "EROFS=>EPERM";
+  case EPERM:
+    return "EPERM";
+  case EIO:
+    return "EIO";
+  case ENOMEM:
+    return "ENOMEM";
+#ifdef EDQUOT
+  case EDQUOT:
+    return "EDQUOT=>ENOSPC";
+#endif
+  case EFBIG:
+    return "EFBIG=>ENOSPC";
+  case ENOSPC:
+    return "ENOSPC";
+#ifdef ESHUTDOWN
+  case ESHUTDOWN:
+    return "ESHUTDOWN";
+#endif
+  case EINVAL:
+    return "EINVAL";
+  default:
+    return "Other=>EINVAL";
+  }
+}
+
+static void
+print_timestamp (FILE *fp, uint64_t time)
+{
+  time_t secs = time / 1000000;
+  struct tm tm;
+  char timestamp[27] = "Time unknown";
+
+  /* Logging is best effort, so ignore failure to get timestamp */
+  if (time != 0 && gmtime_r (&secs, &tm) != NULL) {
+    size_t s;
+
+    s = strftime (timestamp, sizeof timestamp - sizeof ".000000" + 1,
+                  "%F %T", &tm);
+    assert (s);
+    snprintf (timestamp + s, sizeof timestamp - s, ".%06ld",
+              (long) (time % 1000000));
+  }
+  fputs (timestamp, fp);
+}
+
+static void
+print_extents (FILE *fp, const struct log_record *rec)
+{
+  const struct log_extent *e = (const struct log_extent *) (rec + 1);
+  size_t i, n = (rec->size - sizeof *rec) / sizeof *e;
+
+  for (i = 0; i < n; ++i) {
+    if (i > 0)
+      fprintf (fp, ", ");
+    fprintf (fp, "{ offset=0x%" PRIx64 ", length=0x%" PRIx64 ", "
+             "hole=%d, zero=%d }",
+             e[i].offset, e[i].length,
+             !!(e[i].type & NBDKIT_EXTENT_HOLE),
+             !!(e[i].type & NBDKIT_EXTENT_ZERO));
+  }
+}
+
+void
+log_format_record (FILE *fp, const struct log_record *rec)
+{
+  uint16_t type = rec->type & ~LOG_REPLY;
+  const int32_t *caps;
+
+  print_timestamp (fp, rec->time);
+  fprintf (fp, " connection=%" PRIu64 " %s%s ", rec->connection,
+           rec->type & LOG_REPLY ? "..." : "", type_name (type));
+
+  if (rec->type & LOG_REPLY) {
+    fprintf (fp, "id=%" PRIu64 " ", rec->id);
+    if (type == LOG_EXTENTS && rec->r == 0) {
+      fprintf (fp, "extents=[");
+      print_extents (fp, rec);
+      fprintf (fp, "] return=0");
+    }
+    else
+      fprintf (fp, "return=%d (%s)", rec->r, return_string (rec->r, rec->err));
+    fputc ('\n', fp);
+    return;
+  }
+
+  switch (type) {
+  case LOG_CONNECT:
+    caps = (const int32_t *) (rec + 1);
+    if (rec->size < sizeof *rec + LOG_NR_CAPS * sizeof *caps)
+      break;
+    fprintf (fp, "size=0x%" PRIx64 " write=%d flush=%d "
+             "rotational=%d trim=%d zero=%d fua=%d extents=%d cache=%d "
+             "fast_zero=%d", rec->offset, caps[0], caps[1], caps[2],
+             caps[3], caps[4], caps[5], caps[6], caps[7], caps[8]);
+    break;
+  case LOG_DISCONNECT:
+    fprintf (fp, "transactions=%" PRId64, rec->id);
+    break;
+  case LOG_READ:
+  case LOG_CACHE:
+    fprintf (fp, "id=%" PRIu64 " offset=0x%" PRIx64 " count=0x%x ...",
+             rec->id, rec->offset, rec->count);
+    break;
+  case LOG_WRITE:
+  case LOG_TRIM:
+    fprintf (fp, "id=%" PRIu64 " offset=0x%" PRIx64 " count=0x%x fua=%d ...",
+             rec->id, rec->offset, rec->count,
+             !!(rec->flags & NBDKIT_FLAG_FUA));
+    break;
+  case LOG_FLUSH:
+    fprintf (fp, "id=%" PRIu64 " ...", rec->id);
+    break;
+  case LOG_ZERO:
+    fprintf (fp, "id=%" PRIu64 " "
+             "offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d fast=%d...",
+             rec->id, rec->offset, rec->count,
+             !!(rec->flags & NBDKIT_FLAG_MAY_TRIM),
+             !!(rec->flags & NBDKIT_FLAG_FUA),
+             !!(rec->flags & NBDKIT_FLAG_FAST_ZERO));
+    break;
+  case LOG_EXTENTS:
+    fprintf (fp, "id=%" PRIu64 " offset=0x%" PRIx64 " count=0x%x "
+             "req_one=%d ...",
+             rec->id, rec->offset, rec->count,
+             !!(rec->flags & NBDKIT_FLAG_REQ_ONE));
+    break;
+  }
+  fputc ('\n', fp);
+}
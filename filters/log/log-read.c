@@ -0,0 +1,155 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Reader for binary logs, shared by nbdkit-log-decode and
+ * nbdkit-log-replay.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+
+/* Sanity limit on the size of a single record. */
+#define MAX_RECORD_SIZE (256 * 1024 * 1024)
+
+/* Read exactly n bytes.  Returns 1 on success, 0 on clean EOF before
+ * any byte was read (only if eof_ok), or -1 on error or truncation.
+ */
+static int
+read_full (FILE *fp, const char *name, void *buf, size_t n, bool eof_ok)
+{
+  size_t r = fread (buf, 1, n, fp);
+
+  if (r == n)
+    return 1;
+  if (ferror (fp)) {
+    fprintf (stderr, "%s: read: %s\n", name, strerror (errno));
+    return -1;
+  }
+  if (r == 0 && eof_ok)
+    return 0;
+  fprintf (stderr, "%s: truncated file\n", name);
+  return -1;
+}
+
+static int
+check_header (const struct log_file_header *header, const char *name)
+{
+  if (header->byte_order != LOG_BYTE_ORDER) {
+    fprintf (stderr, "%s: log was written on a machine with "
+             "a different byte order\n", name);
+    return -1;
+  }
+  if (header->version != LOG_VERSION) {
+    fprintf (stderr, "%s: unsupported log version %u\n",
+             name, header->version);
+    return -1;
+  }
+  return 0;
+}
+
+int
+log_read_file (FILE *fp, const char *name,
+               int (*fn) (const struct log_record *rec, void *opaque),
+               void *opaque)
+{
+  union {
+    struct log_file_header header;
+    struct log_record rec;
+  } u;
+  struct log_record *rec = NULL;
+  size_t allocated = 0;
+  int r, ret = -1;
+
+  /* Every session starts with a header, and because of logappend
+   * there may be more headers later in the file.
+   */
+  r = read_full (fp, name, &u.header, sizeof u.header, false);
+  if (r == -1)
+    return -1;
+  if (memcmp (u.header.magic, LOG_MAGIC, sizeof LOG_MAGIC) != 0) {
+    fprintf (stderr, "%s: not a binary nbdkit log file\n", name);
+    return -1;
+  }
+  if (check_header (&u.header, name) == -1)
+    return -1;
+
+  for (;;) {
+    r = read_full (fp, name, &u.header, sizeof u.header, true);
+    if (r == -1)
+      goto out;
+    if (r == 0)
+      break;
+    if (memcmp (u.header.magic, LOG_MAGIC, sizeof LOG_MAGIC) == 0) {
+      if (check_header (&u.header, name) == -1)
+        goto out;
+      continue;
+    }
+
+    /* Not a header, so it is the start of a record. */
+    if (read_full (fp, name, (char *) &u.rec + sizeof u.header,
+                   sizeof u.rec - sizeof u.header, false) == -1)
+      goto out;
+    if (u.rec.size < sizeof u.rec || u.rec.size > MAX_RECORD_SIZE) {
+      fprintf (stderr, "%s: corrupt record\n", name);
+      goto out;
+    }
+    if (u.rec.size > allocated) {
+      struct log_record *p = realloc (rec, u.rec.size);
+      if (p == NULL) {
+        perror ("realloc");
+        goto out;
+      }
+      rec = p;
+      allocated = u.rec.size;
+    }
+    memcpy (rec, &u.rec, sizeof u.rec);
+    if (read_full (fp, name, rec + 1, u.rec.size - sizeof u.rec,
+                   false) == -1)
+      goto out;
+
+    if (fn (rec, opaque) == -1)
+      goto out;
+  }
+  ret = 0;
+
+ out:
+  free (rec);
+  return ret;
+}
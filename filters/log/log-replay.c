@@ -0,0 +1,603 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* nbdkit-log-replay: replay the requests recorded in a binary log
+ * written by nbdkit-log-filter logformat=binary against an NBD
+ * server, and report throughput and latency.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#include <nbdkit-filter.h>
+
+#include "log.h"
+
+static const char *progname = "nbdkit-log-replay";
+
+/* A single request from the trace. */
+struct call {
+  uint64_t time;                /* µs after the first request */
+  size_t conn;                  /* Index into conns[]. */
+  uint64_t connection;          /* Connection number in the trace. */
+  uint64_t id;
+  uint16_t type;
+  uint16_t flags;
+  uint64_t offset;
+  uint32_t count;
+  int64_t orig_usecs;           /* Latency in the trace, or -1. */
+  uint64_t start;               /* When we issued it. */
+  int64_t usecs;                /* Replayed latency, or -1. */
+  int err;
+};
+
+static struct call *calls;
+static size_t ncalls, calls_alloc;
+
+/* The connections seen in the trace, in order of first appearance. */
+struct conn {
+  uint64_t connection;
+  struct nbd_handle *nbd;
+  uint64_t in_flight;
+};
+
+static struct conn *conns;
+static size_t nconns;
+
+static double speed = 1.0;
+static uint64_t max_in_flight = 64;
+static uint64_t in_flight;
+static uint64_t errors;
+
+static void
+usage (FILE *fp)
+{
+  fprintf (fp,
+           "usage: %s [OPTIONS] TRACE SOCKET|URI\n"
+           "Replay a binary nbdkit-log-filter log against an NBD server.\n"
+           "\n"
+           "  -s, --speed=FACTOR        Replay FACTOR times faster than\n"
+           "                            recorded (0 = as fast as possible).\n"
+           "  -q, --max-in-flight=N     Maximum number of requests in flight\n"
+           "                            (default 64).\n",
+           progname);
+}
+
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+static size_t
+find_conn (uint64_t connection)
+{
+  size_t i;
+  struct conn *p;
+
+  for (i = 0; i < nconns; ++i)
+    if (conns[i].connection == connection)
+      return i;
+
+  p = realloc (conns, (nconns + 1) * sizeof *p);
+  if (p == NULL) {
+    perror ("realloc");
+    exit (EXIT_FAILURE);
+  }
+  conns = p;
+  memset (&conns[nconns], 0, sizeof conns[nconns]);
+  conns[nconns].connection = connection;
+  return nconns++;
+}
+
+/* Callback from log_read_file. */
+static int
+add_record (const struct log_record *rec, void *opaque)
+{
+  uint16_t type = rec->type & ~LOG_REPLY;
+  struct call *c;
+  size_t i;
+
+  if (type < LOG_READ || type > LOG_CACHE)
+    return 0;
+
+  /* Match replies to their call.  The call is normally only a few
+   * records earlier, as far back as the number of requests that were
+   * in flight.
+   */
+  if (rec->type & LOG_REPLY) {
+    for (i = ncalls; i > 0; --i) {
+      c = &calls[i-1];
+      if (c->connection == rec->connection && c->id == rec->id) {
+        if (rec->time >= c->time)
+          c->orig_usecs = rec->time - c->time;
+        break;
+      }
+    }
+    return 0;
+  }
+
+  if (ncalls >= calls_alloc) {
+    size_t n = calls_alloc ? calls_alloc * 2 : 1024;
+    struct call *p = realloc (calls, n * sizeof *p);
+    if (p == NULL) {
+      perror ("realloc");
+      return -1;
+    }
+    calls = p;
+    calls_alloc = n;
+  }
+
+  c = &calls[ncalls++];
+  memset (c, 0, sizeof *c);
+  c->time = rec->time;
+  c->conn = find_conn (rec->connection);
+  c->connection = rec->connection;
+  c->id = rec->id;
+  c->type = type;
+  c->flags = rec->flags;
+  c->offset = rec->offset;
+  c->count = rec->count;
+  c->orig_usecs = -1;
+  c->usecs = -1;
+  return 0;
+}
+
+/* Records from different threads may be slightly out of order in the
+ * log, so sort calls by time (stably, by connection and id).
+ */
+static int
+compare_calls (const void *av, const void *bv)
+{
+  const struct call *a = av, *b = bv;
+
+  if (a->time != b->time)
+    return a->time < b->time ? -1 : 1;
+  if (a->connection != b->connection)
+    return a->connection < b->connection ? -1 : 1;
+  if (a->id != b->id)
+    return a->id < b->id ? -1 : 1;
+  return 0;
+}
+
+static void
+load_trace (const char *filename)
+{
+  FILE *fp;
+  char *what;
+  uint64_t t0;
+  size_t i;
+  int r;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    fprintf (stderr, "%s: %s: %s\n", progname, filename, strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  if (asprintf (&what, "%s: %s", progname, filename) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+  r = log_read_file (fp, what, add_record, NULL);
+  free (what);
+  fclose (fp);
+  if (r == -1)
+    exit (EXIT_FAILURE);
+
+  if (ncalls == 0) {
+    fprintf (stderr, "%s: %s: no requests found in the log\n",
+             progname, filename);
+    exit (EXIT_FAILURE);
+  }
+
+  qsort (calls, ncalls, sizeof calls[0], compare_calls);
+  t0 = calls[0].time;
+  for (i = 0; i < ncalls; ++i)
+    calls[i].time -= t0;
+}
+
+static void
+open_connections (const char *target)
+{
+  bool need_extents = false;
+  size_t i;
+  int r;
+
+  for (i = 0; i < ncalls; ++i)
+    if (calls[i].type == LOG_EXTENTS)
+      need_extents = true;
+
+  for (i = 0; i < nconns; ++i) {
+    struct nbd_handle *nbd = nbd_create ();
+
+    if (nbd == NULL)
+      goto err;
+    conns[i].nbd = nbd;
+    if (need_extents &&
+        nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+      goto err;
+    if (strstr (target, "://") != NULL)
+      r = nbd_connect_uri (nbd, target);
+    else
+      r = nbd_connect_unix (nbd, target);
+    if (r == -1)
+      goto err;
+  }
+  return;
+
+ err:
+  fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+  exit (EXIT_FAILURE);
+}
+
+static void
+close_connections (void)
+{
+  size_t i;
+
+  for (i = 0; i < nconns; ++i) {
+    if (nbd_shutdown (conns[i].nbd, 0) == -1)
+      fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    nbd_close (conns[i].nbd);
+  }
+}
+
+static int
+complete (void *opaque, int *error)
+{
+  struct call *c = opaque;
+
+  c->usecs = now_usec () - c->start;
+  c->err = *error;
+  if (*error)
+    errors++;
+  conns[c->conn].in_flight--;
+  in_flight--;
+  return 1;
+}
+
+static int
+ignore_extent (void *opaque, const char *metacontext, uint64_t offset,
+               uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+static void
+issue (struct call *c, void *rbuf, const void *wbuf)
+{
+  struct nbd_handle *nbd = conns[c->conn].nbd;
+  nbd_completion_callback cb = { .callback = complete, .user_data = c };
+  nbd_extent_callback extcb = { .callback = ignore_extent };
+  uint32_t f = 0;
+  int64_t cookie = -1;
+
+  if (c->flags & NBDKIT_FLAG_FUA)
+    f |= LIBNBD_CMD_FLAG_FUA;
+
+  c->start = now_usec ();
+  switch (c->type) {
+  case LOG_READ:
+    cookie = nbd_aio_pread (nbd, rbuf, c->count, c->offset, cb, 0);
+    break;
+  case LOG_WRITE:
+    cookie = nbd_aio_pwrite (nbd, wbuf, c->count, c->offset, cb, f);
+    break;
+  case LOG_FLUSH:
+    cookie = nbd_aio_flush (nbd, cb, 0);
+    break;
+  case LOG_TRIM:
+    cookie = nbd_aio_trim (nbd, c->count, c->offset, cb, f);
+    break;
+  case LOG_ZERO:
+    if (!(c->flags & NBDKIT_FLAG_MAY_TRIM))
+      f |= LIBNBD_CMD_FLAG_NO_HOLE;
+#if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
+    if (c->flags & NBDKIT_FLAG_FAST_ZERO)
+      f |= LIBNBD_CMD_FLAG_FAST_ZERO;
+#endif
+    cookie = nbd_aio_zero (nbd, c->count, c->offset, cb, f);
+    break;
+  case LOG_EXTENTS:
+    if (c->flags & NBDKIT_FLAG_REQ_ONE)
+      f = LIBNBD_CMD_FLAG_REQ_ONE;
+    cookie = nbd_aio_block_status (nbd, c->count, c->offset, extcb, cb, f);
+    break;
+  case LOG_CACHE:
+    cookie = nbd_aio_cache (nbd, c->count, c->offset, cb, 0);
+    break;
+  }
+
+  if (cookie == -1) {
+    /* The command was rejected before being sent (for example a write
+     * to a read-only server), so the callback will not be called.
+     */
+    c->err = nbd_get_errno () ? : EINVAL;
+    errors++;
+    return;
+  }
+  conns[c->conn].in_flight++;
+  in_flight++;
+}
+
+static void
+replay (uint64_t *elapsed)
+{
+  struct pollfd *fds;
+  void *rbuf, *wbuf;
+  uint32_t max_count = 0;
+  uint64_t start, t, due;
+  size_t i, next = 0;
+  int timeout;
+
+  for (i = 0; i < ncalls; ++i)
+    if (calls[i].count > max_count)
+      max_count = calls[i].count;
+
+  /* All reads share one buffer and all writes share another, since we
+   * don't care about the data.  The write buffer is filled with a
+   * non-zero pattern so that servers don't detect zero writes.
+   */
+  rbuf = malloc (max_count ? max_count : 1);
+  wbuf = malloc (max_count ? max_count : 1);
+  fds = calloc (nconns, sizeof *fds);
+  if (rbuf == NULL || wbuf == NULL || fds == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < max_count; ++i)
+    ((unsigned char *) wbuf)[i] = i & 0xff;
+
+  start = now_usec ();
+  while (next < ncalls || in_flight > 0) {
+    t = now_usec () - start;
+    timeout = -1;
+    while (next < ncalls && in_flight < max_in_flight) {
+      if (speed > 0) {
+        due = calls[next].time / speed;
+        if (due > t) {
+          timeout = (due - t + 999) / 1000;
+          break;
+        }
+      }
+      issue (&calls[next++], rbuf, wbuf);
+    }
+    if (in_flight == 0 && next < ncalls && timeout == -1)
+      continue;
+
+    for (i = 0; i < nconns; ++i) {
+      unsigned dir = nbd_aio_get_direction (conns[i].nbd);
+
+      fds[i].fd = nbd_aio_get_fd (conns[i].nbd);
+      fds[i].events = 0;
+      fds[i].revents = 0;
+      if (dir & LIBNBD_AIO_DIRECTION_READ)
+        fds[i].events |= POLLIN;
+      if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+        fds[i].events |= POLLOUT;
+    }
+
+    if (poll (fds, nconns, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("poll");
+      exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nconns; ++i) {
+      int r = 0;
+
+      if (fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        r = nbd_aio_notify_read (conns[i].nbd);
+      else if (fds[i].revents & POLLOUT)
+        r = nbd_aio_notify_write (conns[i].nbd);
+      if (r == -1) {
+        fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  *elapsed = now_usec () - start;
+
+  free (fds);
+  free (rbuf);
+  free (wbuf);
+}
+
+static int
+compare_int64 (const void *av, const void *bv)
+{
+  const int64_t *a = av, *b = bv;
+
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Return percentile p of the n sorted values in v. */
+static int64_t
+percentile (const int64_t *v, size_t n, double p)
+{
+  size_t i = n * p / 100.0;
+
+  if (i >= n)
+    i = n - 1;
+  return v[i];
+}
+
+static void
+print_latencies (const char *what, int64_t *v, size_t n)
+{
+  if (n == 0)
+    return;
+  qsort (v, n, sizeof *v, compare_int64);
+  printf ("  %s latency: p50 %" PRIi64 " us, p90 %" PRIi64 " us, "
+          "p99 %" PRIi64 " us, p99.9 %" PRIi64 " us, max %" PRIi64 " us\n",
+          what,
+          percentile (v, n, 50), percentile (v, n, 90), percentile (v, n, 99),
+          percentile (v, n, 99.9), v[n-1]);
+}
+
+static void
+print_results (uint64_t elapsed)
+{
+  static const char *names[] = {
+    [LOG_READ] = "read", [LOG_WRITE] = "write", [LOG_FLUSH] = "flush",
+    [LOG_TRIM] = "trim", [LOG_ZERO] = "zero", [LOG_EXTENTS] = "extents",
+    [LOG_CACHE] = "cache",
+  };
+  int64_t *replayed, *orig;
+  uint64_t bytes = 0, traced = calls[ncalls-1].time;
+  double secs = elapsed / 1000000.0;
+  size_t i, nr, no;
+  uint16_t type;
+
+  replayed = malloc (ncalls * sizeof *replayed);
+  orig = malloc (ncalls * sizeof *orig);
+  if (replayed == NULL || orig == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < ncalls; ++i)
+    if (calls[i].type == LOG_READ || calls[i].type == LOG_WRITE)
+      bytes += calls[i].count;
+
+  printf ("trace: %zu requests, %zu connections, %.6f s\n",
+          ncalls, nconns, traced / 1000000.0);
+  printf ("replay: %zu requests, %.6f s, %" PRIu64 " errors\n",
+          ncalls, secs, errors);
+  if (secs > 0)
+    printf ("throughput: %.1f ops/s, %.2f MiB/s\n",
+            ncalls / secs, bytes / secs / 1048576);
+
+  for (type = LOG_READ; type <= LOG_CACHE; ++type) {
+    uint64_t ops = 0, type_bytes = 0;
+
+    nr = no = 0;
+    for (i = 0; i < ncalls; ++i) {
+      if (calls[i].type != type)
+        continue;
+      ops++;
+      type_bytes += calls[i].count;
+      if (calls[i].usecs >= 0 && calls[i].err == 0)
+        replayed[nr++] = calls[i].usecs;
+      if (calls[i].orig_usecs >= 0)
+        orig[no++] = calls[i].orig_usecs;
+    }
+    if (ops == 0)
+      continue;
+    printf ("%s: %" PRIu64 " ops, %" PRIu64 " bytes\n",
+            names[type], ops, type_bytes);
+    print_latencies ("replay", replayed, nr);
+    print_latencies ("trace", orig, no);
+  }
+
+  free (replayed);
+  free (orig);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum { HELP_OPTION = CHAR_MAX + 1 };
+  static const char short_options[] = "q:s:V";
+  static const struct option long_options[] = {
+    { "help", no_argument, NULL, HELP_OPTION },
+    { "max-in-flight", required_argument, NULL, 'q' },
+    { "speed", required_argument, NULL, 's' },
+    { "version", no_argument, NULL, 'V' },
+    { NULL }
+  };
+  int c;
+  char *end;
+  uint64_t elapsed;
+
+  while ((c = getopt_long (argc, argv, short_options, long_options,
+                           NULL)) != -1) {
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout);
+      exit (EXIT_SUCCESS);
+    case 'q':
+      errno = 0;
+      max_in_flight = strtoull (optarg, &end, 10);
+      if (errno || *end || end == optarg || max_in_flight == 0) {
+        fprintf (stderr, "%s: invalid --max-in-flight: %s\n",
+                 progname, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      errno = 0;
+      speed = strtod (optarg, &end);
+      if (errno || *end || end == optarg || speed < 0) {
+        fprintf (stderr, "%s: invalid --speed: %s\n", progname, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'V':
+      printf ("%s %s\n", progname, PACKAGE_VERSION);
+      exit (EXIT_SUCCESS);
+    default:
+      usage (stderr);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage (stderr);
+    exit (EXIT_FAILURE);
+  }
+
+  load_trace (argv[optind]);
+  open_connections (argv[optind+1]);
+  replay (&elapsed);
+  close_connections ();
+  print_results (elapsed);
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
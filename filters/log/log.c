@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018-2019 Red Hat Inc.
+ * Copyright (C) 2018-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -35,11 +35,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
-#include <stdarg.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <fcntl.h>
@@ -49,18 +50,86 @@
 
 #include "cleanup.h"
 
+#include "log.h"
+
 static uint64_t connections;
 static char *logfilename;
 static FILE *logfile;
 static int append;
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool binary;
+
+/* In binary mode, each thread appends records to its own lock-free
+ * ring buffer (single producer, single consumer), and a background
+ * thread drains all of the rings to the log file.  Records from one
+ * thread stay in order, but records from different threads may be
+ * written slightly out of order.
+ */
+#define RING_SIZE (64 * 1024)
+
+/* How often the writer thread drains the rings if not woken up. */
+#define WRITER_INTERVAL_MS 100
+
+struct ring {
+  struct ring *next;            /* Protected by ring_lock. */
+  uint64_t head;                /* Written only by the producer. */
+  uint64_t tail;                /* Written only by the writer thread. */
+  bool dead;                    /* Producer thread has exited. */
+  char buf[RING_SIZE];
+};
+
+/* This lock protects the list of rings, and writes to the log file in
+ * binary mode.
+ */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;
+static pthread_key_t ring_key;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static pthread_t writer_thread;
+static bool writer_started;
+static bool writer_stop;
+static int writer_error;
+
+static void drain_rings (void);
+static void retire_ring (void *vp);
+
+static void
+log_load (void)
+{
+  if (pthread_key_create (&ring_key, retire_ring) != 0) {
+    nbdkit_error ("log: pthread_key_create failed");
+    exit (EXIT_FAILURE);
+  }
+}
 
 static void
 log_unload (void)
 {
+  struct ring *r, *next;
+
+  if (writer_started) {
+    pthread_mutex_lock (&ring_lock);
+    writer_stop = true;
+    pthread_cond_signal (&writer_cond);
+    pthread_mutex_unlock (&ring_lock);
+    pthread_join (writer_thread, NULL);
+  }
+
+  if (binary && logfile) {
+    pthread_mutex_lock (&ring_lock);
+    drain_rings ();
+    pthread_mutex_unlock (&ring_lock);
+  }
+  for (r = rings; r != NULL; r = next) {
+    next = r->next;
+    free (r);
+  }
+
   if (logfilename)
     fclose (logfile);
   free (logfilename);
+  pthread_key_delete (ring_key);
 }
 
 /* Called for each key=value passed on the command line. */
@@ -83,6 +152,17 @@ log_config (nbdkit_next_config *next, void *nxdata,
       return -1;
     return 0;
   }
+  if (strcmp (key, "logformat") == 0) {
+    if (strcmp (value, "text") == 0)
+      binary = false;
+    else if (strcmp (value, "binary") == 0)
+      binary = true;
+    else {
+      nbdkit_error ("logformat must be 'text' or 'binary'");
+      return -1;
+    }
+    return 0;
+  }
   return next (nxdata, key, value);
 }
 
@@ -116,12 +196,232 @@ log_config_complete (nbdkit_next_config_complete *next, void *nxdata)
     return -1;
   }
 
+  /* Every binary session starts with a header, even when appending.
+   * The decoder accepts a header wherever a record could start.
+   */
+  if (binary) {
+    struct log_file_header header = {
+      .magic = LOG_MAGIC,
+      .byte_order = LOG_BYTE_ORDER,
+      .version = LOG_VERSION,
+    };
+
+    if (fwrite (&header, sizeof header, 1, logfile) != 1 ||
+        fflush (logfile) == EOF) {
+      nbdkit_error ("write: %s: %m", logfilename);
+      return -1;
+    }
+  }
+
   return next (nxdata);
 }
 
 #define log_config_help \
   "logfile=<FILE>    (required) The file to place the log in.\n" \
-  "logappend=<BOOL>  True to append to the log (default false).\n"
+  "logappend=<BOOL>  True to append to the log (default false).\n" \
+  "logformat=text|binary\n" \
+  "                  Format of the log file (default text).\n"
+
+/* Write out everything in the rings.  Must be called with ring_lock
+ * held, by the writer thread or after it has stopped.
+ */
+static void
+drain_rings (void)
+{
+  struct ring **rp, *r;
+  uint64_t head, tail;
+  size_t start, n;
+  bool dead;
+
+  rp = &rings;
+  while ((r = *rp) != NULL) {
+    /* Read dead before head, so that if the producer has exited we
+     * are sure to see all of its records.
+     */
+    dead = __atomic_load_n (&r->dead, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    tail = r->tail;
+
+    while (tail < head) {
+      start = tail % RING_SIZE;
+      n = head - tail;
+      if (n > RING_SIZE - start)
+        n = RING_SIZE - start;
+      if (fwrite (&r->buf[start], n, 1, logfile) != 1 && writer_error == 0) {
+        writer_error = errno;
+        nbdkit_error ("write: %s: %m", logfilename);
+      }
+      tail += n;
+    }
+    __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+
+    if (dead) {
+      *rp = r->next;
+      free (r);
+    }
+    else
+      rp = &r->next;
+  }
+
+  fflush (logfile);
+  pthread_cond_broadcast (&space_cond);
+}
+
+static void *
+writer (void *vp)
+{
+  struct timespec deadline;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+  while (!writer_stop) {
+    drain_rings ();
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WRITER_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait (&writer_cond, &ring_lock, &deadline);
+  }
+  return NULL;
+}
+
+/* The writer thread is started on the first connection rather than
+ * in .config_complete because nbdkit may fork into the background
+ * after that, and threads do not survive the fork.
+ */
+static void
+start_writer (void)
+{
+  int err;
+
+  err = pthread_create (&writer_thread, NULL, writer, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("log: cannot create writer thread: %m");
+    return;
+  }
+  writer_started = true;
+}
+
+/* Called when each thread exits.  The writer thread frees the ring
+ * once it has been drained.
+ */
+static void
+retire_ring (void *vp)
+{
+  struct ring *r = vp;
+
+  __atomic_store_n (&r->dead, true, __ATOMIC_RELEASE);
+}
+
+static struct ring *
+get_ring (void)
+{
+  struct ring *r;
+
+  r = pthread_getspecific (ring_key);
+  if (r)
+    return r;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+  r->next = rings;
+  rings = r;
+  pthread_setspecific (ring_key, r);
+  return r;
+}
+
+/* Write a record to the log file, bypassing the rings. */
+static void
+write_direct (const struct log_record *rec)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+  fwrite (rec, rec->size, 1, logfile);
+  fflush (logfile);
+}
+
+/* Wait until the writer has drained r to within size bytes of free
+ * space.
+ */
+static uint64_t
+wait_for_space (struct ring *r, uint64_t size)
+{
+  uint64_t tail;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+  for (;;) {
+    tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+    if (RING_SIZE - (r->head - tail) >= size)
+      return tail;
+    pthread_cond_signal (&writer_cond);
+    pthread_cond_wait (&space_cond, &ring_lock);
+  }
+}
+
+static void
+push_record (const struct log_record *rec)
+{
+  struct ring *r = get_ring ();
+  uint64_t head, tail;
+  size_t start, n;
+
+  if (r == NULL) {
+    write_direct (rec);
+    return;
+  }
+
+  /* Records too large for the ring (huge extents lists) are written
+   * directly once the ring is empty, to preserve ordering.
+   */
+  if (rec->size > RING_SIZE) {
+    wait_for_space (r, RING_SIZE);
+    write_direct (rec);
+    return;
+  }
+
+  head = r->head;
+  tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+  if (RING_SIZE - (head - tail) < rec->size)
+    tail = wait_for_space (r, rec->size);
+
+  start = head % RING_SIZE;
+  n = rec->size;
+  if (n > RING_SIZE - start)
+    n = RING_SIZE - start;
+  memcpy (&r->buf[start], rec, n);
+  memcpy (r->buf, (const char *) rec + n, rec->size - n);
+  head += rec->size;
+  __atomic_store_n (&r->head, head, __ATOMIC_RELEASE);
+
+  /* Kick the writer early if the ring is getting full. */
+  if (head - tail > RING_SIZE / 2)
+    pthread_cond_signal (&writer_cond);
+}
+
+/* Output a record, either formatted as text or in binary. */
+static void
+output (struct log_record *rec)
+{
+  struct timeval tv;
+
+  /* Logging is best effort, so ignore failure to get timestamp */
+  if (!gettimeofday (&tv, NULL))
+    rec->time = tv.tv_sec * UINT64_C(1000000) + tv.tv_usec;
+
+  if (binary)
+    push_record (rec);
+  else {
+    flockfile (logfile);
+    log_format_record (logfile, rec);
+    fflush (logfile);
+    funlockfile (logfile);
+  }
+}
 
 struct handle {
   uint64_t connection;
@@ -132,90 +432,41 @@ struct handle {
 static uint64_t
 get_id (struct handle *h)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE(&lock);
-  return ++h->id;
+  return __atomic_add_fetch (&h->id, 1, __ATOMIC_RELAXED);
 }
 
-/* Output a timestamp and the log message. */
-static void __attribute__ ((format (printf, 4, 5)))
-output (struct handle *h, const char *act, uint64_t id, const char *fmt, ...)
+/* Log the start of a command. */
+static void
+output_call (struct handle *h, uint16_t type, uint64_t id,
+             uint64_t offs, uint32_t count, uint32_t flags)
 {
-  va_list args;
-  struct timeval tv;
-  struct tm tm;
-  char timestamp[27] = "Time unknown";
-
-  /* Logging is best effort, so ignore failure to get timestamp */
-  if (!gettimeofday (&tv, NULL))
-    {
-      size_t s;
-
-      gmtime_r (&tv.tv_sec, &tm);
-      s = strftime (timestamp, sizeof timestamp - sizeof ".000000" + 1,
-                    "%F %T", &tm);
-      assert (s);
-      snprintf (timestamp + s, sizeof timestamp - s, ".%06ld",
-                0L + tv.tv_usec);
-    }
-  flockfile (logfile);
-  fprintf (logfile, "%s connection=%" PRIu64 " %s ", timestamp, h->connection,
-           act);
-  if (id)
-    fprintf (logfile, "id=%" PRIu64 " ", id);
-  va_start (args, fmt);
-  vfprintf (logfile, fmt, args);
-  va_end (args);
-  fputc ('\n', logfile);
-  fflush (logfile);
-  funlockfile (logfile);
+  struct log_record rec = {
+    .size = sizeof rec,
+    .type = type,
+    .flags = flags,
+    .connection = h->connection,
+    .id = id,
+    .offset = offs,
+    .count = count,
+  };
+
+  output (&rec);
 }
 
-/* Shared code for a nicer log of return value */
+/* Log the return value of a command. */
 static void
-output_return (struct handle *h, const char *act, uint64_t id, int r, int *err)
+output_return (struct handle *h, uint16_t type, uint64_t id, int r, int *err)
 {
-  const char *s = "Other=>EINVAL";
-
-  /* Only decode what connections.c:nbd_errno() recognizes */
-  if (r == -1) {
-    switch (*err) {
-    case EROFS:
-      s = "EROFS=>EPERM";
-      break;
-    case EPERM:
-      s = "EPERM";
-      break;
-    case EIO:
-      s = "EIO";
-      break;
-    case ENOMEM:
-      s = "ENOMEM";
-      break;
-#ifdef EDQUOT
-    case EDQUOT:
-      s = "EDQUOT=>ENOSPC";
-      break;
-#endif
-    case EFBIG:
-      s = "EFBIG=>ENOSPC";
-      break;
-    case ENOSPC:
-      s = "ENOSPC";
-      break;
-#ifdef ESHUTDOWN
-    case ESHUTDOWN:
-      s = "ESHUTDOWN";
-      break;
-#endif
-    case EINVAL:
-      s = "EINVAL";
-      break;
-    }
-  }
-  else {
-    s = "Success";
-  }
-  output (h, act, id, "return=%d (%s)", r, s);
+  struct log_record rec = {
+    .size = sizeof rec,
+    .type = type | LOG_REPLY,
+    .connection = h->connection,
+    .id = id,
+    .r = r,
+    .err = r == -1 ? *err : 0,
+  };
+
+  output (&rec);
 }
 
 /* Open a connection. */
@@ -224,6 +475,12 @@ log_open (nbdkit_next_open *next, void *nxdata, int readonly)
 {
   struct handle *h;
 
+  if (binary) {
+    pthread_once (&writer_once, start_writer);
+    if (!writer_started)
+      return NULL;
+  }
+
   if (next (nxdata, readonly) == -1)
     return NULL;
 
@@ -233,8 +490,7 @@ log_open (nbdkit_next_open *next, void *nxdata, int readonly)
     return NULL;
   }
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  h->connection = ++connections;
+  h->connection = __atomic_add_fetch (&connections, 1, __ATOMIC_RELAXED);
   h->id = 0;
   return h;
 }
@@ -262,14 +518,31 @@ log_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
   int e = next_ops->can_extents (nxdata);
   int c = next_ops->can_cache (nxdata);
   int Z = next_ops->can_fast_zero (nxdata);
+  struct {
+    struct log_record rec;
+    int32_t caps[LOG_NR_CAPS];
+  } connect;
 
   if (size < 0 || w < 0 || f < 0 || r < 0 || t < 0 || z < 0 || F < 0 ||
       e < 0 || c < 0 || Z < 0)
     return -1;
 
-  output (h, "Connect", 0, "size=0x%" PRIx64 " write=%d flush=%d "
-          "rotational=%d trim=%d zero=%d fua=%d extents=%d cache=%d "
-          "fast_zero=%d", size, w, f, r, t, z, F, e, c, Z);
+  memset (&connect, 0, sizeof connect);
+  connect.rec.size = sizeof connect;
+  connect.rec.type = LOG_CONNECT;
+  connect.rec.connection = h->connection;
+  connect.rec.offset = size;
+  connect.caps[0] = w;
+  connect.caps[1] = f;
+  connect.caps[2] = r;
+  connect.caps[3] = t;
+  connect.caps[4] = z;
+  connect.caps[5] = F;
+  connect.caps[6] = e;
+  connect.caps[7] = c;
+  connect.caps[8] = Z;
+  connect.caps[9] = 0;          /* reserved */
+  output (&connect.rec);
   return 0;
 }
 
@@ -277,8 +550,14 @@ static int
 log_finalize (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
 {
   struct handle *h = handle;
-
-  output (h, "Disconnect", 0, "transactions=%" PRId64, h->id);
+  struct log_record rec = {
+    .size = sizeof rec,
+    .type = LOG_DISCONNECT,
+    .connection = h->connection,
+    .id = __atomic_load_n (&h->id, __ATOMIC_RELAXED),
+  };
+
+  output (&rec);
   return 0;
 }
 
@@ -293,10 +572,9 @@ log_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!flags);
-  output (h, "Read", id, "offset=0x%" PRIx64 " count=0x%x ...",
-          offs, count);
+  output_call (h, LOG_READ, id, offs, count, flags);
   r = next_ops->pread (nxdata, buf, count, offs, flags, err);
-  output_return (h, "...Read", id, r, err);
+  output_return (h, LOG_READ, id, r, err);
   return r;
 }
 
@@ -311,10 +589,9 @@ log_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
-  output (h, "Write", id, "offset=0x%" PRIx64 " count=0x%x fua=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  output_call (h, LOG_WRITE, id, offs, count, flags);
   r = next_ops->pwrite (nxdata, buf, count, offs, flags, err);
-  output_return (h, "...Write", id, r, err);
+  output_return (h, LOG_WRITE, id, r, err);
   return r;
 }
 
@@ -328,9 +605,9 @@ log_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
   int r;
 
   assert (!flags);
-  output (h, "Flush", id, "...");
+  output_call (h, LOG_FLUSH, id, 0, 0, flags);
   r = next_ops->flush (nxdata, flags, err);
-  output_return (h, "...Flush", id, r, err);
+  output_return (h, LOG_FLUSH, id, r, err);
   return r;
 }
 
@@ -345,10 +622,9 @@ log_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
-  output (h, "Trim", id, "offset=0x%" PRIx64 " count=0x%x fua=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  output_call (h, LOG_TRIM, id, offs, count, flags);
   r = next_ops->trim (nxdata, count, offs, flags, err);
-  output_return (h, "...Trim", id, r, err);
+  output_return (h, LOG_TRIM, id, r, err);
   return r;
 }
 
@@ -364,13 +640,9 @@ log_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                       NBDKIT_FLAG_FAST_ZERO)));
-  output (h, "Zero", id,
-          "offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d fast=%d...",
-          offs, count, !!(flags & NBDKIT_FLAG_MAY_TRIM),
-          !!(flags & NBDKIT_FLAG_FUA),
-          !!(flags & NBDKIT_FLAG_FAST_ZERO));
+  output_call (h, LOG_ZERO, id, offs, count, flags);
   r = next_ops->zero (nxdata, count, offs, flags, err);
-  output_return (h, "...Zero", id, r, err);
+  output_return (h, LOG_ZERO, id, r, err);
   return r;
 }
 
@@ -385,36 +657,37 @@ log_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~(NBDKIT_FLAG_REQ_ONE)));
-  output (h, "Extents", id,
-          "offset=0x%" PRIx64 " count=0x%x req_one=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_REQ_ONE));
+  output_call (h, LOG_EXTENTS, id, offs, count, flags);
   r = next_ops->extents (nxdata, count, offs, flags, extents, err);
   if (r == -1)
-    output_return (h, "...Extents", id, r, err);
+    output_return (h, LOG_EXTENTS, id, r, err);
   else {
-    FILE *fp;
-    CLEANUP_FREE char *extents_str = NULL;
-    size_t i, n, len = 0;
-
-    fp = open_memstream (&extents_str, &len);
-    if (fp != NULL) {
-      n = nbdkit_extents_count (extents);
-      for (i = 0; i < n; ++i) {
-        struct nbdkit_extent e = nbdkit_get_extent (extents, i);
-        if (i > 0)
-          fprintf (fp, ", ");
-        fprintf (fp, "{ offset=0x%" PRIx64 ", length=0x%" PRIx64 ", "
-                 "hole=%d, zero=%d }",
-                 e.offset, e.length,
-                 !!(e.type & NBDKIT_EXTENT_HOLE),
-                 !!(e.type & NBDKIT_EXTENT_ZERO));
-      }
-
-      fclose (fp);
+    CLEANUP_FREE struct log_record *rec = NULL;
+    struct log_extent *e;
+    size_t i, n;
+
+    n = nbdkit_extents_count (extents);
+    rec = calloc (1, sizeof *rec + n * sizeof *e);
+    if (rec == NULL) {
+      /* Logging is best effort, so log the return without extents. */
+      n = 0;
+      rec = calloc (1, sizeof *rec);
+      if (rec == NULL)
+        return r;
     }
-
-    output (h, "...Extents", id, "extents=[%s] return=0",
-            extents_str ? extents_str : "(null)");
+    rec->size = sizeof *rec + n * sizeof *e;
+    rec->type = LOG_EXTENTS | LOG_REPLY;
+    rec->connection = h->connection;
+    rec->id = id;
+    e = (struct log_extent *) (rec + 1);
+    for (i = 0; i < n; ++i) {
+      struct nbdkit_extent ex = nbdkit_get_extent (extents, i);
+
+      e[i].offset = ex.offset;
+      e[i].length = ex.length;
+      e[i].type = ex.type;
+    }
+    output (rec);
   }
   return r;
 }
@@ -430,16 +703,16 @@ log_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!flags);
-  output (h, "Cache", id, "offset=0x%" PRIx64 " count=0x%x ...",
-          offs, count);
+  output_call (h, LOG_CACHE, id, offs, count, flags);
   r = next_ops->cache (nxdata, count, offs, flags, err);
-  output_return (h, "...Cache", id, r, err);
+  output_return (h, LOG_CACHE, id, r, err);
   return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "log",
   .longname          = "nbdkit log filter",
+  .load              = log_load,
   .config            = log_config,
   .config_complete   = log_config_complete,
   .config_help       = log_config_help,
@@ -0,0 +1,116 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_LOG_H
+#define NBDKIT_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Binary log format, written by logformat=binary and read back by
+ * nbdkit-log-decode.
+ *
+ * The file starts with a struct log_file_header, followed by a
+ * stream of records.  Each record is a struct log_record, followed
+ * by (size - sizeof (struct log_record)) bytes of payload which
+ * depend on the type.  All fields are in host byte order; the
+ * header records which order that was.
+ */
+#define LOG_MAGIC "NBDKLOG"
+#define LOG_VERSION 1
+#define LOG_BYTE_ORDER 0x01020304
+
+struct log_file_header {
+  char magic[8];                /* LOG_MAGIC, NUL-padded */
+  uint32_t byte_order;          /* LOG_BYTE_ORDER */
+  uint32_t version;             /* LOG_VERSION */
+};
+
+enum log_type {
+  LOG_CONNECT = 1,    /* offset = size, payload = int32_t caps[LOG_NR_CAPS] */
+  LOG_DISCONNECT,     /* id = number of transactions */
+  LOG_READ,
+  LOG_WRITE,
+  LOG_FLUSH,
+  LOG_TRIM,
+  LOG_ZERO,
+  LOG_EXTENTS,
+  LOG_CACHE,
+};
+
+/* Set in type for the record logged when a command returns.  For a
+ * successful extents call, the payload is an array of struct
+ * log_extent.
+ */
+#define LOG_REPLY 0x8000
+
+/* The Connect payload holds the results of can_write, can_flush,
+ * is_rotational, can_trim, can_zero, can_fua, can_extents, can_cache
+ * and can_fast_zero in that order, plus one reserved slot.
+ */
+#define LOG_NR_CAPS 10
+
+struct log_record {
+  uint32_t size;                /* Total size including payload. */
+  uint16_t type;                /* enum log_type, maybe | LOG_REPLY */
+  uint16_t flags;               /* NBDKIT_FLAG_* */
+  uint64_t time;                /* Microseconds since the Epoch. */
+  uint64_t connection;
+  uint64_t id;
+  uint64_t offset;
+  uint32_t count;
+  int32_t r;                    /* Return value of LOG_REPLY records. */
+  int32_t err;                  /* errno if r == -1. */
+  uint32_t reserved;
+};
+
+struct log_extent {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t type;
+  uint32_t reserved;
+};
+
+/* Write a record in the text format as a single line. */
+extern void log_format_record (FILE *fp, const struct log_record *rec);
+
+/* Read a binary log, calling fn for each record in turn.  The
+ * record is only valid during the call.  Errors are printed on
+ * stderr prefixed by name.  Returns 0 on success, or -1 on error or
+ * if fn returns -1.
+ */
+extern int log_read_file (FILE *fp, const char *name,
+                          int (*fn) (const struct log_record *rec,
+                                     void *opaque),
+                          void *opaque);
+
+#endif /* NBDKIT_LOG_H */
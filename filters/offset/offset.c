@@ -138,9 +138,7 @@ offset_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                 void *handle, uint32_t count, uint64_t offs, uint32_t flags,
                 struct nbdkit_extents *extents, int *err)
 {
-  size_t i;
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 = NULL;
-  struct nbdkit_extent e;
   int64_t end = range >= 0 ? offset + range : next_ops->get_size (nxdata);
 
   extents2 = nbdkit_extents_new (offs + offset, end);
@@ -152,13 +150,9 @@ offset_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                          flags, extents2, err) == -1)
     return -1;
 
-  for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
-    e = nbdkit_get_extent (extents2, i);
-    e.offset -= offset;
-    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
-      *err = errno;
-      return -1;
-    }
+  if (nbdkit_extents_copy (extents, extents2, -(int64_t) offset) == -1) {
+    *err = errno;
+    return -1;
   }
   return 0;
 }
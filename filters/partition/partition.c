@@ -229,9 +229,7 @@ partition_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                    struct nbdkit_extents *extents, int *err)
 {
   struct handle *h = handle;
-  size_t i;
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 = NULL;
-  struct nbdkit_extent e;
 
   extents2 = nbdkit_extents_new (offs + h->offset, h->offset + h->range);
   if (extents2 == NULL) {
@@ -242,13 +240,9 @@ partition_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                          flags, extents2, err) == -1)
     return -1;
 
-  for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
-    e = nbdkit_get_extent (extents2, i);
-    e.offset -= h->offset;
-    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
-      *err = errno;
-      return -1;
-    }
+  if (nbdkit_extents_copy (extents, extents2, -(int64_t) h->offset) == -1) {
+    *err = errno;
+    return -1;
   }
   return 0;
 }
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018-2019 Red Hat Inc.
+ * Copyright (C) 2018-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -38,10 +38,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
 #include <pthread.h>
@@ -49,21 +54,44 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
 
 #include "bucket.h"
 
-/* Per-connection and global limit, both in bits per second, with zero
- * meaning not set / not enforced.  These are only used when reading
- * the command line and initializing the buckets for the first time.
- * They are not involved in dynamic rate adjustment.
+/* Per-connection, per-client and global limit, all in bits per
+ * second, with zero meaning not set / not enforced.  These are only
+ * used when reading the command line.  The rates currently in force
+ * are in the *_target variables below.
  */
 static uint64_t connection_rate = 0;
+static uint64_t client_rate = 0;
 static uint64_t rate = 0;
 
+/* Divide the global rate equally between connected clients. */
+static bool fair_share = false;
+
 /* Files for dynamic rate adjustment. */
 static char *connection_rate_file = NULL;
+static char *client_rate_file = NULL;
 static char *rate_file = NULL;
 
+/* Rates currently in force.  These are initialized from the command
+ * line and updated by the rate file thread (or for client buckets,
+ * when clients connect and disconnect if fair_share is set).  Buckets
+ * are adjusted to the new rate the next time they are used, so the
+ * only cost on the data path is an atomic load.
+ *
+ * client_rate_base is the per-client rate before fair sharing.
+ */
+static uint64_t connection_rate_target;
+static uint64_t client_rate_base;
+static uint64_t client_rate_target;
+static uint64_t rate_target;
+
+/* How often the rate files are checked (in seconds). */
+#define RATE_FILE_INTERVAL 1
+
 /* Bucket capacity controls the burst rate.  It is expressed as the
  * length of time in "rate-equivalent seconds" that the client can
  * burst for after a period of inactivity.  This could be adjustable
@@ -71,14 +99,43 @@ static char *rate_file = NULL;
  */
 #define BUCKET_CAPACITY 2.0
 
+/* Requests larger than a slice are split up, so that we sleep often
+ * for a short time instead of rarely for a long time.  A slice is
+ * worth SLICE_SECS seconds at the lowest rate which applies to the
+ * request, rounded down to a multiple of MIN_SLICE bytes.
+ */
+#define SLICE_SECS 0.1
+#define MIN_SLICE 4096
+
 /* Global read and write buckets. */
 static struct bucket read_bucket;
 static pthread_mutex_t read_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct bucket write_bucket;
 static pthread_mutex_t write_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Per-client read and write buckets, shared by all connections from
+ * the same IP address.  Only used if client-rate, client-rate-file or
+ * fair-share were given.
+ */
+struct client {
+  struct client *next;
+  char *name;                   /* Address of the client. */
+  unsigned refs;                /* Number of connections. */
+  struct bucket read_bucket;
+  pthread_mutex_t read_bucket_lock;
+  struct bucket write_bucket;
+  pthread_mutex_t write_bucket_lock;
+};
+
+static struct client *clients = NULL;
+static size_t nr_clients = 0;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Per-connection handle. */
 struct rate_handle {
+  /* Per-client buckets, or NULL if not used. */
+  struct client *client;
+
   /* Per-connection read and write buckets. */
   struct bucket read_bucket;
   pthread_mutex_t read_bucket_lock;
@@ -86,70 +143,217 @@ struct rate_handle {
   pthread_mutex_t write_bucket_lock;
 };
 
+/* Background thread which checks the rate files. */
+static pthread_t file_thread;
+static bool file_thread_running = false;
+static bool file_thread_stop = false;
+static pthread_mutex_t file_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t file_thread_cond = PTHREAD_COND_INITIALIZER;
+
+static bool
+use_clients (void)
+{
+  return client_rate > 0 || client_rate_file != NULL || fair_share;
+}
+
 static void
 rate_unload (void)
 {
+  pthread_mutex_lock (&file_thread_lock);
+  if (file_thread_running) {
+    file_thread_stop = true;
+    pthread_cond_signal (&file_thread_cond);
+    pthread_mutex_unlock (&file_thread_lock);
+    pthread_join (file_thread, NULL);
+  }
+  else
+    pthread_mutex_unlock (&file_thread_lock);
+
   free (connection_rate_file);
+  free (client_rate_file);
   free (rate_file);
 }
 
+static int
+parse_rate (const char *key, const char *value, uint64_t *r)
+{
+  int64_t v;
+
+  if (*r > 0) {
+    nbdkit_error ("%s set twice on the command line", key);
+    return -1;
+  }
+  v = nbdkit_parse_size (value);
+  if (v == -1)
+    return -1;
+  if (v == 0) {
+    nbdkit_error ("%s cannot be set to 0", key);
+    return -1;
+  }
+  *r = v;
+  return 0;
+}
+
+static int
+parse_rate_file (const char *value, char **file)
+{
+  free (*file);
+  *file = nbdkit_absolute_path (value);
+  if (*file == NULL)
+    return -1;
+  return 0;
+}
+
 /* Called for each key=value passed on the command line. */
 static int
 rate_config (nbdkit_next_config *next, void *nxdata,
              const char *key, const char *value)
 {
-  if (strcmp (key, "rate") == 0) {
-    if (rate > 0) {
-      nbdkit_error ("rate set twice on the command line");
-      return -1;
-    }
-    rate = nbdkit_parse_size (value);
-    if (rate == -1)
+  int r;
+
+  if (strcmp (key, "rate") == 0)
+    return parse_rate (key, value, &rate);
+  else if (strcmp (key, "connection-rate") == 0)
+    return parse_rate (key, value, &connection_rate);
+  else if (strcmp (key, "client-rate") == 0)
+    return parse_rate (key, value, &client_rate);
+  else if (strcmp (key, "rate-file") == 0)
+    return parse_rate_file (value, &rate_file);
+  else if (strcmp (key, "connection-rate-file") == 0)
+    return parse_rate_file (value, &connection_rate_file);
+  else if (strcmp (key, "client-rate-file") == 0)
+    return parse_rate_file (value, &client_rate_file);
+  else if (strcmp (key, "fair-share") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
       return -1;
-    if (rate == 0) {
-      nbdkit_error ("rate cannot be set to 0");
-      return -1;
-    }
+    fair_share = r;
     return 0;
   }
-  else if (strcmp (key, "connection-rate") == 0) {
-    if (connection_rate > 0) {
-      nbdkit_error ("connection-rate set twice on the command line");
-      return -1;
-    }
-    connection_rate = nbdkit_parse_size (value);
-    if (connection_rate == -1)
-      return -1;
-    if (connection_rate == 0) {
-      nbdkit_error ("connection-rate cannot be set to 0");
-      return -1;
-    }
-    return 0;
+  else
+    return next (nxdata, key, value);
+}
+
+/* Recalculate client_rate_target.  Call with clients_lock held. */
+static void
+update_client_rate (void)
+{
+  uint64_t r = __atomic_load_n (&client_rate_base, __ATOMIC_RELAXED);
+  uint64_t total = __atomic_load_n (&rate_target, __ATOMIC_RELAXED);
+
+  if (fair_share && total > 0 && nr_clients > 0) {
+    uint64_t share = total / nr_clients;
+
+    if (r == 0 || share < r)
+      r = share;
   }
-  else if (strcmp (key, "rate-file") == 0) {
-    free (rate_file);
-    rate_file = nbdkit_absolute_path (value);
-    if (rate_file == NULL)
-      return -1;
-    return 0;
+  __atomic_store_n (&client_rate_target, r, __ATOMIC_RELAXED);
+}
+
+/* Read a rate from the first line of file.  Returns -1 if the file
+ * could not be read, which is not an error.
+ */
+static int
+read_rate_file (const char *file, uint64_t *r)
+{
+  int fd;
+  FILE *fp;
+  ssize_t len;
+  size_t n = 0;
+  CLEANUP_FREE char *line = NULL;
+  int64_t new_rate;
+
+  /* Alas, Haiku lacks fopen("re"), so we have to spell this out the
+   * long way. We require atomic CLOEXEC, in case the plugin is using
+   * fork() in a parallel thread model.
+   */
+  fd = open (file, O_CLOEXEC | O_RDONLY);
+  if (fd == -1)
+    return -1; /* this is not an error */
+  fp = fdopen (fd, "r");
+  if (fp == NULL) {
+    nbdkit_debug ("fdopen: %s: %m", file);
+    close (fd);
+    return -1; /* unexpected, but treat it as a non-error */
   }
-  else if (strcmp (key, "connection-rate-file") == 0) {
-    free (connection_rate_file);
-    connection_rate_file = nbdkit_absolute_path (value);
-    if (connection_rate_file == NULL)
-      return -1;
-    return 0;
+
+  len = getline (&line, &n, fp);
+  if (len == -1) {
+    nbdkit_debug ("could not read rate file: %s: %m", file);
+    fclose (fp);
+    return -1;
   }
-  else
-    return next (nxdata, key, value);
+  fclose (fp);
+
+  if (len > 0 && line[len-1] == '\n') line[len-1] = '\0';
+  new_rate = nbdkit_parse_size (line);
+  if (new_rate == -1)
+    return -1;
+  *r = new_rate;
+  return 0;
+}
+
+static void
+check_rate_file (const char *file, uint64_t *target)
+{
+  uint64_t old_rate, new_rate;
+
+  if (file == NULL || read_rate_file (file, &new_rate) == -1)
+    return;
+
+  old_rate = __atomic_exchange_n (target, new_rate, __ATOMIC_RELAXED);
+  if (old_rate != new_rate)
+    nbdkit_debug ("%s: rate adjusted from %" PRIu64 " to %" PRIu64,
+                  file, old_rate, new_rate);
+}
+
+static void
+check_rate_files (void)
+{
+  check_rate_file (rate_file, &rate_target);
+  check_rate_file (connection_rate_file, &connection_rate_target);
+  check_rate_file (client_rate_file, &client_rate_base);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&clients_lock);
+  update_client_rate ();
+}
+
+/* Check the rate files every RATE_FILE_INTERVAL seconds until
+ * rate_unload tells us to stop.
+ */
+static void *
+rate_file_thread (void *arg)
+{
+  struct timespec ts;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&file_thread_lock);
+  while (!file_thread_stop) {
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += RATE_FILE_INTERVAL;
+    pthread_cond_timedwait (&file_thread_cond, &file_thread_lock, &ts);
+    if (file_thread_stop)
+      break;
+
+    pthread_mutex_unlock (&file_thread_lock);
+    check_rate_files ();
+    pthread_mutex_lock (&file_thread_lock);
+  }
+  return NULL;
 }
 
 static int
 rate_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 {
+  rate_target = rate;
+  connection_rate_target = connection_rate;
+  client_rate_base = client_rate;
+
+  /* Pick up the initial contents of the rate files, if any. */
+  check_rate_files ();
+
   /* Initialize the global buckets. */
-  bucket_init (&read_bucket, rate, BUCKET_CAPACITY);
-  bucket_init (&write_bucket, rate, BUCKET_CAPACITY);
+  bucket_init (&read_bucket, rate_target, BUCKET_CAPACITY);
+  bucket_init (&write_bucket, rate_target, BUCKET_CAPACITY);
 
   return next (nxdata);
 }
@@ -157,8 +361,127 @@ rate_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 #define rate_config_help \
   "rate=BITSPERSEC                Limit total bandwidth.\n" \
   "connection-rate=BITSPERSEC     Limit per-connection bandwidth.\n" \
+  "client-rate=BITSPERSEC         Limit per-client bandwidth.\n" \
   "rate-file=FILENAME             Dynamically adjust total bandwidth.\n" \
-  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth."
+  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth.\n" \
+  "client-rate-file=FILENAME      Dynamically adjust per-client bandwidth.\n" \
+  "fair-share=true                Share total bandwidth equally between clients."
+
+/* The background thread is started when the first client connects
+ * rather than in config_complete, because nbdkit may fork after
+ * that.
+ */
+static int
+start_file_thread (void)
+{
+  int err;
+
+  if (!rate_file && !connection_rate_file && !client_rate_file)
+    return 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&file_thread_lock);
+  if (file_thread_running)
+    return 0;
+  err = pthread_create (&file_thread, NULL, rate_file_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  file_thread_running = true;
+  return 0;
+}
+
+/* Return a name for the client's address.  All connections with the
+ * same name share the client buckets.
+ */
+static char *
+get_client_name (void)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+  char buf[INET6_ADDRSTRLEN];
+  const char *name;
+
+  if (nbdkit_peer_name ((struct sockaddr *) &addr, &addrlen) == -1)
+    name = "unknown";
+  else if (addr.ss_family == AF_INET)
+    name = inet_ntop (AF_INET, &((struct sockaddr_in *) &addr)->sin_addr,
+                      buf, sizeof buf);
+  else if (addr.ss_family == AF_INET6)
+    name = inet_ntop (AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr,
+                      buf, sizeof buf);
+  else if (addr.ss_family == AF_UNIX)
+    name = "unix";
+  else
+    name = "other";
+
+  return strdup (name ? name : "unknown");
+}
+
+/* Find or create the client structure for this connection. */
+static struct client *
+get_client (void)
+{
+  CLEANUP_FREE char *name = get_client_name ();
+  struct client *client;
+
+  if (name == NULL) {
+    nbdkit_error ("strdup: %m");
+    return NULL;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&clients_lock);
+  for (client = clients; client != NULL; client = client->next) {
+    if (strcmp (client->name, name) == 0) {
+      client->refs++;
+      return client;
+    }
+  }
+
+  client = malloc (sizeof *client);
+  if (client == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  client->name = name;
+  name = NULL;
+  client->refs = 1;
+  client->next = clients;
+  clients = client;
+  nr_clients++;
+  update_client_rate ();
+
+  bucket_init (&client->read_bucket, client_rate_target, BUCKET_CAPACITY);
+  bucket_init (&client->write_bucket, client_rate_target, BUCKET_CAPACITY);
+  pthread_mutex_init (&client->read_bucket_lock, NULL);
+  pthread_mutex_init (&client->write_bucket_lock, NULL);
+
+  nbdkit_debug ("new client %s, %zu clients connected",
+                client->name, nr_clients);
+  return client;
+}
+
+static void
+put_client (struct client *client)
+{
+  struct client **p;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&clients_lock);
+  if (--client->refs > 0)
+    return;
+
+  for (p = &clients; *p != client; p = &(*p)->next)
+    ;
+  *p = client->next;
+  nr_clients--;
+  update_client_rate ();
+
+  pthread_mutex_destroy (&client->read_bucket_lock);
+  pthread_mutex_destroy (&client->write_bucket_lock);
+  free (client->name);
+  free (client);
+}
 
 /* Create the per-connection handle. */
 static void *
@@ -169,14 +492,26 @@ rate_open (nbdkit_next_open *next, void *nxdata, int readonly)
   if (next (nxdata, readonly) == -1)
     return NULL;
 
+  if (start_file_thread () == -1)
+    return NULL;
+
   h = malloc (sizeof *h);
   if (h == NULL) {
     nbdkit_error ("malloc: %m");
     return NULL;
   }
 
-  bucket_init (&h->read_bucket, connection_rate, BUCKET_CAPACITY);
-  bucket_init (&h->write_bucket, connection_rate, BUCKET_CAPACITY);
+  h->client = NULL;
+  if (use_clients ()) {
+    h->client = get_client ();
+    if (h->client == NULL) {
+      free (h);
+      return NULL;
+    }
+  }
+
+  bucket_init (&h->read_bucket, connection_rate_target, BUCKET_CAPACITY);
+  bucket_init (&h->write_bucket, connection_rate_target, BUCKET_CAPACITY);
   pthread_mutex_init (&h->read_bucket_lock, NULL);
   pthread_mutex_init (&h->write_bucket_lock, NULL);
 
@@ -189,65 +524,19 @@ rate_close (void *handle)
 {
   struct rate_handle *h = handle;
 
+  if (h->client)
+    put_client (h->client);
   pthread_mutex_destroy (&h->read_bucket_lock);
   pthread_mutex_destroy (&h->write_bucket_lock);
   free (h);
 }
 
-static void
-maybe_adjust (const char *file, struct bucket *bucket, pthread_mutex_t *lock)
-{
-  int fd;
-  FILE *fp;
-  ssize_t r;
-  size_t len = 0;
-  CLEANUP_FREE char *line = NULL;
-  int64_t new_rate;
-  uint64_t old_rate;
-
-  if (!file) return;
-
-  /* Alas, Haiku lacks fopen("re"), so we have to spell this out the
-   * long way. We require atomic CLOEXEC, in case the plugin is using
-   * fork() in a parallel thread model.
-   */
-  fd = open (file, O_CLOEXEC | O_RDONLY);
-  if (fd == -1)
-    return; /* this is not an error */
-  fp = fdopen (fd, "r");
-  if (fp == NULL) {
-    nbdkit_debug ("fdopen: %s: %m", file);
-    close (fd);
-    return; /* unexpected, but treat it as a non-error */
-  }
-
-  r = getline (&line, &len, fp);
-  if (r == -1) {
-    nbdkit_debug ("could not read rate file: %s: %m", file);
-    fclose (fp);
-    return;
-  }
-  fclose (fp);
-
-  if (r > 0 && line[r-1] == '\n') line[r-1] = '\0';
-  new_rate = nbdkit_parse_size (line);
-  if (new_rate == -1)
-    return;
-
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
-  old_rate = bucket_adjust_rate (bucket, new_rate);
-
-  if (old_rate != new_rate)
-    nbdkit_debug ("rate adjusted from %" PRIu64 " to %" PRIi64,
-                  old_rate, new_rate);
-}
-
 static inline int
-maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
-             int *err)
+maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock,
+             const uint64_t *target, uint32_t count, int *err)
 {
   struct timespec ts;
-  uint64_t bits;
+  uint64_t bits, new_rate;
 
   /* Count is in bytes, but we rate limit using bits.  We could
    * multiply this by 10 to include start/stop but let's not
@@ -259,6 +548,9 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
     /* Run the token bucket algorithm. */
     {
       ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
+      new_rate = __atomic_load_n (target, __ATOMIC_RELAXED);
+      if (bucket->rate != new_rate)
+        bucket_adjust_rate (bucket, new_rate);
       bits = bucket_run (bucket, bits, &ts);
     }
 
@@ -270,6 +562,62 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
   return 0;
 }
 
+/* Wait for enough tokens in the global, per-client and
+ * per-connection buckets to read or write count bytes.
+ */
+static int
+wait_for_tokens (struct rate_handle *h, bool write, uint32_t count, int *err)
+{
+  struct client *client = h->client;
+
+  if (!write) {
+    if (maybe_sleep (&read_bucket, &read_bucket_lock, &rate_target,
+                     count, err) == -1)
+      return -1;
+    if (client &&
+        maybe_sleep (&client->read_bucket, &client->read_bucket_lock,
+                     &client_rate_target, count, err) == -1)
+      return -1;
+    return maybe_sleep (&h->read_bucket, &h->read_bucket_lock,
+                        &connection_rate_target, count, err);
+  }
+  else {
+    if (maybe_sleep (&write_bucket, &write_bucket_lock, &rate_target,
+                     count, err) == -1)
+      return -1;
+    if (client &&
+        maybe_sleep (&client->write_bucket, &client->write_bucket_lock,
+                     &client_rate_target, count, err) == -1)
+      return -1;
+    return maybe_sleep (&h->write_bucket, &h->write_bucket_lock,
+                        &connection_rate_target, count, err);
+  }
+}
+
+/* Return the largest number of bytes to read or write at once. */
+static uint32_t
+slice_size (struct rate_handle *h)
+{
+  uint64_t rates[3], lowest = 0, slice;
+  size_t i;
+
+  rates[0] = __atomic_load_n (&rate_target, __ATOMIC_RELAXED);
+  rates[1] = h->client ?
+    __atomic_load_n (&client_rate_target, __ATOMIC_RELAXED) : 0;
+  rates[2] = __atomic_load_n (&connection_rate_target, __ATOMIC_RELAXED);
+  for (i = 0; i < 3; ++i)
+    if (rates[i] > 0 && (lowest == 0 || rates[i] < lowest))
+      lowest = rates[i];
+
+  if (lowest == 0)              /* No limit. */
+    return UINT32_MAX;
+
+  slice = lowest * SLICE_SECS / 8;
+  slice = ROUND_DOWN (slice, MIN_SLICE);
+  slice = MAX (slice, MIN_SLICE);
+  return MIN (slice, UINT32_MAX);
+}
+
 /* Read data. */
 static int
 rate_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
@@ -277,15 +625,22 @@ rate_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
             uint32_t flags, int *err)
 {
   struct rate_handle *h = handle;
+  uint32_t slice = slice_size (h);
+  char *b = buf;
+  uint32_t n;
 
-  maybe_adjust (rate_file, &read_bucket, &read_bucket_lock);
-  if (maybe_sleep (&read_bucket, &read_bucket_lock, count, err))
-    return -1;
-  maybe_adjust (connection_rate_file, &h->read_bucket, &h->read_bucket_lock);
-  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, count, err))
-    return -1;
+  while (count > 0) {
+    n = MIN (count, slice);
+    if (wait_for_tokens (h, false, n, err) == -1)
+      return -1;
+    if (next_ops->pread (nxdata, b, n, offset, flags, err) == -1)
+      return -1;
+    b += n;
+    offset += n;
+    count -= n;
+  }
 
-  return next_ops->pread (nxdata, buf, count, offset, flags, err);
+  return 0;
 }
 
 /* Write data. */
@@ -296,15 +651,22 @@ rate_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
              int *err)
 {
   struct rate_handle *h = handle;
+  uint32_t slice = slice_size (h);
+  const char *b = buf;
+  uint32_t n;
 
-  maybe_adjust (rate_file, &write_bucket, &write_bucket_lock);
-  if (maybe_sleep (&write_bucket, &write_bucket_lock, count, err))
-    return -1;
-  maybe_adjust (connection_rate_file, &h->write_bucket, &h->write_bucket_lock);
-  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, count, err))
-    return -1;
+  while (count > 0) {
+    n = MIN (count, slice);
+    if (wait_for_tokens (h, true, n, err) == -1)
+      return -1;
+    if (next_ops->pwrite (nxdata, b, n, offset, flags, err) == -1)
+      return -1;
+    b += n;
+    offset += n;
+    count -= n;
+  }
 
-  return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  return 0;
 }
 
 static struct nbdkit_filter filter = {
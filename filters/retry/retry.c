@@ -38,28 +38,154 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "random.h"
 
 static unsigned retries = 5;    /* 0 = filter is disabled */
-static unsigned initial_delay = 2;
+static unsigned initial_delay_ms = 2000;
 static bool exponential_backoff = true;
+static bool jitter = true;
 static bool force_readonly = false;
+static bool reopen = true;
+
+/* If nr_retry_errors > 0, only these errnos are retried. */
+#define MAX_RETRY_ERRORS 32
+static int retry_errors[MAX_RETRY_ERRORS];
+static size_t nr_retry_errors;
 
 /* Currently next_ops->reopen is not safe if another thread makes a
  * request on the same connection (but on other connections it's OK).
  * To work around this for now we limit the thread model here, but
  * this is something we could improve in server/backend.c in future.
+ * Without reopening, retries only reissue the failed command.
  */
 static int
 retry_thread_model (void)
 {
+  if (!reopen)
+    return NBDKIT_THREAD_MODEL_PARALLEL;
   return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
 }
 
+/* Parse a delay in seconds, or in milliseconds with the "ms" suffix. */
+static int
+parse_delay (const char *key, const char *value, unsigned *ms)
+{
+  size_t len = strlen (value);
+  unsigned r;
+
+  if (len > 2 && strcmp (&value[len-2], "ms") == 0) {
+    CLEANUP_FREE char *num = strndup (value, len-2);
+
+    if (num == NULL) {
+      nbdkit_error ("strndup: %m");
+      return -1;
+    }
+    if (nbdkit_parse_unsigned (key, num, &r) == -1)
+      return -1;
+    *ms = r;
+    return 0;
+  }
+
+  if (nbdkit_parse_unsigned (key, value, &r) == -1)
+    return -1;
+  if (r > UINT_MAX / 1000) {
+    nbdkit_error ("%s is too large: %s", key, value);
+    return -1;
+  }
+  *ms = r * 1000;
+  return 0;
+}
+
+/* Errnos which can be named in retry-errors. */
+static const struct {
+  const char *name;
+  int err;
+} errno_names[] = {
+  { "EPERM", EPERM },
+  { "EIO", EIO },
+  { "ENOMEM", ENOMEM },
+  { "EINVAL", EINVAL },
+  { "ENOSPC", ENOSPC },
+  { "EROFS", EROFS },
+  { "EAGAIN", EAGAIN },
+  { "EINTR", EINTR },
+  { "EPIPE", EPIPE },
+  { "EOVERFLOW", EOVERFLOW },
+  { "ENOTSUP", ENOTSUP },
+  { "EOPNOTSUPP", EOPNOTSUPP },
+  { "ESHUTDOWN", ESHUTDOWN },
+  { "ETIMEDOUT", ETIMEDOUT },
+  { "ECONNREFUSED", ECONNREFUSED },
+  { "ECONNRESET", ECONNRESET },
+  { "ECONNABORTED", ECONNABORTED },
+  { "ENOTCONN", ENOTCONN },
+  { "ENETDOWN", ENETDOWN },
+  { "ENETUNREACH", ENETUNREACH },
+  { "EHOSTUNREACH", EHOSTUNREACH },
+};
+
+/* Parse a comma-separated list of errno names or numbers. */
+static int
+parse_retry_errors (const char *value)
+{
+  CLEANUP_FREE char *copy = strdup (value);
+  char *p, *saveptr;
+  size_t i;
+  int err;
+
+  if (copy == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+
+  nr_retry_errors = 0;
+  for (p = strtok_r (copy, ",", &saveptr); p != NULL;
+       p = strtok_r (NULL, ",", &saveptr)) {
+    err = 0;
+    for (i = 0; i < sizeof errno_names / sizeof errno_names[0]; ++i) {
+      if (strcmp (p, errno_names[i].name) == 0) {
+        err = errno_names[i].err;
+        break;
+      }
+    }
+    if (err == 0) {
+      if (nbdkit_parse_int ("retry-errors", p, &err) == -1)
+        return -1;
+      if (err <= 0) {
+        nbdkit_error ("retry-errors: invalid errno: %s", p);
+        return -1;
+      }
+    }
+    if (nr_retry_errors == MAX_RETRY_ERRORS) {
+      nbdkit_error ("retry-errors: too many errors listed");
+      return -1;
+    }
+    retry_errors[nr_retry_errors++] = err;
+  }
+  return 0;
+}
+
+static bool
+is_retry_error (int err)
+{
+  size_t i;
+
+  if (nr_retry_errors == 0)
+    return true;
+  for (i = 0; i < nr_retry_errors; ++i)
+    if (retry_errors[i] == err)
+      return true;
+  return false;
+}
+
 static int
 retry_config (nbdkit_next_config *next, void *nxdata,
               const char *key, const char *value)
@@ -72,9 +198,9 @@ retry_config (nbdkit_next_config *next, void *nxdata,
     return 0;
   }
   else if (strcmp (key, "retry-delay") == 0) {
-    if (nbdkit_parse_unsigned ("retry-delay", value, &initial_delay) == -1)
+    if (parse_delay ("retry-delay", value, &initial_delay_ms) == -1)
       return -1;
-    if (initial_delay == 0) {
+    if (initial_delay_ms == 0) {
       nbdkit_error ("retry-delay cannot be 0");
       return -1;
     }
@@ -94,15 +220,34 @@ retry_config (nbdkit_next_config *next, void *nxdata,
     force_readonly = r;
     return 0;
   }
+  else if (strcmp (key, "retry-jitter") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    jitter = r;
+    return 0;
+  }
+  else if (strcmp (key, "retry-reopen") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    reopen = r;
+    return 0;
+  }
+  else if (strcmp (key, "retry-errors") == 0)
+    return parse_retry_errors (value);
 
   return next (nxdata, key, value);
 }
 
 #define retry_config_help \
   "retries=<N>              Number of retries (default: 5).\n" \
-  "retry-delay=<N>          Seconds to wait before retry (default: 2).\n" \
+  "retry-delay=<N>[ms]      Seconds to wait before retry (default: 2).\n" \
   "retry-exponential=yes|no Exponential back-off (default: yes).\n" \
-  "retry-readonly=yes|no    Force read-only on failure (default: no).\n"
+  "retry-jitter=yes|no      Add random jitter to delays (default: yes).\n" \
+  "retry-readonly=yes|no    Force read-only on failure (default: no).\n" \
+  "retry-reopen=yes|no      Reopen the plugin before retry (default: yes).\n" \
+  "retry-errors=<ERR>,...   Only retry these errors (default: all).\n"
 
 struct retry_handle {
   int readonly;                 /* Save original readonly setting. */
@@ -147,7 +292,8 @@ retry_close (void *handle)
  */
 struct retry_data {
   int retry;                    /* Retry number (0 = first time). */
-  int delay;                    /* Seconds to wait before retrying. */
+  uint64_t delay_ms;            /* Milliseconds to wait before retrying. */
+  struct random_state random;   /* For jitter. */
 };
 
 static bool
@@ -167,9 +313,17 @@ do_retry (struct retry_handle *h,
           struct nbdkit_next_ops *next_ops, void *nxdata,
           int *err)
 {
+  uint64_t ms;
+
   /* If it's the first retry, initialize the other fields in *data. */
-  if (data->retry == 0)
-    data->delay = initial_delay;
+  if (data->retry == 0) {
+    struct timespec ts;
+
+    data->delay_ms = initial_delay_ms;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    xsrandom (ts.tv_sec * 1000000000 + ts.tv_nsec + (uintptr_t) data,
+              &data->random);
+  }
 
  again:
   /* Log the original errno since it will be lost when we retry. */
@@ -180,8 +334,21 @@ do_retry (struct retry_handle *h,
     return false;
   }
 
-  nbdkit_debug ("waiting %d seconds before retrying", data->delay);
-  if (nbdkit_nanosleep (data->delay, 0) == -1) {
+  /* After a failed reopen the error is ours, so always retry. */
+  if (h->open && !is_retry_error (*err)) {
+    nbdkit_debug ("errno %d is not in retry-errors, not retrying", *err);
+    return false;
+  }
+
+  /* Jitter spreads out retries from many connections which failed at
+   * the same time, but never shortens the configured delay.
+   */
+  ms = data->delay_ms;
+  if (jitter)
+    ms += xrandom (&data->random) % (ms / 2 + 1);
+
+  nbdkit_debug ("waiting %" PRIu64 " ms before retrying", ms);
+  if (nbdkit_nanosleep (ms / 1000, (ms % 1000) * 1000000) == -1) {
     /* We could do this but it would overwrite the more important
      * errno from the underlying data call.
      */
@@ -192,8 +359,11 @@ do_retry (struct retry_handle *h,
 
   /* Update *data in case we are called again. */
   data->retry++;
-  if (exponential_backoff)
-    data->delay *= 2;
+  if (exponential_backoff && data->delay_ms < UINT32_MAX)
+    data->delay_ms *= 2;
+
+  if (!reopen)
+    return true;
 
   /* Reopen the connection. */
   h->reopens++;
@@ -372,7 +542,6 @@ retry_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct retry_data data = {0};
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 = NULL;
   int r;
-  size_t i;
 
  again:
   if (! (h->open && valid_range (next_ops, nxdata, count, offset, false, err)))
@@ -395,13 +564,9 @@ retry_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   if (r == 0) {
     /* Transfer the successful extents back to the caller. */
-    for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
-      struct nbdkit_extent e = nbdkit_get_extent (extents2, i);
-
-      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
-        *err = errno;
-        return -1;
-      }
+    if (nbdkit_extents_copy (extents, extents2, 0) == -1) {
+      *err = errno;
+      return -1;
     }
   }
 
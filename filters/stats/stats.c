@@ -38,6 +38,8 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -51,25 +53,146 @@
 
 static char *filename;
 static bool append;
+static bool perconn;
+static bool openmetrics;
+static unsigned interval;       /* statsinterval, 0 = only on exit */
 static FILE *fp;
 static struct timeval start_t;
 
+/* Latency histograms are log-linear (similar to HdrHistogram): values
+ * below LAT_SUB_COUNT µs each get their own bucket, and every power
+ * of 2 above that is split into LAT_SUB_COUNT equal buckets, giving
+ * percentiles with a relative error of at most 1/LAT_SUB_COUNT.
+ * Latencies longer than 2^LAT_MAX_BITS µs (about 19 hours) are
+ * clamped into the last bucket.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 36
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
+
+/* Request sizes use one bucket per power of 2.  Bucket 0 holds
+ * zero-length requests, bucket i holds sizes in [2^(i-1), 2^i).
+ */
+#define SIZE_BUCKETS 33
+
+enum {
+  OP_READ, OP_WRITE, OP_TRIM, OP_ZERO, OP_EXTENTS, OP_CACHE, OP_FLUSH,
+  NR_OPS
+};
+
+static const char *op_names[NR_OPS] = {
+  "read", "write", "trim", "zero", "extents", "cache", "flush"
+};
+
+/* Failed requests are counted by the errno that would be sent to the
+ * client.  This mirrors nbd_errno() in the server, which maps any
+ * other error to EINVAL.
+ */
+enum {
+  ERR_EPERM, ERR_EIO, ERR_ENOMEM, ERR_EINVAL, ERR_ENOSPC, ERR_EOVERFLOW,
+  ERR_ENOTSUP, ERR_ESHUTDOWN,
+  NR_ERRS
+};
+
+static const char *err_names[NR_ERRS] = {
+  "EPERM", "EIO", "ENOMEM", "EINVAL", "ENOSPC", "EOVERFLOW",
+  "ENOTSUP", "ESHUTDOWN"
+};
+
+static inline int
+err_index (int err)
+{
+  switch (err) {
+  case EROFS:
+  case EPERM:
+    return ERR_EPERM;
+  case EIO:
+    return ERR_EIO;
+  case ENOMEM:
+    return ERR_ENOMEM;
+#ifdef EDQUOT
+  case EDQUOT:
+#endif
+  case EFBIG:
+  case ENOSPC:
+    return ERR_ENOSPC;
+#ifdef EOVERFLOW
+  case EOVERFLOW:
+    return ERR_EOVERFLOW;
+#endif
+#if defined ENOTSUP || defined EOPNOTSUPP
+#if defined ENOTSUP
+  case ENOTSUP:
+#endif
+#if defined EOPNOTSUPP && EOPNOTSUPP != ENOTSUP
+  case EOPNOTSUPP:
+#endif
+    return ERR_ENOTSUP;
+#endif
+  case ESHUTDOWN:
+    return ERR_ESHUTDOWN;
+  default:
+    return ERR_EINVAL;
+  }
+}
+
 typedef struct {
-  const char *name;
   uint64_t ops;
   uint64_t bytes;
   uint64_t usecs;
+  uint64_t max_usecs;
+  uint64_t latency[LAT_BUCKETS];
+  uint64_t size[SIZE_BUCKETS];
+  uint64_t errors[NR_ERRS];
 } stat;
 
-/* This lock protects all the stats. */
+/* To avoid any lock on the request path, each worker thread
+ * accumulates into its own struct thread_stats.  These are only
+ * merged when we need the totals.  When a thread exits its counts
+ * are folded into retired_st and its struct is freed, so memory does
+ * not grow as connections come and go.
+ *
+ * Only the owning thread ever writes to a struct thread_stats.
+ * Fields are written and read with relaxed atomics so that
+ * statsinterval can merge them while requests are running.
+ */
+struct thread_stats {
+  struct thread_stats *prev, *next;
+  stat st[NR_OPS];
+};
+
+/* Per-connection counters.  Requests on a single connection can run
+ * in parallel so these are updated atomically, but they are never
+ * shared between connections.  ops, bytes and usecs are only kept if
+ * statsperconn=true.
+ */
+struct handle {
+  struct handle *prev, *next;
+  uint64_t id;
+  struct timeval start_t;
+  uint64_t in_flight;
+  uint64_t ops[NR_OPS];
+  uint64_t bytes[NR_OPS];
+  uint64_t usecs[NR_OPS];
+};
+
+/* This lock protects the list of thread stats, retired_st, the list
+ * of open connections and writes to the stats file.
+ */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static stat pread_st   = { "read" };
-static stat pwrite_st  = { "write" };
-static stat trim_st    = { "trim" };
-static stat zero_st    = { "zero" };
-static stat extents_st = { "extents" };
-static stat cache_st   = { "cache" };
-static stat flush_st   = { "flush" };
+static struct thread_stats *threads;
+static stat retired_st[NR_OPS];
+static pthread_key_t stats_key;
+static struct handle *handles;
+static uint64_t connections;
+
+/* Background thread used by statsinterval. */
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static bool writer_started;
+static bool writer_stop;
+static pthread_t writer_thread;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
 
 #define KiB 1024
 #define MiB 1048576
@@ -107,17 +230,215 @@ maybe (char *s)
   return s ? s : "(n/a)";
 }
 
+/* Map a latency to its histogram bucket, and back again. */
+static inline unsigned
+lat_bucket (uint64_t usecs)
+{
+  unsigned msb, shift;
+
+  if (usecs < LAT_SUB_COUNT)
+    return usecs;
+  if (usecs >= UINT64_C(1) << LAT_MAX_BITS)
+    return LAT_BUCKETS - 1;
+  msb = 63 - __builtin_clzll (usecs);
+  shift = msb - LAT_SUB_BITS;
+  return (shift + 1) * LAT_SUB_COUNT + (usecs >> shift) - LAT_SUB_COUNT;
+}
+
+/* Highest latency that falls in bucket b. */
+static uint64_t
+lat_bucket_max (unsigned b)
+{
+  unsigned shift;
+  uint64_t mant;
+
+  if (b < LAT_SUB_COUNT)
+    return b;
+  shift = b / LAT_SUB_COUNT - 1;
+  mant = b % LAT_SUB_COUNT + LAT_SUB_COUNT;
+  return ((mant + 1) << shift) - 1;
+}
+
+static inline unsigned
+size_bucket (uint32_t count)
+{
+  return count == 0 ? 0 : 32 - __builtin_clz (count);
+}
+
+static inline uint64_t
+get (const uint64_t *p)
+{
+  return __atomic_load_n (p, __ATOMIC_RELAXED);
+}
+
+/* Single writer, so a relaxed load and store is enough for readers
+ * to never see a torn value.
+ */
+static inline void
+add (uint64_t *p, uint64_t n)
+{
+  __atomic_store_n (p, *p + n, __ATOMIC_RELAXED);
+}
+
+static void
+add_stat (stat *dst, const stat *src)
+{
+  uint64_t max_usecs = get (&src->max_usecs);
+  size_t i;
+
+  dst->ops += get (&src->ops);
+  dst->bytes += get (&src->bytes);
+  dst->usecs += get (&src->usecs);
+  if (max_usecs > dst->max_usecs)
+    dst->max_usecs = max_usecs;
+  for (i = 0; i < LAT_BUCKETS; ++i)
+    dst->latency[i] += get (&src->latency[i]);
+  for (i = 0; i < SIZE_BUCKETS; ++i)
+    dst->size[i] += get (&src->size[i]);
+  for (i = 0; i < NR_ERRS; ++i)
+    dst->errors[i] += get (&src->errors[i]);
+}
+
+/* Sum the stats of all threads.  Must be called with the lock held. */
 static void
-print_stat (const stat *st, int64_t usecs)
+merge_stats (stat *st)
 {
-  if (st->ops > 0) {
+  struct thread_stats *t;
+  size_t i;
+
+  memcpy (st, retired_st, sizeof retired_st);
+  for (t = threads; t != NULL; t = t->next)
+    for (i = 0; i < NR_OPS; ++i)
+      add_stat (&st[i], &t->st[i]);
+}
+
+/* Called when each worker thread exits. */
+static void
+retire_thread_stats (void *vp)
+{
+  struct thread_stats *t = vp;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (i = 0; i < NR_OPS; ++i)
+    add_stat (&retired_st[i], &t->st[i]);
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    threads = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  free (t);
+}
+
+/* Return the stats for the current thread, allocating them on first
+ * use.  Returns NULL if allocation fails.
+ */
+static struct thread_stats *
+get_thread_stats (void)
+{
+  struct thread_stats *t;
+
+  t = pthread_getspecific (stats_key);
+  if (t)
+    return t;
+
+  t = calloc (1, sizeof *t);
+  if (t == NULL)
+    return NULL;
+  if (pthread_setspecific (stats_key, t) != 0) {
+    free (t);
+    return NULL;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  t->next = threads;
+  if (threads)
+    threads->prev = t;
+  threads = t;
+  return t;
+}
+
+/* Return the latency at percentile p (0 < p <= 100). */
+static uint64_t
+percentile (const stat *st, double p)
+{
+  uint64_t target, seen = 0;
+  unsigned b;
+
+  target = (uint64_t) (st->ops * p / 100.0 + 0.5);
+  if (target == 0)
+    target = 1;
+  for (b = 0; b < LAT_BUCKETS; ++b) {
+    seen += st->latency[b];
+    if (seen >= target) {
+      uint64_t v = lat_bucket_max (b);
+      return v < st->max_usecs ? v : st->max_usecs;
+    }
+  }
+  return st->max_usecs;
+}
+
+static uint64_t
+total_errors (const stat *st)
+{
+  uint64_t n = 0;
+  size_t i;
+
+  for (i = 0; i < NR_ERRS; ++i)
+    n += st->errors[i];
+  return n;
+}
+
+static void
+print_histogram (FILE *out, const stat *st)
+{
+  unsigned b;
+
+  if (st->ops > 0)
+    fprintf (out, "  latency: p50 %" PRIu64 " us, p90 %" PRIu64 " us, "
+             "p99 %" PRIu64 " us, p99.9 %" PRIu64 " us, max %" PRIu64 " us\n",
+             percentile (st, 50), percentile (st, 90), percentile (st, 99),
+             percentile (st, 99.9), st->max_usecs);
+
+  for (b = 0; b < SIZE_BUCKETS; ++b) {
+    if (st->size[b] == 0)
+      continue;
+    if (b == 0)
+      fprintf (out, "  size 0: %" PRIu64 " ops\n", st->size[b]);
+    else if (b == 1)
+      fprintf (out, "  size 1: %" PRIu64 " ops\n", st->size[b]);
+    else
+      fprintf (out, "  size %" PRIu64 "-%" PRIu64 ": %" PRIu64 " ops\n",
+               UINT64_C(1) << (b-1), (UINT64_C(1) << b) - 1, st->size[b]);
+  }
+
+  if (total_errors (st) > 0) {
+    const char *sep = "";
+
+    fprintf (out, "  errors:");
+    for (b = 0; b < NR_ERRS; ++b) {
+      if (st->errors[b] > 0) {
+        fprintf (out, "%s %s %" PRIu64, sep, err_names[b], st->errors[b]);
+        sep = ",";
+      }
+    }
+    fprintf (out, "\n");
+  }
+}
+
+static void
+print_stat (FILE *out, const char *name, const stat *st, int64_t usecs)
+{
+  if (st->ops > 0 || total_errors (st) > 0) {
     char *size = humansize (st->bytes);
     char *op_rate = humanrate (st->bytes, st->usecs);
     char *total_rate = humanrate (st->bytes, usecs);
 
-    fprintf (fp, "%s: %" PRIu64 " ops, %.6f s, %s, %s/s op, %s/s total\n",
-             st->name, st->ops, st->usecs / 1000000.0, maybe (size),
+    fprintf (out, "%s: %" PRIu64 " ops, %.6f s, %s, %s/s op, %s/s total\n",
+             name, st->ops, st->usecs / 1000000.0, maybe (size),
              maybe (op_rate), maybe (total_rate));
+    print_histogram (out, st);
 
     free (size);
     free (op_rate);
@@ -126,52 +447,253 @@ print_stat (const stat *st, int64_t usecs)
 }
 
 static void
-print_totals (uint64_t usecs)
+print_totals (FILE *out, const stat *st, uint64_t usecs)
 {
-  uint64_t ops = pread_st.ops + pwrite_st.ops + trim_st.ops + zero_st.ops +
-    extents_st.ops + flush_st.ops;
-  uint64_t bytes = pread_st.bytes + pwrite_st.bytes + trim_st.bytes +
-    zero_st.bytes;
+  uint64_t ops = st[OP_READ].ops + st[OP_WRITE].ops + st[OP_TRIM].ops +
+    st[OP_ZERO].ops + st[OP_EXTENTS].ops + st[OP_FLUSH].ops;
+  uint64_t bytes = st[OP_READ].bytes + st[OP_WRITE].bytes +
+    st[OP_TRIM].bytes + st[OP_ZERO].bytes;
   char *size = humansize (bytes);
   char *rate = humanrate (bytes, usecs);
 
-  fprintf (fp, "total: %" PRIu64 " ops, %.6f s, %s, %s/s\n",
+  fprintf (out, "total: %" PRIu64 " ops, %.6f s, %s, %s/s\n",
            ops, usecs / 1000000.0, maybe (size), maybe (rate));
 
   free (size);
   free (rate);
 }
 
-static inline void
-print_stats (int64_t usecs)
+static void
+print_text (FILE *out, const stat *st, int64_t usecs)
 {
-  print_totals (usecs);
-  print_stat (&pread_st,   usecs);
-  print_stat (&pwrite_st,  usecs);
-  print_stat (&trim_st,    usecs);
-  print_stat (&zero_st,    usecs);
-  print_stat (&extents_st, usecs);
-  print_stat (&cache_st,   usecs);
-  print_stat (&flush_st,   usecs);
-  fflush (fp);
+  size_t i;
+
+  print_totals (out, st, usecs);
+  for (i = 0; i < NR_OPS; ++i)
+    print_stat (out, op_names[i], &st[i], usecs);
 }
 
+/* Print the stats in OpenMetrics (Prometheus) text format. */
 static void
-stats_unload (void)
+print_openmetrics (FILE *out, const stat *st, int64_t usecs)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const struct handle *h;
+  uint64_t open_conns = 0;
+  size_t i, j;
+
+  fprintf (out, "# TYPE nbdkit_uptime_seconds gauge\n");
+  fprintf (out, "nbdkit_uptime_seconds %.6f\n", usecs / 1000000.0);
+
+  fprintf (out, "# TYPE nbdkit_connections counter\n");
+  fprintf (out, "nbdkit_connections_total %" PRIu64 "\n",
+           get (&connections));
+  for (h = handles; h != NULL; h = h->next)
+    open_conns++;
+  fprintf (out, "# TYPE nbdkit_connections_open gauge\n");
+  fprintf (out, "nbdkit_connections_open %" PRIu64 "\n", open_conns);
+  fprintf (out, "# TYPE nbdkit_connection_requests_in_flight gauge\n");
+  for (h = handles; h != NULL; h = h->next)
+    fprintf (out,
+             "nbdkit_connection_requests_in_flight{connection=\"%" PRIu64 "\"} "
+             "%" PRIu64 "\n",
+             h->id, get (&h->in_flight));
+
+  fprintf (out, "# TYPE nbdkit_requests counter\n");
+  for (i = 0; i < NR_OPS; ++i)
+    fprintf (out, "nbdkit_requests_total{op=\"%s\"} %" PRIu64 "\n",
+             op_names[i], st[i].ops);
+
+  fprintf (out, "# TYPE nbdkit_request_bytes counter\n");
+  fprintf (out, "# UNIT nbdkit_request_bytes bytes\n");
+  for (i = 0; i < NR_OPS; ++i)
+    fprintf (out, "nbdkit_request_bytes_total{op=\"%s\"} %" PRIu64 "\n",
+             op_names[i], st[i].bytes);
+
+  fprintf (out, "# TYPE nbdkit_request_errors counter\n");
+  for (i = 0; i < NR_OPS; ++i)
+    for (j = 0; j < NR_ERRS; ++j)
+      if (st[i].errors[j] > 0)
+        fprintf (out,
+                 "nbdkit_request_errors_total{op=\"%s\",errno=\"%s\"} "
+                 "%" PRIu64 "\n",
+                 op_names[i], err_names[j], st[i].errors[j]);
+
+  fprintf (out, "# TYPE nbdkit_request_latency_seconds summary\n");
+  fprintf (out, "# UNIT nbdkit_request_latency_seconds seconds\n");
+  for (i = 0; i < NR_OPS; ++i) {
+    if (st[i].ops > 0) {
+      for (j = 0; j < sizeof quantiles / sizeof quantiles[0]; ++j)
+        fprintf (out,
+                 "nbdkit_request_latency_seconds{op=\"%s\",quantile=\"%g\"} "
+                 "%.6f\n",
+                 op_names[i], quantiles[j],
+                 percentile (&st[i], quantiles[j] * 100) / 1000000.0);
+    }
+    fprintf (out, "nbdkit_request_latency_seconds_sum{op=\"%s\"} %.6f\n",
+             op_names[i], st[i].usecs / 1000000.0);
+    fprintf (out, "nbdkit_request_latency_seconds_count{op=\"%s\"} "
+             "%" PRIu64 "\n",
+             op_names[i], st[i].ops);
+  }
+
+  fprintf (out, "# TYPE nbdkit_request_size_bytes histogram\n");
+  fprintf (out, "# UNIT nbdkit_request_size_bytes bytes\n");
+  for (i = 0; i < NR_OPS; ++i) {
+    uint64_t cumulative = 0;
+
+    for (j = 0; j < SIZE_BUCKETS; ++j) {
+      cumulative += st[i].size[j];
+      fprintf (out,
+               "nbdkit_request_size_bytes_bucket{op=\"%s\",le=\"%" PRIu64 "\"} "
+               "%" PRIu64 "\n",
+               op_names[i], (UINT64_C(1) << j) - 1, cumulative);
+    }
+    fprintf (out,
+             "nbdkit_request_size_bytes_bucket{op=\"%s\",le=\"+Inf\"} "
+             "%" PRIu64 "\n",
+             op_names[i], cumulative);
+    fprintf (out, "nbdkit_request_size_bytes_sum{op=\"%s\"} %" PRIu64 "\n",
+             op_names[i], st[i].bytes);
+    fprintf (out, "nbdkit_request_size_bytes_count{op=\"%s\"} %" PRIu64 "\n",
+             op_names[i], cumulative);
+  }
+
+  fprintf (out, "# EOF\n");
+}
+
+static void
+print_stats (FILE *out, int64_t usecs)
+{
+  static stat st[NR_OPS];
+
+  merge_stats (st);
+  if (openmetrics)
+    print_openmetrics (out, st, usecs);
+  else
+    print_text (out, st, usecs);
+}
+
+/* Write the current stats.  Must be called with the lock held.
+ *
+ * Normally this just writes to the stats file.  However for periodic
+ * snapshots without statsappend, we write to a temporary file and
+ * rename it over the stats file, so that readers (such as a
+ * Prometheus textfile collector) only ever see a complete snapshot.
+ */
+static void
+write_stats (void)
 {
   struct timeval now;
   int64_t usecs;
+  CLEANUP_FREE char *tmpname = NULL;
+  int fd;
+  FILE *out;
 
   gettimeofday (&now, NULL);
   usecs = tvdiff_usec (&start_t, &now);
-  if (fp && usecs > 0) {
+  if (usecs <= 0)
+    return;
+
+  if (interval == 0 || append) {
+    print_stats (fp, usecs);
+    fflush (fp);
+    return;
+  }
+
+  if (asprintf (&tmpname, "%s.tmp", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return;
+  }
+  fd = open (tmpname, O_CLOEXEC | O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    nbdkit_error ("open: %s: %m", tmpname);
+    return;
+  }
+  out = fdopen (fd, "w");
+  if (out == NULL) {
+    nbdkit_error ("fdopen: %s: %m", tmpname);
+    close (fd);
+    unlink (tmpname);
+    return;
+  }
+  print_stats (out, usecs);
+  if (fclose (out) == EOF) {
+    nbdkit_error ("close: %s: %m", tmpname);
+    unlink (tmpname);
+    return;
+  }
+  if (rename (tmpname, filename) == -1) {
+    nbdkit_error ("rename: %s: %m", tmpname);
+    unlink (tmpname);
+  }
+}
+
+static void *
+writer (void *vp)
+{
+  struct timespec deadline;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  while (!writer_stop) {
+    deadline.tv_sec += interval;
+    while (!writer_stop &&
+           pthread_cond_timedwait (&writer_cond, &lock, &deadline) == 0)
+      ;
+    if (!writer_stop)
+      write_stats ();
+  }
+  return NULL;
+}
+
+/* The writer thread is started on the first connection rather than
+ * in .config_complete because nbdkit may fork into the background
+ * after that, and threads do not survive the fork.
+ */
+static void
+start_writer (void)
+{
+  int err;
+
+  err = pthread_create (&writer_thread, NULL, writer, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("stats: cannot create writer thread: %m");
+    return;
+  }
+  writer_started = true;
+}
+
+static void
+stats_load (void)
+{
+  if (pthread_key_create (&stats_key, retire_thread_stats) != 0) {
+    nbdkit_error ("stats: pthread_key_create failed");
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+stats_unload (void)
+{
+  if (writer_started) {
+    pthread_mutex_lock (&lock);
+    writer_stop = true;
+    pthread_cond_signal (&writer_cond);
+    pthread_mutex_unlock (&lock);
+    pthread_join (writer_thread, NULL);
+  }
+
+  if (fp) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    print_stats (usecs);
+    write_stats ();
   }
 
   if (fp)
     fclose (fp);
   free (filename);
+  pthread_key_delete (stats_key);
 }
 
 static int
@@ -194,6 +716,30 @@ stats_config (nbdkit_next_config *next, void *nxdata,
     append = r;
     return 0;
   }
+  else if (strcmp (key, "statsperconn") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    perconn = r;
+    return 0;
+  }
+  else if (strcmp (key, "statsformat") == 0) {
+    if (strcmp (value, "text") == 0)
+      openmetrics = false;
+    else if (strcmp (value, "openmetrics") == 0 ||
+             strcmp (value, "prometheus") == 0)
+      openmetrics = true;
+    else {
+      nbdkit_error ("statsformat must be 'text' or 'openmetrics'");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "statsinterval") == 0) {
+    if (nbdkit_parse_unsigned ("statsinterval", value, &interval) == -1)
+      return -1;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -234,21 +780,141 @@ stats_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 
 #define stats_config_help \
   "statsfile=<FILE>    (required) The file to place the log in.\n" \
-  "statsappend=<BOOL>  True to append to the log (default false).\n"
+  "statsappend=<BOOL>  True to append to the log (default false).\n" \
+  "statsperconn=<BOOL> True to log stats for each connection (default false).\n" \
+  "statsformat=text|openmetrics\n" \
+  "                    Format of the stats file (default text).\n" \
+  "statsinterval=<SECS>\n" \
+  "                    Update the stats file every SECS seconds.\n"
+
+static void *
+stats_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  struct handle *h;
+
+  if (next (nxdata, readonly) == -1)
+    return NULL;
+
+  if (interval > 0)
+    pthread_once (&writer_once, start_writer);
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  h->id = __atomic_add_fetch (&connections, 1, __ATOMIC_RELAXED);
+  gettimeofday (&h->start_t, NULL);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  h->next = handles;
+  if (handles)
+    handles->prev = h;
+  handles = h;
+  return h;
+}
+
+static void
+stats_close (void *handle)
+{
+  struct handle *h = handle;
+  struct timeval now;
+  int64_t usecs;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (h->prev)
+    h->prev->next = h->next;
+  else
+    handles = h->next;
+  if (h->next)
+    h->next->prev = h->prev;
+
+  /* Per-connection summaries are only written when we are appending
+   * to a single text file, not when the file is replaced by periodic
+   * snapshots.
+   */
+  if (perconn && !openmetrics && (interval == 0 || append)) {
+    gettimeofday (&now, NULL);
+    usecs = tvdiff_usec (&h->start_t, &now);
+
+    fprintf (fp, "connection %" PRIu64 ": %.6f s\n", h->id, usecs / 1000000.0);
+    for (i = 0; i < NR_OPS; ++i) {
+      if (h->ops[i] > 0) {
+        char *size = humansize (h->bytes[i]);
+        char *op_rate = humanrate (h->bytes[i], h->usecs[i]);
+
+        fprintf (fp, "  %s: %" PRIu64 " ops, %.6f s, %s, %s/s op\n",
+                 op_names[i], h->ops[i], h->usecs[i] / 1000000.0,
+                 maybe (size), maybe (op_rate));
+        free (size);
+        free (op_rate);
+      }
+    }
+    fflush (fp);
+  }
+
+  free (h);
+}
+
+static inline void
+start_request (struct handle *h, struct timeval *start)
+{
+  __atomic_add_fetch (&h->in_flight, 1, __ATOMIC_RELAXED);
+  gettimeofday (start, NULL);
+}
 
 static inline void
-record_stat (stat *st, uint32_t count, const struct timeval *start)
+record_stat (struct handle *h, int op, uint32_t count,
+             const struct timeval *start, int r, int err)
 {
   struct timeval end;
   uint64_t usecs;
+  struct thread_stats *t;
+  stat *st;
 
   gettimeofday (&end, NULL);
   usecs = tvdiff_usec (start, &end);
+  __atomic_sub_fetch (&h->in_flight, 1, __ATOMIC_RELAXED);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  st->ops++;
-  st->bytes += count;
-  st->usecs += usecs;
+  if (perconn && r == 0) {
+    __atomic_add_fetch (&h->ops[op], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->bytes[op], count, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->usecs[op], usecs, __ATOMIC_RELAXED);
+  }
+
+  t = get_thread_stats ();
+  if (t == NULL) {
+    /* Out of memory, fall back to the slow path. */
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    st = &retired_st[op];
+    if (r == -1) {
+      st->errors[err_index (err)]++;
+      return;
+    }
+    st->ops++;
+    st->bytes += count;
+    st->usecs += usecs;
+    if (usecs > st->max_usecs)
+      st->max_usecs = usecs;
+    st->latency[lat_bucket (usecs)]++;
+    st->size[size_bucket (count)]++;
+    return;
+  }
+
+  st = &t->st[op];
+  if (r == -1) {
+    add (&st->errors[err_index (err)], 1);
+    return;
+  }
+  add (&st->ops, 1);
+  add (&st->bytes, count);
+  add (&st->usecs, usecs);
+  if (usecs > st->max_usecs)
+    __atomic_store_n (&st->max_usecs, usecs, __ATOMIC_RELAXED);
+  add (&st->latency[lat_bucket (usecs)], 1);
+  add (&st->size[size_bucket (count)], 1);
 }
 
 /* Read. */
@@ -260,9 +926,9 @@ stats_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->pread (nxdata, buf, count, offset, flags, err);
-  if (r == 0) record_stat (&pread_st, count, &start);
+  record_stat (handle, OP_READ, count, &start, r, *err);
   return r;
 }
 
@@ -276,9 +942,9 @@ stats_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
-  if (r == 0) record_stat (&pwrite_st, count, &start);
+  record_stat (handle, OP_WRITE, count, &start, r, *err);
   return r;
 }
 
@@ -292,9 +958,9 @@ stats_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->trim (nxdata, count, offset, flags, err);
-  if (r == 0) record_stat (&trim_st, count, &start);
+  record_stat (handle, OP_TRIM, count, &start, r, *err);
   return r;
 }
 
@@ -307,9 +973,9 @@ stats_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->flush (nxdata, flags, err);
-  if (r == 0) record_stat (&flush_st, 0, &start);
+  record_stat (handle, OP_FLUSH, 0, &start, r, *err);
   return r;
 }
 
@@ -323,9 +989,9 @@ stats_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->zero (nxdata, count, offset, flags, err);
-  if (r == 0) record_stat (&zero_st, count, &start);
+  record_stat (handle, OP_ZERO, count, &start, r, *err);
   return r;
 }
 
@@ -339,13 +1005,13 @@ stats_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->extents (nxdata, count, offset, flags, extents, err);
   /* XXX There's a case for trying to determine how long the extents
    * will be that are returned to the client (instead of simply using
    * count), given the flags and the complex rules in the protocol.
    */
-  if (r == 0) record_stat (&extents_st, count, &start);
+  record_stat (handle, OP_EXTENTS, count, &start, r, *err);
   return r;
 }
 
@@ -359,19 +1025,22 @@ stats_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct timeval start;
   int r;
 
-  gettimeofday (&start, NULL);
+  start_request (handle, &start);
   r = next_ops->cache (nxdata, count, offset, flags, err);
-  if (r == 0) record_stat (&cache_st, count, &start);
+  record_stat (handle, OP_CACHE, count, &start, r, *err);
   return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "stats",
   .longname          = "nbdkit stats filter",
+  .load              = stats_load,
   .unload            = stats_unload,
   .config            = stats_config,
   .config_complete   = stats_config_complete,
   .config_help       = stats_config_help,
+  .open              = stats_open,
+  .close             = stats_close,
   .pread             = stats_pread,
   .pwrite            = stats_pwrite,
   .trim              = stats_trim,
@@ -344,7 +344,6 @@ truncate_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   uint32_t n;
   struct handle *h = handle;
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 = NULL;
-  size_t i;
 
   /* If the entire request is beyond the end of the underlying plugin
    * then this is the easy case: return a hole up to the end of the
@@ -380,13 +379,9 @@ truncate_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (next_ops->extents (nxdata, n, offset, flags, extents2, err) == -1)
     return -1;
 
-  for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
-    struct nbdkit_extent e = nbdkit_get_extent (extents2, i);
-
-    if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
-      *err = errno;
-      return -1;
-    }
+  if (nbdkit_extents_copy (extents, extents2, 0) == -1) {
+    *err = errno;
+    return -1;
   }
 
   return 0;
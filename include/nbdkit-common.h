@@ -112,6 +112,10 @@ extern int nbdkit_nanosleep (unsigned sec, unsigned nsec);
 extern const char *nbdkit_export_name (void);
 extern int nbdkit_peer_name (struct sockaddr *addr, socklen_t *addrlen);
 
+struct nbdkit_exports;
+extern int nbdkit_add_export (struct nbdkit_exports *,
+                              const char *name, const char *description);
+
 struct nbdkit_extents;
 extern int nbdkit_add_extent (struct nbdkit_extents *,
                               uint64_t offset, uint64_t length, uint32_t type);
@@ -63,6 +63,8 @@ typedef int nbdkit_next_config (nbdkit_backend *nxdata,
                                 const char *key, const char *value);
 typedef int nbdkit_next_config_complete (nbdkit_backend *nxdata);
 typedef int nbdkit_next_preconnect (nbdkit_backend *nxdata, int readonly);
+typedef int nbdkit_next_list_exports (nbdkit_backend *nxdata, int readonly,
+                                      struct nbdkit_exports *exports);
 typedef int nbdkit_next_open (nbdkit_backend *nxdata, int readonly);
 
 struct nbdkit_next_ops {
@@ -73,6 +75,9 @@ struct nbdkit_next_ops {
 
   /* The rest of the next ops are the same as normal plugin operations. */
   int64_t (*get_size) (nbdkit_backend *nxdata);
+  int (*block_size) (nbdkit_backend *nxdata,
+                     uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
 
   int (*can_write) (nbdkit_backend *nxdata);
   int (*can_flush) (nbdkit_backend *nxdata);
@@ -114,6 +119,14 @@ extern void nbdkit_extents_free (struct nbdkit_extents *);
 extern size_t nbdkit_extents_count (const struct nbdkit_extents *);
 extern struct nbdkit_extent nbdkit_get_extent (const struct nbdkit_extents *,
                                                size_t);
+extern int nbdkit_extents_append (struct nbdkit_extents *,
+                                  const struct nbdkit_extent *, size_t n);
+extern int nbdkit_extents_copy (struct nbdkit_extents *dst,
+                                const struct nbdkit_extents *src,
+                                int64_t shift);
+extern int nbdkit_extents_intersect (struct nbdkit_extents *dst,
+                                     const struct nbdkit_extents *a,
+                                     const struct nbdkit_extents *b);
 
 /* Filter struct. */
 struct nbdkit_filter {
@@ -145,6 +158,8 @@ struct nbdkit_filter {
   int (*thread_model) (void);
   int (*preconnect) (nbdkit_next_preconnect *next, nbdkit_backend *nxdata,
                      int readonly);
+  int (*list_exports) (nbdkit_next_list_exports *next, nbdkit_backend *nxdata,
+                       int readonly, struct nbdkit_exports *exports);
 
   void * (*open) (nbdkit_next_open *next, nbdkit_backend *nxdata,
                   int readonly);
@@ -157,6 +172,9 @@ struct nbdkit_filter {
 
   int64_t (*get_size) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
                        void *handle);
+  int (*block_size) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+                     void *handle, uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
 
   int (*can_write) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
                     void *handle);
@@ -136,6 +136,12 @@ struct nbdkit_plugin {
   int (*can_fast_zero) (void *handle);
 
   int (*preconnect) (int readonly);
+
+  int (*block_size) (void *handle,
+                     uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
+
+  int (*list_exports) (int readonly, struct nbdkit_exports *exports);
 };
 
 extern void nbdkit_set_error (int err);
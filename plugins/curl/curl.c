@@ -50,7 +50,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <curl/curl.h>
 
@@ -68,6 +70,7 @@ static const char *unix_socket_path = NULL;
 static long protocols = CURLPROTO_ALL;
 static const char *cainfo = NULL;
 static const char *capath = NULL;
+static unsigned connections = 4;
 
 /* Use '-D curl.verbose=1' to set. */
 int curl_debug_verbose = 0;
@@ -76,6 +79,8 @@ int curl_debug_verbose = 0;
 #define HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
 #endif
 
+static void stop_worker (void);
+
 static void
 curl_load (void)
 {
@@ -91,6 +96,7 @@ curl_load (void)
 static void
 curl_unload (void)
 {
+  stop_worker ();
   free (password);
   free (proxy_password);
   free (cookie);
@@ -197,6 +203,15 @@ curl_config (const char *key, const char *value)
       return -1;
   }
 
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
   else if (strcmp (key, "cookie") == 0) {
     free (cookie);
     if (nbdkit_read_password (value, &cookie) == -1)
@@ -265,6 +280,7 @@ curl_config_complete (void)
 #define curl_config_help \
   "cainfo=<CAINFO>            Path to Certificate Authority file.\n" \
   "capath=<CAPATH>            Path to directory with CA certificates.\n" \
+  "connections=<N>            Number of parallel requests (default 4).\n" \
   "cookie=<COOKIE>            Set HTTP/HTTPS cookies.\n" \
   "password=<PASSWORD>        The password for the user account.\n" \
   "protocols=PROTO,PROTO,..   Limit protocols allowed.\n" \
@@ -276,49 +292,96 @@ curl_config_complete (void)
   "url=<URL>       (required) The disk image URL to serve.\n" \
   "user=<USER>                The user to log in as."
 
-/* The per-connection handle. */
+/* A pooled libcurl easy handle.  Requests from all NBD connections
+ * take a free handle from the pool, attach their buffers to it and
+ * pass it to the worker thread, which drives every handle in flight
+ * through a single curl multi handle.  Because the multi handle owns
+ * the connection cache, HTTP keep-alive connections (and HTTP/2
+ * streams, if the server supports them) are reused by all handles.
+ */
 struct curl_handle {
   CURL *c;
+  bool in_use;
   bool accept_range;
-  int64_t exportsize;
   char errbuf[CURL_ERROR_SIZE];
   char *write_buf;
   uint32_t write_count;
   const char *read_buf;
   uint32_t read_count;
+
+  /* Set by the worker thread when the transfer finishes. */
+  bool done;
+  CURLcode r;
+  pthread_cond_t cond;
+
+  /* Queue of handles waiting to be added to the multi handle. */
+  struct curl_handle *next;
+};
+
+/* The per-connection handle. */
+struct handle {
+  int64_t exportsize;
 };
 
 /* Translate CURLcode to nbdkit_error. */
-#define display_curl_error(h, r, fs, ...)                       \
+#define display_curl_error(ch, r, fs, ...)                      \
   do {                                                          \
     nbdkit_error ((fs ": %s: %s"), ## __VA_ARGS__,              \
-                  curl_easy_strerror ((r)), (h)->errbuf);       \
+                  curl_easy_strerror ((r)), (ch)->errbuf);      \
   } while (0)
 
 static size_t header_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t read_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 
-/* Create the per-connection handle. */
-static void *
-curl_open (int readonly)
+/* The pool of easy handles.  Handles are created on demand up to
+ * the connections=N limit and are only freed when the plugin is
+ * unloaded.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct curl_handle **pool;
+static size_t pool_size;
+
+/* The worker thread and the queue of handles to be started.  The
+ * worker sleeps in curl_multi_wait, so after queuing a handle we
+ * write a byte to the self-pipe to wake it.
+ */
+static pthread_once_t worker_once = PTHREAD_ONCE_INIT;
+static pthread_t worker_thread;
+static bool worker_running;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct curl_handle *queue_head, *queue_tail;
+static bool worker_quit;
+static CURLM *multi;
+static int wakeup_fd[2] = { -1, -1 };
+
+static void
+free_handle (struct curl_handle *ch)
+{
+  curl_easy_cleanup (ch->c);
+  pthread_cond_destroy (&ch->cond);
+  free (ch);
+}
+
+/* Create a new easy handle with all the settings common to every
+ * request.
+ */
+static struct curl_handle *
+allocate_handle (void)
 {
-  struct curl_handle *h;
+  struct curl_handle *ch;
   CURLcode r;
-#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
-  curl_off_t o;
-#else
-  double d;
-#endif
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
+  ch = calloc (1, sizeof *ch);
+  if (ch == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
   }
+  pthread_cond_init (&ch->cond, NULL);
 
-  h->c = curl_easy_init ();
-  if (h->c == NULL) {
+  ch->c = curl_easy_init ();
+  if (ch->c == NULL) {
     nbdkit_error ("curl_easy_init: failed: %m");
     goto err;
   }
@@ -329,82 +392,372 @@ curl_open (int readonly)
    * consider using CURLOPT_DEBUGFUNCTION so we can handle it with
    * nbdkit_debug.
    */
-  curl_easy_setopt (h->c, CURLOPT_VERBOSE, curl_debug_verbose);
+  curl_easy_setopt (ch->c, CURLOPT_VERBOSE, curl_debug_verbose);
 
-  curl_easy_setopt (h->c, CURLOPT_ERRORBUFFER, h->errbuf);
+  curl_easy_setopt (ch->c, CURLOPT_ERRORBUFFER, ch->errbuf);
 
   r = CURLE_OK;
   if (unix_socket_path) {
 #if HAVE_CURLOPT_UNIX_SOCKET_PATH
-    r = curl_easy_setopt (h->c, CURLOPT_UNIX_SOCKET_PATH, unix_socket_path);
+    r = curl_easy_setopt (ch->c, CURLOPT_UNIX_SOCKET_PATH, unix_socket_path);
 #else
     r = CURLE_UNKNOWN_OPTION;
 #endif
   }
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "curl_easy_setopt: CURLOPT_UNIX_SOCKET_PATH");
+    display_curl_error (ch, r, "curl_easy_setopt: CURLOPT_UNIX_SOCKET_PATH");
     goto err;
   }
 
-  r = curl_easy_setopt (h->c, CURLOPT_URL, url);
+  r = curl_easy_setopt (ch->c, CURLOPT_URL, url);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "curl_easy_setopt: CURLOPT_URL [%s]", url);
+    display_curl_error (ch, r, "curl_easy_setopt: CURLOPT_URL [%s]", url);
     goto err;
   }
 
   nbdkit_debug ("set libcurl URL: %s", url);
 
-  curl_easy_setopt (h->c, CURLOPT_AUTOREFERER, 1);
-  curl_easy_setopt (h->c, CURLOPT_FOLLOWLOCATION, 1);
-  curl_easy_setopt (h->c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (ch->c, CURLOPT_PRIVATE, ch);
+  curl_easy_setopt (ch->c, CURLOPT_AUTOREFERER, 1);
+  curl_easy_setopt (ch->c, CURLOPT_FOLLOWLOCATION, 1);
+  curl_easy_setopt (ch->c, CURLOPT_FAILONERROR, 1);
+  /* Signals cannot be used for timeouts in a multithreaded program. */
+  curl_easy_setopt (ch->c, CURLOPT_NOSIGNAL, 1L);
+#if CURL_AT_LEAST_VERSION(7, 43, 0)
+  /* Prefer waiting to multiplex on an existing HTTP/2 connection
+   * over opening a new connection.
+   */
+  curl_easy_setopt (ch->c, CURLOPT_PIPEWAIT, 1L);
+#endif
   if (protocols != CURLPROTO_ALL) {
-    curl_easy_setopt (h->c, CURLOPT_PROTOCOLS, protocols);
-    curl_easy_setopt (h->c, CURLOPT_REDIR_PROTOCOLS, protocols);
+    curl_easy_setopt (ch->c, CURLOPT_PROTOCOLS, protocols);
+    curl_easy_setopt (ch->c, CURLOPT_REDIR_PROTOCOLS, protocols);
   }
   if (timeout > 0)
     /* NB: The cast is required here because the parameter is varargs
      * treated as long, and not type safe.
      */
-    curl_easy_setopt (h->c, CURLOPT_TIMEOUT, (long) timeout);
+    curl_easy_setopt (ch->c, CURLOPT_TIMEOUT, (long) timeout);
   if (!sslverify) {
     /* See comment above. */
-    curl_easy_setopt (h->c, CURLOPT_SSL_VERIFYPEER, 0L);
-    curl_easy_setopt (h->c, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt (ch->c, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt (ch->c, CURLOPT_SSL_VERIFYHOST, 0L);
   }
   if (user)
-    curl_easy_setopt (h->c, CURLOPT_USERNAME, user);
+    curl_easy_setopt (ch->c, CURLOPT_USERNAME, user);
   if (password)
-    curl_easy_setopt (h->c, CURLOPT_PASSWORD, password);
+    curl_easy_setopt (ch->c, CURLOPT_PASSWORD, password);
   if (proxy_user)
-    curl_easy_setopt (h->c, CURLOPT_PROXYUSERNAME, proxy_user);
+    curl_easy_setopt (ch->c, CURLOPT_PROXYUSERNAME, proxy_user);
   if (proxy_password)
-    curl_easy_setopt (h->c, CURLOPT_PROXYPASSWORD, proxy_password);
+    curl_easy_setopt (ch->c, CURLOPT_PROXYPASSWORD, proxy_password);
   if (cookie)
-    curl_easy_setopt (h->c, CURLOPT_COOKIE, cookie);
+    curl_easy_setopt (ch->c, CURLOPT_COOKIE, cookie);
   if (cainfo)
-    curl_easy_setopt (h->c, CURLOPT_CAINFO, cainfo);
+    curl_easy_setopt (ch->c, CURLOPT_CAINFO, cainfo);
   if (capath)
-    curl_easy_setopt (h->c, CURLOPT_CAPATH, capath);
+    curl_easy_setopt (ch->c, CURLOPT_CAPATH, capath);
+
+  curl_easy_setopt (ch->c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt (ch->c, CURLOPT_WRITEDATA, ch);
+  curl_easy_setopt (ch->c, CURLOPT_READFUNCTION, read_cb);
+  curl_easy_setopt (ch->c, CURLOPT_READDATA, ch);
+
+  return ch;
+
+ err:
+  if (ch->c)
+    curl_easy_cleanup (ch->c);
+  pthread_cond_destroy (&ch->cond);
+  free (ch);
+  return NULL;
+}
+
+/* Take a free handle from the pool, creating one if the pool has
+ * not reached its limit, otherwise waiting for one to be returned.
+ */
+static struct curl_handle *
+get_handle (void)
+{
+  struct curl_handle *ch, **p;
+  size_t i;
+
+  pthread_mutex_lock (&pool_lock);
+  for (;;) {
+    for (i = 0; i < pool_size; ++i) {
+      if (!pool[i]->in_use) {
+        ch = pool[i];
+        goto found;
+      }
+    }
+    if (pool_size < connections) {
+      p = realloc (pool, (pool_size + 1) * sizeof *p);
+      if (p == NULL) {
+        nbdkit_error ("realloc: %m");
+        pthread_mutex_unlock (&pool_lock);
+        return NULL;
+      }
+      pool = p;
+      ch = allocate_handle ();
+      if (ch == NULL) {
+        pthread_mutex_unlock (&pool_lock);
+        return NULL;
+      }
+      pool[pool_size++] = ch;
+      goto found;
+    }
+    pthread_cond_wait (&pool_cond, &pool_lock);
+  }
+
+ found:
+  ch->in_use = true;
+  pthread_mutex_unlock (&pool_lock);
+  return ch;
+}
+
+static void
+put_handle (struct curl_handle *ch)
+{
+  pthread_mutex_lock (&pool_lock);
+  ch->in_use = false;
+  pthread_cond_signal (&pool_cond);
+  pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+free_pool (void)
+{
+  size_t i;
+
+  for (i = 0; i < pool_size; ++i)
+    free_handle (pool[i]);
+  free (pool);
+  pool = NULL;
+  pool_size = 0;
+}
+
+/* Called with worker_lock held. */
+static void
+wake_worker (void)
+{
+  char c = 0;
+
+  if (write (wakeup_fd[1], &c, 1) == -1 && errno != EAGAIN)
+    nbdkit_debug ("curl: write: wakeup pipe: %m");
+}
+
+static void *
+worker (void *arg)
+{
+  struct curl_handle *ch, *queue;
+  struct curl_waitfd extra_fd = { .fd = wakeup_fd[0], .events = CURL_WAIT_POLLIN };
+  struct CURLMsg *msg;
+  CURLMcode mc;
+  int running, nr_msgs;
+  char buf[64];
+
+  for (;;) {
+    pthread_mutex_lock (&worker_lock);
+    if (worker_quit) {
+      pthread_mutex_unlock (&worker_lock);
+      break;
+    }
+    queue = queue_head;
+    queue_head = queue_tail = NULL;
+    pthread_mutex_unlock (&worker_lock);
+
+    while (queue) {
+      ch = queue;
+      queue = ch->next;
+      ch->next = NULL;
+      mc = curl_multi_add_handle (multi, ch->c);
+      if (mc != CURLM_OK) {
+        nbdkit_debug ("curl_multi_add_handle: %s", curl_multi_strerror (mc));
+        pthread_mutex_lock (&worker_lock);
+        ch->r = CURLE_OUT_OF_MEMORY;
+        ch->done = true;
+        pthread_cond_signal (&ch->cond);
+        pthread_mutex_unlock (&worker_lock);
+      }
+    }
+
+    mc = curl_multi_perform (multi, &running);
+    if (mc != CURLM_OK)
+      nbdkit_debug ("curl_multi_perform: %s", curl_multi_strerror (mc));
+
+    while ((msg = curl_multi_info_read (multi, &nr_msgs)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &ch);
+      curl_multi_remove_handle (multi, ch->c);
+      pthread_mutex_lock (&worker_lock);
+      ch->r = msg->data.result;
+      ch->done = true;
+      pthread_cond_signal (&ch->cond);
+      pthread_mutex_unlock (&worker_lock);
+    }
+
+    mc = curl_multi_wait (multi, &extra_fd, 1, 1000, NULL);
+    if (mc != CURLM_OK)
+      nbdkit_debug ("curl_multi_wait: %s", curl_multi_strerror (mc));
+    if (extra_fd.revents & CURL_WAIT_POLLIN) {
+      while (read (wakeup_fd[0], buf, sizeof buf) > 0)
+        ;
+      extra_fd.revents = 0;
+    }
+  }
+
+  return NULL;
+}
+
+/* nbdkit forks after .config_complete when it goes into the
+ * background, so the worker thread is started by the first .open.
+ */
+static void
+start_worker (void)
+{
+  int err, i;
+
+  multi = curl_multi_init ();
+  if (multi == NULL) {
+    nbdkit_error ("curl_multi_init: failed");
+    return;
+  }
+#if CURL_AT_LEAST_VERSION(7, 43, 0)
+  curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+#if CURL_AT_LEAST_VERSION(7, 30, 0)
+  curl_multi_setopt (multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) connections);
+#endif
+
+  if (pipe (wakeup_fd) == -1) {
+    nbdkit_error ("pipe: %m");
+    goto err;
+  }
+  for (i = 0; i < 2; ++i) {
+    if (fcntl (wakeup_fd[i], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl (wakeup_fd[i], F_SETFD, FD_CLOEXEC) == -1) {
+      nbdkit_error ("fcntl: %m");
+      goto err;
+    }
+  }
+
+  err = pthread_create (&worker_thread, NULL, worker, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    goto err;
+  }
+  worker_running = true;
+  return;
+
+ err:
+  for (i = 0; i < 2; ++i) {
+    if (wakeup_fd[i] >= 0)
+      close (wakeup_fd[i]);
+    wakeup_fd[i] = -1;
+  }
+  curl_multi_cleanup (multi);
+  multi = NULL;
+}
+
+static void
+stop_worker (void)
+{
+  if (worker_running) {
+    pthread_mutex_lock (&worker_lock);
+    worker_quit = true;
+    wake_worker ();
+    pthread_mutex_unlock (&worker_lock);
+    pthread_join (worker_thread, NULL);
+    close (wakeup_fd[0]);
+    close (wakeup_fd[1]);
+    worker_running = false;
+  }
+  /* Handles must be removed from the multi handle before it is
+   * cleaned up.
+   */
+  free_pool ();
+  if (multi)
+    curl_multi_cleanup (multi);
+}
+
+/* Pass the handle to the worker thread and wait for the transfer to
+ * finish.
+ */
+static CURLcode
+run_handle (struct curl_handle *ch)
+{
+  CURLcode r;
+
+  pthread_mutex_lock (&worker_lock);
+  ch->done = false;
+  ch->next = NULL;
+  if (queue_tail)
+    queue_tail->next = ch;
+  else
+    queue_head = ch;
+  queue_tail = ch;
+  wake_worker ();
+  while (!ch->done)
+    pthread_cond_wait (&ch->cond, &worker_lock);
+  r = ch->r;
+  pthread_mutex_unlock (&worker_lock);
+
+  return r;
+}
+
+/* Create the per-connection handle. */
+static void *
+curl_open (int readonly)
+{
+  struct handle *h;
+  struct curl_handle *ch = NULL;
+  CURLcode r;
+#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+  curl_off_t o;
+#else
+  double d;
+#endif
+
+  pthread_once (&worker_once, start_worker);
+  if (!worker_running) {
+    nbdkit_error ("curl worker thread is not running");
+    return NULL;
+  }
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  ch = get_handle ();
+  if (ch == NULL)
+    goto err;
 
   /* Get the file size and also whether the remote HTTP server
    * supports byte ranges.
    */
-  h->accept_range = false;
-  curl_easy_setopt (h->c, CURLOPT_NOBODY, 1); /* No Body, not nobody! */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, header_cb);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, h);
-  r = curl_easy_perform (h->c);
+  ch->accept_range = false;
+  curl_easy_setopt (ch->c, CURLOPT_NOBODY, 1); /* No Body, not nobody! */
+  curl_easy_setopt (ch->c, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERDATA, ch);
+  r = run_handle (ch);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERDATA, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_NOBODY, 0);
   if (r != CURLE_OK) {
-    display_curl_error (h, r,
+    display_curl_error (ch, r,
                         "problem doing HEAD request to fetch size of URL [%s]",
                         url);
     goto err;
   }
 
 #ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
+  r = curl_easy_getinfo (ch->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
+    display_curl_error (ch, r, "could not get length of remote file [%s]", url);
     goto err;
   }
 
@@ -416,9 +769,9 @@ curl_open (int readonly)
 
   h->exportsize = o;
 #else
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+  r = curl_easy_getinfo (ch->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
+    display_curl_error (ch, r, "could not get length of remote file [%s]", url);
     goto err;
   }
 
@@ -434,7 +787,7 @@ curl_open (int readonly)
 
   if (strncasecmp (url, "http://", strlen ("http://")) == 0 ||
       strncasecmp (url, "https://", strlen ("https://")) == 0) {
-    if (!h->accept_range) {
+    if (!ch->accept_range) {
       nbdkit_error ("server does not support 'range' (byte range) requests");
       goto err;
     }
@@ -442,23 +795,15 @@ curl_open (int readonly)
     nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
   }
 
-  /* Get set up for reading and writing. */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, NULL);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, NULL);
-  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
-  if (!readonly) {
-    curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
-    curl_easy_setopt (h->c, CURLOPT_READDATA, h);
-  }
+  put_handle (ch);
 
   nbdkit_debug ("returning new handle %p", h);
 
   return h;
 
  err:
-  if (h->c)
-    curl_easy_cleanup (h->c);
+  if (ch)
+    put_handle (ch);
   free (h);
   return NULL;
 }
@@ -466,7 +811,7 @@ curl_open (int readonly)
 static size_t
 header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 {
-  struct curl_handle *h = opaque;
+  struct curl_handle *ch = opaque;
   size_t realsize = size * nmemb;
   size_t len;
   const char *accept_line = "Accept-Ranges: bytes";
@@ -474,7 +819,7 @@ header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 
   if (realsize >= strlen (accept_line) &&
       strncmp (line, accept_line, strlen (accept_line)) == 0)
-    h->accept_range = true;
+    ch->accept_range = true;
 
   /* Useful to print the server headers when debugging.  However we
    * must strip off trailing \r?\n from each line.
@@ -494,19 +839,18 @@ header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 static void
 curl_close (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *h = handle;
 
-  curl_easy_cleanup (h->c);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 curl_get_size (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *h = handle;
 
   return h->exportsize;
 }
@@ -515,27 +859,32 @@ curl_get_size (void *handle)
 static int
 curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *ch;
   CURLcode r;
   char range[128];
 
+  ch = get_handle ();
+  if (ch == NULL)
+    return -1;
+
   /* Tell the write_cb where we want the data to be written.  write_cb
    * will update this if the data comes in multiple sections.
    */
-  h->write_buf = buf;
-  h->write_count = count;
+  ch->write_buf = buf;
+  ch->write_count = count;
 
-  curl_easy_setopt (h->c, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt (ch->c, CURLOPT_HTTPGET, 1);
 
   /* Make an HTTP range request. */
   snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
             offset, offset + count);
-  curl_easy_setopt (h->c, CURLOPT_RANGE, range);
+  curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = run_handle (ch);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "pread: curl_easy_perform");
+    display_curl_error (ch, r, "pread: curl_multi_perform");
+    put_handle (ch);
     return -1;
   }
 
@@ -544,30 +893,31 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
    */
 
   /* As far as I understand the cURL API, this should never happen. */
-  assert (h->write_count == 0);
+  assert (ch->write_count == 0);
 
+  put_handle (ch);
   return 0;
 }
 
 static size_t
 write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 {
-  struct curl_handle *h = opaque;
+  struct curl_handle *ch = opaque;
   size_t orig_realsize = size * nmemb;
   size_t realsize = orig_realsize;
 
-  assert (h->write_buf);
+  assert (ch->write_buf);
 
   /* Don't read more than the requested amount of data, even if the
    * server or libcurl sends more.
    */
-  if (realsize > h->write_count)
-    realsize = h->write_count;
+  if (realsize > ch->write_count)
+    realsize = ch->write_count;
 
-  memcpy (h->write_buf, ptr, realsize);
+  memcpy (ch->write_buf, ptr, realsize);
 
-  h->write_count -= realsize;
-  h->write_buf += realsize;
+  ch->write_count -= realsize;
+  ch->write_buf += realsize;
 
   return orig_realsize;
 }
@@ -576,27 +926,32 @@ write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 static int
 curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *ch;
   CURLcode r;
   char range[128];
 
+  ch = get_handle ();
+  if (ch == NULL)
+    return -1;
+
   /* Tell the read_cb where we want the data to be read from.  read_cb
    * will update this if the data comes in multiple sections.
    */
-  h->read_buf = buf;
-  h->read_count = count;
+  ch->read_buf = buf;
+  ch->read_count = count;
 
-  curl_easy_setopt (h->c, CURLOPT_UPLOAD, 1);
+  curl_easy_setopt (ch->c, CURLOPT_UPLOAD, 1);
 
   /* Make an HTTP range request. */
   snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
             offset, offset + count);
-  curl_easy_setopt (h->c, CURLOPT_RANGE, range);
+  curl_easy_setopt (ch->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = run_handle (ch);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "pwrite: curl_easy_perform");
+    display_curl_error (ch, r, "pwrite: curl_multi_perform");
+    put_handle (ch);
     return -1;
   }
 
@@ -605,25 +960,26 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
    */
 
   /* As far as I understand the cURL API, this should never happen. */
-  assert (h->read_count == 0);
+  assert (ch->read_count == 0);
 
+  put_handle (ch);
   return 0;
 }
 
 static size_t
 read_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 {
-  struct curl_handle *h = opaque;
+  struct curl_handle *ch = opaque;
   size_t realsize = size * nmemb;
 
-  assert (h->read_buf);
-  if (realsize > h->read_count)
-    realsize = h->read_count;
+  assert (ch->read_buf);
+  if (realsize > ch->read_count)
+    realsize = ch->read_count;
 
-  memcpy (ptr, h->read_buf, realsize);
+  memcpy (ptr, ch->read_buf, realsize);
 
-  h->read_count -= realsize;
-  h->read_buf += realsize;
+  ch->read_count -= realsize;
+  ch->read_buf += realsize;
 
   return realsize;
 }
@@ -43,6 +43,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <dirent.h>
 
 #include <pthread.h>
 
@@ -66,6 +67,7 @@
 #endif
 
 static char *filename = NULL;
+static char *directory = NULL;
 
 /* Any callbacks using lseek must be protected by this lock. */
 static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -83,10 +85,11 @@ static void
 file_unload (void)
 {
   free (filename);
+  free (directory);
 }
 
 /* Called for each key=value passed on the command line.  This plugin
- * only accepts file=<filename>, which is required.
+ * accepts file=<filename> or dir=<dirname>, one of which is required.
  */
 static int
 file_config (const char *key, const char *value)
@@ -98,6 +101,12 @@ file_config (const char *key, const char *value)
     if (!filename)
       return -1;
   }
+  else if (strcmp (key, "dir") == 0) {
+    free (directory);
+    directory = nbdkit_realpath (value);
+    if (!directory)
+      return -1;
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -111,13 +120,18 @@ file_config (const char *key, const char *value)
   return 0;
 }
 
-/* Check the user did pass a file=<FILENAME> parameter. */
+/* Check the user passed exactly one of file=<FILENAME> or dir=<DIRNAME>. */
 static int
 file_config_complete (void)
 {
-  if (filename == NULL) {
-    nbdkit_error ("you must supply the file=<FILENAME> parameter "
-                  "after the plugin name on the command line");
+  if (filename == NULL && directory == NULL) {
+    nbdkit_error ("you must supply either the file=<FILENAME> or "
+                  "dir=<DIRNAME> parameter after the plugin name "
+                  "on the command line");
+    return -1;
+  }
+  if (filename != NULL && directory != NULL) {
+    nbdkit_error ("file= and dir= cannot be used at the same time");
     return -1;
   }
 
@@ -125,7 +139,43 @@ file_config_complete (void)
 }
 
 #define file_config_help \
-  "file=<FILENAME>     (required) The filename to serve." \
+  "file=<FILENAME>     The filename to serve.\n" \
+  "dir=<DIRNAME>       Serve the files in this directory by export name." \
+
+/* With dir=, list the regular files and block devices in the
+ * directory.  With file=, leave the list empty so that nbdkit
+ * advertises the -e name.
+ */
+static int
+file_list_exports (int readonly, struct nbdkit_exports *exports)
+{
+  DIR *dir;
+  struct dirent *d;
+  struct stat statbuf;
+  int r = 0;
+
+  if (directory == NULL)
+    return 0;
+
+  dir = opendir (directory);
+  if (dir == NULL) {
+    nbdkit_error ("opendir: %s: %m", directory);
+    return -1;
+  }
+  errno = 0;
+  while (r == 0 && (d = readdir (dir)) != NULL) {
+    if (fstatat (dirfd (dir), d->d_name, &statbuf, 0) == 0 &&
+        (S_ISREG (statbuf.st_mode) || S_ISBLK (statbuf.st_mode)))
+      r = nbdkit_add_export (exports, d->d_name, NULL);
+    errno = 0;
+  }
+  if (r == 0 && errno != 0) {
+    nbdkit_error ("readdir: %s: %m", directory);
+    r = -1;
+  }
+  closedir (dir);
+  return r;
+}
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -163,6 +213,26 @@ file_open (int readonly)
   struct handle *h;
   struct stat statbuf;
   int flags;
+  CLEANUP_FREE char *path = NULL;
+  const char *file = filename;
+
+  /* With dir=, the export name selects a file in the directory. */
+  if (directory) {
+    const char *name = nbdkit_export_name ();
+
+    if (name == NULL)
+      return NULL;
+    if (strcmp (name, "") == 0 || strcmp (name, ".") == 0 ||
+        strcmp (name, "..") == 0 || strchr (name, '/') != NULL) {
+      nbdkit_error ("invalid export name for dir=%s: '%s'", directory, name);
+      return NULL;
+    }
+    if (asprintf (&path, "%s/%s", directory, name) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return NULL;
+    }
+    file = path;
+  }
 
   h = malloc (sizeof *h);
   if (h == NULL) {
@@ -176,15 +246,23 @@ file_open (int readonly)
   else
     flags |= O_RDWR;
 
-  h->fd = open (filename, flags);
+  h->fd = open (file, flags);
   if (h->fd == -1) {
-    nbdkit_error ("open: %s: %m", filename);
+    nbdkit_error ("open: %s: %m", file);
     free (h);
     return NULL;
   }
 
   if (fstat (h->fd, &statbuf) == -1) {
-    nbdkit_error ("fstat: %s: %m", filename);
+    nbdkit_error ("fstat: %s: %m", file);
+    free (h);
+    return NULL;
+  }
+
+  if (directory &&
+      !S_ISREG (statbuf.st_mode) && !S_ISBLK (statbuf.st_mode)) {
+    nbdkit_error ("%s: not a regular file or block device", file);
+    close (h->fd);
     free (h);
     return NULL;
   }
@@ -195,7 +273,7 @@ file_open (int readonly)
 #ifdef BLKSSZGET
   if (h->is_block_device) {
     if (ioctl (h->fd, BLKSSZGET, &h->sector_size))
-      nbdkit_debug ("cannot get sector size: %s: %m", filename);
+      nbdkit_debug ("cannot get sector size: %s: %m", file);
   }
 #endif
 
@@ -653,6 +731,7 @@ static struct nbdkit_plugin plugin = {
   .config_help       = file_config_help,
   .magic_config_key  = "file",
   .dump_plugin       = file_dump_plugin,
+  .list_exports      = file_list_exports,
   .open              = file_open,
   .close             = file_close,
   .get_size          = file_get_size,
@@ -65,14 +65,24 @@ struct transaction {
   nbd_completion_callback cb;
 };
 
-/* The per-connection handle */
-struct handle {
+/* A single connection to the server */
+struct upstream {
   /* These fields are read-only once initialized */
   struct nbd_handle *nbd;
   int fd; /* Cache of nbd_aio_get_fd */
   int fds[2]; /* Pipe for kicking the reader thread */
-  bool readonly;
   pthread_t reader;
+
+  /* Number of commands in flight on this connection */
+  unsigned in_flight;
+};
+
+/* The per-connection handle */
+struct handle {
+  /* These fields are read-only once initialized */
+  bool readonly;
+  size_t nr_upstreams;
+  struct upstream *upstreams[];
 };
 
 /* Connect to server via absolute name of Unix socket */
@@ -91,6 +101,9 @@ static const char *export;
 /* Number of retries */
 static unsigned retry;
 
+/* Number of server connections per handle, if the server allows it */
+static unsigned connections = 1;
+
 /* True to share single server connection among all clients */
 static bool shared;
 static struct handle *shared_handle;
@@ -118,8 +131,8 @@ nbdplug_unload (void)
 /* Called for each key=value passed on the command line.  This plugin
  * accepts socket=<sockname>, hostname=<hostname>/port=<port>, or
  * [uri=]<uri> (exactly one connection required), and optional
- * parameters export=<name>, retry=<n>, shared=<bool> and various
- * tls settings.
+ * parameters export=<name>, retry=<n>, connections=<n>, shared=<bool>
+ * and various tls settings.
  */
 static int
 nbdplug_config (const char *key, const char *value)
@@ -145,6 +158,14 @@ nbdplug_config (const char *key, const char *value)
     if (nbdkit_parse_unsigned ("retry", value, &retry) == -1)
       return -1;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
   else if (strcmp (key, "shared") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -274,6 +295,8 @@ nbdplug_config_complete (void)
   "port=<PORT>            TCP port or service name to use (default 10809).\n" \
   "export=<NAME>          Export name to connect to (default \"\").\n" \
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
+  "connections=<N>        Open N connections to a multi-conn server\n" \
+  "                       per handle (default 1).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
@@ -301,9 +324,9 @@ nbdplug_dump_plugin (void)
 
 /* Reader loop. */
 void *
-nbdplug_reader (void *handle)
+nbdplug_reader (void *upstream)
 {
-  struct handle *h = handle;
+  struct upstream *h = upstream;
 
   while (!nbd_aio_is_dead (h->nbd) && !nbd_aio_is_closed (h->nbd)) {
     struct pollfd fds[2] = {
@@ -377,9 +400,30 @@ nbdplug_prepare (struct transaction *trans)
   trans->cb.user_data = trans;
 }
 
+/* Choose the connection with the fewest commands in flight. */
+static struct upstream *
+nbdplug_select (struct handle *h)
+{
+  struct upstream *u = h->upstreams[0];
+  unsigned best = __atomic_load_n (&u->in_flight, __ATOMIC_RELAXED);
+  size_t i;
+
+  for (i = 1; i < h->nr_upstreams && best > 0; ++i) {
+    unsigned n = __atomic_load_n (&h->upstreams[i]->in_flight,
+                                  __ATOMIC_RELAXED);
+    if (n < best) {
+      u = h->upstreams[i];
+      best = n;
+    }
+  }
+  __atomic_add_fetch (&u->in_flight, 1, __ATOMIC_RELAXED);
+  return u;
+}
+
 /* Register a cookie and kick the I/O thread. */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_register (struct upstream *h, struct transaction *trans,
+                  int64_t cookie)
 {
   char c = 0;
 
@@ -398,7 +442,7 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
 
 /* Perform the reply half of a transaction. */
 static int
-nbdplug_reply (struct handle *h, struct transaction *trans)
+nbdplug_reply (struct upstream *h, struct transaction *trans)
 {
   int err;
 
@@ -416,15 +460,16 @@ nbdplug_reply (struct handle *h, struct transaction *trans)
   }
   if (sem_destroy (&trans->sem))
     abort ();
+  __atomic_sub_fetch (&h->in_flight, 1, __ATOMIC_RELAXED);
   errno = err;
   return err ? -1 : 0;
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly)
+/* Open one connection to the server. */
+static struct upstream *
+nbdplug_open_upstream (void)
 {
-  struct handle *h;
+  struct upstream *h;
   int r;
   unsigned long retries = retry;
 
@@ -499,9 +544,6 @@ nbdplug_open_handle (int readonly)
   if (h->fd == -1)
     goto err;
 
-  if (readonly)
-    h->readonly = true;
-
   /* Spawn a dedicated reader thread */
   if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
     nbdkit_error ("failed to initialize reader thread: %m");
@@ -520,6 +562,64 @@ nbdplug_open_handle (int readonly)
   return NULL;
 }
 
+static void nbdplug_close_upstream (struct upstream *h);
+
+/* Create the shared or per-connection handle.  Extra connections are
+ * only opened if the server advertises multi-conn, which guarantees
+ * that all connections see a consistent view of the data, and that a
+ * flush on any connection persists writes completed on every
+ * connection.
+ */
+static struct handle *
+nbdplug_open_handle (int readonly)
+{
+  struct handle *h;
+  size_t i;
+  int r;
+
+  h = calloc (1, sizeof *h + connections * sizeof h->upstreams[0]);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  h->readonly = readonly;
+
+  h->upstreams[0] = nbdplug_open_upstream ();
+  if (h->upstreams[0] == NULL) {
+    free (h);
+    return NULL;
+  }
+  h->nr_upstreams = 1;
+
+  if (connections > 1) {
+    r = nbd_can_multi_conn (h->upstreams[0]->nbd);
+    if (r == -1) {
+      nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
+      goto err;
+    }
+    if (r == 0)
+      nbdkit_debug ("server does not support multi-conn, "
+                    "using a single connection");
+    else {
+      for (i = 1; i < connections; ++i) {
+        h->upstreams[i] = nbdplug_open_upstream ();
+        if (h->upstreams[i] == NULL)
+          goto err;
+        h->nr_upstreams++;
+      }
+      nbdkit_debug ("opened %zu connections to server", h->nr_upstreams);
+    }
+  }
+
+  return h;
+
+ err:
+  for (i = 0; i < h->nr_upstreams; ++i)
+    nbdplug_close_upstream (h->upstreams[i]);
+  free (h);
+  return NULL;
+}
+
 /* Create the per-connection handle. */
 static void *
 nbdplug_open (int readonly)
@@ -529,9 +629,9 @@ nbdplug_open (int readonly)
   return nbdplug_open_handle (readonly);
 }
 
-/* Free up the shared or per-connection handle. */
+/* Close one connection to the server. */
 static void
-nbdplug_close_handle (struct handle *h)
+nbdplug_close_upstream (struct upstream *h)
 {
   if (nbd_shutdown (h->nbd, 0) == -1)
     nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
@@ -543,6 +643,17 @@ nbdplug_close_handle (struct handle *h)
   free (h);
 }
 
+/* Free up the shared or per-connection handle. */
+static void
+nbdplug_close_handle (struct handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_upstreams; ++i)
+    nbdplug_close_upstream (h->upstreams[i]);
+  free (h);
+}
+
 /* Free up the per-connection handle. */
 static void
 nbdplug_close (void *handle)
@@ -558,7 +669,7 @@ static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = nbd_get_size (h->upstreams[0]->nbd);
 
   if (size == -1) {
     nbdkit_error ("failure to get size: %s", nbd_get_error ());
@@ -571,7 +682,7 @@ static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int i = nbd_is_read_only (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
@@ -584,7 +695,7 @@ static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int i = nbd_can_flush (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
@@ -597,7 +708,7 @@ static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int i = nbd_is_rotational (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check rotational flag: %s", nbd_get_error ());
@@ -610,7 +721,7 @@ static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int i = nbd_can_trim (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
@@ -623,7 +734,7 @@ static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int i = nbd_can_zero (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
@@ -637,7 +748,7 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int i = nbd_can_fast_zero (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fast zero flag: %s", nbd_get_error ());
@@ -654,7 +765,7 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int i = nbd_can_fua (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
@@ -667,7 +778,7 @@ static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int i = nbd_can_multi_conn (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
@@ -680,7 +791,7 @@ static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int i = nbd_can_cache (h->upstreams[0]->nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
@@ -693,7 +804,8 @@ static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  int i = nbd_can_meta_context (h->upstreams[0]->nbd,
+                                LIBNBD_CONTEXT_BASE_ALLOCATION);
 
   if (i == -1) {
     nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
@@ -709,12 +821,14 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
 
   assert (!flags);
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (u, &s, nbd_aio_pread (u->nbd, buf, count, offset,
                                           s.cb, 0));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Write data to the file. */
@@ -724,13 +838,15 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (u, &s, nbd_aio_pwrite (u->nbd, buf, count, offset,
                                            s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Write zeroes to the file. */
@@ -739,6 +855,7 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
   uint32_t f = 0;
 
   assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
@@ -754,9 +871,10 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #else
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_zero (u->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (u, &s);
 }
 
 /* Trim a portion of the file. */
@@ -765,12 +883,14 @@ nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_trim (u->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (u, &s);
 }
 
 /* Flush the file to disk. */
@@ -779,11 +899,13 @@ nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
 
   assert (!flags);
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_flush (u->nbd, s.cb, 0));
+  return nbdplug_reply (u, &s);
 }
 
 static int
@@ -814,14 +936,16 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (u, &s, nbd_aio_block_status (u->nbd, count, offset,
                                                  extcb, s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (u, &s);
 }
 
 /* Cache a portion of the file. */
@@ -830,11 +954,13 @@ nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
   struct transaction s;
+  struct upstream *u;
 
   assert (!flags);
+  u = nbdplug_select (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (u, &s, nbd_aio_cache (u->nbd, count, offset, s.cb, 0));
+  return nbdplug_reply (u, &s);
 }
 
 static struct nbdkit_plugin plugin = {
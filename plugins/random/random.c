@@ -126,31 +126,18 @@ static int
 random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
               uint32_t flags)
 {
-  uint32_t i;
-  unsigned char *b = buf;
-  uint64_t s;
-
-  for (i = 0; i < count; ++i) {
-    /* We use nbdkit common/include/random.h to make random numbers.
-     *
-     * However we're not quite using it in the ordinary way.  In order
-     * to be able to read any byte of data without needing to run the
-     * PRNG from the start, the random data is computed from the index
-     * and seed through three rounds of PRNG:
-     *
-     * index i     PRNG(seed+i)   -> PRNG -> PRNG -> mod 256 -> b[i]
-     * index i+1   PRNG(seed+i+1) -> PRNG -> PRNG -> mod 256 -> b[i+1]
-     * etc
-     */
-    struct random_state state;
-
-    xsrandom (seed + offset + i, &state);
-    xrandom (&state);
-    xrandom (&state);
-    s = xrandom (&state);
-    s &= 255;
-    b[i] = s;
-  }
+  /* We use nbdkit common/include/random.h to make random numbers.
+   *
+   * In order to be able to read any byte of data without needing to
+   * run the PRNG from the start, the disk is the stream of counter
+   * based random words xrandom_at (key, 0), xrandom_at (key, 1), ...
+   * where the key is derived from the seed.  Each 8 byte word is
+   * computed directly from its index.
+   */
+  uint64_t key = seed;
+
+  key = snext (&key);
+  xrandom_fill (key, buf, count, offset);
   return 0;
 }
 
@@ -43,43 +43,77 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 
-/* The files. */
-static char **filenames = NULL;
+/* A range of allocated data in a file, used by the extent map. */
+struct data_range {
+  uint64_t offset, length;
+};
+
+struct file {
+  char *filename;
+  uint64_t offset, size;
+  int fd;                       /* Shared by all connections. */
+  bool writable;
+  bool can_extents;
+
+  /* Cached list of allocated ranges in this file, built on the first
+   * extents request and dropped by writes which may allocate.
+   */
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  bool map_valid;
+  uint64_t generation;          /* Incremented when map is invalidated. */
+  struct data_range *map;
+  size_t nr_map;
+};
+
+/* The files, sorted by offset. */
+static struct file *files = NULL;
 static size_t nr_files = 0;
 
-/* Any callbacks using lseek must be protected by this lock. */
-static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Total concatenated size. */
+static uint64_t size;
 
 static void
 split_unload (void)
 {
   size_t i;
 
-  for (i = 0; i < nr_files; ++i)
-    free (filenames[i]);
-  free (filenames);
+  for (i = 0; i < nr_files; ++i) {
+    if (files[i].fd >= 0)
+      close (files[i].fd);
+    free (files[i].filename);
+    free (files[i].map);
+    pthread_mutex_destroy (&files[i].lock);
+  }
+  free (files);
 }
 
 static int
 split_config (const char *key, const char *value)
 {
-  char **new_filenames;
+  struct file *new_files;
 
   if (strcmp (key, "file") == 0) {
-    new_filenames = realloc (filenames, (nr_files+1) * sizeof (char *));
-    if (new_filenames == NULL) {
+    new_files = realloc (files, (nr_files+1) * sizeof (struct file));
+    if (new_files == NULL) {
       nbdkit_error ("malloc: %m");
       return -1;
     }
-    filenames = new_filenames;
-    filenames[nr_files] = nbdkit_realpath (value);
-    if (filenames[nr_files] == NULL)
+    files = new_files;
+    memset (&files[nr_files], 0, sizeof (struct file));
+    files[nr_files].fd = -1;
+    pthread_mutex_init (&files[nr_files].lock, NULL);
+    files[nr_files].filename = nbdkit_realpath (value);
+    if (files[nr_files].filename == NULL) {
+      pthread_mutex_destroy (&files[nr_files].lock);
       return -1;
+    }
     nr_files++;
   }
   else {
@@ -90,127 +124,102 @@ split_config (const char *key, const char *value)
   return 0;
 }
 
-#define split_config_help \
-  "file=<FILENAME>  (required) File(s) to serve."
-
-/* The per-connection handle. */
-struct handle {
-  struct file *files;
-  uint64_t size;                /* Total concatenated size. */
-};
-
-struct file {
-  uint64_t offset, size;
-  int fd;
-  bool can_extents;
-};
-
-/* Create the per-connection handle. */
-static void *
-split_open (int readonly)
+/* Open the files once, to be shared by all connections.  We don't
+ * know yet if clients will be allowed to write, so fall back to
+ * opening read-only and check in split_open.
+ */
+static int
+split_config_complete (void)
 {
-  struct handle *h;
-  int flags;
   size_t i;
   uint64_t offset;
   struct stat statbuf;
   off_t r;
 
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
-
-  h->files = malloc (nr_files * sizeof (struct file));
-  if (h->files == NULL) {
-    nbdkit_error ("malloc: %m");
-    free (h);
-    return NULL;
+  if (nr_files == 0) {
+    nbdkit_error ("you must supply at least one file=<FILENAME> parameter");
+    return -1;
   }
-  for (i = 0; i < nr_files; ++i)
-    h->files[i].fd = -1;
-
-  /* Open the files. */
-  flags = O_CLOEXEC|O_NOCTTY;
-  if (readonly)
-    flags |= O_RDONLY;
-  else
-    flags |= O_RDWR;
 
+  offset = 0;
   for (i = 0; i < nr_files; ++i) {
-    h->files[i].fd = open (filenames[i], flags);
-    if (h->files[i].fd == -1) {
-      nbdkit_error ("open: %s: %m", filenames[i]);
-      goto err;
+    struct file *file = &files[i];
+
+    file->fd = open (file->filename, O_RDWR|O_CLOEXEC|O_NOCTTY);
+    if (file->fd >= 0)
+      file->writable = true;
+    else if (errno == EACCES || errno == EPERM || errno == EROFS)
+      file->fd = open (file->filename, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+    if (file->fd == -1) {
+      nbdkit_error ("open: %s: %m", file->filename);
+      return -1;
     }
-  }
 
-  offset = 0;
-  for (i = 0; i < nr_files; ++i) {
-    h->files[i].offset = offset;
+    file->offset = offset;
 
-    if (fstat (h->files[i].fd, &statbuf) == -1) {
-      nbdkit_error ("stat: %s: %m", filenames[i]);
-      goto err;
+    if (fstat (file->fd, &statbuf) == -1) {
+      nbdkit_error ("stat: %s: %m", file->filename);
+      return -1;
     }
-    h->files[i].size = statbuf.st_size;
+    file->size = statbuf.st_size;
     offset += statbuf.st_size;
 
     nbdkit_debug ("file[%zu]=%s: offset=%" PRIu64 ", size=%" PRIu64,
-                  i, filenames[i], h->files[i].offset, h->files[i].size);
+                  i, file->filename, file->offset, file->size);
 
 #ifdef SEEK_HOLE
     /* Test if this file supports extents. */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-    r = lseek (h->files[i].fd, 0, SEEK_DATA);
+    r = lseek (file->fd, 0, SEEK_DATA);
     if (r == -1 && errno != ENXIO) {
-      nbdkit_debug ("disabling extents: lseek on %s: %m", filenames[i]);
-      h->files[i].can_extents = false;
+      nbdkit_debug ("disabling extents: lseek on %s: %m", file->filename);
+      file->can_extents = false;
     }
     else
-      h->files[i].can_extents = true;
+      file->can_extents = true;
 #else
-    h->files[i].can_extents = false;
+    file->can_extents = false;
 #endif
   }
-  h->size = offset;
-  nbdkit_debug ("total size=%" PRIu64, h->size);
-
-  return h;
+  size = offset;
+  nbdkit_debug ("total size=%" PRIu64, size);
 
- err:
-  for (i = 0; i < nr_files; ++i) {
-    if (h->files[i].fd >= 0)
-      close (h->files[i].fd);
-  }
-  free (h->files);
-  free (h);
-  return NULL;
+  return 0;
 }
 
-/* Free up the per-connection handle. */
-static void
-split_close (void *handle)
+#define split_config_help \
+  "file=<FILENAME>  (required) File(s) to serve."
+
+/* The file descriptors are shared by all connections.  Only pread,
+ * pwrite and lseek(SEEK_DATA/SEEK_HOLE) are used on them, and none of
+ * those depend on the shared file position, so requests can run in
+ * parallel without locking.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Create the per-connection handle. */
+static void *
+split_open (int readonly)
 {
-  struct handle *h = handle;
   size_t i;
 
-  for (i = 0; i < nr_files; ++i)
-    close (h->files[i].fd);
-  free (h->files);
-  free (h);
-}
+  if (!readonly) {
+    for (i = 0; i < nr_files; ++i) {
+      if (!files[i].writable) {
+        nbdkit_error ("%s: file is not writable, use nbdkit -r",
+                      files[i].filename);
+        return NULL;
+      }
+    }
+  }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
 
 /* Get the disk size. */
 static int64_t
 split_get_size (void *handle)
 {
-  struct handle *h = handle;
-
-  return (int64_t) h->size;
+  return (int64_t) size;
 }
 
 static int
@@ -240,9 +249,9 @@ compare_offset (const void *offsetp, const void *filep)
 }
 
 static struct file *
-get_file (struct handle *h, uint64_t offset)
+get_file (uint64_t offset)
 {
-  return bsearch (&offset, h->files,
+  return bsearch (&offset, files,
                   nr_files, sizeof (struct file),
                   compare_offset);
 }
@@ -251,10 +260,29 @@ get_file (struct handle *h, uint64_t offset)
 static int
 split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
-  struct handle *h = handle;
+#if HAVE_POSIX_FADVISE
+  struct file *first = get_file (offset);
+
+  /* If the read spans several files, start readahead on the later
+   * parts so that they are fetched while we read the first part.
+   */
+  if (offset + count > first->offset + first->size) {
+    uint64_t o = first->offset + first->size;
+    uint64_t end = offset + count;
+
+    while (o < end) {
+      struct file *file = get_file (o);
+      uint64_t max = MIN (file->size, end - o);
+
+      /* Advisory, so errors are ignored. */
+      posix_fadvise (file->fd, 0, max, POSIX_FADV_WILLNEED);
+      o += max;
+    }
+  }
+#endif
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
+    struct file *file = get_file (offset);
     uint64_t foffs = offset - file->offset;
     uint64_t max;
     ssize_t r;
@@ -280,14 +308,64 @@ split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+/* Return the number of ranges in the map starting at or before
+ * offset, so the last such range (if any) is the one before the
+ * returned index.
+ */
+static size_t
+find_range (const struct data_range *map, size_t nr_map, uint64_t offset)
+{
+  size_t lo = 0, hi = nr_map;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (map[mid].offset <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Return true if [offset, offset+count) is entirely allocated
+ * according to the extent map.  Must be called with file->lock held.
+ */
+static bool
+is_allocated (struct file *file, uint64_t offset, uint64_t count)
+{
+  size_t i = find_range (file->map, file->nr_map, offset);
+
+  if (i == 0)
+    return false;
+  return offset + count <= file->map[i-1].offset + file->map[i-1].length;
+}
+
+/* Writes into holes allocate, so drop the extent map unless the
+ * write is entirely inside allocated data.
+ */
+static void
+invalidate_map (struct file *file, uint64_t offset, uint64_t count)
+{
+  if (!file->can_extents)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&file->lock);
+  if (file->map_valid && is_allocated (file, offset, count))
+    return;
+  file->generation++;
+  file->map_valid = false;
+  free (file->map);
+  file->map = NULL;
+  file->nr_map = 0;
+}
+
 /* Write data to the file. */
 static int
 split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct handle *h = handle;
-
   while (count > 0) {
-    struct file *file = get_file (h, offset);
+    struct file *file = get_file (offset);
     uint64_t foffs = offset - file->offset;
     uint64_t max;
     ssize_t r;
@@ -296,7 +374,8 @@ split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
     if (max > count)
       max = count;
 
-    r = pwrite (file->fd, buf, max, offset);
+    r = pwrite (file->fd, buf, max, foffs);
+    invalidate_map (file, foffs, max);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -314,11 +393,9 @@ split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 static int
 split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-  struct handle *h = handle;
-
   /* Cache is advisory, we don't care if this fails */
   while (count > 0) {
-    struct file *file = get_file (h, offset);
+    struct file *file = get_file (offset);
     uint64_t foffs = offset - file->offset;
     uint64_t max;
     int r;
@@ -327,14 +404,14 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
     if (max > count)
       max = count;
 
-    r = posix_fadvise (file->fd, offset, max, POSIX_FADV_WILLNEED);
+    r = posix_fadvise (file->fd, foffs, max, POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
       return -1;
     }
-    count -= r;
-    offset += r;
+    count -= max;
+    offset += max;
   }
 
   return 0;
@@ -342,64 +419,158 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #endif /* HAVE_POSIX_FADVISE */
 
 #ifdef SEEK_HOLE
-static int64_t
-do_extents (struct file *file, uint32_t count, uint64_t offset,
-            bool req_one, struct nbdkit_extents *extents)
+/* Build the list of allocated ranges in the whole file. */
+static int
+scan_file (struct file *file, struct data_range **map_ret, size_t *nr_ret)
 {
-  int64_t r = 0;
-  uint64_t end = offset + count;
+  struct data_range *map = NULL, *new_map;
+  size_t nr = 0, allocated = 0;
+  uint64_t offset = 0;
 
-  do {
-    off_t pos;
+  while (offset < file->size) {
+    off_t data, hole;
 
-    pos = lseek (file->fd, offset, SEEK_DATA);
-    if (pos == -1) {
+    data = lseek (file->fd, offset, SEEK_DATA);
+    if (data == -1) {
       if (errno == ENXIO) {
         /* The current man page does not describe this situation well,
          * but a proposed change to POSIX adds these words for ENXIO:
          * "or the whence argument is SEEK_DATA and the offset falls
          * within the final hole of the file."
          */
-        pos = end;
+        break;
       }
-      else {
-        nbdkit_error ("lseek: SEEK_DATA: %" PRIu64 ": %m", offset);
-        return -1;
+      nbdkit_error ("lseek: SEEK_DATA: %" PRIu64 ": %m", offset);
+      goto err;
+    }
+    if (data >= file->size)
+      break;
+
+    hole = lseek (file->fd, data, SEEK_HOLE);
+    if (hole == -1) {
+      nbdkit_error ("lseek: SEEK_HOLE: %" PRIu64 ": %m", (uint64_t) data);
+      goto err;
+    }
+    if (hole > file->size)
+      hole = file->size;
+
+    if (nr == allocated) {
+      allocated = allocated == 0 ? 16 : allocated * 2;
+      new_map = realloc (map, allocated * sizeof (struct data_range));
+      if (new_map == NULL) {
+        nbdkit_error ("realloc: %m");
+        goto err;
       }
+      map = new_map;
     }
+    map[nr].offset = data;
+    map[nr].length = hole - data;
+    nr++;
+
+    offset = hole;
+  }
+
+  nbdkit_debug ("%s: extent map has %zu data ranges", file->filename, nr);
+  *map_ret = map;
+  *nr_ret = nr;
+  return 0;
+
+ err:
+  free (map);
+  return -1;
+}
+
+/* Add the extents of [offset, offset+count) within the file from the
+ * map.
+ */
+static int
+add_extents (struct file *file,
+             const struct data_range *map, size_t nr_map,
+             uint64_t offset, uint64_t count,
+             bool req_one, struct nbdkit_extents *extents)
+{
+  const uint64_t end = offset + count;
+  size_t i;
+
+  /* Start from the last range starting at or before offset. */
+  i = find_range (map, nr_map, offset);
+  if (i > 0)
+    i--;
+
+  for (; i < nr_map && offset < end; ++i) {
+    uint64_t data = MAX (map[i].offset, offset);
+    uint64_t data_end = MIN (map[i].offset + map[i].length, end);
+
+    if (data_end <= offset)
+      continue;
 
-    /* We know there is a hole from offset to pos-1. */
-    if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset + file->offset, pos - offset,
+    /* We know there is a hole from offset to data-1. */
+    if (data > offset) {
+      if (nbdkit_add_extent (extents, file->offset + offset, data - offset,
                              NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
         return -1;
-      r += pos - offset;
       if (req_one)
-        break;
+        return 0;
     }
 
-    offset = pos;
-    if (offset >= end)
-      break;
-
-    pos = lseek (file->fd, offset, SEEK_HOLE);
-    if (pos == -1) {
-      nbdkit_error ("lseek: SEEK_HOLE: %" PRIu64 ": %m", offset);
-      return -1;
-    }
-
-    /* We know there is data from offset to pos-1. */
-    if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset + file->offset, pos - offset,
+    /* We know there is data from data to data_end-1. */
+    if (data_end > data) {
+      if (nbdkit_add_extent (extents, file->offset + data, data_end - data,
                              0 /* allocated data */) == -1)
         return -1;
-      r += pos - offset;
       if (req_one)
-        break;
+        return 0;
     }
 
-    offset = pos;
-  } while (offset < end);
+    offset = data_end;
+  }
+
+  /* Anything left over is a hole. */
+  if (offset < end &&
+      nbdkit_add_extent (extents, file->offset + offset, end - offset,
+                         NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+    return -1;
+
+  return 0;
+}
+
+static int
+do_extents (struct file *file, uint32_t count, uint64_t offset,
+            bool req_one, struct nbdkit_extents *extents)
+{
+  struct data_range *map;
+  size_t nr_map;
+  uint64_t generation;
+  int r;
+
+  pthread_mutex_lock (&file->lock);
+  if (file->map_valid) {
+    r = add_extents (file, file->map, file->nr_map, offset, count,
+                     req_one, extents);
+    pthread_mutex_unlock (&file->lock);
+    return r;
+  }
+  generation = file->generation;
+  pthread_mutex_unlock (&file->lock);
+
+  /* Scan without holding the lock so that other requests are not
+   * held up.
+   */
+  if (scan_file (file, &map, &nr_map) == -1)
+    return -1;
+
+  r = add_extents (file, map, nr_map, offset, count, req_one, extents);
+
+  /* Keep the map unless a write may have changed the file meanwhile. */
+  pthread_mutex_lock (&file->lock);
+  if (file->generation == generation && !file->map_valid) {
+    file->map = map;
+    file->nr_map = nr_map;
+    file->map_valid = true;
+    map = NULL;
+  }
+  pthread_mutex_unlock (&file->lock);
+  free (map);
 
   return r;
 }
@@ -408,23 +579,20 @@ static int
 split_extents (void *handle, uint32_t count, uint64_t offset,
                uint32_t flags, struct nbdkit_extents *extents)
 {
-  struct handle *h = handle;
   const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
+    struct file *file = get_file (offset);
     uint64_t foffs = offset - file->offset;
     uint64_t max;
-    int64_t r;
+    int r;
 
     max = file->size - foffs;
     if (max > count)
       max = count;
 
-    if (file->can_extents) {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-      max = r = do_extents (file, max, foffs, req_one, extents);
-    }
+    if (file->can_extents)
+      r = do_extents (file, max, foffs, req_one, extents);
     else
       r = nbdkit_add_extent (extents, offset, max, 0 /* allocated data */);
     if (r == -1)
@@ -444,10 +612,10 @@ static struct nbdkit_plugin plugin = {
   .version           = PACKAGE_VERSION,
   .unload            = split_unload,
   .config            = split_config,
+  .config_complete   = split_config_complete,
   .config_help       = split_config_help,
   .magic_config_key  = "file",
   .open              = split_open,
-  .close             = split_close,
   .get_size          = split_get_size,
   .can_cache         = split_can_cache,
   .pread             = split_pread,
@@ -42,6 +42,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
@@ -50,6 +51,7 @@
 #include <nbdkit-plugin.h>
 
 #include "minmax.h"
+#include "rounding.h"
 
 static const char *host = NULL;
 static const char *path = NULL;
@@ -62,6 +64,7 @@ static const char **identity = NULL;
 static size_t nr_identities = 0;
 static uint32_t timeout = 0;
 static bool compression = false;
+static unsigned connections = 4;
 
 /* config can be:
  * NULL => parse options from default file
@@ -165,6 +168,16 @@ ssh_config (const char *key, const char *value)
     }
 #endif
   }
+
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
   else if (strcmp (key, "compression") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -204,13 +217,29 @@ ssh_config_complete (void)
   "identity=<FILENAME>        Prepend private key (identity) file.\n" \
   "timeout=SECS               Set SSH connection timeout.\n" \
   "verify-remote-host=false   Ignore known_hosts.\n" \
-  "compression=true           Enable compression."
+  "compression=true           Enable compression.\n" \
+  "connections=<N>            Maximum SSH sessions per connection (default 4)."
 
-/* The per-connection handle. */
+/* A single SSH session with the remote file open. */
 struct ssh_handle {
   ssh_session session;
   sftp_session sftp;
   sftp_file file;
+  bool in_use;
+};
+
+/* The per-connection handle.  libssh sessions can only be used by
+ * one thread at a time, so each request takes a free session from
+ * this pool.  Sessions are opened on demand, up to connections=N.
+ */
+struct handle {
+  bool readonly;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t max_sessions;
+  size_t nr_sessions;
+  size_t opening;                /* Sessions being opened. */
+  struct ssh_handle *sessions[];
 };
 
 /* Verify the remote host.
@@ -339,9 +368,9 @@ authenticate (struct ssh_handle *h)
   return -1;
 }
 
-/* Create the per-connection handle. */
-static void *
-ssh_open (int readonly)
+/* Open a new SSH session and the remote file. */
+static struct ssh_handle *
+open_session (int readonly)
 {
   struct ssh_handle *h;
   const int set = 1;
@@ -502,7 +531,7 @@ ssh_open (int readonly)
     goto err;
   }
 
-  nbdkit_debug ("opened libssh handle");
+  nbdkit_debug ("opened libssh session");
 
   return h;
 
@@ -519,11 +548,9 @@ ssh_open (int readonly)
   return NULL;
 }
 
-/* Free up the per-connection handle. */
 static void
-ssh_close (void *handle)
+close_session (struct ssh_handle *h)
 {
-  struct ssh_handle *h = handle;
   int r;
 
   r = sftp_close (h->file);
@@ -536,41 +563,159 @@ ssh_close (void *handle)
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* Take a free session from the pool, opening a new session if all
+ * are busy and the limit has not been reached.
+ */
+static struct ssh_handle *
+get_session (struct handle *h)
+{
+  struct ssh_handle *s;
+  size_t i;
+
+  pthread_mutex_lock (&h->lock);
+  for (;;) {
+    for (i = 0; i < h->nr_sessions; ++i) {
+      s = h->sessions[i];
+      if (!s->in_use)
+        goto found;
+    }
+
+    if (h->nr_sessions + h->opening < h->max_sessions) {
+      /* Don't hold the lock while connecting to the server. */
+      h->opening++;
+      pthread_mutex_unlock (&h->lock);
+      s = open_session (h->readonly);
+      pthread_mutex_lock (&h->lock);
+      h->opening--;
+      if (s) {
+        h->sessions[h->nr_sessions++] = s;
+        goto found;
+      }
+      /* The server may limit the number of sessions per user, so
+       * make do with the sessions we have.
+       */
+      if (h->nr_sessions == 0) {
+        pthread_mutex_unlock (&h->lock);
+        return NULL;
+      }
+      h->max_sessions = h->nr_sessions;
+      nbdkit_debug ("limiting connection to %zu SSH sessions",
+                    h->max_sessions);
+      continue;
+    }
+
+    pthread_cond_wait (&h->cond, &h->lock);
+  }
+
+ found:
+  s->in_use = true;
+  pthread_mutex_unlock (&h->lock);
+  return s;
+}
+
+static void
+put_session (struct handle *h, struct ssh_handle *s)
+{
+  pthread_mutex_lock (&h->lock);
+  s->in_use = false;
+  pthread_cond_signal (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Create the per-connection handle. */
+static void *
+ssh_open (int readonly)
+{
+  struct handle *h;
+
+  h = calloc (1, sizeof *h + connections * sizeof h->sessions[0]);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  h->readonly = readonly;
+  h->max_sessions = connections;
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+
+  /* Open the first session now so that errors are reported to the
+   * client immediately.
+   */
+  h->sessions[0] = open_session (readonly);
+  if (h->sessions[0] == NULL) {
+    pthread_mutex_destroy (&h->lock);
+    pthread_cond_destroy (&h->cond);
+    free (h);
+    return NULL;
+  }
+  h->nr_sessions = 1;
+
+  return h;
+}
+
+/* Free up the per-connection handle. */
+static void
+ssh_close (void *handle)
+{
+  struct handle *h = handle;
+  size_t i;
+
+  for (i = 0; i < h->nr_sessions; ++i)
+    close_session (h->sessions[i]);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
+  free (h);
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 ssh_get_size (void *handle)
 {
-  struct ssh_handle *h = handle;
+  struct handle *h = handle;
+  struct ssh_handle *s;
   sftp_attributes attrs;
   int64_t r;
 
-  attrs = sftp_fstat (h->file);
+  s = get_session (h);
+  if (s == NULL)
+    return -1;
+  attrs = sftp_fstat (s->file);
   r = attrs->size;
   sftp_attributes_free (attrs);
+  put_session (h, s);
 
   return r;
 }
 
-/* Read data from the remote server. */
+/* Reads are split into chunks and up to MAX_READS chunks are
+ * requested from the server before waiting for the first reply, so a
+ * large read costs about one round trip instead of one per chunk.
+ */
+#define READ_CHUNK (64*1024)
+#define MAX_READS 32
+
+/* Synchronously read the part of a chunk that a short reply missed. */
 static int
-ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+read_remainder (struct ssh_handle *s, char *buf, uint32_t count,
+                uint64_t offset)
 {
-  struct ssh_handle *h = handle;
-  int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
-  if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
     return -1;
   }
 
   while (count > 0) {
-    rs = sftp_read (h->file, buf, count);
+    rs = sftp_read (s->file, buf, count);
     if (rs < 0) {
-      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (s->session), rs);
+      return -1;
+    }
+    if (rs == 0) {
+      nbdkit_error ("read failed: unexpected end of file");
       return -1;
     }
     buf += rs;
@@ -580,18 +725,99 @@ ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+/* Read data from the remote server. */
+static int
+ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  struct handle *h = handle;
+  struct ssh_handle *s;
+  const size_t nr_chunks = DIV_ROUND_UP (count, READ_CHUNK);
+  uint32_t ids[MAX_READS], lens[MAX_READS];
+  size_t issued = 0, done = 0, i;
+  uint64_t pos;
+  uint32_t len;
+  char *p;
+  int id, rs, r = -1;
+
+  s = get_session (h);
+  if (s == NULL)
+    return -1;
+
+  while (done < nr_chunks) {
+    /* Keep the pipeline full. */
+    while (issued < nr_chunks && issued - done < MAX_READS) {
+      pos = (uint64_t) issued * READ_CHUNK;
+      len = MIN (count - pos, READ_CHUNK);
+      /* sftp_async_read_begin reads from the current file offset, and
+       * short replies move the offset backwards, so always set it.
+       */
+      if (sftp_seek64 (s->file, offset + pos) != SSH_OK) {
+        nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+        goto out;
+      }
+      id = sftp_async_read_begin (s->file, len);
+      if (id < 0) {
+        nbdkit_error ("read failed: %s", ssh_get_error (s->session));
+        goto out;
+      }
+      ids[issued % MAX_READS] = id;
+      lens[issued % MAX_READS] = len;
+      issued++;
+    }
+
+    i = done % MAX_READS;
+    pos = (uint64_t) done * READ_CHUNK;
+    p = (char *) buf + pos;
+    done++;
+    do
+      rs = sftp_async_read (s->file, p, lens[i], ids[i]);
+    while (rs == SSH_AGAIN);
+    if (rs < 0) {
+      nbdkit_error ("read failed: %s (%d)", ssh_get_error (s->session), rs);
+      goto out;
+    }
+    if (rs == 0) {
+      nbdkit_error ("read failed: unexpected end of file");
+      goto out;
+    }
+    if ((uint32_t) rs < lens[i] &&
+        read_remainder (s, p + rs, lens[i] - rs, offset + pos + rs) == -1)
+      goto out;
+  }
+  r = 0;
+
+ out:
+  /* After an error, collect the replies still outstanding so that
+   * they are not left queued in the session.
+   */
+  while (done < issued) {
+    i = done % MAX_READS;
+    do
+      rs = sftp_async_read (s->file, (char *) buf + done * READ_CHUNK,
+                            lens[i], ids[i]);
+    while (rs == SSH_AGAIN);
+    done++;
+  }
+  put_session (h, s);
+  return r;
+}
+
 /* Write data to the remote server. */
 static int
 ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct ssh_handle *h = handle;
-  int r;
+  struct handle *h = handle;
+  struct ssh_handle *s;
+  int r = -1;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
-  if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+  s = get_session (h);
+  if (s == NULL)
     return -1;
+
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    goto out;
   }
 
   while (count > 0) {
@@ -602,44 +828,65 @@ ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
      * the request.  I don't know whether 256K is a limit that applies
      * to all servers.
      */
-    rs = sftp_write (h->file, buf, MIN (count, 128*1024));
+    rs = sftp_write (s->file, buf, MIN (count, 128*1024));
     if (rs < 0) {
-      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (h->session), rs);
-      return -1;
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (s->session), rs);
+      goto out;
     }
     buf += rs;
     count -= rs;
   }
+  r = 0;
 
-  return 0;
+ out:
+  put_session (h, s);
+  return r;
 }
 
 static int
 ssh_can_flush (void *handle)
 {
-  struct ssh_handle *h = handle;
+  struct handle *h = handle;
+  struct ssh_handle *s;
+  int r;
 
+  s = get_session (h);
+  if (s == NULL)
+    return -1;
   /* I added this extension to openssh 6.5 (April 2013).  It may not
    * be available in other SSH servers.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  r = sftp_extension_supported (s->sftp, "fsync@openssh.com", "1");
+  put_session (h, s);
+  return r;
 }
 
+/* Writes are synchronous, so every write that has completed on any
+ * session has reached the server, and fsync on one open handle
+ * flushes the whole file.
+ */
 static int
 ssh_flush (void *handle)
 {
-  struct ssh_handle *h = handle;
+  struct handle *h = handle;
+  struct ssh_handle *s;
   int r;
 
+  s = get_session (h);
+  if (s == NULL)
+    return -1;
+
  again:
-  r = sftp_fsync (h->file);
+  r = sftp_fsync (s->file);
   if (r == SSH_AGAIN)
     goto again;
   else if (r != SSH_OK) {
-    nbdkit_error ("fsync failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("fsync failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
     return -1;
   }
 
+  put_session (h, s);
   return 0;
 }
 
@@ -42,6 +42,7 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #define NBDKIT_API_VERSION 2
 
@@ -49,6 +50,7 @@
 
 #include "cleanup.h"
 #include "isaligned.h"
+#include "ispowerof2.h"
 #include "minmax.h"
 #include "rounding.h"
 
@@ -96,6 +98,8 @@ static bool unbuffered;                    /* unbuffered */
 static const char *username;               /* user */
 static const char *vmx_spec;               /* vm */
 static bool is_remote;
+static unsigned connections = 1;           /* connections */
+static int64_t extents_cache = 1024*1024*1024; /* extents-cache */
 
 #define VDDK_ERROR(err, fs, ...)                                \
   do {                                                          \
@@ -180,9 +184,30 @@ vddk_config (const char *key, const char *value)
     if (!config)
       return -1;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
   else if (strcmp (key, "cookie") == 0) {
     cookie = value;
   }
+  else if (strcmp (key, "extents-cache") == 0) {
+    extents_cache = nbdkit_parse_size (value);
+    if (extents_cache == -1)
+      return -1;
+    if (extents_cache > 0 && !is_power_of_2 (extents_cache)) {
+      nbdkit_error ("extents-cache must be 0 or a power of 2");
+      return -1;
+    }
+    /* The cache is filled by whole chunks. */
+    if (extents_cache > 0)
+      extents_cache = MAX (extents_cache,
+                           VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE);
+  }
   else if (strcmp (key, "file") == 0) {
     /* NB: Don't convert this to an absolute path, because in the
      * remote case this can be a path located on the VMware server.
@@ -557,17 +582,80 @@ vddk_dump_plugin (void)
 #endif
 }
 
-/* XXX To really do threading correctly in accordance with the VDDK
- * documentation, we must do all open/close calls from a single
- * thread.  This is a huge pain.
+/* Requests are handled in parallel.  Each connection opens one or
+ * more VDDK disk handles (connections=N), and every VDDK call on a
+ * handle is made from that handle's worker thread.  VDDK does not
+ * allow handles to be opened or closed concurrently, so those calls
+ * are serialized by open_close_lock.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
-/* The per-connection handle. */
-struct vddk_handle {
+static pthread_mutex_t open_close_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct vddk_conn;
+
+/* A command sent to a worker thread. */
+enum command_type { READ, WRITE, CALL };
+
+struct command {
+  enum command_type type;
+  uint64_t sector;                 /* READ, WRITE */
+  uint64_t nr_sectors;
+  void *buf;
+  int (*fn) (struct vddk_conn *c, void *opaque); /* CALL */
+  void *opaque;
+
+  struct vddk_conn *c;
+  bool done;                       /* Protected by c->lock. */
+  VixError err;
+  pthread_cond_t cond;
+  struct command *next;
+};
+
+/* One VDDK connection and disk handle, and its worker thread. */
+struct vddk_conn {
   VixDiskLibConnectParams *params; /* connection parameters */
   VixDiskLibConnection connection; /* connection */
   VixDiskLibHandle handle;         /* disk handle */
+  int readonly;
+  pthread_t thread;                /* worker thread */
+
+  pthread_mutex_t lock;            /* protects the fields below */
+  pthread_cond_t cond;             /* signalled when a command is queued
+                                      or the handle has been opened */
+  enum { OPENING, OPEN, OPEN_FAILED } state;
+  struct command *head, *tail;     /* queue of commands */
+  bool quit;
+
+  unsigned in_flight;              /* commands queued or running */
+};
+
+/* Allocated blocks returned by VixDiskLib_QueryAllocatedBlocks,
+ * converted to bytes.
+ */
+struct block {
+  uint64_t offset;
+  uint64_t length;
+};
+
+/* Cache of the allocated blocks in one chunk-aligned window of the
+ * disk (extents-cache=SIZE).  Writes through this connection
+ * invalidate it.  Writes through other connections are not seen.
+ */
+struct extents_cache {
+  pthread_mutex_t lock;            /* protects the fields below */
+  uint64_t generation;             /* incremented by every write */
+  uint64_t start, end;             /* window, start == end if empty */
+  struct block *blocks;
+  size_t nr_blocks;
+};
+
+/* The per-connection handle. */
+struct vddk_handle {
+  int64_t size;                    /* saved by vddk_get_size */
+  struct extents_cache cache;
+  size_t nr_conns;
+  struct vddk_conn conns[];
 };
 
 static inline VixDiskLibConnectParams *
@@ -599,43 +687,119 @@ free_connect_params (VixDiskLibConnectParams *params)
     free (params);
 }
 
-/* Create the per-connection handle. */
-static void *
-vddk_open (int readonly)
+/* Called when a command finishes, either by the worker thread or, for
+ * asynchronous reads and writes, by VDDK.
+ */
+static void
+complete_command (void *vp, VixError result)
+{
+  struct command *cmd = vp;
+  struct vddk_conn *c = cmd->c;
+
+  pthread_mutex_lock (&c->lock);
+  cmd->err = result;
+  cmd->done = true;
+  pthread_cond_signal (&cmd->cond);
+  pthread_mutex_unlock (&c->lock);
+}
+
+/* Start a read or write.  Returns true if the command was started
+ * asynchronously and will be completed later by VDDK.
+ */
+static bool
+start_read_write (struct vddk_conn *c, struct command *cmd)
 {
-  struct vddk_handle *h;
   VixError err;
-  uint32_t flags;
 
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
+  if (cmd->type == READ) {
+    if (VixDiskLib_ReadAsync != NULL) {
+      DEBUG_CALL_DATAPATH ("VixDiskLib_ReadAsync",
+                           "handle, %" PRIu64 " sectors, "
+                           "%" PRIu64 " sectors, buffer, callback, cmd",
+                           cmd->sector, cmd->nr_sectors);
+      err = VixDiskLib_ReadAsync (c->handle, cmd->sector, cmd->nr_sectors,
+                                  cmd->buf, complete_command, cmd);
+      if (err == VIX_ASYNC)
+        return true;
+    }
+    else {
+      DEBUG_CALL_DATAPATH ("VixDiskLib_Read",
+                           "handle, %" PRIu64 " sectors, "
+                           "%" PRIu64 " sectors, buffer",
+                           cmd->sector, cmd->nr_sectors);
+      err = VixDiskLib_Read (c->handle, cmd->sector, cmd->nr_sectors,
+                             cmd->buf);
+    }
   }
+  else {
+    if (VixDiskLib_WriteAsync != NULL) {
+      DEBUG_CALL_DATAPATH ("VixDiskLib_WriteAsync",
+                           "handle, %" PRIu64 " sectors, "
+                           "%" PRIu64 " sectors, buffer, callback, cmd",
+                           cmd->sector, cmd->nr_sectors);
+      err = VixDiskLib_WriteAsync (c->handle, cmd->sector, cmd->nr_sectors,
+                                   cmd->buf, complete_command, cmd);
+      if (err == VIX_ASYNC)
+        return true;
+    }
+    else {
+      DEBUG_CALL_DATAPATH ("VixDiskLib_Write",
+                           "handle, %" PRIu64 " sectors, "
+                           "%" PRIu64 " sectors, buffer",
+                           cmd->sector, cmd->nr_sectors);
+      err = VixDiskLib_Write (c->handle, cmd->sector, cmd->nr_sectors,
+                              cmd->buf);
+    }
+  }
+
+  complete_command (cmd, err);
+  return false;
+}
+
+/* Wait for all asynchronous commands on the handle to complete. */
+static void
+wait_for_async (struct vddk_conn *c)
+{
+  VixError err;
+
+  DEBUG_CALL_DATAPATH ("VixDiskLib_Wait", "handle");
+  err = VixDiskLib_Wait (c->handle);
+  if (err != VIX_OK)
+    VDDK_ERROR (err, "VixDiskLib_Wait");
+}
+
+/* Open a VDDK connection and disk handle.  Called on the worker
+ * thread.
+ */
+static int
+open_handle (struct vddk_conn *c)
+{
+  VixError err;
+  uint32_t flags;
 
-  h->params = allocate_connect_params ();
-  if (h->params == NULL) {
+  c->params = allocate_connect_params ();
+  if (c->params == NULL) {
     nbdkit_error ("allocate VixDiskLibConnectParams: %m");
-    goto err0;
+    return -1;
   }
 
   if (is_remote) {
-    h->params->vmxSpec = (char *) vmx_spec;
-    h->params->serverName = (char *) server_name;
+    c->params->vmxSpec = (char *) vmx_spec;
+    c->params->serverName = (char *) server_name;
     if (cookie == NULL) {
-      h->params->credType = VIXDISKLIB_CRED_UID;
-      h->params->creds.uid.userName = (char *) username;
-      h->params->creds.uid.password = password;
+      c->params->credType = VIXDISKLIB_CRED_UID;
+      c->params->creds.uid.userName = (char *) username;
+      c->params->creds.uid.password = password;
     }
     else {
-      h->params->credType = VIXDISKLIB_CRED_SESSIONID;
-      h->params->creds.sessionId.cookie = (char *) cookie;
-      h->params->creds.sessionId.userName = (char *) username;
-      h->params->creds.sessionId.key = password;
+      c->params->credType = VIXDISKLIB_CRED_SESSIONID;
+      c->params->creds.sessionId.cookie = (char *) cookie;
+      c->params->creds.sessionId.userName = (char *) username;
+      c->params->creds.sessionId.key = password;
     }
-    h->params->thumbPrint = (char *) thumb_print;
-    h->params->port = port;
-    h->params->nfcHostPort = nfc_host_port;
+    c->params->thumbPrint = (char *) thumb_print;
+    c->params->port = port;
+    c->params->nfcHostPort = nfc_host_port;
   }
 
   /* XXX Some documentation suggests we should call
@@ -645,22 +809,22 @@ vddk_open (int readonly)
    */
 
   DEBUG_CALL ("VixDiskLib_ConnectEx",
-              "h->params, %d, %s, %s, &connection",
-              readonly,
+              "c->params, %d, %s, %s, &connection",
+              c->readonly,
               snapshot_moref ? : "NULL",
               transport_modes ? : "NULL");
-  err = VixDiskLib_ConnectEx (h->params,
-                              readonly,
+  err = VixDiskLib_ConnectEx (c->params,
+                              c->readonly,
                               snapshot_moref,
                               transport_modes,
-                              &h->connection);
+                              &c->connection);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_ConnectEx");
     goto err1;
   }
 
   flags = 0;
-  if (readonly)
+  if (c->readonly)
     flags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
   if (single_link)
     flags |= VIXDISKLIB_FLAG_OPEN_SINGLE_LINK;
@@ -669,23 +833,240 @@ vddk_open (int readonly)
 
   DEBUG_CALL ("VixDiskLib_Open",
               "connection, %s, %d, &handle", filename, flags);
-  err = VixDiskLib_Open (h->connection, filename, flags, &h->handle);
+  err = VixDiskLib_Open (c->connection, filename, flags, &c->handle);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Open: %s", filename);
     goto err2;
   }
 
   nbdkit_debug ("transport mode: %s",
-                VixDiskLib_GetTransportMode (h->handle));
+                VixDiskLib_GetTransportMode (c->handle));
 
-  return h;
+  return 0;
 
  err2:
   DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
-  VixDiskLib_Disconnect (h->connection);
+  VixDiskLib_Disconnect (c->connection);
  err1:
-  free_connect_params (h->params);
- err0:
+  free_connect_params (c->params);
+  return -1;
+}
+
+/* Close the disk handle and connection.  Called on the worker thread. */
+static void
+close_handle (struct vddk_conn *c)
+{
+  DEBUG_CALL ("VixDiskLib_Close", "handle");
+  VixDiskLib_Close (c->handle);
+  DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
+  VixDiskLib_Disconnect (c->connection);
+  free_connect_params (c->params);
+}
+
+/* The worker thread opens the disk handle, reports the result to
+ * open_conn, and then takes all queued commands at once.  Reads and
+ * writes are started asynchronously if VDDK supports it, so every
+ * command in the batch is in flight together.  Other calls first wait
+ * for earlier reads and writes to finish.  At the end of the batch we
+ * wait for the remaining asynchronous commands while new commands
+ * queue up for the next batch.  When asked to quit it drains the
+ * queue and closes the handle, so that every VDDK call on the handle
+ * is made from this thread.
+ */
+static void *
+worker (void *vp)
+{
+  struct vddk_conn *c = vp;
+  struct command *batch, *cmd;
+  unsigned pending;
+  int r;
+
+  r = open_handle (c);
+  pthread_mutex_lock (&c->lock);
+  c->state = r == 0 ? OPEN : OPEN_FAILED;
+  pthread_cond_signal (&c->cond);
+  pthread_mutex_unlock (&c->lock);
+  if (r == -1)
+    return NULL;
+
+  for (;;) {
+    pthread_mutex_lock (&c->lock);
+    while (c->head == NULL && !c->quit)
+      pthread_cond_wait (&c->cond, &c->lock);
+    batch = c->head;
+    c->head = c->tail = NULL;
+    pthread_mutex_unlock (&c->lock);
+    if (batch == NULL)
+      break;
+
+    pending = 0;
+    while (batch) {
+      cmd = batch;
+      batch = cmd->next;
+
+      switch (cmd->type) {
+      case READ:
+      case WRITE:
+        if (start_read_write (c, cmd))
+          pending++;
+        break;
+      case CALL:
+        if (pending > 0) {
+          wait_for_async (c);
+          pending = 0;
+        }
+        r = cmd->fn (c, cmd->opaque);
+        complete_command (cmd, r == 0 ? VIX_OK : VIX_E_FAIL);
+        break;
+      }
+    }
+    if (pending > 0)
+      wait_for_async (c);
+  }
+
+  close_handle (c);
+  return NULL;
+}
+
+/* Send a command to the worker thread and wait for it to finish. */
+static VixError
+run_command (struct vddk_conn *c, struct command *cmd)
+{
+  VixError err;
+
+  cmd->c = c;
+  cmd->done = false;
+  cmd->next = NULL;
+  pthread_cond_init (&cmd->cond, NULL);
+
+  __atomic_add_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock (&c->lock);
+  if (c->tail)
+    c->tail->next = cmd;
+  else
+    c->head = cmd;
+  c->tail = cmd;
+  pthread_cond_signal (&c->cond);
+  while (!cmd->done)
+    pthread_cond_wait (&cmd->cond, &c->lock);
+  err = cmd->err;
+  pthread_mutex_unlock (&c->lock);
+  __atomic_sub_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
+
+  pthread_cond_destroy (&cmd->cond);
+  return err;
+}
+
+/* Call fn on the worker thread.  Returns 0 or -1 as returned by fn. */
+static int
+run_call (struct vddk_conn *c, int (*fn) (struct vddk_conn *, void *),
+          void *opaque)
+{
+  struct command cmd = { .type = CALL, .fn = fn, .opaque = opaque };
+
+  return run_command (c, &cmd) == VIX_OK ? 0 : -1;
+}
+
+/* Choose the handle with the fewest commands in flight. */
+static struct vddk_conn *
+select_conn (struct vddk_handle *h)
+{
+  struct vddk_conn *c = &h->conns[0];
+  unsigned best = __atomic_load_n (&c->in_flight, __ATOMIC_RELAXED);
+  size_t i;
+
+  for (i = 1; i < h->nr_conns && best > 0; ++i) {
+    unsigned n = __atomic_load_n (&h->conns[i].in_flight, __ATOMIC_RELAXED);
+    if (n < best) {
+      c = &h->conns[i];
+      best = n;
+    }
+  }
+  return c;
+}
+
+/* Start the worker thread and wait for it to open the VDDK connection
+ * and disk handle.  Called with open_close_lock held.
+ */
+static int
+open_conn (struct vddk_conn *c, int readonly)
+{
+  int r;
+
+  c->readonly = readonly;
+  c->state = OPENING;
+  pthread_mutex_init (&c->lock, NULL);
+  pthread_cond_init (&c->cond, NULL);
+  r = pthread_create (&c->thread, NULL, worker, c);
+  if (r) {
+    errno = r;
+    nbdkit_error ("pthread_create: %m");
+    goto err;
+  }
+
+  pthread_mutex_lock (&c->lock);
+  while (c->state == OPENING)
+    pthread_cond_wait (&c->cond, &c->lock);
+  pthread_mutex_unlock (&c->lock);
+
+  if (c->state == OPEN_FAILED) {
+    pthread_join (c->thread, NULL);
+    goto err;
+  }
+
+  return 0;
+
+ err:
+  pthread_mutex_destroy (&c->lock);
+  pthread_cond_destroy (&c->cond);
+  return -1;
+}
+
+/* Stop the worker thread, which closes the disk handle and connection
+ * once the queue has drained.  Called with open_close_lock held.
+ */
+static void
+close_conn (struct vddk_conn *c)
+{
+  pthread_mutex_lock (&c->lock);
+  c->quit = true;
+  pthread_cond_signal (&c->cond);
+  pthread_mutex_unlock (&c->lock);
+  pthread_join (c->thread, NULL);
+  pthread_mutex_destroy (&c->lock);
+  pthread_cond_destroy (&c->cond);
+}
+
+/* Create the per-connection handle. */
+static void *
+vddk_open (int readonly)
+{
+  struct vddk_handle *h;
+  size_t i;
+
+  h = calloc (1, sizeof *h + connections * sizeof h->conns[0]);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  pthread_mutex_init (&h->cache.lock, NULL);
+
+  pthread_mutex_lock (&open_close_lock);
+  for (i = 0; i < connections; ++i) {
+    if (open_conn (&h->conns[i], readonly) == -1)
+      goto err;
+    h->nr_conns++;
+  }
+  pthread_mutex_unlock (&open_close_lock);
+
+  return h;
+
+ err:
+  for (i = 0; i < h->nr_conns; ++i)
+    close_conn (&h->conns[i]);
+  pthread_mutex_unlock (&open_close_lock);
+  pthread_mutex_destroy (&h->cache.lock);
   free (h);
   return NULL;
 }
@@ -695,26 +1076,28 @@ static void
 vddk_close (void *handle)
 {
   struct vddk_handle *h = handle;
+  size_t i;
 
-  DEBUG_CALL ("VixDiskLib_Close", "handle");
-  VixDiskLib_Close (h->handle);
-  DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
-  VixDiskLib_Disconnect (h->connection);
-  free_connect_params (h->params);
+  pthread_mutex_lock (&open_close_lock);
+  for (i = 0; i < h->nr_conns; ++i)
+    close_conn (&h->conns[i]);
+  pthread_mutex_unlock (&open_close_lock);
+  pthread_mutex_destroy (&h->cache.lock);
+  free (h->cache.blocks);
   free (h);
 }
 
 /* Get the file size. */
-static int64_t
-vddk_get_size (void *handle)
+static int
+do_get_size (struct vddk_conn *c, void *vp)
 {
-  struct vddk_handle *h = handle;
+  int64_t *size_ret = vp;
   VixDiskLibInfo *info;
   VixError err;
   uint64_t size;
 
   DEBUG_CALL ("VixDiskLib_GetInfo", "handle, &info");
-  err = VixDiskLib_GetInfo (h->handle, &info);
+  err = VixDiskLib_GetInfo (c->handle, &info);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_GetInfo");
     return -1;
@@ -745,7 +1128,33 @@ vddk_get_size (void *handle)
   DEBUG_CALL ("VixDiskLib_FreeInfo", "info");
   VixDiskLib_FreeInfo (info);
 
-  return (int64_t) size;
+  *size_ret = size;
+  return 0;
+}
+
+static int64_t
+vddk_get_size (void *handle)
+{
+  struct vddk_handle *h = handle;
+  int64_t size;
+
+  if (run_call (&h->conns[0], do_get_size, &size) == -1)
+    return -1;
+  h->size = size;
+  return size;
+}
+
+/* Reads and writes must be aligned to sectors.  VDDK allocates disk
+ * space in chunks, so clients should prefer requests of whole chunks.
+ */
+static int
+vddk_block_size (void *handle,
+                 uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  *minimum = VIXDISKLIB_SECTOR_SIZE;
+  *preferred = VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE;
+  *maximum = 0xffffffff;
+  return 0;
 }
 
 /* Read data from the file.
@@ -757,6 +1166,7 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags)
 {
   struct vddk_handle *h = handle;
+  struct command cmd = { .type = READ, .buf = buf };
   VixError err;
 
   /* Align to sectors. */
@@ -768,14 +1178,10 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     nbdkit_error ("read is not aligned to sectors");
     return -1;
   }
-  offset /= VIXDISKLIB_SECTOR_SIZE;
-  count /= VIXDISKLIB_SECTOR_SIZE;
+  cmd.sector = offset / VIXDISKLIB_SECTOR_SIZE;
+  cmd.nr_sectors = count / VIXDISKLIB_SECTOR_SIZE;
 
-  DEBUG_CALL_DATAPATH ("VixDiskLib_Read",
-                       "handle, %" PRIu64 " sectors, "
-                       "%" PRIu32 " sectors, buffer",
-                       offset, count);
-  err = VixDiskLib_Read (h->handle, offset, count, buf);
+  err = run_command (select_conn (h), &cmd);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Read");
     return -1;
@@ -784,7 +1190,27 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
-static int vddk_flush (void *handle, uint32_t flags);
+static int do_flush (struct vddk_conn *c, void *unused);
+
+/* Forget the cached extents if they overlap a write. */
+static void
+invalidate_extents_cache (struct vddk_handle *h,
+                          uint64_t offset, uint32_t count)
+{
+  struct extents_cache *cache = &h->cache;
+
+  pthread_mutex_lock (&cache->lock);
+  cache->generation++;
+  if (offset < cache->end && offset + count > cache->start) {
+    if (vddk_debug_extents)
+      nbdkit_debug ("extents cache invalidated by write");
+    free (cache->blocks);
+    cache->blocks = NULL;
+    cache->nr_blocks = 0;
+    cache->start = cache->end = 0;
+  }
+  pthread_mutex_unlock (&cache->lock);
+}
 
 /* Write data to the file.
  *
@@ -796,6 +1222,8 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   const bool fua = flags & NBDKIT_FLAG_FUA;
   struct vddk_handle *h = handle;
+  struct vddk_conn *c;
+  struct command cmd = { .type = WRITE, .buf = (void *) buf };
   VixError err;
 
   /* Align to sectors. */
@@ -807,20 +1235,23 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     nbdkit_error ("read is not aligned to sectors");
     return -1;
   }
-  offset /= VIXDISKLIB_SECTOR_SIZE;
-  count /= VIXDISKLIB_SECTOR_SIZE;
+  cmd.sector = offset / VIXDISKLIB_SECTOR_SIZE;
+  cmd.nr_sectors = count / VIXDISKLIB_SECTOR_SIZE;
 
-  DEBUG_CALL_DATAPATH ("VixDiskLib_Write",
-                       "handle, %" PRIu64 " sectors, "
-                       "%" PRIu32 " sectors, buffer",
-                       offset, count);
-  err = VixDiskLib_Write (h->handle, offset, count, buf);
+  /* Invalidate before and after the write, so that an extents query
+   * overlapping the write in time does not fill the cache.
+   */
+  invalidate_extents_cache (h, offset, count);
+  c = select_conn (h);
+  err = run_command (c, &cmd);
+  invalidate_extents_cache (h, offset, count);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Write");
     return -1;
   }
 
-  if (fua && vddk_flush (handle, 0) == -1)
+  /* Only this handle has to be flushed. */
+  if (fua && run_call (c, do_flush, NULL) == -1)
     return -1;
 
   return 0;
@@ -828,9 +1259,8 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 
 /* Flush data to the file. */
 static int
-vddk_flush (void *handle, uint32_t flags)
+do_flush (struct vddk_conn *c, void *unused)
 {
-  struct vddk_handle *h = handle;
   VixError err;
 
   /* The Flush call was not available in VDDK < 6.0 so this is simply
@@ -840,7 +1270,7 @@ vddk_flush (void *handle, uint32_t flags)
     return 0;
 
   DEBUG_CALL ("VixDiskLib_Flush", "handle");
-  err = VixDiskLib_Flush (h->handle);
+  err = VixDiskLib_Flush (c->handle);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Flush");
     return -1;
@@ -850,9 +1280,24 @@ vddk_flush (void *handle, uint32_t flags)
 }
 
 static int
-vddk_can_extents (void *handle)
+vddk_flush (void *handle, uint32_t flags)
 {
   struct vddk_handle *h = handle;
+  size_t i;
+  int r = 0;
+
+  /* Writes may have gone through any handle. */
+  for (i = 0; i < h->nr_conns; ++i)
+    if (run_call (&h->conns[i], do_flush, NULL) == -1)
+      r = -1;
+
+  return r;
+}
+
+static int
+do_can_extents (struct vddk_conn *c, void *vp)
+{
+  int *ret = vp;
   VixError err;
   VixDiskLibBlockList *block_list;
 
@@ -862,6 +1307,7 @@ vddk_can_extents (void *handle)
   if (VixDiskLib_QueryAllocatedBlocks == NULL) {
     nbdkit_debug ("can_extents: VixDiskLib_QueryAllocatedBlocks == NULL, "
                   "probably this is VDDK < 6.7");
+    *ret = 0;
     return 0;
   }
 
@@ -872,7 +1318,7 @@ vddk_can_extents (void *handle)
   DEBUG_CALL ("VixDiskLib_QueryAllocatedBlocks",
               "handle, 0, %d sectors, %d sectors",
               VIXDISKLIB_MIN_CHUNK_SIZE, VIXDISKLIB_MIN_CHUNK_SIZE);
-  err = VixDiskLib_QueryAllocatedBlocks (h->handle,
+  err = VixDiskLib_QueryAllocatedBlocks (c->handle,
                                          0, VIXDISKLIB_MIN_CHUNK_SIZE,
                                          VIXDISKLIB_MIN_CHUNK_SIZE,
                                          &block_list);
@@ -887,10 +1333,23 @@ vddk_can_extents (void *handle)
                   "original error: %s",
                   errmsg);
     VixDiskLib_FreeErrorText (errmsg);
+    *ret = 0;
     return 0;
   }
 
-  return 1;
+  *ret = 1;
+  return 0;
+}
+
+static int
+vddk_can_extents (void *handle)
+{
+  struct vddk_handle *h = handle;
+  int ret;
+
+  if (run_call (&h->conns[0], do_can_extents, &ret) == -1)
+    return -1;
+  return ret;
 }
 
 static int
@@ -923,43 +1382,40 @@ add_extent (struct nbdkit_extents *extents,
   return 0;
 }
 
+struct query_args {
+  uint64_t start, end;             /* chunk-aligned range, in bytes */
+  struct block *blocks;            /* returned allocated blocks */
+  size_t nr_blocks;
+};
+
+/* Query the allocated blocks in a chunk-aligned range, splitting it
+ * into as many VixDiskLib_QueryAllocatedBlocks calls as necessary.
+ */
 static int
-vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
-              struct nbdkit_extents *extents)
+do_query_blocks (struct vddk_conn *c, void *vp)
 {
-  struct vddk_handle *h = handle;
-  bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
-  uint64_t position, end, start_sector;
+  struct query_args *args = vp;
+  uint64_t start_sector = args->start / VIXDISKLIB_SECTOR_SIZE;
+  const uint64_t end_sector = args->end / VIXDISKLIB_SECTOR_SIZE;
 
-  position = offset;
-  end = offset + count;
-
-  /* We can only query whole chunks.  Therefore start with the first
-   * chunk before offset.
-   */
-  start_sector =
-    ROUND_DOWN (offset, VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE)
-    / VIXDISKLIB_SECTOR_SIZE;
-  while (start_sector * VIXDISKLIB_SECTOR_SIZE < end) {
+  while (start_sector < end_sector) {
     VixError err;
     uint32_t i;
-    uint64_t nr_chunks, nr_sectors;
+    uint64_t nr_sectors;
     VixDiskLibBlockList *block_list;
+    struct block *blocks;
 
     assert (IS_ALIGNED (start_sector, VIXDISKLIB_MIN_CHUNK_SIZE));
 
-    nr_chunks =
-      ROUND_UP (end - start_sector * VIXDISKLIB_SECTOR_SIZE,
-                VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE)
-      / (VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE);
-    nr_chunks = MIN (nr_chunks, VIXDISKLIB_MAX_CHUNK_NUMBER);
-    nr_sectors = nr_chunks * VIXDISKLIB_MIN_CHUNK_SIZE;
+    nr_sectors = MIN (end_sector - start_sector,
+                      (uint64_t) VIXDISKLIB_MAX_CHUNK_NUMBER *
+                      VIXDISKLIB_MIN_CHUNK_SIZE);
 
     DEBUG_CALL ("VixDiskLib_QueryAllocatedBlocks",
                 "handle, %" PRIu64 " sectors, %" PRIu64 " sectors, "
                 "%d sectors",
                 start_sector, nr_sectors, VIXDISKLIB_MIN_CHUNK_SIZE);
-    err = VixDiskLib_QueryAllocatedBlocks (h->handle,
+    err = VixDiskLib_QueryAllocatedBlocks (c->handle,
                                            start_sector, nr_sectors,
                                            VIXDISKLIB_MIN_CHUNK_SIZE,
                                            &block_list);
@@ -968,46 +1424,142 @@ vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
       return -1;
     }
 
-    for (i = 0; i < block_list->numBlocks; ++i) {
-      uint64_t blk_offset, blk_length;
-
-      blk_offset = block_list->blocks[i].offset * VIXDISKLIB_SECTOR_SIZE;
-      blk_length = block_list->blocks[i].length * VIXDISKLIB_SECTOR_SIZE;
-
-      /* The query returns allocated blocks.  We must insert holes
-       * between the blocks as necessary.
-       */
-      if ((position < blk_offset &&
-           add_extent (extents, &position, blk_offset, true) == -1) ||
-          (add_extent (extents,
-                       &position, blk_offset + blk_length, false) == -1)) {
+    if (block_list->numBlocks > 0) {
+      blocks = realloc (args->blocks,
+                        (args->nr_blocks + block_list->numBlocks) *
+                        sizeof (struct block));
+      if (blocks == NULL) {
+        nbdkit_error ("realloc: %m");
         DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
         VixDiskLib_FreeBlockList (block_list);
         return -1;
       }
+      args->blocks = blocks;
+      for (i = 0; i < block_list->numBlocks; ++i) {
+        blocks[args->nr_blocks].offset =
+          block_list->blocks[i].offset * VIXDISKLIB_SECTOR_SIZE;
+        blocks[args->nr_blocks].length =
+          block_list->blocks[i].length * VIXDISKLIB_SECTOR_SIZE;
+        args->nr_blocks++;
+      }
     }
     DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
     VixDiskLib_FreeBlockList (block_list);
 
-    /* There's an implicit hole after the returned list of blocks, up
-     * to the end of the QueryAllocatedBlocks request.
+    start_sector += nr_sectors;
+  }
+
+  return 0;
+}
+
+/* Add the extents covering [offset, end) from a list of allocated
+ * blocks.  The list covers a window which contains offset but may
+ * finish before end, in which case fewer extents are returned.
+ */
+static int
+add_extents (struct nbdkit_extents *extents,
+             const struct block *blocks, size_t nr_blocks,
+             uint64_t window_end,
+             uint64_t offset, uint64_t end, bool req_one)
+{
+  uint64_t position = offset;
+  size_t i;
+
+  end = MIN (end, window_end);
+
+  for (i = 0; i < nr_blocks && position < end; ++i) {
+    uint64_t blk_offset, blk_end;
+
+    blk_offset = MAX (blocks[i].offset, position);
+    blk_end = MIN (blocks[i].offset + blocks[i].length, end);
+    if (blk_end <= position)
+      continue;
+
+    /* The query returns allocated blocks.  We must insert holes
+     * between the blocks as necessary.
      */
-    if (add_extent (extents,
-                    &position,
-                    (start_sector + nr_sectors) * VIXDISKLIB_SECTOR_SIZE,
-                    true) == -1)
+    if ((position < blk_offset &&
+         add_extent (extents, &position, blk_offset, true) == -1) ||
+        add_extent (extents, &position, blk_end, false) == -1)
       return -1;
 
-    start_sector += nr_sectors;
-
     /* If one extent was requested, as long as we've added an extent
      * overlapping the original offset we're done.
      */
-    if (req_one && position > offset)
-      break;
+    if (req_one)
+      return 0;
   }
 
-  return 0;
+  /* There's an implicit hole after the returned list of blocks, up
+   * to the end of the window.
+   */
+  return add_extent (extents, &position, end, true);
+}
+
+static int
+vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+              struct nbdkit_extents *extents)
+{
+  struct vddk_handle *h = handle;
+  struct extents_cache *cache = &h->cache;
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+  const uint64_t chunk = VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE;
+  struct query_args args = { .blocks = NULL, .nr_blocks = 0 };
+  uint64_t generation = 0;
+  int r;
+
+  if (extents_cache > 0) {
+    pthread_mutex_lock (&cache->lock);
+    if (cache->start <= offset && offset < cache->end) {
+      if (vddk_debug_extents)
+        nbdkit_debug ("extents cache hit at %" PRIu64, offset);
+      r = add_extents (extents, cache->blocks, cache->nr_blocks, cache->end,
+                       offset, offset + count, req_one);
+      pthread_mutex_unlock (&cache->lock);
+      return r;
+    }
+    generation = cache->generation;
+    pthread_mutex_unlock (&cache->lock);
+
+    /* Prefetch the whole window containing offset.  We can only
+     * query whole chunks, so the last window may extend beyond the
+     * end of the disk up to the next chunk boundary.
+     */
+    args.start = ROUND_DOWN (offset, extents_cache);
+    args.end = MIN (args.start + extents_cache, ROUND_UP (h->size, chunk));
+  }
+  else {
+    /* We can only query whole chunks.  Therefore start with the first
+     * chunk before offset.
+     */
+    args.start = ROUND_DOWN (offset, chunk);
+    args.end = ROUND_UP (offset + count, chunk);
+  }
+
+  if (run_call (select_conn (h), do_query_blocks, &args) == -1) {
+    free (args.blocks);
+    return -1;
+  }
+
+  r = add_extents (extents, args.blocks, args.nr_blocks, args.end,
+                   offset, offset + count, req_one);
+
+  /* Save the window unless a write happened while we were querying. */
+  if (extents_cache > 0) {
+    pthread_mutex_lock (&cache->lock);
+    if (cache->generation == generation) {
+      free (cache->blocks);
+      cache->blocks = args.blocks;
+      cache->nr_blocks = args.nr_blocks;
+      cache->start = args.start;
+      cache->end = args.end;
+      args.blocks = NULL;
+    }
+    pthread_mutex_unlock (&cache->lock);
+  }
+  free (args.blocks);
+
+  return r;
 }
 
 static struct nbdkit_plugin plugin = {
@@ -1023,6 +1575,7 @@ static struct nbdkit_plugin plugin = {
   .open              = vddk_open,
   .close             = vddk_close,
   .get_size          = vddk_get_size,
+  .block_size        = vddk_block_size,
   .pread             = vddk_pread,
   .pwrite            = vddk_pwrite,
   .flush             = vddk_flush,
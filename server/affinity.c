@@ -0,0 +1,323 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "internal.h"
+
+/* CPU and NUMA placement of threads, used by --listeners and --numa.
+ *
+ * Each accept thread (--listeners) is pinned to one CPU.  The threads
+ * serving a connection may run on any CPU in a single NUMA node: with
+ * --numa this is the node of the CPU which received the connection
+ * from the network card, otherwise the node of the accept thread.
+ * With --numa the connection threads also prefer to allocate memory
+ * from that node.  Worker threads are started by the connection
+ * thread, so they inherit its placement.
+ */
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+
+/* Larger node numbers are treated as unknown. */
+#define MAX_NODES 64
+
+static bool initialized;
+static cpu_set_t allowed;       /* CPUs we were started on. */
+static int cpu_nodes[CPU_SETSIZE]; /* NUMA node of each CPU, or -1. */
+static cpu_set_t node_cpus[MAX_NODES]; /* Allowed CPUs of each node. */
+
+/* CPU of each accept thread. */
+static int *listener_cpus;
+
+/* Parse a sysfs CPU list such as "0-3,8-11" into set. */
+static int
+parse_cpulist (const char *list, cpu_set_t *set)
+{
+  unsigned first, last;
+  int n;
+
+  CPU_ZERO (set);
+  while (*list != '\0' && *list != '\n') {
+    if (sscanf (list, "%u%n", &first, &n) != 1)
+      return -1;
+    list += n;
+    last = first;
+    if (*list == '-') {
+      list++;
+      if (sscanf (list, "%u%n", &last, &n) != 1)
+        return -1;
+      list += n;
+    }
+    for (; first <= last && first < CPU_SETSIZE; ++first)
+      CPU_SET (first, set);
+    if (*list == ',')
+      list++;
+  }
+  return 0;
+}
+
+/* Return the NUMA node of cpu, or -1 if it cannot be found (for
+ * example if /sys is not mounted).
+ */
+static int
+read_cpu_node (int cpu)
+{
+  char path[64];
+  DIR *dir;
+  struct dirent *d;
+  int node = -1;
+
+  snprintf (path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir (path);
+  if (dir == NULL)
+    return -1;
+  while ((d = readdir (dir)) != NULL) {
+    if (sscanf (d->d_name, "node%d", &node) == 1)
+      break;
+    node = -1;
+  }
+  closedir (dir);
+  return node >= 0 && node < MAX_NODES ? node : -1;
+}
+
+/* Get the CPUs belonging to NUMA node. */
+static int
+read_node_cpus (int node, cpu_set_t *set)
+{
+  char path[64];
+  FILE *fp;
+  char *line = NULL;
+  size_t n = 0;
+  int r = -1;
+
+  snprintf (path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+            node);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+  if (getline (&line, &n, fp) != -1)
+    r = parse_cpulist (line, set);
+  free (line);
+  fclose (fp);
+  return r;
+}
+
+void
+affinity_init (void)
+{
+  cpu_set_t set;
+  unsigned i;
+  int cpu, node, nr_cpus;
+
+  /* Only use the CPUs we were started on, which may have been
+   * restricted by taskset, cgroups, etc.
+   */
+  if (sched_getaffinity (0, sizeof allowed, &allowed) == -1) {
+    perror ("sched_getaffinity");
+    exit (EXIT_FAILURE);
+  }
+  nr_cpus = CPU_COUNT (&allowed);
+
+  /* Read the NUMA topology of the allowed CPUs. */
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    cpu_nodes[cpu] = -1;
+    if (!CPU_ISSET (cpu, &allowed))
+      continue;
+    node = read_cpu_node (cpu);
+    if (node == -1)
+      continue;
+    if (CPU_COUNT (&node_cpus[node]) == 0) {
+      if (read_node_cpus (node, &set) == -1)
+        continue;
+      CPU_AND (&node_cpus[node], &set, &allowed);
+      debug ("NUMA node %d: %d CPU(s)", node, CPU_COUNT (&node_cpus[node]));
+    }
+    cpu_nodes[cpu] = node;
+  }
+
+  /* Spread the listeners round-robin over the allowed CPUs. */
+  listener_cpus = calloc (listeners, sizeof *listener_cpus);
+  if (listener_cpus == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0, cpu = -1; i < listeners; ++i) {
+    if (i % nr_cpus == 0)
+      cpu = -1;
+    do
+      cpu++;
+    while (!CPU_ISSET (cpu, &allowed));
+    listener_cpus[i] = cpu;
+    if (listeners > 1)
+      debug ("listener %u: CPU %d, NUMA node %d", i, cpu, cpu_nodes[cpu]);
+  }
+
+  initialized = true;
+}
+
+void
+affinity_free (void)
+{
+  free (listener_cpus);
+  listener_cpus = NULL;
+  initialized = false;
+}
+
+/* Called by accept thread i to pin itself to its CPU. */
+void
+affinity_pin_listener (unsigned i)
+{
+  cpu_set_t set;
+  int err;
+
+  CPU_ZERO (&set);
+  CPU_SET (listener_cpus[i], &set);
+  err = pthread_setaffinity_np (pthread_self (), sizeof set, &set);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_setaffinity_np: %m");
+  }
+}
+
+/* Choose the NUMA node for a connection accepted on sock by listener
+ * i.  Returns -1 if the node is unknown or placement is not enabled.
+ */
+int
+affinity_connection_node (int sock, unsigned i)
+{
+  if (!initialized)
+    return -1;
+
+#ifdef SO_INCOMING_CPU
+  if (numa) {
+    int cpu;
+    socklen_t len = sizeof cpu;
+
+    if (getsockopt (sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < CPU_SETSIZE && cpu_nodes[cpu] >= 0)
+      return cpu_nodes[cpu];
+  }
+#endif
+
+  if (listeners > 1)
+    return cpu_nodes[listener_cpus[i]];
+
+  return -1;
+}
+
+/* Called by a connection thread to move itself to node (which may be
+ * -1 if unknown).
+ */
+void
+affinity_place_connection (int node)
+{
+  const cpu_set_t *set;
+  int err;
+
+  if (!initialized)
+    return;
+
+  /* Even if the node is unknown we must undo the pinning inherited
+   * from the accept thread.
+   */
+  set = node >= 0 ? &node_cpus[node] : &allowed;
+  err = pthread_setaffinity_np (pthread_self (), sizeof *set, set);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_setaffinity_np: %m");
+  }
+
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(SYS_set_mempolicy)
+  if (numa && node >= 0) {
+    unsigned long nodemask = 1UL << node;
+
+    /* The kernel only reads maxnode-1 bits of the mask. */
+    if (syscall (SYS_set_mempolicy, MPOL_PREFERRED,
+                 &nodemask, sizeof nodemask * 8 + 1) == -1)
+      debug ("set_mempolicy: %m");
+  }
+#endif
+}
+
+#else /* !HAVE_PTHREAD_SETAFFINITY_NP */
+
+/* Without CPU affinity the listeners still share the incoming
+ * connections, but the threads are placed by the operating system.
+ */
+
+void
+affinity_init (void)
+{
+  debug ("CPU affinity is not supported on this platform");
+}
+
+void
+affinity_free (void)
+{
+}
+
+void
+affinity_pin_listener (unsigned i)
+{
+}
+
+int
+affinity_connection_node (int sock, unsigned i)
+{
+  return -1;
+}
+
+void
+affinity_place_connection (int node)
+{
+}
+
+#endif /* !HAVE_PTHREAD_SETAFFINITY_NP */
@@ -42,6 +42,7 @@
 #include <dlfcn.h>
 
 #include "internal.h"
+#include "ispowerof2.h"
 #include "minmax.h"
 
 /* Helpers for registering a new backend. */
@@ -301,6 +302,58 @@ backend_get_size (struct backend *b)
   return h->exportsize;
 }
 
+int
+backend_block_size (struct backend *b,
+                    uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  if (h->minimum_block_size == (uint32_t) -1) {
+    controlpath_debug ("%s: block_size", b->name);
+    *minimum = *preferred = *maximum = 0;
+    if (b->block_size (b, h->handle, minimum, preferred, maximum) == -1)
+      return -1;
+
+    /* All zero means the backend has no constraints.  Otherwise the
+     * values must satisfy the rules in the NBD protocol.
+     */
+    if (*minimum != 0 || *preferred != 0 || *maximum != 0) {
+      if (*minimum < 1 || *minimum > 65536 || !is_power_of_2 (*minimum)) {
+        nbdkit_error ("%s: .block_size: minimum block size (%" PRIu32 ") "
+                      "must be a power of 2 between 1 and 64K",
+                      b->name, *minimum);
+        return -1;
+      }
+      if (*preferred < MAX (512, *minimum) || *preferred > 32 * 1024 * 1024 ||
+          !is_power_of_2 (*preferred)) {
+        nbdkit_error ("%s: .block_size: preferred block size (%" PRIu32 ") "
+                      "must be a power of 2 between max(512, minimum) "
+                      "and 32M", b->name, *preferred);
+        return -1;
+      }
+      if (*maximum < *preferred ||
+          (*maximum != (uint32_t) -1 && *maximum % *minimum != 0)) {
+        nbdkit_error ("%s: .block_size: maximum block size (%" PRIu32 ") "
+                      "must be at least the preferred size and "
+                      "a multiple of the minimum size", b->name, *maximum);
+        return -1;
+      }
+    }
+
+    h->minimum_block_size = *minimum;
+    h->preferred_block_size = *preferred;
+    h->maximum_block_size = *maximum;
+  }
+  else {
+    *minimum = h->minimum_block_size;
+    *preferred = h->preferred_block_size;
+    *maximum = h->maximum_block_size;
+  }
+  return 0;
+}
+
 int
 backend_can_write (struct backend *b)
 {
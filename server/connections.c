@@ -117,6 +117,7 @@ connection_worker (void *data)
   threadlocal_new_server_thread ();
   threadlocal_set_name (name);
   threadlocal_set_conn (conn);
+  threadlocal_set_numa_node (conn->numa_node);
   free (worker);
 
   while (!quit && connection_get_status () > 0)
@@ -143,6 +144,8 @@ handle_single_connection (int sockin, int sockout)
   conn = new_connection (sockin, sockout, nworkers);
   if (!conn)
     goto done;
+  if (conn->numa_node >= 0)
+    debug ("serving connection on NUMA node %d", conn->numa_node);
 
   /* NB: because of an asynchronous exit top can be set to NULL at
    * just about any time.
@@ -253,6 +256,7 @@ new_connection (int sockin, int sockout, int nworkers)
 
   conn->status = 1;
   conn->nworkers = nworkers;
+  conn->numa_node = threadlocal_get_numa_node ();
   if (nworkers) {
 #ifdef HAVE_PIPE2
     if (pipe2 (conn->status_pipe, O_NONBLOCK | O_CLOEXEC)) {
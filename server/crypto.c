@@ -48,10 +48,25 @@
 
 #include "internal.h"
 
+/* -D nbdkit.tls.ktls=0 stops the server from handing TLS records
+ * over to the kernel, so that GnuTLS does all of the encryption.
+ */
+int nbdkit_debug_tls_ktls = 1;
+
 #ifdef HAVE_GNUTLS
 
 #include <gnutls/gnutls.h>
 
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#if defined(SOL_TLS) && defined(TCP_ULP)
+#define HAVE_KTLS 1
+#endif
+#endif
+
 static int crypto_auth;
 #define CRYPTO_AUTH_CERTIFICATES 1
 #define CRYPTO_AUTH_PSK 2
@@ -415,6 +430,253 @@ crypto_close (void)
   conn->crypto_session = NULL;
 }
 
+#ifdef HAVE_KTLS
+
+/* TLS record content types (RFC 8446 section 5.1). */
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+/* Fill in the kernel crypto_info for an AES-GCM cipher.  In TLS 1.2
+ * the kernel generates the explicit part of the nonce itself starting
+ * from the record sequence number, while TLS 1.3 uses the whole
+ * implicit IV from the key schedule.
+ */
+#define SET_AES_GCM_INFO(ci, type)                                      \
+  do {                                                                  \
+    if (cipher_key.size != sizeof (ci).key ||                           \
+        iv.size < sizeof (ci).salt +                                    \
+        (version == TLS_1_2_VERSION ? 0 : sizeof (ci).iv))              \
+      return -1;                                                        \
+    (ci).info.version = version;                                        \
+    (ci).info.cipher_type = (type);                                     \
+    memcpy ((ci).salt, iv.data, sizeof (ci).salt);                      \
+    if (version == TLS_1_2_VERSION)                                     \
+      memcpy ((ci).iv, seq, sizeof (ci).iv);                            \
+    else                                                                \
+      memcpy ((ci).iv, iv.data + sizeof (ci).salt, sizeof (ci).iv);     \
+    memcpy ((ci).key, cipher_key.data, sizeof (ci).key);                \
+    memcpy ((ci).rec_seq, seq, sizeof (ci).rec_seq);                    \
+    info_len = sizeof (ci);                                             \
+  } while (0)
+
+/* Copy the keys and record sequence number for one direction of the
+ * session into the kernel.  Returns -1 if the negotiated version or
+ * cipher is not one the kernel implements, or if setsockopt fails.
+ */
+static int
+set_ktls_keys (gnutls_session_t session, int sock, bool read)
+{
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq[8];
+  union {
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+  } info;
+  socklen_t info_len;
+  unsigned version;
+  int r;
+
+  switch (gnutls_protocol_get_version (session)) {
+  case GNUTLS_TLS1_2: version = TLS_1_2_VERSION; break;
+#ifdef TLS_1_3_VERSION
+  case GNUTLS_TLS1_3: version = TLS_1_3_VERSION; break;
+#endif
+  default: return -1;
+  }
+
+  if (gnutls_record_get_state (session, read,
+                               &mac_key, &iv, &cipher_key, seq) < 0)
+    return -1;
+
+  memset (&info, 0, sizeof info);
+  switch (gnutls_cipher_get (session)) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    SET_AES_GCM_INFO (info.aes_gcm_128, TLS_CIPHER_AES_GCM_128);
+    break;
+  case GNUTLS_CIPHER_AES_256_GCM:
+    SET_AES_GCM_INFO (info.aes_gcm_256, TLS_CIPHER_AES_GCM_256);
+    break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  case GNUTLS_CIPHER_CHACHA20_POLY1305:
+    if (cipher_key.size != sizeof info.chacha20_poly1305.key ||
+        iv.size != sizeof info.chacha20_poly1305.iv)
+      return -1;
+    info.chacha20_poly1305.info.version = version;
+    info.chacha20_poly1305.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy (info.chacha20_poly1305.iv, iv.data, iv.size);
+    memcpy (info.chacha20_poly1305.key, cipher_key.data, cipher_key.size);
+    memcpy (info.chacha20_poly1305.rec_seq, seq, sizeof seq);
+    info_len = sizeof info.chacha20_poly1305;
+    break;
+#endif
+  default:
+    return -1;
+  }
+
+  r = setsockopt (sock, SOL_TLS, read ? TLS_RX : TLS_TX, &info, info_len);
+  memset (&info, 0, sizeof info);
+  return r;
+}
+
+/* Read buffer from the kernel TLS socket and either succeed
+ * completely (returns > 0), read an EOF (returns 0), or fail (returns
+ * -1).  This is raw_recv except that the record type of each read is
+ * checked, since the kernel passes alerts and post-handshake messages
+ * up to userspace rather than decrypting them into the data stream.
+ */
+static int
+ktls_recv (void *vbuf, size_t len)
+{
+  GET_CONN;
+  int sock = conn->sockin;
+  char *buf = vbuf;
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char type;
+  ssize_t r;
+  bool first_read = true;
+
+  while (len > 0) {
+    memset (&msg, 0, sizeof msg);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof cmsgbuf;
+
+    r = recvmsg (sock, &msg, 0);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    if (r == 0)
+      goto eof;
+
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+      type = *(unsigned char *) CMSG_DATA (cmsg);
+      if (type != TLS_RECORD_APPLICATION_DATA) {
+        /* A close_notify alert is the TLS equivalent of EOF. */
+        if (type == TLS_RECORD_ALERT && r >= 2 && buf[1] == 0)
+          goto eof;
+        nbdkit_error ("kTLS: unexpected TLS record type %d "
+                      "received from client", type);
+        errno = EIO;
+        return -1;
+      }
+    }
+
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+
+ eof:
+  if (first_read)
+    return 0;
+  /* Partial record read.  This is an error. */
+  errno = EBADMSG;
+  return -1;
+}
+
+/* Send close_notify through the kernel, then close the sockets.  This
+ * is used whenever the kernel encrypts sent records, since GnuTLS no
+ * longer knows the write sequence number.  Errors are ignored as in
+ * crypto_close.
+ */
+static void
+ktls_close (void)
+{
+  GET_CONN;
+  gnutls_session_t session = conn->crypto_session;
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+
+  assert (session != NULL);
+
+  memset (&msg, 0, sizeof msg);
+  iov.iov_base = alert;
+  iov.iov_len = sizeof alert;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof cmsgbuf;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *(unsigned char *) CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+  msg.msg_controllen = cmsg->cmsg_len;
+  sendmsg (conn->sockout, &msg, MSG_NOSIGNAL);
+
+  if (conn->sockin >= 0)
+    close (conn->sockin);
+  if (conn->sockout >= 0 && conn->sockin != conn->sockout)
+    close (conn->sockout);
+
+  gnutls_deinit (session);
+  conn->crypto_session = NULL;
+}
+
+/* Return values of enable_ktls. */
+#define KTLS_NONE 0             /* GnuTLS encrypts both directions */
+#define KTLS_TX 1               /* the kernel encrypts sent records */
+#define KTLS_TX_RX 2            /* the kernel handles both directions */
+
+/* After the handshake, try to install the session keys into the
+ * socket so the kernel encrypts and decrypts the records.  This needs
+ * a TCP socket, a kernel with the "tls" upper layer protocol, and a
+ * cipher which the kernel implements.  Kernels before 4.17 can only
+ * encrypt, in which case GnuTLS still decrypts received records.
+ */
+static int
+enable_ktls (gnutls_session_t session, int sockin, int sockout)
+{
+  if (!nbdkit_debug_tls_ktls || sockin != sockout)
+    return KTLS_NONE;
+
+  /* Any data GnuTLS has already decrypted would be lost. */
+  if (gnutls_record_check_pending (session) > 0)
+    return KTLS_NONE;
+
+  if (setsockopt (sockout, IPPROTO_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug ("kTLS not available: %m");
+    return KTLS_NONE;
+  }
+
+  /* Until keys are installed the socket behaves as plain TCP, so
+   * failing to set either set of keys leaves that direction to
+   * GnuTLS.
+   */
+  if (set_ktls_keys (session, sockout, false) == -1) {
+    debug ("kTLS not used for %s with %s: %m",
+           gnutls_protocol_get_name (gnutls_protocol_get_version (session)),
+           gnutls_cipher_get_name (gnutls_cipher_get (session)));
+    return KTLS_NONE;
+  }
+  if (set_ktls_keys (session, sockin, true) == -1) {
+    debug ("kTLS receive keys not set, GnuTLS will decrypt: %m");
+    return KTLS_TX;
+  }
+
+  return KTLS_TX_RX;
+}
+
+#endif /* HAVE_KTLS */
+
 /* Upgrade an existing connection to TLS.  Also this should do access
  * control if enabled.  The protocol code ensures this function can
  * only be called once per connection.
@@ -520,10 +782,29 @@ crypto_negotiate_tls (int sockin, int sockout)
   }
   debug ("TLS handshake completed");
 
+  conn->crypto_session = session;
+
+#ifdef HAVE_KTLS
+  /* If the kernel is doing the encryption then the existing send
+   * function on the raw socket can still be used.
+   */
+  switch (enable_ktls (session, sockin, sockout)) {
+  case KTLS_TX_RX:
+    debug ("TLS records are encrypted and decrypted by the kernel (kTLS)");
+    conn->recv = ktls_recv;
+    conn->close = ktls_close;
+    return 0;
+  case KTLS_TX:
+    debug ("TLS records are encrypted by the kernel (kTLS)");
+    conn->recv = crypto_recv;
+    conn->close = ktls_close;
+    return 0;
+  }
+#endif
+
   /* Set up the connection recv/send/close functions so they call
    * GnuTLS wrappers instead.
    */
-  conn->crypto_session = session;
   conn->recv = crypto_recv;
   conn->send = crypto_send;
   conn->close = crypto_close;
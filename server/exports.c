@@ -0,0 +1,144 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+
+/* Cap nr_exports to avoid sending over-large replies to the client,
+ * and to avoid a plugin with a huge list consuming too much memory.
+ */
+#define MAX_EXPORTS 10000
+
+struct nbdkit_exports {
+  struct nbdkit_export *exports;
+  size_t nr_exports, allocated;
+};
+
+struct nbdkit_exports *
+exports_new (void)
+{
+  struct nbdkit_exports *r;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  return r;
+}
+
+void
+exports_free (struct nbdkit_exports *exps)
+{
+  size_t i;
+
+  if (exps) {
+    for (i = 0; i < exps->nr_exports; ++i) {
+      free (exps->exports[i].name);
+      free (exps->exports[i].description);
+    }
+    free (exps->exports);
+    free (exps);
+  }
+}
+
+size_t
+exports_count (const struct nbdkit_exports *exps)
+{
+  return exps->nr_exports;
+}
+
+const struct nbdkit_export *
+exports_get (const struct nbdkit_exports *exps, size_t i)
+{
+  assert (i < exps->nr_exports);
+  return &exps->exports[i];
+}
+
+int
+nbdkit_add_export (struct nbdkit_exports *exps,
+                   const char *name, const char *description)
+{
+  struct nbdkit_export e = { NULL, NULL };
+
+  if (exps->nr_exports == MAX_EXPORTS) {
+    nbdkit_error ("nbdkit_add_export: too many exports");
+    errno = EINVAL;
+    return -1;
+  }
+  if (strlen (name) > NBD_MAX_STRING ||
+      (description && strlen (description) > NBD_MAX_STRING)) {
+    nbdkit_error ("nbdkit_add_export: %s too long",
+                  strlen (name) > NBD_MAX_STRING ? "name" : "description");
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (exps->nr_exports == exps->allocated) {
+    size_t new_allocated = exps->allocated == 0 ? 16 : exps->allocated * 2;
+    struct nbdkit_export *new_exports;
+
+    new_exports = realloc (exps->exports,
+                           new_allocated * sizeof (struct nbdkit_export));
+    if (new_exports == NULL) {
+      nbdkit_error ("nbdkit_add_export: realloc: %m");
+      return -1;
+    }
+    exps->exports = new_exports;
+    exps->allocated = new_allocated;
+  }
+
+  e.name = strdup (name);
+  if (e.name == NULL) {
+    nbdkit_error ("nbdkit_add_export: strdup: %m");
+    return -1;
+  }
+  if (description) {
+    e.description = strdup (description);
+    if (e.description == NULL) {
+      nbdkit_error ("nbdkit_add_export: strdup: %m");
+      free (e.name);
+      return -1;
+    }
+  }
+
+  exps->exports[exps->nr_exports++] = e;
+  return 0;
+}
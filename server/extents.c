@@ -92,8 +92,9 @@ nbdkit_extents_new (uint64_t start, uint64_t end)
     nbdkit_error ("nbdkit_extents_new: malloc: %m");
     return NULL;
   }
-  r->extents = NULL;
-  r->nr_extents = r->allocated = 0;
+  /* Reuse the array from a list previously freed by this thread. */
+  r->extents = threadlocal_take_extents (&r->allocated);
+  r->nr_extents = 0;
   r->start = start;
   r->end = end;
   r->next = -1;
@@ -104,7 +105,7 @@ void
 nbdkit_extents_free (struct nbdkit_extents *exts)
 {
   if (exts) {
-    free (exts->extents);
+    threadlocal_give_extents (exts->extents, exts->allocated);
     free (exts);
   }
 }
@@ -122,18 +123,22 @@ nbdkit_get_extent (const struct nbdkit_extents *exts, size_t i)
   return exts->extents[i];
 }
 
-/* Insert *e in the list at the end. */
+/* Make sure there is room for n more extents in the list. */
 static int
-append_extent (struct nbdkit_extents *exts, const struct nbdkit_extent *e)
+reserve_extents (struct nbdkit_extents *exts, size_t n)
 {
-  if (exts->nr_extents >= exts->allocated) {
+  if (n > MAX_EXTENTS - exts->nr_extents)
+    n = MAX_EXTENTS - exts->nr_extents;
+
+  if (exts->nr_extents + n > exts->allocated) {
     size_t new_allocated;
     struct nbdkit_extent *new_extents;
 
     new_allocated = exts->allocated;
     if (new_allocated == 0)
       new_allocated = 1;
-    new_allocated *= 2;
+    while (new_allocated < exts->nr_extents + n)
+      new_allocated *= 2;
     new_extents =
       realloc (exts->extents, new_allocated * sizeof (struct nbdkit_extent));
     if (new_extents == NULL) {
@@ -144,6 +149,16 @@ append_extent (struct nbdkit_extents *exts, const struct nbdkit_extent *e)
     exts->extents = new_extents;
   }
 
+  return 0;
+}
+
+/* Insert *e in the list at the end. */
+static int
+append_extent (struct nbdkit_extents *exts, const struct nbdkit_extent *e)
+{
+  if (reserve_extents (exts, 1) == -1)
+    return -1;
+
   exts->extents[exts->nr_extents] = *e;
   exts->nr_extents++;
   return 0;
@@ -219,3 +234,115 @@ nbdkit_add_extent (struct nbdkit_extents *exts,
     return append_extent (exts, &e);
   }
 }
+
+int
+nbdkit_extents_append (struct nbdkit_extents *exts,
+                       const struct nbdkit_extent *extents, size_t n)
+{
+  size_t i;
+
+  if (reserve_extents (exts, n) == -1)
+    return -1;
+
+  for (i = 0; i < n; ++i) {
+    if (nbdkit_add_extent (exts, extents[i].offset, extents[i].length,
+                           extents[i].type) == -1)
+      return -1;
+    if (extents[i].offset >= exts->end)
+      break;
+  }
+  return 0;
+}
+
+/* Return the index of the first extent in the list which ends after
+ * offset, or the number of extents if there is none.
+ */
+static size_t
+find_extent (const struct nbdkit_extents *exts, uint64_t offset)
+{
+  size_t lo = 0, hi = exts->nr_extents;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (exts->extents[mid].offset + exts->extents[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int
+nbdkit_extents_copy (struct nbdkit_extents *dst,
+                     const struct nbdkit_extents *src, int64_t shift)
+{
+  size_t i = 0;
+
+  /* Skip the extents of src which are entirely before the range of
+   * dst.  These would be ignored by nbdkit_add_extent anyway.
+   */
+  if (dst->next == -1 && (int64_t) dst->start - shift > 0)
+    i = find_extent (src, dst->start - shift);
+
+  for (; i < src->nr_extents; ++i) {
+    const struct nbdkit_extent *e = &src->extents[i];
+
+    if ((int64_t) e->offset + shift < 0) {
+      nbdkit_error ("nbdkit_extents_copy: "
+                    "extent offset (%" PRIu64 ") + shift (%" PRIi64 ") < 0",
+                    e->offset, shift);
+      errno = ERANGE;
+      return -1;
+    }
+    if (e->offset + shift >= dst->end)
+      break;
+    if (nbdkit_add_extent (dst, e->offset + shift, e->length, e->type) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+int
+nbdkit_extents_intersect (struct nbdkit_extents *dst,
+                          const struct nbdkit_extents *a,
+                          const struct nbdkit_extents *b)
+{
+  size_t i, j;
+  uint64_t start, pos;
+
+  if (a->nr_extents == 0 || b->nr_extents == 0)
+    return 0;
+
+  /* Both lists are contiguous, so the result covers the range where
+   * they overlap.  Nothing is known about any part of dst before the
+   * overlap, so report it as data.
+   */
+  start = dst->next >= 0 ? dst->next : dst->start;
+  pos = MAX (a->extents[0].offset, b->extents[0].offset);
+  pos = MAX (pos, start);
+  if (pos > start && nbdkit_add_extent (dst, start, pos - start, 0) == -1)
+    return -1;
+  i = find_extent (a, pos);
+  j = find_extent (b, pos);
+
+  while (i < a->nr_extents && j < b->nr_extents && pos < dst->end) {
+    const uint64_t a_end = a->extents[i].offset + a->extents[i].length;
+    const uint64_t b_end = b->extents[j].offset + b->extents[j].length;
+    const uint64_t end = MIN (a_end, b_end);
+
+    /* A range is only a hole, or only reads as zeroes, if it is in
+     * both lists.
+     */
+    if (nbdkit_add_extent (dst, pos, end - pos,
+                           a->extents[i].type & b->extents[j].type) == -1)
+      return -1;
+
+    pos = end;
+    if (a_end == end)
+      i++;
+    if (b_end == end)
+      j++;
+  }
+  return 0;
+}
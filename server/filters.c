@@ -184,6 +184,21 @@ filter_preconnect (struct backend *b, int readonly)
     return b->next->preconnect (b->next, readonly);
 }
 
+static int
+filter_list_exports (struct backend *b, int readonly,
+                     struct nbdkit_exports *exports)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  debug ("%s: list_exports readonly=%d", b->name, readonly);
+
+  if (f->filter.list_exports)
+    return f->filter.list_exports (b->next->list_exports, b->next,
+                                   readonly, exports);
+  else
+    return b->next->list_exports (b->next, readonly, exports);
+}
+
 /* magic_config_key only applies to plugins, so this passes the
  * request through to the plugin (hence the name).
  */
@@ -223,6 +238,7 @@ filter_close (struct backend *b, void *handle)
 static struct nbdkit_next_ops next_ops = {
   .reopen = backend_reopen,
   .get_size = backend_get_size,
+  .block_size = backend_block_size,
   .can_write = backend_can_write,
   .can_flush = backend_can_flush,
   .is_rotational = backend_is_rotational,
@@ -276,6 +292,19 @@ filter_get_size (struct backend *b, void *handle)
     return backend_get_size (b->next);
 }
 
+static int
+filter_block_size (struct backend *b, void *handle,
+                   uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  if (f->filter.block_size)
+    return f->filter.block_size (&next_ops, b->next, handle,
+                                 minimum, preferred, maximum);
+  else
+    return backend_block_size (b->next, minimum, preferred, maximum);
+}
+
 static int
 filter_can_write (struct backend *b, void *handle)
 {
@@ -494,11 +523,13 @@ static struct backend filter_functions = {
   .config_complete = filter_config_complete,
   .magic_config_key = plugin_magic_config_key,
   .preconnect = filter_preconnect,
+  .list_exports = filter_list_exports,
   .open = filter_open,
   .prepare = filter_prepare,
   .finalize = filter_finalize,
   .close = filter_close,
   .get_size = filter_get_size,
+  .block_size = filter_block_size,
   .can_write = filter_can_write,
   .can_flush = filter_can_flush,
   .is_rotational = filter_is_rotational,
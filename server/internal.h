@@ -101,11 +101,16 @@ extern struct debug_flag *debug_flags;
 extern const char *exportname;
 extern bool foreground;
 extern const char *ipaddr;
+extern unsigned listeners;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
+extern unsigned max_client_connections;
+extern unsigned max_connections;
 extern bool newstyle;
+extern bool numa;
 extern bool no_sr;
 extern const char *port;
+extern unsigned queue_timeout;
 extern bool read_only;
 extern const char *run;
 extern bool listen_stdin;
@@ -191,6 +196,9 @@ struct handle {
   unsigned char state;  /* Bitmask of HANDLE_* values */
 
   uint64_t exportsize;
+  uint32_t minimum_block_size;  /* All -1 until .block_size is called */
+  uint32_t preferred_block_size;
+  uint32_t maximum_block_size;
   int can_write;
   int can_flush;
   int is_rotational;
@@ -209,6 +217,9 @@ reset_handle (struct handle *h)
   h->handle = NULL;
   h->state = 0;
   h->exportsize = -1;
+  h->minimum_block_size = -1;
+  h->preferred_block_size = -1;
+  h->maximum_block_size = -1;
   h->can_write = -1;
   h->can_flush = -1;
   h->is_rotational = -1;
@@ -230,6 +241,7 @@ struct connection {
   int status_pipe[2]; /* track status changes via poll when nworkers > 1 */
   void *crypto_session;
   int nworkers;
+  int numa_node;                /* NUMA node of the threads, or -1. */
 
   struct handle *handles;       /* One per plugin and filter. */
   size_t nr_handles;
@@ -238,6 +250,7 @@ struct connection {
   uint32_t exportnamelen;
   uint32_t cflags;
   uint16_t eflags;
+  uint32_t max_block_size;      /* Largest read or write accepted. */
   bool using_tls;
   bool structured_replies;
   bool meta_context_base_allocation;
@@ -345,12 +358,17 @@ struct backend {
   void (*config_complete) (struct backend *);
   const char *(*magic_config_key) (struct backend *);
   int (*preconnect) (struct backend *, int readonly);
+  int (*list_exports) (struct backend *, int readonly,
+                       struct nbdkit_exports *exports);
   void *(*open) (struct backend *, int readonly);
   int (*prepare) (struct backend *, void *handle, int readonly);
   int (*finalize) (struct backend *, void *handle);
   void (*close) (struct backend *, void *handle);
 
   int64_t (*get_size) (struct backend *, void *handle);
+  int (*block_size) (struct backend *, void *handle,
+                     uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
   int (*can_write) (struct backend *, void *handle);
   int (*can_flush) (struct backend *, void *handle);
   int (*is_rotational) (struct backend *, void *handle);
@@ -405,6 +423,10 @@ extern int backend_reopen (struct backend *b, int readonly)
   __attribute__((__nonnull__ (1)));
 extern int64_t backend_get_size (struct backend *b)
   __attribute__((__nonnull__ (1)));
+extern int backend_block_size (struct backend *b,
+                               uint32_t *minimum, uint32_t *preferred,
+                               uint32_t *maximum)
+  __attribute__((__nonnull__ (1, 2, 3, 4)));
 extern int backend_can_write (struct backend *b)
   __attribute__((__nonnull__ (1)));
 extern int backend_can_flush (struct backend *b)
@@ -459,6 +481,20 @@ extern struct backend *plugin_register (size_t index, const char *filename,
                                         void *dl, struct nbdkit_plugin *(*plugin_init) (void))
   __attribute__((__nonnull__ (2, 3, 4)));
 
+/* exports.c */
+struct nbdkit_export {
+  char *name;
+  char *description;            /* May be NULL. */
+};
+
+extern struct nbdkit_exports *exports_new (void);
+extern void exports_free (struct nbdkit_exports *exps);
+extern size_t exports_count (const struct nbdkit_exports *exps)
+  __attribute__((__nonnull__ (1)));
+extern const struct nbdkit_export *exports_get
+  (const struct nbdkit_exports *exps, size_t i)
+  __attribute__((__nonnull__ (1)));
+
 /* filters.c */
 extern struct backend *filter_register (struct backend *next, size_t index,
                                         const char *filename, void *dl,
@@ -475,6 +511,13 @@ extern void unlock_request (void);
 extern void lock_unload (void);
 extern void unlock_unload (void);
 
+/* affinity.c */
+extern void affinity_init (void);
+extern void affinity_free (void);
+extern void affinity_pin_listener (unsigned i);
+extern int affinity_connection_node (int sock, unsigned i);
+extern void affinity_place_connection (int node);
+
 /* sockets.c */
 extern int *bind_unix_socket (size_t *)
   __attribute__((__nonnull__ (1)));
@@ -498,6 +541,10 @@ extern int threadlocal_get_error (void);
 extern void *threadlocal_buffer (size_t size);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
+extern void threadlocal_set_numa_node (int node);
+extern int threadlocal_get_numa_node (void);
+extern void *threadlocal_take_extents (size_t *allocated);
+extern void threadlocal_give_extents (void *extents, size_t allocated);
 
 /* Macro which sets local variable struct connection *conn from
  * thread-local storage, asserting that it is non-NULL.  If you want
@@ -80,12 +80,17 @@ bool exit_with_parent;          /* --exit-with-parent */
 const char *exportname;         /* -e */
 bool foreground;                /* -f */
 const char *ipaddr;             /* -i */
+unsigned listeners = 1;         /* --listeners */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+unsigned max_client_connections; /* --max-client-connections */
+unsigned max_connections;       /* --max-connections */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_sr;                     /* --no-sr */
+bool numa;                      /* --numa */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
+unsigned queue_timeout;         /* --queue-timeout */
 bool read_only;                 /* -r */
 const char *run;                /* --run */
 bool listen_stdin;              /* -s */
@@ -361,6 +366,28 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case LISTENERS_OPTION:
+      if (nbdkit_parse_unsigned ("listeners", optarg, &listeners) == -1)
+        exit (EXIT_FAILURE);
+      if (listeners == 0 || listeners > 1024) {
+        fprintf (stderr, "%s: --listeners must be between 1 and 1024\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case MAX_CLIENT_CONNECTIONS_OPTION:
+      if (nbdkit_parse_unsigned ("max-client-connections", optarg,
+                                 &max_client_connections) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case MAX_CONNECTIONS_OPTION:
+      if (nbdkit_parse_unsigned ("max-connections",
+                                 optarg, &max_connections) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
     case 'n':
       newstyle = true;
       break;
@@ -369,6 +396,10 @@ main (int argc, char *argv[])
       no_sr = true;
       break;
 
+    case NUMA_OPTION:
+      numa = true;
+      break;
+
     case 'o':
       newstyle = false;
       break;
@@ -388,6 +419,12 @@ main (int argc, char *argv[])
       port = optarg;
       break;
 
+    case QUEUE_TIMEOUT_OPTION:
+      if (nbdkit_parse_unsigned ("queue-timeout",
+                                 optarg, &queue_timeout) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
     case 'r':
       read_only = true;
       break;
@@ -867,6 +904,22 @@ start_serving (void)
     exit (EXIT_FAILURE);
   }
 
+  /* Multiple listeners are only possible for TCP/IP. */
+  if (listeners > 1) {
+#ifdef SO_REUSEPORT
+    if (socket_activation || listen_stdin || unixsocket || vsock) {
+      fprintf (stderr,
+               "%s: --listeners can only be used with TCP/IP\n",
+               program_name);
+      exit (EXIT_FAILURE);
+    }
+#else
+    fprintf (stderr, "%s: SO_REUSEPORT (--listeners option) "
+             "is not supported on this platform\n", program_name);
+    exit (EXIT_FAILURE);
+#endif
+  }
+
   /* Lock the process into memory if requested. */
   if (swap) {
 #ifdef HAVE_MLOCKALL
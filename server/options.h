@@ -44,10 +44,15 @@ enum {
   DUMP_PLUGIN_OPTION,
   EXIT_WITH_PARENT_OPTION,
   FILTER_OPTION,
+  LISTENERS_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  MAX_CLIENT_CONNECTIONS_OPTION,
+  MAX_CONNECTIONS_OPTION,
   NO_SR_OPTION,
+  NUMA_OPTION,
+  QUEUE_TIMEOUT_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
   SHORT_OPTIONS_OPTION,
@@ -75,17 +80,23 @@ static const struct option long_options[] = {
   { "help",             no_argument,       NULL, HELP_OPTION },
   { "ip-addr",          required_argument, NULL, 'i' },
   { "ipaddr",           required_argument, NULL, 'i' },
+  { "listeners",        required_argument, NULL, LISTENERS_OPTION },
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "max-client-connections", required_argument, NULL,
+    MAX_CLIENT_CONNECTIONS_OPTION },
+  { "max-connections",  required_argument, NULL, MAX_CONNECTIONS_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
+  { "numa",             no_argument,       NULL, NUMA_OPTION },
   { "old-style",        no_argument,       NULL, 'o' },
   { "oldstyle",         no_argument,       NULL, 'o' },
   { "pid-file",         required_argument, NULL, 'P' },
   { "pidfile",          required_argument, NULL, 'P' },
   { "port",             required_argument, NULL, 'p' },
+  { "queue-timeout",    required_argument, NULL, QUEUE_TIMEOUT_OPTION },
   { "read-only",        no_argument,       NULL, 'r' },
   { "readonly",         no_argument,       NULL, 'r' },
   { "run",              required_argument, NULL, RUN_OPTION },
@@ -159,6 +159,7 @@ plugin_dump_fields (struct backend *b)
   HAS (config_complete);
   HAS (config_help);
   HAS (preconnect);
+  HAS (list_exports);
   HAS (open);
   HAS (close);
   HAS (get_size);
@@ -185,6 +186,7 @@ plugin_dump_fields (struct backend *b)
   HAS (cache);
   HAS (thread_model);
   HAS (can_fast_zero);
+  HAS (block_size);
 #undef HAS
 
   /* Custom fields. */
@@ -247,6 +249,26 @@ plugin_preconnect (struct backend *b, int readonly)
   return p->plugin.preconnect (readonly);
 }
 
+/* Plugins which cannot list their exports, or which list none, get
+ * the -e name.
+ */
+static int
+plugin_list_exports (struct backend *b, int readonly,
+                     struct nbdkit_exports *exports)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  debug ("%s: list_exports readonly=%d", b->name, readonly);
+
+  if (p->plugin.list_exports &&
+      p->plugin.list_exports (readonly, exports) == -1)
+    return -1;
+
+  if (exports_count (exports) == 0)
+    return nbdkit_add_export (exports, exportname, NULL);
+  return 0;
+}
+
 static void *
 plugin_open (struct backend *b, int readonly)
 {
@@ -293,6 +315,20 @@ plugin_get_size (struct backend *b, void *handle)
   return p->plugin.get_size (handle);
 }
 
+static int
+plugin_block_size (struct backend *b, void *handle,
+                   uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  if (p->plugin.block_size)
+    return p->plugin.block_size (handle, minimum, preferred, maximum);
+  else {
+    *minimum = *preferred = *maximum = 0;
+    return 0;
+  }
+}
+
 static int
 plugin_can_write (struct backend *b, void *handle)
 {
@@ -671,11 +707,13 @@ static struct backend plugin_functions = {
   .config_complete = plugin_config_complete,
   .magic_config_key = plugin_magic_config_key,
   .preconnect = plugin_preconnect,
+  .list_exports = plugin_list_exports,
   .open = plugin_open,
   .prepare = plugin_prepare,
   .finalize = plugin_finalize,
   .close = plugin_close,
   .get_size = plugin_get_size,
+  .block_size = plugin_block_size,
   .can_write = plugin_can_write,
   .can_flush = plugin_can_flush,
   .is_rotational = plugin_is_rotational,
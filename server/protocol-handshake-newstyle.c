@@ -41,6 +41,7 @@
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
 
@@ -75,18 +76,23 @@ send_newstyle_option_reply (uint32_t option, uint32_t reply)
   return 0;
 }
 
+/* Send an export name, followed by the optional description. */
 static int
-send_newstyle_option_reply_exportname (uint32_t option, uint32_t reply)
+send_newstyle_option_reply_exportname (uint32_t option, uint32_t reply,
+                                       const char *name,
+                                       const char *description)
 {
   GET_CONN;
   struct nbd_fixed_new_option_reply fixed_new_option_reply;
-  size_t name_len = strlen (exportname);
+  size_t name_len = strlen (name);
+  size_t desc_len = description ? strlen (description) : 0;
   uint32_t len;
 
   fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
   fixed_new_option_reply.option = htobe32 (option);
   fixed_new_option_reply.reply = htobe32 (reply);
-  fixed_new_option_reply.replylen = htobe32 (name_len + sizeof (len));
+  fixed_new_option_reply.replylen =
+    htobe32 (sizeof (len) + name_len + desc_len);
 
   if (conn->send (&fixed_new_option_reply,
                   sizeof fixed_new_option_reply, SEND_MORE) == -1) {
@@ -100,11 +106,16 @@ send_newstyle_option_reply_exportname (uint32_t option, uint32_t reply)
                   name_of_nbd_opt (option), "sending length");
     return -1;
   }
-  if (conn->send (exportname, name_len, 0) == -1) {
+  if (conn->send (name, name_len, desc_len > 0 ? SEND_MORE : 0) == -1) {
     nbdkit_error ("write: %s: %s: %m",
                   name_of_nbd_opt (option), "sending export name");
     return -1;
   }
+  if (desc_len > 0 && conn->send (description, desc_len, 0) == -1) {
+    nbdkit_error ("write: %s: %s: %m",
+                  name_of_nbd_opt (option), "sending export description");
+    return -1;
+  }
 
   return 0;
 }
@@ -135,6 +146,53 @@ send_newstyle_option_reply_info_export (uint32_t option, uint32_t reply,
   return 0;
 }
 
+/* Send NBD_INFO_BLOCK_SIZE.  A backend without constraints only
+ * needs the limit which nbdkit itself places on reads and writes.
+ */
+static int
+send_newstyle_option_reply_info_block_size (uint32_t option, uint32_t reply)
+{
+  GET_CONN;
+  struct nbd_fixed_new_option_reply fixed_new_option_reply;
+  struct nbd_fixed_new_option_reply_info_block_size block_size;
+  uint32_t minimum, preferred, maximum;
+
+  /* Already cached by protocol_common_open. */
+  if (backend_block_size (top, &minimum, &preferred, &maximum) == -1)
+    return -1;
+  if (minimum == 0) {
+    minimum = 1;
+    preferred = 4096;
+    maximum = MAX_REQUEST_SIZE;
+  }
+  else {
+    preferred = MIN (preferred, MAX_REQUEST_SIZE);
+    maximum = MIN (maximum, MAX_REQUEST_SIZE);
+  }
+  conn->max_block_size = maximum;
+
+  debug ("newstyle negotiation: %s: block size "
+         "minimum=%" PRIu32 " preferred=%" PRIu32 " maximum=%" PRIu32,
+         name_of_nbd_opt (option), minimum, preferred, maximum);
+  fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
+  fixed_new_option_reply.option = htobe32 (option);
+  fixed_new_option_reply.reply = htobe32 (reply);
+  fixed_new_option_reply.replylen = htobe32 (sizeof block_size);
+  block_size.info = htobe16 (NBD_INFO_BLOCK_SIZE);
+  block_size.minimum = htobe32 (minimum);
+  block_size.preferred = htobe32 (preferred);
+  block_size.maximum = htobe32 (maximum);
+
+  if (conn->send (&fixed_new_option_reply,
+                  sizeof fixed_new_option_reply, SEND_MORE) == -1 ||
+      conn->send (&block_size, sizeof block_size, 0) == -1) {
+    nbdkit_error ("write: %s: %m", name_of_nbd_opt (option));
+    return -1;
+  }
+
+  return 0;
+}
+
 static int
 send_newstyle_option_reply_meta_context (uint32_t option, uint32_t reply,
                                          uint32_t context_id,
@@ -363,11 +421,37 @@ negotiate_handshake_newstyle_options (void)
         continue;
       }
 
-      /* Send back the exportname. */
-      debug ("newstyle negotiation: %s: advertising export '%s'",
-             name_of_nbd_opt (option), exportname);
-      if (send_newstyle_option_reply_exportname (option, NBD_REP_SERVER) == -1)
-        return -1;
+      /* Send back the list of exports from the plugin, which is the
+       * -e name unless the plugin or a filter can list them.
+       */
+      {
+        struct nbdkit_exports *exports;
+        const struct nbdkit_export *e;
+        size_t i;
+
+        exports = exports_new ();
+        if (exports == NULL)
+          return -1;
+        if (top->list_exports (top, read_only, exports) == -1) {
+          exports_free (exports);
+          if (send_newstyle_option_reply (option, NBD_REP_ERR_PLATFORM)
+              == -1)
+            return -1;
+          continue;
+        }
+        for (i = 0; i < exports_count (exports); ++i) {
+          e = exports_get (exports, i);
+          debug ("newstyle negotiation: %s: advertising export '%s'",
+                 name_of_nbd_opt (option), e->name);
+          if (send_newstyle_option_reply_exportname (option, NBD_REP_SERVER,
+                                                     e->name,
+                                                     e->description) == -1) {
+            exports_free (exports);
+            return -1;
+          }
+        }
+        exports_free (exports);
+      }
 
       if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
         return -1;
@@ -433,6 +517,8 @@ negotiate_handshake_newstyle_options (void)
         uint32_t exportnamelen;
         uint16_t nrinfos;
         uint16_t info;
+        uint32_t minimum, preferred, maximum;
+        bool sent_block_size = false;
         size_t i;
 
         /* Validate the name length and number of INFO requests. */
@@ -492,16 +578,24 @@ negotiate_handshake_newstyle_options (void)
                                                     exportsize) == -1)
           return -1;
 
-        /* For now we ignore all other info requests (but we must
-         * ignore NBD_INFO_EXPORT if it was requested, because we
-         * replied already above).  Therefore this loop doesn't do
-         * much at the moment.
+        /* Reply to the info requests we understand, ignoring
+         * NBD_INFO_EXPORT if it was requested because we replied
+         * already above.
          */
         for (i = 0; i < nrinfos; ++i) {
           memcpy (&info, &data[4 + exportnamelen + 2 + i*2], 2);
           info = be16toh (info);
           switch (info) {
           case NBD_INFO_EXPORT: /* ignore - reply sent above */ break;
+          case NBD_INFO_BLOCK_SIZE:
+            if (sent_block_size)
+              break;
+            if (send_newstyle_option_reply_info_block_size (option,
+                                                            NBD_REP_INFO)
+                == -1)
+              return -1;
+            sent_block_size = true;
+            break;
           default:
             debug ("newstyle negotiation: %s: "
                    "ignoring NBD_INFO_* request %u (%s)",
@@ -509,6 +603,20 @@ negotiate_handshake_newstyle_options (void)
             break;
           }
         }
+
+        /* If the backend has real constraints then advertise them
+         * even if the client did not ask, since the spec allows it
+         * and a client which ignores them will still work.
+         */
+        if (!sent_block_size) {
+          if (backend_block_size (top, &minimum, &preferred, &maximum) == -1)
+            return -1;
+          if (minimum != 0 &&
+              send_newstyle_option_reply_info_block_size (option,
+                                                          NBD_REP_INFO)
+              == -1)
+            return -1;
+        }
       }
 
       /* Unlike NBD_OPT_EXPORT_NAME, NBD_OPT_GO sends back an ACK
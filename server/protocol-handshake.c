@@ -62,7 +62,7 @@ protocol_handshake ()
  *
  * - call the backend .open method
  *
- * - get the export size
+ * - get the export size and block size constraints
  *
  * - compute the eflags (same between oldstyle and newstyle
  *   protocols)
@@ -76,6 +76,7 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags)
 {
   GET_CONN;
   int64_t size;
+  uint32_t minimum, preferred, maximum;
   uint16_t eflags = NBD_FLAG_HAS_FLAGS;
   int fl;
 
@@ -95,6 +96,13 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags)
     return -1;
   }
 
+  /* Only advertised by the newstyle protocol, which may then lower
+   * the largest request accepted from the client.
+   */
+  if (backend_block_size (top, &minimum, &preferred, &maximum) == -1)
+    return -1;
+  conn->max_block_size = MAX_REQUEST_SIZE;
+
   /* Check all flags even if they won't be advertised, to prime the
    * cache and make later request validation easier.
    */
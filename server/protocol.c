@@ -146,12 +146,15 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     return false;
   }
 
-  /* Refuse over-large read and write requests. */
+  /* Refuse over-large read and write requests.  The limit is lower
+   * than MAX_REQUEST_SIZE if a smaller maximum block size was
+   * advertised to the client.
+   */
   if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
-      count > MAX_REQUEST_SIZE) {
+      count > conn->max_block_size) {
     nbdkit_error ("invalid request: %s: data request is too large (%" PRIu32
-                  " > %d)",
-                  name_of_nbd_cmd (cmd), count, MAX_REQUEST_SIZE);
+                  " > %" PRIu32 ")",
+                  name_of_nbd_cmd (cmd), count, conn->max_block_size);
     *error = ENOMEM;
     return false;
   }
@@ -38,8 +38,10 @@
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -163,6 +165,7 @@ bind_tcpip_socket (size_t *nr_socks)
   int err, opt;
   int *socks = NULL;
   bool addr_in_use = false;
+  unsigned i;
 
   if (port == NULL)
     port = "10809";
@@ -184,58 +187,75 @@ bind_tcpip_socket (size_t *nr_socks)
   *nr_socks = 0;
 
   for (a = ai; a != NULL; a = a->ai_next) {
-    int sock;
+    for (i = 0; i < listeners; ++i) {
+      int sock;
 
-    set_selinux_label ();
+      set_selinux_label ();
 
 #ifdef SOCK_CLOEXEC
-    sock = socket (a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+      sock = socket (a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                     a->ai_protocol);
 #else
-    /* Fortunately, this code is only run at startup, so there is no
-     * risk of the fd leaking to a plugin's fork()
-     */
-    sock = set_cloexec (socket (a->ai_family, a->ai_socktype, a->ai_protocol));
+      /* Fortunately, this code is only run at startup, so there is no
+       * risk of the fd leaking to a plugin's fork()
+       */
+      sock = set_cloexec (socket (a->ai_family, a->ai_socktype,
+                                  a->ai_protocol));
 #endif
-    if (sock == -1) {
-      perror ("bind_tcpip_socket: socket");
-      exit (EXIT_FAILURE);
-    }
+      if (sock == -1) {
+        perror ("bind_tcpip_socket: socket");
+        exit (EXIT_FAILURE);
+      }
 
-    opt = 1;
-    if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
-      perror ("setsockopt: SO_REUSEADDR");
+      opt = 1;
+      if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
+        perror ("setsockopt: SO_REUSEADDR");
+
+#ifdef SO_REUSEPORT
+      /* With --listeners, several sockets are bound to each address
+       * and the kernel spreads incoming connections between them.
+       */
+      if (listeners > 1 &&
+          setsockopt (sock, SOL_SOCKET, SO_REUSEPORT,
+                      &opt, sizeof opt) == -1) {
+        perror ("setsockopt: SO_REUSEPORT");
+        exit (EXIT_FAILURE);
+      }
+#endif
 
 #ifdef IPV6_V6ONLY
-    if (a->ai_family == PF_INET6) {
-      if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
-        perror ("setsockopt: IPv6 only");
-    }
+      if (a->ai_family == PF_INET6) {
+        if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                        &opt, sizeof opt) == -1)
+          perror ("setsockopt: IPv6 only");
+      }
 #endif
 
-    if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
-      if (errno == EADDRINUSE) {
-        addr_in_use = true;
-        close (sock);
-        continue;
+      if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
+        if (errno == EADDRINUSE && i == 0) {
+          addr_in_use = true;
+          close (sock);
+          break;
+        }
+        perror ("bind");
+        exit (EXIT_FAILURE);
       }
-      perror ("bind");
-      exit (EXIT_FAILURE);
-    }
 
-    if (listen (sock, SOMAXCONN) == -1) {
-      perror ("listen");
-      exit (EXIT_FAILURE);
-    }
+      if (listen (sock, SOMAXCONN) == -1) {
+        perror ("listen");
+        exit (EXIT_FAILURE);
+      }
 
-    clear_selinux_label ();
+      clear_selinux_label ();
 
-    (*nr_socks)++;
-    socks = realloc (socks, sizeof (int) * (*nr_socks));
-    if (!socks) {
-      perror ("realloc");
-      exit (EXIT_FAILURE);
+      (*nr_socks)++;
+      socks = realloc (socks, sizeof (int) * (*nr_socks));
+      if (!socks) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
+      }
+      socks[*nr_socks - 1] = sock;
     }
-    socks[*nr_socks - 1] = sock;
   }
 
   freeaddrinfo (ai);
@@ -327,50 +347,281 @@ bind_vsock (size_t *nr_socks)
  * worker independent threads in the current implementation).  The
  * purpose of this is so we can wait for all the connection threads to
  * exit before we return from accept_incoming_connections, so that
- * unload-time actions happen with no connections open.
+ * unload-time actions happen with no connections open.  It is also
+ * used to enforce --max-connections.
  */
 static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t count_cond = PTHREAD_COND_INITIALIZER;
 static unsigned count = 0;
 
+/* Number of connections from each client IP address, if
+ * --max-client-connections is used.  Protected by count_mutex.
+ */
+struct client {
+  struct sockaddr_storage addr;
+  unsigned count;
+};
+static struct client *clients;
+static size_t nr_clients;
+
+/* Connections which have been accepted but are waiting for a free
+ * slot.  Protected by count_mutex.  Once it is full we stop
+ * accepting, so further connections wait in the kernel's listen
+ * backlog.
+ */
+#define MAX_QUEUED_CONNECTIONS 1024
+
 struct thread_data {
   int sock;
   size_t instance_num;
+  int numa_node;                /* NUMA node for the connection, or -1. */
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct timespec deadline;     /* When queued, the time to give up. */
 };
 
+static struct thread_data *queue[MAX_QUEUED_CONNECTIONS];
+static size_t nr_queued;
+
+/* Connection threads write to this pipe when they exit, to wake up
+ * the accept threads if connections are queued.
+ */
+static int wakeup_fd = -1, write_wakeup_fd = -1;
+
+static bool
+limit_connections (void)
+{
+  return max_connections > 0 || max_client_connections > 0;
+}
+
+/* Return true if addr is an IP address subject to
+ * --max-client-connections.
+ */
+static bool
+is_ip_client (const struct sockaddr_storage *addr)
+{
+  return max_client_connections > 0 &&
+    (addr->ss_family == AF_INET || addr->ss_family == AF_INET6);
+}
+
+/* Compare the IP addresses (not the ports) of two clients. */
+static bool
+same_client (const struct sockaddr_storage *a,
+             const struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family)
+    return false;
+  if (a->ss_family == AF_INET)
+    return memcmp (&((struct sockaddr_in *) a)->sin_addr,
+                   &((struct sockaddr_in *) b)->sin_addr,
+                   sizeof (struct in_addr)) == 0;
+  else
+    return memcmp (&((struct sockaddr_in6 *) a)->sin6_addr,
+                   &((struct sockaddr_in6 *) b)->sin6_addr,
+                   sizeof (struct in6_addr)) == 0;
+}
+
+/* Must be called with count_mutex held. */
+static struct client *
+find_client (const struct sockaddr_storage *addr)
+{
+  size_t i;
+
+  for (i = 0; i < nr_clients; ++i)
+    if (same_client (&clients[i].addr, addr))
+      return &clients[i];
+  return NULL;
+}
+
+/* Can a connection from addr start now?  Must be called with
+ * count_mutex held.
+ */
+static bool
+can_start (const struct sockaddr_storage *addr)
+{
+  struct client *client;
+
+  if (max_connections > 0 && count >= max_connections)
+    return false;
+  if (is_ip_client (addr)) {
+    client = find_client (addr);
+    if (client && client->count >= max_client_connections)
+      return false;
+  }
+  return true;
+}
+
 static void *
 start_thread (void *datav)
 {
   struct thread_data *data = datav;
+  struct client *client;
+  char c = 0;
 
   debug ("accepted connection");
 
-  pthread_mutex_lock (&count_mutex);
-  count++;
-  pthread_mutex_unlock (&count_mutex);
+  affinity_place_connection (data->numa_node);
 
   /* Set thread-local data. */
   threadlocal_new_server_thread ();
   threadlocal_set_instance_num (data->instance_num);
+  threadlocal_set_numa_node (data->numa_node);
 
   handle_single_connection (data->sock, data->sock);
 
-  free (data);
-
   pthread_mutex_lock (&count_mutex);
   count--;
+  if (is_ip_client (&data->addr)) {
+    client = find_client (&data->addr);
+    assert (client != NULL);
+    if (--client->count == 0)
+      *client = clients[--nr_clients];
+  }
+  /* This is done with the lock held so that the main thread cannot
+   * close the pipe under us.
+   */
+  if (write_wakeup_fd >= 0) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+    write (write_wakeup_fd, &c, 1);
+#pragma GCC diagnostic pop
+  }
   pthread_cond_signal (&count_cond);
   pthread_mutex_unlock (&count_mutex);
 
+  free (data);
+
   return NULL;
 }
 
+/* Start a thread to handle this connection.  Note we always do this
+ * even for non-threaded plugins.  There are mutexes in plugins.c
+ * which ensure that non-threaded plugins are handled correctly.
+ *
+ * Must be called with count_mutex held and can_start true.
+ */
 static void
-accept_connection (int listen_sock)
+start_connection (struct thread_data *thread_data)
 {
   int err;
   pthread_attr_t attrs;
   pthread_t thread;
+  struct client *client = NULL, *new_clients;
+
+  if (is_ip_client (&thread_data->addr)) {
+    client = find_client (&thread_data->addr);
+    if (client == NULL) {
+      new_clients = realloc (clients, (nr_clients+1) * sizeof *clients);
+      if (new_clients == NULL) {
+        perror ("realloc");
+        close (thread_data->sock);
+        free (thread_data);
+        return;
+      }
+      clients = new_clients;
+      client = &clients[nr_clients++];
+      client->addr = thread_data->addr;
+      client->count = 0;
+    }
+  }
+
+  /* Count the connection before the thread starts, so that
+   * accept_incoming_connections cannot miss it when waiting for
+   * connections to finish.
+   */
+  count++;
+  if (client)
+    client->count++;
+
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attrs, start_thread, thread_data);
+  pthread_attr_destroy (&attrs);
+  if (unlikely (err != 0)) {
+    fprintf (stderr, "%s: pthread_create: %s\n", program_name, strerror (err));
+    count--;
+    if (client && --client->count == 0)
+      *client = clients[--nr_clients];
+    close (thread_data->sock);
+    free (thread_data);
+    return;
+  }
+
+  /* If the thread starts successfully, then it is responsible for
+   * closing the socket and freeing thread_data.
+   */
+}
+
+/* Start as many queued connections as the limits allow, in the order
+ * they arrived, and drop any which have waited too long.
+ */
+static void
+process_queue (void)
+{
+  size_t i, j;
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_mutex);
+  for (i = j = 0; i < nr_queued; ++i) {
+    struct thread_data *data = queue[i];
+
+    if (can_start (&data->addr)) {
+      debug ("starting queued connection");
+      start_connection (data);
+    }
+    else if (queue_timeout > 0 &&
+             (now.tv_sec > data->deadline.tv_sec ||
+              (now.tv_sec == data->deadline.tv_sec &&
+               now.tv_nsec >= data->deadline.tv_nsec))) {
+      debug ("dropping queued connection after %u seconds", queue_timeout);
+      close (data->sock);
+      free (data);
+    }
+    else
+      queue[j++] = data;
+  }
+  nr_queued = j;
+}
+
+/* Return the poll timeout in milliseconds until the first queued
+ * connection times out, or -1 if there is no need to wake up.
+ */
+static int
+queue_poll_timeout (void)
+{
+  struct timespec now;
+  int64_t ms, min_ms = -1;
+  size_t i;
+
+  if (queue_timeout == 0)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_mutex);
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  for (i = 0; i < nr_queued; ++i) {
+    ms = (queue[i]->deadline.tv_sec - now.tv_sec) * INT64_C(1000) +
+      (queue[i]->deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+    if (ms < 0)
+      ms = 0;
+    if (min_ms == -1 || ms < min_ms)
+      min_ms = ms;
+  }
+  return min_ms;
+}
+
+static bool
+queue_is_full (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_mutex);
+  return nr_queued >= MAX_QUEUED_CONNECTIONS;
+}
+
+static void
+accept_connection (int listen_sock, unsigned listener)
+{
   struct thread_data *thread_data;
   static size_t instance_num = 1;
   const int flag = 1;
@@ -381,10 +632,12 @@ accept_connection (int listen_sock)
     return;
   }
 
-  thread_data->instance_num = instance_num++;
  again:
+  thread_data->addrlen = sizeof thread_data->addr;
 #ifdef HAVE_ACCEPT4
-  thread_data->sock = accept4 (listen_sock, NULL, NULL, SOCK_CLOEXEC);
+  thread_data->sock = accept4 (listen_sock,
+                               (struct sockaddr *) &thread_data->addr,
+                               &thread_data->addrlen, SOCK_CLOEXEC);
 #else
   /* If we were fully parallel, then this function could be accepting
    * connections in one thread while another thread could be in a
@@ -396,7 +649,10 @@ accept_connection (int listen_sock)
   assert (backend->thread_model (backend) <=
           NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS);
   lock_request (NULL);
-  thread_data->sock = set_cloexec (accept (listen_sock, NULL, NULL));
+  thread_data->sock = set_cloexec (accept (listen_sock,
+                                           (struct sockaddr *)
+                                           &thread_data->addr,
+                                           &thread_data->addrlen));
   unlock_request (NULL);
 #endif
   if (thread_data->sock == -1) {
@@ -412,24 +668,28 @@ accept_connection (int listen_sock)
    */
   setsockopt (thread_data->sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
 
-  /* Start a thread to handle this connection.  Note we always do this
-   * even for non-threaded plugins.  There are mutexes in plugins.c
-   * which ensure that non-threaded plugins are handled correctly.
+  thread_data->numa_node =
+    affinity_connection_node (thread_data->sock, listener);
+
+  /* If we are over the connection limits, queue the connection until
+   * another one finishes.
    */
-  pthread_attr_init (&attrs);
-  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
-  err = pthread_create (&thread, &attrs, start_thread, thread_data);
-  pthread_attr_destroy (&attrs);
-  if (unlikely (err != 0)) {
-    fprintf (stderr, "%s: pthread_create: %s\n", program_name, strerror (err));
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_mutex);
+  thread_data->instance_num = instance_num++;
+  if (can_start (&thread_data->addr))
+    start_connection (thread_data);
+  else if (nr_queued < MAX_QUEUED_CONNECTIONS) {
+    debug ("queuing connection: too many connections");
+    clock_gettime (CLOCK_MONOTONIC, &thread_data->deadline);
+    thread_data->deadline.tv_sec += queue_timeout;
+    queue[nr_queued++] = thread_data;
+  }
+  else {
+    /* Another listener filled the queue since we checked. */
+    debug ("dropping connection: queue is full");
     close (thread_data->sock);
     free (thread_data);
-    return;
   }
-
-  /* If the thread starts successfully, then it is responsible for
-   * closing the socket and freeing thread_data.
-   */
 }
 
 /* Check the list of sockets plus quit_fd until a POLLIN event occurs
@@ -440,30 +700,38 @@ accept_connection (int listen_sock)
  *
  * If POLLIN occurs on one of the sockets, call
  * accept_connection (socks[i]) on each of them.
+ *
+ * When connections are limited we also wait on wakeup_fd, and we stop
+ * listening while the queue of waiting connections is full.
  */
 static void
-check_sockets_and_quit_fd (int *socks, size_t nr_socks)
+check_sockets_and_quit_fd (int *socks, size_t nr_socks, unsigned listener)
 {
   size_t i;
   int r;
+  char buf[64];
+  const bool listening = !queue_is_full ();
 
   CLEANUP_FREE struct pollfd *fds =
-    malloc (sizeof (struct pollfd) * (nr_socks+1));
+    malloc (sizeof (struct pollfd) * (nr_socks+2));
   if (fds == NULL) {
     perror ("malloc");
     exit (EXIT_FAILURE);
   }
 
   for (i = 0; i < nr_socks; ++i) {
-    fds[i].fd = socks[i];
+    fds[i].fd = listening ? socks[i] : -1;
     fds[i].events = POLLIN;
     fds[i].revents = 0;
   }
   fds[nr_socks].fd = quit_fd;
   fds[nr_socks].events = POLLIN;
   fds[nr_socks].revents = 0;
+  fds[nr_socks+1].fd = wakeup_fd;
+  fds[nr_socks+1].events = POLLIN;
+  fds[nr_socks+1].revents = 0;
 
-  r = poll (fds, nr_socks + 1, -1);
+  r = poll (fds, nr_socks + 2, queue_poll_timeout ());
   if (r == -1) {
     if (errno == EINTR || errno == EAGAIN)
       return;
@@ -478,10 +746,109 @@ check_sockets_and_quit_fd (int *socks, size_t nr_socks)
   if (fds[nr_socks].revents & POLLIN)
     return;
 
+  /* Connections may have finished or timed out. */
+  if (fds[nr_socks+1].revents & POLLIN) {
+    while (read (wakeup_fd, buf, sizeof buf) > 0)
+      ;
+  }
+  process_queue ();
+
   for (i = 0; i < nr_socks; ++i) {
-    if (fds[i].revents & POLLIN)
-      accept_connection (socks[i]);
+    if ((fds[i].revents & POLLIN) && !queue_is_full ())
+      accept_connection (socks[i], listener);
+  }
+}
+
+static void
+set_up_wakeup_pipe (void)
+{
+  int fds[2];
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+#else
+  /* See the comment in set_up_quit_pipe. */
+  if (pipe (fds) < 0) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  if (set_cloexec (fds[0]) == -1 || set_cloexec (fds[1]) == -1 ||
+      set_nonblock (fds[0]) == -1 || set_nonblock (fds[1]) == -1) {
+    perror ("fcntl");
+    exit (EXIT_FAILURE);
+  }
+#endif
+  wakeup_fd = fds[0];
+  write_wakeup_fd = fds[1];
+}
+
+/* With --listeners, bind_tcpip_socket binds each address to that
+ * many consecutive sockets, so listener i serves every socket whose
+ * index modulo listeners is i.
+ */
+struct listener {
+  unsigned i;
+  pthread_t thread;
+  int *socks;
+  size_t nr_socks;
+};
+
+static void *
+listener_thread (void *datav)
+{
+  struct listener *l = datav;
+
+  affinity_pin_listener (l->i);
+
+  while (!quit)
+    check_sockets_and_quit_fd (l->socks, l->nr_socks, l->i);
+
+  return NULL;
+}
+
+static void
+run_listeners (int *socks, size_t nr_socks)
+{
+  struct listener *l;
+  unsigned i;
+  size_t j;
+  int err;
+
+  assert (nr_socks % listeners == 0);
+
+  l = calloc (listeners, sizeof *l);
+  if (l == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < listeners; ++i) {
+    l[i].i = i;
+    l[i].socks = malloc (sizeof (int) * (nr_socks / listeners));
+    if (l[i].socks == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    for (j = i; j < nr_socks; j += listeners)
+      l[i].socks[l[i].nr_socks++] = socks[j];
+  }
+
+  for (i = 0; i < listeners; ++i) {
+    err = pthread_create (&l[i].thread, NULL, listener_thread, &l[i]);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < listeners; ++i) {
+    pthread_join (l[i].thread, NULL);
+    free (l[i].socks);
   }
+
+  free (l);
 }
 
 void
@@ -490,8 +857,24 @@ accept_incoming_connections (int *socks, size_t nr_socks)
   size_t i;
   int err;
 
-  while (!quit)
-    check_sockets_and_quit_fd (socks, nr_socks);
+  if (limit_connections ())
+    set_up_wakeup_pipe ();
+  if (listeners > 1 || numa)
+    affinity_init ();
+
+  if (listeners > 1)
+    run_listeners (socks, nr_socks);
+  else {
+    while (!quit)
+      check_sockets_and_quit_fd (socks, nr_socks, 0);
+  }
+
+  /* Drop connections which never started. */
+  for (i = 0; i < nr_queued; ++i) {
+    close (queue[i]->sock);
+    free (queue[i]);
+  }
+  nr_queued = 0;
 
   /* Wait for all threads to exit. */
   pthread_mutex_lock (&count_mutex);
@@ -509,4 +892,10 @@ accept_incoming_connections (int *socks, size_t nr_socks)
   for (i = 0; i < nr_socks; ++i)
     close (socks[i]);
   free (socks);
+  free (clients);
+  affinity_free ();
+  if (wakeup_fd >= 0) {
+    close (wakeup_fd);
+    close (write_wakeup_fd);
+  }
 }
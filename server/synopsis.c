@@ -0,0 +1,24 @@
+"nbdkit [-D|--debug PLUGIN|FILTER|nbdkit.FLAG=N]\n"
+"       [-e|--exportname EXPORTNAME] [--exit-with-parent]\n"
+"       [--filter FILTER ...] [-f|--foreground]\n"
+"       [-g|--group GROUP] [-i|--ipaddr IPADDR] [--listeners N]\n"
+"       [--log stderr|syslog|null]\n"
+"       [--max-connections N] [--max-client-connections N]\n"
+"       [-n|--newstyle] [--mask-handshake MASK] [--no-sr] [--numa]\n"
+"       [-o|--oldstyle]\n"
+"       [-P|--pidfile PIDFILE]\n"
+"       [-p|--port PORT] [--queue-timeout SECS] [-r|--readonly]\n"
+"       [--run CMD] [-s|--single] [--selinux-label LABEL] [--swap]\n"
+"       [-t|--threads THREADS]\n"
+"       [--tls off|on|require]\n"
+"       [--tls-certificates /path/to/certificates]\n"
+"       [--tls-psk /path/to/pskfile] [--tls-verify-peer]\n"
+"       [-U|--unix SOCKET] [-u|--user USER]\n"
+"       [-v|--verbose] [-V|--version] [--vsock]\n"
+"       PLUGIN [[KEY=]VALUE [KEY=VALUE [...]]]\n"
+"\n"
+"nbdkit --dump-config\n"
+"\n"
+"nbdkit PLUGIN --dump-plugin\n"
+"\n"
+"nbdkit --help\n"
@@ -67,6 +67,19 @@ int connection_get_status (void)
   abort ();
 }
 
+void *
+threadlocal_take_extents (size_t *allocated)
+{
+  *allocated = 0;
+  return NULL;
+}
+
+void
+threadlocal_give_extents (void *extents, size_t allocated)
+{
+  free (extents);
+}
+
 static bool
 test_nbdkit_parse_size (void)
 {
@@ -431,6 +444,118 @@ test_nbdkit_read_password (void)
   return pass;
 }
 
+/* Check that the list matches the expected (offset, length, type)
+ * triples.
+ */
+static bool
+check_extents (const char *what, const struct nbdkit_extents *exts,
+               size_t n, const struct nbdkit_extent *expected)
+{
+  size_t i;
+
+  if (nbdkit_extents_count (exts) != n) {
+    fprintf (stderr, "%s: expected %zu extents, got %zu\n",
+             what, n, nbdkit_extents_count (exts));
+    return false;
+  }
+  for (i = 0; i < n; ++i) {
+    struct nbdkit_extent e = nbdkit_get_extent (exts, i);
+
+    if (e.offset != expected[i].offset ||
+        e.length != expected[i].length ||
+        e.type != expected[i].type) {
+      fprintf (stderr, "%s: extent %zu: expected %" PRIu64 "/%" PRIu64 "/%u, "
+               "got %" PRIu64 "/%" PRIu64 "/%u\n",
+               what, i,
+               expected[i].offset, expected[i].length, expected[i].type,
+               e.offset, e.length, e.type);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+test_nbdkit_extents (void)
+{
+  bool pass = true;
+  const struct nbdkit_extent a[] = {
+    { 0, 100, 0 }, { 100, 100, 3 }, { 200, 100, 0 }, { 300, 100, 3 },
+  };
+  const struct nbdkit_extent b[] = {
+    { 50, 100, 3 }, { 150, 200, 1 }, { 350, 50, 3 },
+  };
+  struct nbdkit_extents *ea, *eb, *dst;
+
+  /* Bulk append, clipped to the range of the list. */
+  ea = nbdkit_extents_new (0, 400);
+  eb = nbdkit_extents_new (50, 400);
+  if (!ea || !eb ||
+      nbdkit_extents_append (ea, a, 4) == -1 ||
+      nbdkit_extents_append (eb, b, 3) == -1) {
+    fprintf (stderr, "nbdkit_extents_append failed\n");
+    return false;
+  }
+  pass &= check_extents ("append", ea, 4, a);
+
+  /* Copy a slice with a shift. */
+  dst = nbdkit_extents_new (120, 250);
+  if (!dst || nbdkit_extents_copy (dst, ea, 20) == -1) {
+    fprintf (stderr, "nbdkit_extents_copy failed\n");
+    pass = false;
+  }
+  else {
+    const struct nbdkit_extent expected[] = {
+      { 120, 100, 3 }, { 220, 30, 0 },
+    };
+    pass &= check_extents ("copy", dst, 2, expected);
+  }
+  nbdkit_extents_free (dst);
+
+  /* A negative shift below offset 0 is an error. */
+  error_flagged = false;
+  dst = nbdkit_extents_new (0, 400);
+  if (!dst || nbdkit_extents_copy (dst, ea, -50) != -1 || !error_flagged) {
+    fprintf (stderr, "nbdkit_extents_copy did not reject negative offset\n");
+    pass = false;
+  }
+  nbdkit_extents_free (dst);
+  error_flagged = false;
+
+  /* Intersect the two lists.  The result starts where both do. */
+  dst = nbdkit_extents_new (50, 400);
+  if (!dst || nbdkit_extents_intersect (dst, ea, eb) == -1) {
+    fprintf (stderr, "nbdkit_extents_intersect failed\n");
+    pass = false;
+  }
+  else {
+    const struct nbdkit_extent expected[] = {
+      { 50, 50, 0 }, { 100, 50, 3 }, { 150, 50, 1 }, { 200, 100, 0 },
+      { 300, 50, 1 }, { 350, 50, 3 },
+    };
+    pass &= check_extents ("intersect", dst, 6, expected);
+  }
+  nbdkit_extents_free (dst);
+
+  /* If dst starts before the overlap, the leading part is data. */
+  dst = nbdkit_extents_new (0, 160);
+  if (!dst || nbdkit_extents_intersect (dst, ea, eb) == -1) {
+    fprintf (stderr, "nbdkit_extents_intersect failed\n");
+    pass = false;
+  }
+  else {
+    const struct nbdkit_extent expected[] = {
+      { 0, 100, 0 }, { 100, 50, 3 }, { 150, 10, 1 },
+    };
+    pass &= check_extents ("intersect leading", dst, 3, expected);
+  }
+  nbdkit_extents_free (dst);
+
+  nbdkit_extents_free (ea);
+  nbdkit_extents_free (eb);
+  return pass;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -438,6 +563,7 @@ main (int argc, char *argv[])
   pass &= test_nbdkit_parse_size ();
   pass &= test_nbdkit_parse_ints ();
   pass &= test_nbdkit_read_password ();
+  pass &= test_nbdkit_extents ();
   /* nbdkit_absolute_path and nbdkit_nanosleep not unit-tested here, but
    * get plenty of coverage in the main testsuite.
    */
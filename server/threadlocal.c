@@ -59,6 +59,9 @@ struct threadlocal {
   void *buffer;
   size_t buffer_size;
   struct connection *conn;
+  void *extents;                /* Spare nbdkit_extents array. */
+  size_t extents_allocated;
+  int numa_node;                /* -1 if unknown. */
 };
 
 static pthread_key_t threadlocal_key;
@@ -70,6 +73,7 @@ free_threadlocal (void *threadlocalv)
 
   free (threadlocal->name);
   free (threadlocal->buffer);
+  free (threadlocal->extents);
   free (threadlocal);
 }
 
@@ -97,6 +101,7 @@ threadlocal_new_server_thread (void)
     perror ("malloc");
     exit (EXIT_FAILURE);
   }
+  threadlocal->numa_node = -1;
   err = pthread_setspecific (threadlocal_key, threadlocal);
   if (err) {
     errno = err;
@@ -193,6 +198,9 @@ threadlocal_buffer (size_t size)
   if (!threadlocal)
     abort ();
 
+  /* The buffer is first touched by the thread which uses it, so with
+   * --numa it is allocated on that thread's node.
+   */
   if (threadlocal->buffer_size < size) {
     void *ptr;
 
@@ -227,3 +235,67 @@ threadlocal_get_conn (void)
 
   return threadlocal ? threadlocal->conn : NULL;
 }
+
+/* Don't keep very large extents arrays around after use. */
+#define MAX_SPARE_EXTENTS 65536
+
+/* Take the spare array of extents kept by this thread, if any.  The
+ * number of extents it can hold is returned in *allocated.
+ */
+void *
+threadlocal_take_extents (size_t *allocated)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  void *ret;
+
+  if (!threadlocal || !threadlocal->extents) {
+    *allocated = 0;
+    return NULL;
+  }
+
+  ret = threadlocal->extents;
+  *allocated = threadlocal->extents_allocated;
+  threadlocal->extents = NULL;
+  threadlocal->extents_allocated = 0;
+  return ret;
+}
+
+/* Give an array of extents which is no longer needed back to this
+ * thread, so the next nbdkit_extents_new can reuse it.  The array is
+ * freed if the thread already has a larger one.
+ */
+void
+threadlocal_give_extents (void *extents, size_t allocated)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (!threadlocal || allocated > MAX_SPARE_EXTENTS ||
+      allocated <= threadlocal->extents_allocated) {
+    free (extents);
+    return;
+  }
+
+  free (threadlocal->extents);
+  threadlocal->extents = extents;
+  threadlocal->extents_allocated = allocated;
+}
+
+/* Set (or get) the NUMA node where the current thread runs, if known,
+ * see --numa.
+ */
+void
+threadlocal_set_numa_node (int node)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->numa_node = node;
+}
+
+int
+threadlocal_get_numa_node (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  return threadlocal ? threadlocal->numa_node : -1;
+}
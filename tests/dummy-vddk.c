@@ -32,16 +32,48 @@
 
 /* This file pretends to be libvixDiskLib.so.6.
  *
- * However it only implements --dump-plugin support so our stubs don't
- * need to do anything.
+ * It serves a small disk from memory.  The asynchronous read and
+ * write calls do the I/O immediately but only call the completion
+ * callbacks from VixDiskLib_Wait, which is the least convenient
+ * behaviour allowed by the real library.  Like the real library, a
+ * handle must only be used from the thread which opened it.
  */
 
+#include <config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "vddk-structs.h"
 
+#define CAPACITY 2048 /* sectors */
+
+static unsigned char disk[CAPACITY * VIXDISKLIB_SECTOR_SIZE];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pending {
+  VixDiskLibCompletionCB callback;
+  void *data;
+  struct pending *next;
+};
+
+struct handle {
+  pthread_t thread;             /* Thread which opened the handle. */
+  struct pending *pending;      /* Protected by lock. */
+};
+
+static void
+check_thread (struct handle *h)
+{
+  if (!pthread_equal (h->thread, pthread_self ())) {
+    fprintf (stderr, "dummy-vddk: handle used from the wrong thread\n");
+    abort ();
+  }
+}
+
 VixError
 VixDiskLib_InitEx (uint32_t major, uint32_t minor,
                    VixDiskLibGenericLogFunc *log_function,
@@ -59,10 +91,275 @@ VixDiskLib_Exit (void)
   /* Do nothing. */
 }
 
-#define NO_INITEX_STUB
-#define NO_EXIT_STUB
-#define STUB(fn,ret,args) void fn (void) { abort (); }
-#define OPTIONAL_STUB(fn,ret,args)
-#include "vddk-stubs.h"
-#undef STUB
-#undef OPTIONAL_STUB
+char *
+VixDiskLib_GetErrorText (VixError err, const char *unused)
+{
+  char *ret;
+
+  if (asprintf (&ret, "dummy error %lu", (unsigned long) err) == -1)
+    return NULL;
+  return ret;
+}
+
+void
+VixDiskLib_FreeErrorText (char *text)
+{
+  free (text);
+}
+
+void
+VixDiskLib_FreeConnectParams (VixDiskLibConnectParams *params)
+{
+  /* Never called since we don't provide AllocateConnectParams. */
+  abort ();
+}
+
+VixError
+VixDiskLib_ConnectEx (const VixDiskLibConnectParams *params,
+                      char read_only,
+                      const char *snapshot_ref,
+                      const char *transport_modes,
+                      VixDiskLibConnection *connection)
+{
+  *connection = (VixDiskLibConnection) disk;
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Open (const VixDiskLibConnection connection,
+                 const char *path,
+                 uint32_t flags,
+                 VixDiskLibHandle *handle)
+{
+  struct handle *h = calloc (1, sizeof *h);
+
+  if (h == NULL)
+    return VIX_E_FAIL;
+  h->thread = pthread_self ();
+  *handle = h;
+  return VIX_OK;
+}
+
+const char *
+VixDiskLib_GetTransportMode (VixDiskLibHandle handle)
+{
+  return "file";
+}
+
+VixError
+VixDiskLib_Close (VixDiskLibHandle handle)
+{
+  struct handle *h = handle;
+
+  check_thread (h);
+  if (h->pending)
+    abort ();
+  free (h);
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Disconnect (VixDiskLibConnection connection)
+{
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_GetInfo (VixDiskLibHandle handle,
+                    VixDiskLibInfo **info)
+{
+  check_thread (handle);
+  *info = calloc (1, sizeof (VixDiskLibInfo));
+  if (*info == NULL)
+    return VIX_E_FAIL;
+  (*info)->capacity = CAPACITY;
+  return VIX_OK;
+}
+
+void
+VixDiskLib_FreeInfo (VixDiskLibInfo *info)
+{
+  free (info);
+}
+
+static VixError
+do_read (uint64_t start_sector, uint64_t nr_sectors, unsigned char *buf)
+{
+  if (start_sector + nr_sectors > CAPACITY)
+    return VIX_E_FAIL;
+  pthread_mutex_lock (&lock);
+  memcpy (buf, &disk[start_sector * VIXDISKLIB_SECTOR_SIZE],
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  pthread_mutex_unlock (&lock);
+  return VIX_OK;
+}
+
+static VixError
+do_write (uint64_t start_sector, uint64_t nr_sectors,
+          const unsigned char *buf)
+{
+  if (start_sector + nr_sectors > CAPACITY)
+    return VIX_E_FAIL;
+  pthread_mutex_lock (&lock);
+  memcpy (&disk[start_sector * VIXDISKLIB_SECTOR_SIZE], buf,
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  pthread_mutex_unlock (&lock);
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Read (VixDiskLibHandle handle,
+                 uint64_t start_sector, uint64_t nr_sectors,
+                 unsigned char *buf)
+{
+  check_thread (handle);
+  return do_read (start_sector, nr_sectors, buf);
+}
+
+VixError
+VixDiskLib_Write (VixDiskLibHandle handle,
+                  uint64_t start_sector, uint64_t nr_sectors,
+                  const unsigned char *buf)
+{
+  check_thread (handle);
+  return do_write (start_sector, nr_sectors, buf);
+}
+
+static VixError
+add_pending (struct handle *h, VixDiskLibCompletionCB callback, void *data)
+{
+  struct pending *p = malloc (sizeof *p);
+
+  if (p == NULL)
+    return VIX_E_FAIL;
+  p->callback = callback;
+  p->data = data;
+  pthread_mutex_lock (&lock);
+  p->next = h->pending;
+  h->pending = p;
+  pthread_mutex_unlock (&lock);
+  return VIX_ASYNC;
+}
+
+VixError
+VixDiskLib_ReadAsync (VixDiskLibHandle handle,
+                      uint64_t start_sector, uint64_t nr_sectors,
+                      unsigned char *buf,
+                      VixDiskLibCompletionCB callback, void *data)
+{
+  VixError err;
+
+  check_thread (handle);
+  err = do_read (start_sector, nr_sectors, buf);
+
+  if (err != VIX_OK)
+    return err;
+  return add_pending (handle, callback, data);
+}
+
+VixError
+VixDiskLib_WriteAsync (VixDiskLibHandle handle,
+                       uint64_t start_sector, uint64_t nr_sectors,
+                       const unsigned char *buf,
+                       VixDiskLibCompletionCB callback, void *data)
+{
+  VixError err;
+
+  check_thread (handle);
+  err = do_write (start_sector, nr_sectors, buf);
+
+  if (err != VIX_OK)
+    return err;
+  return add_pending (handle, callback, data);
+}
+
+VixError
+VixDiskLib_Wait (VixDiskLibHandle handle)
+{
+  struct handle *h = handle;
+  struct pending *p, *next;
+
+  check_thread (h);
+  pthread_mutex_lock (&lock);
+  p = h->pending;
+  h->pending = NULL;
+  pthread_mutex_unlock (&lock);
+
+  for (; p != NULL; p = next) {
+    next = p->next;
+    p->callback (p->data, VIX_OK);
+    free (p);
+  }
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Flush (VixDiskLibHandle handle)
+{
+  check_thread (handle);
+  return VIX_OK;
+}
+
+/* A chunk is allocated if it contains any non-zero byte. */
+static int
+chunk_is_allocated (uint64_t sector, uint64_t chunk_size)
+{
+  uint64_t i;
+
+  for (i = sector * VIXDISKLIB_SECTOR_SIZE;
+       i < (sector + chunk_size) * VIXDISKLIB_SECTOR_SIZE &&
+         i < sizeof disk;
+       ++i)
+    if (disk[i] != 0)
+      return 1;
+  return 0;
+}
+
+VixError
+VixDiskLib_QueryAllocatedBlocks (VixDiskLibHandle handle,
+                                 uint64_t start_sector, uint64_t nr_sectors,
+                                 uint64_t chunk_size,
+                                 VixDiskLibBlockList **block_list)
+{
+  VixDiskLibBlockList *ret;
+  uint64_t sector;
+  uint32_t n = 0;
+
+  check_thread (handle);
+  if (chunk_size == 0 ||
+      start_sector % chunk_size != 0 || nr_sectors % chunk_size != 0)
+    return VIX_E_FAIL;
+
+  /* Enough for alternating allocated and unallocated chunks. */
+  ret = malloc (sizeof *ret +
+                (nr_sectors / chunk_size / 2 + 1) * sizeof ret->blocks[0]);
+  if (ret == NULL)
+    return VIX_E_FAIL;
+
+  pthread_mutex_lock (&lock);
+  for (sector = start_sector; sector < start_sector + nr_sectors;
+       sector += chunk_size) {
+    if (!chunk_is_allocated (sector, chunk_size))
+      continue;
+    if (n > 0 &&
+        ret->blocks[n-1].offset + ret->blocks[n-1].length == sector)
+      ret->blocks[n-1].length += chunk_size;
+    else {
+      ret->blocks[n].offset = sector;
+      ret->blocks[n].length = chunk_size;
+      n++;
+    }
+  }
+  pthread_mutex_unlock (&lock);
+
+  ret->numBlocks = n;
+  *block_list = ret;
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_FreeBlockList (VixDiskLibBlockList *block_list)
+{
+  free (block_list);
+  return VIX_OK;
+}
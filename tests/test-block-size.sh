@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that block size constraints are advertised to the client.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh -c 'exit (not hasattr (h, "get_block_size"))'
+
+# Without constraints nbdkit only advertises its own maximum.
+nbdkit -U - memory 1M \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_block_size (nbd.SIZE_MINIMUM) == 1
+assert h.get_block_size (nbd.SIZE_PREFERRED) == 4096
+assert h.get_block_size (nbd.SIZE_MAXIMUM) == 64 * 1024 * 1024
+"'
+
+# The blocksize filter accepts anything, but prefers minblock.
+nbdkit -U - --filter=blocksize memory 1M minblock=16k \
+       --run 'nbdsh -u "$uri" -c "
+assert h.get_block_size (nbd.SIZE_MINIMUM) == 1
+assert h.get_block_size (nbd.SIZE_PREFERRED) == 16384
+assert h.get_block_size (nbd.SIZE_MAXIMUM) == 64 * 1024 * 1024
+"'
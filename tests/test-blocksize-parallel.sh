@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the blocksize filter runs requests in parallel without losing
+# writes to different parts of the same block.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+# Both writes start a read-modify-write of block 0.  The delay filter
+# makes them overlap if the filter does not serialize them.
+nbdkit -U - --filter=blocksize --filter=delay memory 1M \
+       minblock=4k delay-write=1 \
+       --run 'nbdsh -u "$uri" -c "
+h.aio_pwrite (b\"a\" * 100, 0)
+h.aio_pwrite (b\"b\" * 100, 200)
+while h.aio_in_flight () > 0:
+    h.poll (-1)
+buf = h.pread (300, 0)
+assert buf == b\"a\" * 100 + bytearray (100) + b\"b\" * 100
+"'
+
+# Aligned writes take no locks, so two of them behind the delay
+# filter should finish in about 1 second, not 2.
+nbdkit -U - --filter=blocksize --filter=delay memory 1M \
+       minblock=4k delay-write=1 \
+       --run 'nbdsh -u "$uri" -c "
+import time
+start = time.monotonic ()
+h.aio_pwrite (b\"a\" * 4096, 0)
+h.aio_pwrite (b\"b\" * 4096, 4096)
+while h.aio_in_flight () > 0:
+    h.poll (-1)
+elapsed = time.monotonic () - start
+print (\"elapsed: %g\" % elapsed)
+assert elapsed < 2
+"'
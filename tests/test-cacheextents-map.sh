@@ -0,0 +1,129 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the map of extents kept by the cacheextents filter, by counting
+# the extents calls which reach the plugin through the log filter.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+sock=`mktemp -u`
+files="cacheextents-map.pid cacheextents-map.log $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The plugin returns exactly the requested range, split at every 1M.
+# Each pair of 1M blocks is data (0) or a hole (3) in turn.
+start_nbdkit -P cacheextents-map.pid -U $sock \
+             --filter=cacheextents --filter=log \
+             sh - logfile=cacheextents-map.log <<'EOF'
+M=$((1024*1024))
+case "$1" in
+  get_size) echo 8M ;;
+  can_extents|can_write|can_trim) ;;
+  pread) dd if=/dev/zero count=$3 iflag=count_bytes ;;
+  pwrite) cat >/dev/null ;;
+  trim) ;;
+  extents)
+    pos=$4
+    end=$(($4 + $3))
+    while [ $pos -lt $end ]; do
+      next=$(( (pos / M + 1) * M ))
+      if [ $next -gt $end ]; then next=$end; fi
+      echo $pos $((next - pos)) $(( pos / M / 2 % 2 * 3 ))
+      pos=$next
+    done
+    ;;
+  *) exit 2 ;;
+esac
+EOF
+
+nbdsh --base-allocation --connect "nbd+unix://?socket=$sock" -c '
+import re
+
+M = 1024 * 1024
+K = 1024
+
+def status (count, offset, flags=0):
+    entries = []
+    def f (metacontext, off, e, err):
+        assert err.value == 0
+        assert metacontext == nbd.CONTEXT_BASE_ALLOCATION
+        entries.extend (e)
+    h.block_status (count, offset, f, flags)
+    return entries
+
+# Offsets of the extents calls which reached the plugin so far.
+def calls ():
+    with open ("cacheextents-map.log") as fp:
+        return [int (re.search (r"offset=(0x[0-9a-f]+)", l).group (1), 16)
+                for l in fp if " Extents id=" in l]
+
+# Two adjacent 1M data extents fetched separately are merged, so a
+# REQ_ONE query returns both at once without calling the plugin.
+status (M, 0)
+status (M, M)
+assert calls () == [0, M]
+assert status (4 * M, 0, nbd.CMD_FLAG_REQ_ONE) == [2 * M, 0]
+assert calls () == [0, M]
+
+# After querying a disjoint range, the first range is still cached.
+status (M, 4 * M)
+assert calls () == [0, M, 4 * M]
+assert status (M, 0)[0:2] == [2 * M, 0]
+assert calls () == [0, M, 4 * M]
+
+# A trim in the middle of the cached extent splits it.  The part
+# before it is still answered from the cache, and only the trimmed
+# range is fetched again.
+h.trim (64 * K, 512 * K)
+assert status (4 * M, 0) == [512 * K, 0]
+assert calls () == [0, M, 4 * M]
+status (64 * K, 512 * K)
+assert calls () == [0, M, 4 * M, 512 * K]
+assert status (64 * K, 576 * K)[0:2] == [M + 448 * K, 0]
+assert calls () == [0, M, 4 * M, 512 * K]
+
+# The refetched range is merged back into its neighbours.
+assert status (4 * M, 0, nbd.CMD_FLAG_REQ_ONE) == [2 * M, 0]
+
+# Likewise a write only invalidates the range written.
+h.pwrite (b"x" * 512, M + 512 * K)
+assert status (4 * M, 0, nbd.CMD_FLAG_REQ_ONE) == [M + 512 * K, 0]
+status (512, M + 512 * K)
+assert calls () == [0, M, 4 * M, 512 * K, M + 512 * K]
+assert status (4 * M, 0, nbd.CMD_FLAG_REQ_ONE) == [2 * M, 0]
+assert calls () == [0, M, 4 * M, 512 * K, M + 512 * K]
+'
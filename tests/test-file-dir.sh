@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin serving a directory by export name.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh -c 'exit (not hasattr (h, "opt_list"))'
+
+sock=`mktemp -u`
+d=file-dir.d
+rm -rf $d
+mkdir -p $d/dir $d/dir/subdir
+cleanup_fn rm -rf $d
+cleanup_fn rm -f $sock
+
+truncate -s 1M $d/dir/a.img
+printf 'hello' > $d/dir/b.img
+truncate -s 2M $d/dir/b.img
+
+start_nbdkit -P $d/file-dir.pid -U $sock file dir=$d/dir
+
+# The regular files are listed, but not the subdirectory.
+nbdsh -c - <<EOPY
+names = []
+def f (name, desc):
+    names.append (name)
+h.set_opt_mode (True)
+h.connect_unix ("$sock")
+h.opt_list (f)
+h.opt_abort ()
+assert sorted (names) == ["a.img", "b.img"]
+EOPY
+
+# The export name picks the file.
+nbdsh -c - <<EOPY
+h.set_export_name ("b.img")
+h.connect_unix ("$sock")
+assert h.get_size () == 2 * 1024 * 1024
+assert h.pread (5, 0) == b"hello"
+EOPY
+
+# Names outside the directory, and the subdirectory, are refused.
+for name in "" subdir ../dir/a.img; do
+    if nbdsh -c "h.set_export_name (\"$name\")" -c "h.connect_unix (\"$sock\")"
+    then
+        echo "$0: export name '$name' should have been refused"
+        exit 1
+    fi
+done
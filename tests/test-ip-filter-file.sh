@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the ip filter rules file, which is reloaded when it changes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+files="ip-filter-file.pid ip-filter-file.rules"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Find an unused port to listen on.
+pick_unused_port
+
+echo 'deny=all' > ip-filter-file.rules
+
+start_nbdkit -P ip-filter-file.pid -p $port --filter=ip null \
+             -D ip.rules=1 rules=ip-filter-file.rules
+
+connect ()
+{
+    nbdsh -c "h.connect_tcp ('127.0.0.1', '$port')"
+}
+
+if connect; then
+    echo "$0: connection should have been denied"
+    exit 1
+fi
+
+# Replace the rules.  The filter should notice within a few seconds.
+cat > ip-filter-file.rules <<'EOF2'
+# Allow loopback only.
+allow=127.0.0.1
+deny=all
+EOF2
+
+for i in {1..10}; do
+    if connect; then
+        exit 0
+    fi
+    sleep 1
+done
+echo "$0: rules file was not reloaded"
+exit 1
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test ip filter hostname and wildcard rules.  These rely on localhost
+# resolving to 127.0.0.1 and back again.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires getent hosts localhost
+
+# A deny rule which cannot be resolved must stop nbdkit from starting.
+if nbdkit -U - --filter=ip null deny=nbdkit-ip-filter-test.invalid \
+          --run true; then
+    echo "$0: unresolvable deny rule should have been rejected"
+    exit 1
+fi
+
+# An allow rule which cannot be resolved matches nothing.
+nbdkit -U - --filter=ip null allow=nbdkit-ip-filter-test.invalid --run true
+
+# Run nbdkit with some rules and try to connect to it over TCP.
+connect ()
+{
+    pick_unused_port
+    nbdkit -p $port --filter=ip null -D ip.rules=1 "$@" \
+           --run "nbdsh -c \"h.connect_tcp ('127.0.0.1', '$port')\""
+}
+
+connect allow=localhost deny=all
+if connect deny=localhost; then
+    echo "$0: client should have been denied by hostname"
+    exit 1
+fi
+
+connect allow='local*' deny=all
+if connect deny='LOCAL*'; then
+    echo "$0: client should have been denied by wildcard"
+    exit 1
+fi
@@ -152,6 +152,18 @@ test_layers_filter_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
   return next_ops->get_size (nxdata);
 }
 
+static int
+test_layers_filter_block_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+                               void *handle, uint32_t *minimum,
+                               uint32_t *preferred, uint32_t *maximum)
+{
+  struct handle *h = handle;
+
+  assert (h->next_ops == next_ops && h->nxdata == nxdata);
+  DEBUG_FUNCTION;
+  return next_ops->block_size (nxdata, minimum, preferred, maximum);
+}
+
 static int
 test_layers_filter_can_write (struct nbdkit_next_ops *next_ops, void *nxdata,
                               void *handle)
@@ -355,6 +367,7 @@ static struct nbdkit_filter filter = {
   .prepare           = test_layers_filter_prepare,
   .finalize          = test_layers_filter_finalize,
   .get_size          = test_layers_filter_get_size,
+  .block_size        = test_layers_filter_block_size,
   .can_write         = test_layers_filter_can_write,
   .can_flush         = test_layers_filter_can_flush,
   .is_rotational     = test_layers_filter_is_rotational,
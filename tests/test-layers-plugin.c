@@ -101,6 +101,18 @@ test_layers_plugin_get_size (void *handle)
   return 1024;
 }
 
+static int
+test_layers_plugin_block_size (void *handle,
+                               uint32_t *minimum, uint32_t *preferred,
+                               uint32_t *maximum)
+{
+  DEBUG_FUNCTION;
+  *minimum = 1;
+  *preferred = 512;
+  *maximum = 1024;
+  return 0;
+}
+
 static int
 test_layers_plugin_can_write (void *handle)
 {
@@ -235,6 +247,7 @@ static struct nbdkit_plugin plugin = {
   .open              = test_layers_plugin_open,
   .close             = test_layers_plugin_close,
   .get_size          = test_layers_plugin_get_size,
+  .block_size        = test_layers_plugin_block_size,
   .can_write         = test_layers_plugin_can_write,
   .can_flush         = test_layers_plugin_can_flush,
   .is_rotational     = test_layers_plugin_is_rotational,
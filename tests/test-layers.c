@@ -335,6 +335,14 @@ main (int argc, char *argv[])
      "test_layers_plugin_get_size",
      NULL);
 
+  /* block_size methods called in order. */
+  log_verify_seen_in_order
+    ("filter3: test_layers_filter_block_size",
+     "filter2: test_layers_filter_block_size",
+     "filter1: test_layers_filter_block_size",
+     "test_layers_plugin_block_size",
+     NULL);
+
   /* can_* / is_* methods called in order. */
   log_verify_seen_in_order
     ("filter3: test_layers_filter_can_write",
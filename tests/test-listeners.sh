@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --listeners.
+
+source ./functions.sh
+set -e
+set -x
+
+# --listeners only works with TCP/IP.
+if nbdkit --listeners=2 -U - null --run true; then
+    echo "$0: --listeners should not work with -U"
+    exit 1
+fi
+
+requires nbdsh --version
+
+files="listeners.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Find an unused port to listen on.
+pick_unused_port
+
+start_nbdkit -P listeners.pid -p $port --listeners=4 memory 1M
+
+# Open enough connections that they should be spread over the
+# listeners, and check that they all work.
+nbdsh -c - <<EOF2
+import nbd
+
+hs = []
+for i in range (16):
+    h = nbd.NBD ()
+    h.connect_tcp ("127.0.0.1", "$port")
+    hs.append (h)
+for i, h in enumerate (hs):
+    h.pwrite (bytearray ([i]) * 512, 512 * i)
+for i, h in enumerate (hs):
+    assert h.pread (512, 512 * i) == bytearray ([i]) * 512
+    h.shutdown ()
+EOF2
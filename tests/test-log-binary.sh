@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="log-binary.img log-binary.bin log-binary.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 10M log-binary.img
+
+nbdkit -U - --filter=log file log-binary.img \
+       logfile=log-binary.bin logformat=binary \
+       --run '
+    qemu-io -f raw -c "w -P 11 1M 2M" $nbd
+    qemu-io -r -f raw -c "r -P 11 2M 1M" $nbd
+'
+
+../filters/log/nbdkit-log-decode log-binary.bin |
+    sort -s -k1,2 > log-binary.log
+cat log-binary.log
+
+# Same checks as test-log.sh, against the decoded text log.
+grep 'connection=1 Connect size=0xa00000 ' log-binary.log
+grep 'connection=1 Write id=1 offset=0x100000 count=0x200000 ' log-binary.log
+grep 'connection=1 ...Write id=1 return=0 (Success)' log-binary.log
+grep 'connection=2 Read id=1 offset=0x200000 count=0x100000 ' log-binary.log
+grep 'connection=2 Disconnect transactions=1' log-binary.log
+
+# Decoding something which isn't a binary log must fail.
+if ../filters/log/nbdkit-log-decode log-binary.log; then
+    echo "$0: expected nbdkit-log-decode to fail on a text file"
+    exit 1
+fi
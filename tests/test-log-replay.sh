@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires test -x ../filters/log/nbdkit-log-replay
+
+files="log-replay.bin log-replay.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Record a binary trace of a small workload.
+nbdkit -U - --filter=log memory 1M \
+       logfile=log-replay.bin logformat=binary \
+       --run 'nbdsh -u "$uri" -c "
+h.pwrite (b\"1\" * 8192, 4096)
+h.pread (4096, 65536)
+h.flush ()
+"'
+
+# Replay it as fast as possible against a fresh server, logging what
+# the server receives as text.
+nbdkit -U - --filter=log memory 1M logfile=log-replay.log \
+       --run '../filters/log/nbdkit-log-replay -s 0 log-replay.bin $unixsocket'
+cat log-replay.log
+
+# The replayed server should see the same requests.
+grep 'connection=1 Write id=[0-9]* offset=0x1000 count=0x2000 ' log-replay.log
+grep 'connection=1 Read id=[0-9]* offset=0x10000 count=0x1000 ' log-replay.log
+grep 'connection=1 Flush id=[0-9]* ' log-replay.log
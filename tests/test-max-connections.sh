@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --max-connections, --max-client-connections and --queue-timeout.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+sock=`mktemp -u`
+files="max-connections.pid max-client-connections.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P max-connections.pid -U $sock \
+             --max-connections=1 --queue-timeout=2 \
+             memory 1M
+
+nbdsh -c - <<EOF2
+import nbd
+import time
+
+h1 = nbd.NBD ()
+h1.connect_unix ("$sock")
+
+# The second connection waits in the queue and times out.
+h2 = nbd.NBD ()
+start = time.time ()
+try:
+    h2.connect_unix ("$sock")
+    assert False
+except nbd.Error:
+    pass
+assert time.time () - start >= 1
+
+# The third connection waits in the queue while the first is open,
+# and is served as soon as the first closes.
+h3 = nbd.NBD ()
+h3.aio_connect_unix ("$sock")
+start = time.time ()
+while time.time () - start < 0.5:
+    h3.poll (100)
+assert h3.aio_is_connecting ()
+h1.shutdown ()
+start = time.time ()
+while h3.aio_is_connecting ():
+    assert time.time () - start < 2
+    h3.poll (100)
+assert h3.aio_is_ready ()
+assert h3.get_size () == 1048576
+h3.shutdown ()
+EOF2
+
+# A second TCP connection from the same client address also waits in
+# the queue until the first closes.
+pick_unused_port
+start_nbdkit -P max-client-connections.pid -p $port \
+             --max-client-connections=1 --queue-timeout=2 \
+             memory 1M
+
+nbdsh -c - <<EOF2
+import nbd
+import time
+
+h1 = nbd.NBD ()
+h1.connect_tcp ("127.0.0.1", "$port")
+
+h2 = nbd.NBD ()
+h2.aio_connect_tcp ("127.0.0.1", "$port")
+start = time.time ()
+while time.time () - start < 0.5:
+    h2.poll (100)
+assert h2.aio_is_connecting ()
+h1.shutdown ()
+start = time.time ()
+while h2.aio_is_connecting ():
+    assert time.time () - start < 2
+    h2.poll (100)
+assert h2.aio_is_ready ()
+assert h2.get_size () == 1048576
+h2.shutdown ()
+EOF2
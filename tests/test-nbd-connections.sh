@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+sock=`mktemp -u`
+files="nbd-connections.pid nbd-connections.log $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Upstream server, which advertises multi-conn and logs every
+# connection it receives.
+start_nbdkit -P nbd-connections.pid -U $sock \
+             --filter=log memory 1M logfile=nbd-connections.log
+
+# Write and read back in parallel through the nbd plugin.
+nbdkit -U - nbd socket=$sock connections=4 \
+       --run 'nbdsh -u "$uri" -c "
+assert h.can_multi_conn ()
+bufs = [bytes ([i + 1]) * 65536 for i in range (8)]
+for i in range (8):
+    h.aio_pwrite (bufs[i], i * 65536)
+while h.aio_in_flight () > 0:
+    h.poll (-1)
+for i in range (8):
+    assert h.pread (65536, i * 65536) == bufs[i]
+"'
+cat nbd-connections.log
+
+# The nbd plugin should have opened more than one upstream connection.
+conns=$(grep -c ' Connect ' nbd-connections.log)
+if [ "$conns" -lt 2 ]; then
+    echo "$0: expected more than one upstream connection, got $conns"
+    exit 1
+fi
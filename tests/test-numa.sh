@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --numa.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires test -d /sys/devices/system/node/node0
+
+files="numa.pid numa.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Find an unused port to listen on.
+pick_unused_port
+
+start_nbdkit -P numa.pid -p $port --log=stderr --numa memory 1M \
+             2>numa.log
+
+nbdsh -c - <<EOF2
+h.connect_tcp ("127.0.0.1", "$port")
+h.pwrite (b"x" * 512, 0)
+assert h.pread (512, 0) == b"x" * 512
+h.shutdown ()
+EOF2
+
+# Wait for the connection to be logged.
+for i in {1..10}; do
+    if grep -q "serving connection on NUMA node" numa.log; then
+        exit 0
+    fi
+    sleep 1
+done
+cat numa.log
+echo "$0: connection was not placed on a NUMA node"
+exit 1
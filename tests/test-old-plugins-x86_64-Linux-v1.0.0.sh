@@ -0,0 +1 @@
+script=test-old-plugins-x86_64-Linux-v1.0.0.sh exec $srcdir/test-old-plugins.sh x86_64-Linux-v1.0.0
@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the rate filter splits large requests.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+files="rate-split.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# At 8 Mbps a slice is 100K, so a 1M read should reach the plugin as
+# 11 smaller reads.  The whole read fits in the initial burst, so
+# this should not take long.
+nbdkit -U - --filter=rate --filter=log pattern 1M \
+       rate=8M logfile=rate-split.log \
+       --run 'nbdsh -u "$uri" -c "
+buf = h.pread (1024*1024, 0)
+assert buf[8:16] == (8).to_bytes (8, \"big\")
+"'
+
+cat rate-split.log
+test "$(grep -c 'Read id=.* offset=.* count=' rate-split.log)" -eq 11
+grep 'Read id=1 offset=0x0 count=0x19000 ' rate-split.log
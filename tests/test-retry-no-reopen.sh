@@ -0,0 +1,105 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test retry-reopen=no, millisecond delays and retry-errors.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+
+files="retry-no-reopen-count retry-no-reopen-open-count"
+rm -f $files
+cleanup_fn rm -f $files
+
+plugin='#!/usr/bin/env bash
+case "$1" in
+    open)
+        read i < retry-no-reopen-open-count
+        echo $((i+1)) > retry-no-reopen-open-count
+        ;;
+    pread)
+        # Fail 3 times then succeed.
+        read i < retry-no-reopen-count
+        ((i++))
+        echo $i > retry-no-reopen-count
+        if [ $i -le 3 ]; then
+            echo "$ERR pread failed" >&2
+            exit 1
+        else
+            dd if=/dev/zero count=$3 iflag=count_bytes
+        fi
+        ;;
+    get_size) echo 512 ;;
+    *) exit 2 ;;
+esac
+'
+
+# EIO is retried in place: quickly, and without reopening.
+echo 0 > retry-no-reopen-count
+echo 0 > retry-no-reopen-open-count
+start_t=$SECONDS
+ERR=EIO nbdkit -v -U - sh - \
+       --filter=retry retry-delay=10ms retry-reopen=no \
+       retry-errors=EIO,ESHUTDOWN \
+       --run 'nbdsh -u "$uri" -c "assert h.pread (512, 0) == bytearray (512)"' \
+       <<<"$plugin"
+end_t=$SECONDS
+if [ $((end_t - start_t)) -ge 5 ]; then
+    echo "$0: test ran too slowly"
+    exit 1
+fi
+read open_count < retry-no-reopen-open-count
+if [ $open_count -ne 1 ]; then
+    echo "$0: open-count ($open_count) != 1"
+    exit 1
+fi
+
+# ENOSPC is not in the list, so the first failure is returned.
+echo 0 > retry-no-reopen-count
+ERR=ENOSPC nbdkit -v -U - sh - \
+       --filter=retry retry-delay=10ms retry-reopen=no \
+       retry-errors=EIO,ESHUTDOWN \
+       --run 'nbdsh -u "$uri" -c "
+try:
+    h.pread (512, 0)
+    assert False
+except nbd.Error as ex:
+    assert ex.errno == \"ENOSPC\"
+"' \
+       <<<"$plugin"
+read count < retry-no-reopen-count
+if [ $count -ne 1 ]; then
+    echo "$0: count ($count) != 1"
+    exit 1
+fi
@@ -71,4 +71,13 @@ entries = []
 # With req one, extents stop at file boundaries
 h.block_status (1024 * 1024, 768 * 1024, f, nbd.CMD_FLAG_REQ_ONE)
 assert entries == [ 256 * 1024, 0 ]
+# Writing into a hole is seen by later requests (the plugin caches
+# the extents of each file)
+h.pwrite (b"1" * 65536, 0)
+entries = []
+h.block_status (2 * 1024 * 1024, 0, f)
+assert entries == [ 64 * 1024, 0,
+                    448 * 1024, 3,
+                    1024 * 1024, 0,
+                    512 * 1024, 3 ]
        "'
@@ -63,3 +63,24 @@ nbdkit -v -D ssh.log=2 -U - \
 
 # The output should be identical.
 cmp disk ssh.img
+
+# Issue several reads in parallel, each crossing the 64K chunks which
+# the plugin pipelines, so that they are spread over a pool of SSH
+# sessions.  Check the data against the original file.
+if nbdsh --version; then
+    nbdkit -v -D ssh.log=2 -U - \
+           ssh host=localhost $PWD/disk connections=4 \
+           --run 'nbdsh -u "$uri" -c "
+disk = open (\"disk\", \"rb\").read ()
+reqs = []
+for i in range (8):
+    offset = i * 100000 + 123
+    buf = nbd.Buffer (200000)
+    h.aio_pread (buf, offset)
+    reqs.append ((buf, offset))
+while h.aio_in_flight () > 0:
+    h.poll (-1)
+for (buf, offset) in reqs:
+    assert buf.to_bytearray () == disk[offset:offset + 200000]
+"'
+fi
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="stats-openmetrics.out stats-openmetrics.out.tmp"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Use statsinterval so that the file is replaced while nbdkit is
+# running as well as written on exit.
+nbdkit -U - --filter=stats memory 10M \
+       statsfile=stats-openmetrics.out \
+       statsformat=openmetrics statsinterval=1 \
+       --run '
+    qemu-io -f raw -c "w -P 11 1M 2M" $nbd
+    sleep 2
+    grep "^nbdkit_requests_total{op=\"write\"} 1\$" stats-openmetrics.out
+    qemu-io -f raw -c "r -P 11 1M 2M" $nbd
+'
+
+cat stats-openmetrics.out
+
+grep '^nbdkit_connections_total 2$' stats-openmetrics.out
+grep '^nbdkit_requests_total{op="read"} 1$' stats-openmetrics.out
+grep '^nbdkit_requests_total{op="write"} 1$' stats-openmetrics.out
+grep '^nbdkit_request_bytes_total{op="read"} 2097152$' stats-openmetrics.out
+grep '^nbdkit_request_latency_seconds_count{op="read"} 1$' stats-openmetrics.out
+grep '^nbdkit_request_size_bytes_bucket{op="read",le="4194303"} 1$' stats-openmetrics.out
+grep '^# EOF$' stats-openmetrics.out
+test ! -f stats-openmetrics.out.tmp
@@ -62,21 +62,26 @@ if [ ! -s keys.psk ]; then
     exit 77
 fi
 
-# Unfortunately qemu cannot do TLS over a Unix domain socket (nbdkit
-# can, but that is tested in tests-nbd-tls-psk.sh).  Find an unused port to
-# listen on.
-pick_unused_port
+# Run the test with kernel TLS offload enabled (where the kernel
+# supports it) and disabled, so that both record paths are covered.
+for ktls in 1 0; do
+    # Unfortunately qemu cannot do TLS over a Unix domain socket (nbdkit
+    # can, but that is tested in tests-nbd-tls-psk.sh).  Find an unused
+    # port to listen on.
+    pick_unused_port
 
-cleanup_fn rm -f tls-psk.pid tls-psk.out
-start_nbdkit -P tls-psk.pid -p $port -n \
-             --tls=require --tls-psk=keys.psk example1
+    cleanup_fn rm -f tls-psk-$ktls.pid tls-psk.out
+    start_nbdkit -P tls-psk-$ktls.pid -p $port -n \
+                 -D nbdkit.tls.ktls=$ktls \
+                 --tls=require --tls-psk=keys.psk example1
 
-# Run qemu-img against the server.
-qemu-img info --output=json \
-         --object "tls-creds-psk,id=tls0,endpoint=client,dir=$PWD" \
-         --image-opts "file.driver=nbd,file.host=localhost,file.port=$port,file.tls-creds=tls0" > tls-psk.out
+    # Run qemu-img against the server.
+    qemu-img info --output=json \
+             --object "tls-creds-psk,id=tls0,endpoint=client,dir=$PWD" \
+             --image-opts "file.driver=nbd,file.host=localhost,file.port=$port,file.tls-creds=tls0" > tls-psk.out
 
-cat tls-psk.out
+    cat tls-psk.out
 
-grep -sq '"format": *"raw"' tls-psk.out
-grep -sq '"virtual-size": *104857600\b' tls-psk.out
+    grep -sq '"format": *"raw"' tls-psk.out
+    grep -sq '"virtual-size": *104857600\b' tls-psk.out
+done
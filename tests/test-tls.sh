@@ -55,21 +55,26 @@ if [ ! -f "$pkidir/ca-cert.pem" ]; then
     exit 77
 fi
 
-# Unfortunately qemu 4.0 cannot do TLS over a Unix domain socket (nbdkit
-# can, but that is tested in tests-nbd-tls.sh).  Find an unused port to
-# listen on.
-pick_unused_port
+# Run the test with kernel TLS offload enabled (where the kernel
+# supports it) and disabled, so that both record paths are covered.
+for ktls in 1 0; do
+    # Unfortunately qemu 4.0 cannot do TLS over a Unix domain socket
+    # (nbdkit can, but that is tested in tests-nbd-tls.sh).  Find an
+    # unused port to listen on.
+    pick_unused_port
 
-cleanup_fn rm -f tls.pid tls.out
-start_nbdkit -P tls.pid -p $port -n --tls=require \
-       --tls-certificates="$pkidir" example1
+    cleanup_fn rm -f tls-$ktls.pid tls.out
+    start_nbdkit -P tls-$ktls.pid -p $port -n --tls=require \
+                 -D nbdkit.tls.ktls=$ktls \
+                 --tls-certificates="$pkidir" example1
 
-# Run qemu-img against the server.
-qemu-img info --output=json \
-         --object "tls-creds-x509,id=tls0,endpoint=client,dir=$pkidir" \
-         --image-opts "file.driver=nbd,file.host=localhost,file.port=$port,file.tls-creds=tls0" > tls.out
+    # Run qemu-img against the server.
+    qemu-img info --output=json \
+             --object "tls-creds-x509,id=tls0,endpoint=client,dir=$pkidir" \
+             --image-opts "file.driver=nbd,file.host=localhost,file.port=$port,file.tls-creds=tls0" > tls.out
 
-cat tls.out
+    cat tls.out
 
-grep -sq '"format": *"raw"' tls.out
-grep -sq '"virtual-size": *104857600\b' tls.out
+    grep -sq '"format": *"raw"' tls.out
+    grep -sq '"virtual-size": *104857600\b' tls.out
+done
@@ -0,0 +1,90 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires jq --version
+requires qemu-img --version
+requires qemu-img map --help
+requires qemu-io --version
+
+log="test-vddk-extents.log"
+out="test-vddk-extents.out"
+expected="test-vddk-extents.expected"
+files="$log $out $expected"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The dummy VDDK library reports any 64K chunk containing non-zero
+# data as allocated.
+do_test ()
+{
+    nbdkit -U - -v vddk libdir=.libs /dev/null \
+           --run '
+        qemu-io -f raw '"$1"' $nbd &&
+        qemu-img map -f raw --output=json $nbd
+    ' 2>$log |
+        jq -c '.[] | {start:.start, length:.length, data:.data}' > $out
+    if ! cmp $out $expected; then
+        echo "$0: output did not match expected data"
+        echo "expected:"
+        cat $expected
+        echo "output:"
+        cat $out
+        exit 1
+    fi
+}
+
+count_queries ()
+{
+    grep -c "VDDK call: VixDiskLib_QueryAllocatedBlocks" $log
+}
+
+cat > $expected <<'EOF2'
+{"start":0,"length":65536,"data":false}
+{"start":65536,"length":65536,"data":true}
+{"start":131072,"length":393216,"data":false}
+{"start":524288,"length":65536,"data":true}
+{"start":589824,"length":458752,"data":false}
+EOF2
+
+# Repeated maps on one connection are answered from the cache.  There
+# is one query from each connection's can_extents, one to fill the
+# cache for qemu-io, and one for qemu-img map.
+do_test '-c "w -P 1 64k 512" -c "w -P 2 512k 512" -c map -c map -c map'
+test "$(count_queries)" -eq 4
+
+# A write through the connection invalidates the cache.
+do_test '-c "w -P 1 64k 512" -c map -c "w -P 2 512k 512" -c map'
+test "$(count_queries)" -eq 5
@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+# The dummy VDDK library serves a 1M disk from memory, and only
+# completes asynchronous reads and writes from VixDiskLib_Wait.  Write
+# and read back patterns with several requests in flight spread over
+# several VDDK handles.
+nbdkit -U - vddk libdir=.libs /dev/null connections=4 \
+       --run '
+    qemu-io -f raw \
+        -c "aio_write -P 1 0 64k" -c "aio_write -P 2 64k 64k" \
+        -c "aio_write -P 3 128k 64k" -c "aio_write -P 4 192k 64k" \
+        -c "aio_flush" \
+        -c "w -P 5 256k 64k" -c "flush" \
+        -c "aio_read -P 1 0 64k" -c "aio_read -P 2 64k 64k" \
+        -c "aio_read -P 3 128k 64k" -c "aio_read -P 4 192k 64k" \
+        -c "aio_flush" \
+        -c "r -P 5 256k 64k" -c "r -P 0 320k 64k" \
+        $nbd
+'